@@ -29,6 +29,7 @@ testScripts=(
     'wallet_addresses.py'
     'wallet_sapling.py'
     'wallet_listnotes.py'
+    'wallet_rescan.py'
     'mergetoaddress_sprout.py'
     'mergetoaddress_sapling.py'
     'mergetoaddress_mixednotes.py'
@@ -39,6 +40,8 @@ testScripts=(
     'getchaintips.py'
     'rawtransactions.py'
     'getrawtransaction_insight.py'
+    'addressindex.py'
+    'utxosnapshot.py'
     'rest.py'
     'mempool_spendcoinbase.py'
     'mempool_reorg.py'
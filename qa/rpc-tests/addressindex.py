@@ -0,0 +1,136 @@
+#!/usr/bin/env python2
+# Copyright (c) 2019 The Zcash developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test the address, spent and timestamp index RPCs used by the
+# Insight Explorer (-insightexplorer)
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+
+from test_framework.util import assert_equal
+from test_framework.util import initialize_chain_clean
+from test_framework.util import start_nodes, stop_nodes, connect_nodes
+from test_framework.util import wait_bitcoinds
+
+from test_framework.mininode import COIN
+
+
+class AddressIndexTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 3)
+
+    def setup_network(self):
+        self.nodes = start_nodes(3, self.options.tmpdir,
+            [['-debug', '-txindex', '-experimentalfeatures', '-insightexplorer']]*3)
+        connect_nodes(self.nodes[0], 1)
+        connect_nodes(self.nodes[0], 2)
+
+        self.is_network_split = False
+        self.sync_all()
+
+    def run_test(self):
+        self.nodes[0].generate(105)
+        self.sync_all()
+
+        # send coinbase to address a, then from a to b
+        a = self.nodes[1].getnewaddress()
+        txid_a = self.nodes[0].sendtoaddress(a, 2)
+        self.sync_all()
+        self.nodes[0].generate(1)
+        self.sync_all()
+
+        b = self.nodes[2].getnewaddress()
+        txid_b = self.nodes[1].sendtoaddress(b, 1)
+        self.sync_all()
+        self.nodes[0].generate(1)
+        self.sync_all()
+
+        # Restart all nodes to ensure indices are saved to disk and recovered
+        stop_nodes(self.nodes)
+        wait_bitcoinds()
+        self.setup_network()
+
+        # a received 2 and spent all of it
+        bal = self.nodes[2].getaddressbalance({'addresses': [a]})
+        assert_equal(bal['balance'], 0)
+        assert_equal(bal['received'], 2 * COIN)
+
+        # b received 1 and still holds it
+        bal = self.nodes[2].getaddressbalance(b)
+        assert_equal(bal['balance'], 1 * COIN)
+        assert_equal(bal['received'], 1 * COIN)
+
+        assert_equal(self.nodes[2].getaddresstxids({'addresses': [a]}), [txid_a, txid_b])
+        assert_equal(self.nodes[2].getaddresstxids({'addresses': [a], 'start': 107}), [txid_b])
+        assert_equal(self.nodes[2].getaddresstxids({'addresses': [a], 'end': 106}), [txid_a])
+        assert_equal(self.nodes[2].getaddresstxids({'addresses': [a, b]}), [txid_a, txid_b])
+
+        deltas = self.nodes[2].getaddressdeltas({'addresses': [a]})
+        assert_equal(len(deltas), 2)
+        assert_equal(deltas[0]['txid'], txid_a)
+        assert_equal(deltas[0]['satoshis'], 2 * COIN)
+        assert_equal(deltas[0]['height'], 106)
+        assert_equal(deltas[1]['txid'], txid_b)
+        assert_equal(deltas[1]['satoshis'], -2 * COIN)
+        assert_equal(deltas[1]['height'], 107)
+
+        deltas = self.nodes[2].getaddressdeltas({'addresses': [a], 'start': 107, 'end': 107, 'chainInfo': True})
+        assert_equal(len(deltas['deltas']), 1)
+        assert_equal(deltas['start']['height'], 107)
+        assert_equal(deltas['end']['height'], 107)
+
+        utxos = self.nodes[2].getaddressutxos({'addresses': [a]})
+        assert_equal(utxos, [])
+        utxos = self.nodes[2].getaddressutxos({'addresses': [b], 'chainInfo': True})
+        assert_equal(utxos['height'], 107)
+        assert_equal(len(utxos['utxos']), 1)
+        assert_equal(utxos['utxos'][0]['address'], b)
+        assert_equal(utxos['utxos'][0]['txid'], txid_b)
+        assert_equal(utxos['utxos'][0]['satoshis'], 1 * COIN)
+        assert_equal(utxos['utxos'][0]['height'], 107)
+
+        # the payment output of txid_a was spent by input 0 of txid_b
+        tx_a = self.nodes[2].getrawtransaction(txid_a, 1)
+        vout = filter(lambda o: o['value'] == 2, tx_a['vout'])
+        spent = self.nodes[2].getspentinfo({'txid': txid_a, 'index': vout[0]['n']})
+        assert_equal(spent['txid'], txid_b)
+        assert_equal(spent['index'], 0)
+        assert_equal(spent['height'], 107)
+
+        # every connected block (the genesis block is not indexed) falls
+        # within this timestamp range, ordered by logical timestamp
+        tip = self.nodes[2].getbestblockhash()
+        hashes = self.nodes[2].getblockhashes(2**31 - 1, 0, {'logicalTimes': True})
+        assert_equal(len(hashes), 107)
+        assert_equal(hashes[-1]['blockhash'], tip)
+        assert(hashes[-1]['logicalts'] > hashes[0]['logicalts'])
+
+        # unconfirmed activity shows up in the mempool index only
+        c = self.nodes[0].getnewaddress()
+        txid_c = self.nodes[2].sendtoaddress(c, 0.5)
+        self.sync_all()
+        mempool = self.nodes[0].getaddressmempool({'addresses': [b, c]})
+        spends = filter(lambda d: d['address'] == b, mempool)
+        assert_equal(len(spends), 1)
+        assert_equal(spends[0]['txid'], txid_c)
+        assert_equal(spends[0]['satoshis'], -1 * COIN)
+        assert_equal(spends[0]['prevtxid'], txid_b)
+        receives = filter(lambda d: d['address'] == c, mempool)
+        assert_equal(len(receives), 1)
+        assert_equal(receives[0]['satoshis'], COIN / 2)
+
+        spent = self.nodes[0].getspentinfo({'txid': txid_b, 'index': utxos['utxos'][0]['outputIndex']})
+        assert_equal(spent['txid'], txid_c)
+        assert_equal(spent['height'], -1)
+
+        self.nodes[0].generate(1)
+        self.sync_all()
+        assert_equal(self.nodes[0].getaddressmempool({'addresses': [b, c]}), [])
+
+if __name__ == '__main__':
+    AddressIndexTest().main()
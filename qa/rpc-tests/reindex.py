@@ -4,7 +4,7 @@
 # file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #
-# Test -reindex with CheckBlockIndex
+# Test -reindex with CheckBlockIndex, with and without worker threads
 #
 
 import sys; assert sys.version_info < (3,), ur"This script does not run under Python 3. Please use Python 2.7.x."
@@ -27,10 +27,15 @@ class ReindexTest(BitcoinTestFramework):
 
     def run_test(self):
         self.nodes[0].generate(3)
-        stop_node(self.nodes[0], 0)
-        wait_bitcoinds()
-        self.nodes[0]=start_node(0, self.options.tmpdir, ["-debug", "-reindex", "-checkblockindex=1"])
-        assert_equal(self.nodes[0].getblockcount(), 3)
+        blockhash = self.nodes[0].getbestblockhash()
+        # Reindex without worker threads, and with them
+        for threads in [1, 4]:
+            stop_node(self.nodes[0], 0)
+            wait_bitcoinds()
+            self.nodes[0]=start_node(0, self.options.tmpdir, ["-debug", "-reindex", "-checkblockindex=1",
+                                                              "-reindexthreads=%d" % threads])
+            assert_equal(self.nodes[0].getblockcount(), 3)
+            assert_equal(self.nodes[0].getbestblockhash(), blockhash)
         print "Success"
 
 if __name__ == '__main__':
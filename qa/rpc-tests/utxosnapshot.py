@@ -0,0 +1,100 @@
+#!/usr/bin/env python2
+# Copyright (c) 2019 The Zcash developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test dumptxoutset and starting a new node from the snapshot with -loadsnapshot
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, initialize_chain_clean, \
+    start_node, connect_nodes_bi, sync_blocks
+
+from hashlib import sha256
+import os
+import subprocess
+
+
+class UTXOSnapshotTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 3)
+
+    def setup_network(self):
+        self.nodes = []
+        self.nodes.append(start_node(0, self.options.tmpdir))
+        self.is_network_split = False
+
+    def assert_snapshot_refused(self, extra_args, message):
+        # Node 2 is only started to check that it refuses a snapshot, so it
+        # is run directly: start_node would wait for an RPC server that never
+        # comes up.
+        datadir = os.path.join(self.options.tmpdir, "node2")
+        args = [os.getenv("BITCOIND", "bitcoind"), "-datadir=" + datadir, "-prune=550"] + extra_args
+        process = subprocess.Popen(args, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        stdout, stderr = process.communicate()
+        assert(process.returncode != 0)
+        assert(message in stderr)
+
+    def run_test(self):
+        node = self.nodes[0]
+        node.generate(101)
+        sent_address = node.getnewaddress()
+        node.sendtoaddress(sent_address, 1)
+        node.generate(1)
+
+        path = os.path.join(self.options.tmpdir, "utxo.dat")
+        res = node.dumptxoutset(path)
+        assert_equal(res['path'], path)
+        assert_equal(res['base_hash'], node.getbestblockhash())
+        assert_equal(res['base_height'], 102)
+        stats = node.gettxoutsetinfo()
+        assert_equal(res['transactions'], stats['transactions'])
+        assert_equal(res['coins_written'], stats['txouts'])
+
+        # An existing file is never overwritten
+        try:
+            node.dumptxoutset(path)
+            raise AssertionError("dumptxoutset overwrote an existing file")
+        except Exception as e:
+            assert("already exists" in str(e))
+
+        # The snapshot hash must be given with the snapshot.
+        self.assert_snapshot_refused(["-loadsnapshot=" + path], "-loadsnapshot requires -snapshothash")
+        self.assert_snapshot_refused(["-loadsnapshot=" + path, "-snapshothash=" + "00" * 32],
+                                     "does not match -snapshothash")
+
+        # Redirect the coin sent above to another address and recompute the
+        # hash at the end of the file. The file is consistent with itself but
+        # not with the pinned hash, so it is refused.
+        with open(path, "rb") as f:
+            data = f.read()
+        script = node.validateaddress(sent_address)['scriptPubKey']
+        other = node.validateaddress(node.getnewaddress())['scriptPubKey']
+        body = data[:-32].replace(script[6:46].decode('hex'), other[6:46].decode('hex'))
+        assert(body != data[:-32])
+        tampered = os.path.join(self.options.tmpdir, "utxo-tampered.dat")
+        with open(tampered, "wb") as f:
+            f.write(body + sha256(sha256(body).digest()).digest())
+        self.assert_snapshot_refused(["-loadsnapshot=" + tampered, "-snapshothash=" + res['snapshot_hash']],
+                                     "does not match -snapshothash")
+
+        # Start a new node from the snapshot: it has the same chainstate
+        # without having downloaded any blocks.
+        self.nodes.append(start_node(1, self.options.tmpdir,
+            ["-loadsnapshot=" + path, "-snapshothash=" + res['snapshot_hash'], "-prune=550"]))
+        loaded = self.nodes[1]
+        assert_equal(loaded.getbestblockhash(), node.getbestblockhash())
+        assert_equal(loaded.gettxoutsetinfo()['hash_serialized'], stats['hash_serialized'])
+
+        # It follows the chain from there.
+        connect_nodes_bi(self.nodes, 0, 1)
+        node.generate(2)
+        sync_blocks(self.nodes)
+        assert_equal(loaded.getblockcount(), 104)
+        assert_equal(loaded.gettxoutsetinfo()['hash_serialized'], node.gettxoutsetinfo()['hash_serialized'])
+
+if __name__ == '__main__':
+    UTXOSnapshotTest().main()
@@ -0,0 +1,126 @@
+#!/usr/bin/env python
+# Copyright (c) 2019 The Zcash developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+import sys; assert sys.version_info < (3,), ur"This script does not run under Python 3. Please use Python 2.7.x."
+
+#
+# Test that a wallet rescan spread over several threads finds the same
+# transactions and notes as a rescan done by a single thread
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import (
+    assert_equal, assert_true,
+    get_coinbase_address,
+    initialize_chain_clean,
+    start_nodes, start_node, stop_node,
+    connect_nodes_bi,
+    wait_and_assert_operationid_status,
+)
+
+from decimal import Decimal
+
+NUPARAMS_ARGS = [
+    '-nuparams=5ba81b19:100', # Overwinter
+    '-nuparams=76b809bb:101', # Sapling
+]
+
+# Must match RESCAN_PREFETCH_BLOCKS_PER_THREAD in wallet.h
+RESCAN_PREFETCH_BLOCKS_PER_THREAD = 8
+RESCAN_THREADS = 4
+
+class WalletRescanTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory " + self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 2)
+
+    def setup_network(self, split=False):
+        self.nodes = start_nodes(2, self.options.tmpdir, [NUPARAMS_ARGS] * 2)
+        connect_nodes_bi(self.nodes, 0, 1)
+        self.is_network_split = False
+        self.sync_all()
+
+    def wallet_state(self, node, addresses):
+        txs = sorted(
+            (tx['txid'], tx['category'], tx['amount'], tx.get('address'), tx.get('blockhash'))
+            for tx in node.listtransactions('*', 1000))
+        received = dict(
+            (addr, sorted(node.z_listreceivedbyaddress(addr, 0), key=lambda n: (n['txid'], n['outindex'])))
+            for addr in addresses)
+        unspent = sorted(node.z_listunspent(), key=lambda n: (n['txid'], n['outindex']))
+        return (txs, received, unspent, node.z_gettotalbalance())
+
+    def restart_with_rescan(self, nThreads):
+        # -zapwallettxes drops the wallet transactions, so they can only come
+        # back through the rescan it triggers
+        stop_node(self.nodes[1], 1)
+        self.nodes[1] = start_node(1, self.options.tmpdir, NUPARAMS_ARGS + [
+            '-zapwallettxes=1',
+            '-rescanthreads=%d' % nThreads,
+        ])
+        connect_nodes_bi(self.nodes, 0, 1)
+
+    def run_test(self):
+        self.nodes[0].generate(101)
+        self.sync_all()
+
+        coinbase_addr = get_coinbase_address(self.nodes[0])
+        sapling_addr = self.nodes[1].z_getnewaddress('sapling')
+        taddr = self.nodes[1].getnewaddress()
+
+        # Spread node 1's transactions over many more blocks than the
+        # rescan threads read ahead at a time, so that the parallel rescan
+        # goes through several batches
+        nRounds = 8
+        nBlocksPerRound = RESCAN_PREFETCH_BLOCKS_PER_THREAD
+        for i in range(nRounds):
+            # Coinbase -> Sapling, to node 1
+            recipients = [{"address": sapling_addr, "amount": Decimal('10')}]
+            myopid = self.nodes[0].z_sendmany(coinbase_addr, recipients, 1, 0)
+            wait_and_assert_operationid_status(self.nodes[0], myopid)
+            self.sync_all()
+            self.nodes[0].generate(nBlocksPerRound)
+            self.sync_all()
+
+            if i % 2 == 1:
+                # Sapling -> transparent, spending one of node 1's notes
+                recipients = [{"address": taddr, "amount": Decimal('3')}]
+                myopid = self.nodes[1].z_sendmany(sapling_addr, recipients, 1, 0)
+                wait_and_assert_operationid_status(self.nodes[1], myopid)
+                self.sync_all()
+                self.nodes[0].generate(nBlocksPerRound)
+                self.sync_all()
+
+        nScannedBlocks = self.nodes[1].getblockcount() - 100
+        assert_true(nScannedBlocks > 2 * RESCAN_THREADS * RESCAN_PREFETCH_BLOCKS_PER_THREAD,
+            "chain must span several rescan batches")
+
+        assert_equal(self.nodes[1].z_getbalance(sapling_addr), Decimal('68'))
+        assert_equal(self.nodes[1].z_getbalance(taddr), Decimal('12'))
+        state = self.wallet_state(self.nodes[1], [sapling_addr])
+
+        # A rescan on one thread recovers the wallet
+        self.restart_with_rescan(1)
+        serial = self.wallet_state(self.nodes[1], [sapling_addr])
+        assert_equal(state, serial)
+
+        # A rescan on several threads recovers exactly the same wallet
+        self.restart_with_rescan(RESCAN_THREADS)
+        parallel = self.wallet_state(self.nodes[1], [sapling_addr])
+        assert_equal(serial, parallel)
+
+        # The note witnesses rebuilt by the parallel rescan are usable
+        recipients = [{"address": taddr, "amount": Decimal('30')}]
+        myopid = self.nodes[1].z_sendmany(sapling_addr, recipients, 1, 0)
+        wait_and_assert_operationid_status(self.nodes[1], myopid)
+        self.sync_all()
+        self.nodes[0].generate(1)
+        self.sync_all()
+        assert_equal(self.nodes[1].z_getbalance(sapling_addr), Decimal('38'))
+        assert_equal(self.nodes[1].z_getbalance(taddr), Decimal('42'))
+
+if __name__ == '__main__':
+    WalletRescanTest().main()
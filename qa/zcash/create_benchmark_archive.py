@@ -189,58 +189,24 @@ def create_benchmark_archive(blk_hash):
     for tx in bar(unique_inputs.keys()):
         rawtx = json.loads(subprocess.check_output([ZCASH_CLI, 'getrawtransaction', tx, '1']))
 
-        mask_size = 0
-        mask_code = 0
-        b = 0
-        while 2+b*8 < len(rawtx['vout']):
-            zero = True
-            i = 0
-            while i < 8 and 2+b*8+i < len(rawtx['vout']):
-                if 2+b*8+i in unique_inputs[tx]:
-                    zero = False
-                i += 1
-            if not zero:
-                mask_size = b + 1
-                mask_code += 1
-            b += 1
-
         coinbase = len(rawtx['vin']) == 1 and 'coinbase' in rawtx['vin'][0]
-        first = len(rawtx['vout']) > 0 and 0 in unique_inputs[tx]
-        second = len(rawtx['vout']) > 1 and 1 in unique_inputs[tx]
-        code = 8*(mask_code - (0 if first or second else 1)) + \
-            (1 if coinbase else 0) + \
-            (2 if first else 0) + \
-            (4 if second else 0)
+        height = json.loads(subprocess.check_output(
+            [ZCASH_CLI, 'getblockheader', rawtx['blockhash']]))['height']
 
-        coins = bytearray()
+        # One record per output spent by the block.
         # Serialized format:
-        # - VARINT(nVersion)
-        coins.extend(encode_varint(rawtx['version']))
-        # - VARINT(nCode)
-        coins.extend(encode_varint(code))
-        # - unspentness bitvector, for vout[2] and further; least significant byte first
-        for b in range(mask_size):
-            avail = 0
-            i = 0
-            while i < 8 and 2+b*8+i < len(rawtx['vout']):
-                if 2+b*8+i in unique_inputs[tx]:
-                    avail |= (1 << i)
-                i += 1
-            coins.append(avail)
-        # - the non-spent CTxOuts (via CTxOutCompressor)
-        for i in range(len(rawtx['vout'])):
-            if i in unique_inputs[tx]:
-                coins.extend(encode_varint(compress_amount(int(rawtx['vout'][i]['valueZat']))))
-                coins.extend(compress_script(
-                    binascii.unhexlify(rawtx['vout'][i]['scriptPubKey']['hex'])))
-        # - VARINT(nHeight)
-        coins.extend(encode_varint(json.loads(
-            subprocess.check_output([ZCASH_CLI, 'getblockheader', rawtx['blockhash']])
-            )['height']))
-
-        db_key = b'c' + bytes(binascii.unhexlify(tx)[::-1])
-        db_val = bytes(coins)
-        wb.put(db_key, db_val)
+        # - VARINT(nHeight * 2 + fCoinBase)
+        # - the CTxOut (via CTxOutCompressor)
+        for i in unique_inputs[tx]:
+            coin = bytearray()
+            coin.extend(encode_varint(height * 2 + (1 if coinbase else 0)))
+            coin.extend(encode_varint(compress_amount(int(rawtx['vout'][i]['valueZat']))))
+            coin.extend(compress_script(
+                binascii.unhexlify(rawtx['vout'][i]['scriptPubKey']['hex'])))
+
+            db_key = b'C' + bytes(binascii.unhexlify(tx)[::-1]) + encode_varint(i)
+            db_val = bytes(coin)
+            wb.put(db_key, db_val)
 
     wb.write()
     db.close()
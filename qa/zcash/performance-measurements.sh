@@ -134,7 +134,9 @@ function zcashd_valgrind_stop {
 
 function extract_benchmark_data {
     if [ -f "block-107134.tar.xz" ]; then
-        # Check the hash of the archive:
+        # Check the hash of the archive. This archive holds one coins record
+        # per transaction, which the benchmark upgrades when it loads it.
+        # Update the hash when the archive is regenerated.
         "$SHA256CMD" $SHA256ARGS -c <<EOF
 4bd5ad1149714394e8895fa536725ed5d6c32c99812b962bfa73f03b5ffad4bb  block-107134.tar.xz
 EOF
@@ -212,6 +214,9 @@ case "$1" in
             trydecryptnotes)
                 zcash_rpc zcbenchmark trydecryptnotes 1000 "${@:3}"
                 ;;
+            trydecryptsaplingnotes)
+                zcash_rpc zcbenchmark trydecryptsaplingnotes 100 "${@:3}"
+                ;;
             incnotewitnesses)
                 zcash_rpc zcbenchmark incnotewitnesses 100 "${@:3}"
                 ;;
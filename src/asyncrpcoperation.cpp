@@ -32,12 +32,14 @@ AsyncRPCOperation::AsyncRPCOperation() : error_code_(0), error_message_() {
     boost::uuids::uuid uuid = uuidgen();
     id_ = "opid-" + boost::uuids::to_string(uuid);
     creation_time_ = (int64_t)time(NULL);
+    creation_clock_ = std::chrono::system_clock::now();
     set_state(OperationStatus::READY);
 }
 
 AsyncRPCOperation::AsyncRPCOperation(const AsyncRPCOperation& o) :
-        id_(o.id_), creation_time_(o.creation_time_), state_(o.state_.load()),
-        start_time_(o.start_time_), end_time_(o.end_time_),
+        id_(o.id_), creation_time_(o.creation_time_), creation_clock_(o.creation_clock_),
+        state_(o.state_.load()), start_time_(o.start_time_), end_time_(o.end_time_),
+        phase_secs_(o.phase_secs_),
         error_code_(o.error_code_), error_message_(o.error_message_),
         result_(o.result_)
 {
@@ -46,9 +48,11 @@ AsyncRPCOperation::AsyncRPCOperation(const AsyncRPCOperation& o) :
 AsyncRPCOperation& AsyncRPCOperation::operator=( const AsyncRPCOperation& other ) {
     this->id_ = other.id_;
     this->creation_time_ = other.creation_time_;
+    this->creation_clock_ = other.creation_clock_;
     this->state_.store(other.state_.load());
     this->start_time_ = other.start_time_;
     this->end_time_ = other.end_time_;
+    this->phase_secs_ = other.phase_secs_;
     this->error_code_ = other.error_code_;
     this->error_message_ = other.error_message_;
     this->result_ = other.result_;
@@ -84,6 +88,14 @@ void AsyncRPCOperation::stop_execution_clock() {
     end_time_ = std::chrono::system_clock::now();
 }
 
+/**
+ * Add time spent in a phase of the execution run, e.g. while creating proofs
+ */
+void AsyncRPCOperation::add_phase_time(const std::string& phase, std::chrono::duration<double> elapsed) {
+    std::lock_guard<std::mutex> guard(lock_);
+    phase_secs_[phase] += elapsed.count();
+}
+
 /**
  * Implement this virtual method in any subclass.  This is just an example implementation.
  */
@@ -155,6 +167,21 @@ UniValue AsyncRPCOperation::getStatus() const {
     obj.push_back(Pair("id", this->id_));
     obj.push_back(Pair("status", OperationStatusMap[status]));
     obj.push_back(Pair("creation_time", this->creation_time_));
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        // Time spent waiting in the queue, once execution has started
+        if (start_time_.time_since_epoch().count() != 0) {
+            std::chrono::duration<double> queued_seconds = start_time_ - creation_clock_;
+            obj.push_back(Pair("queued_secs", queued_seconds.count()));
+        }
+        if (!phase_secs_.empty()) {
+            UniValue timings(UniValue::VOBJ);
+            for (const auto& phase : phase_secs_) {
+                timings.push_back(Pair(phase.first + "_secs", phase.second));
+            }
+            obj.push_back(Pair("timings", timings));
+        }
+    }
     // TODO: Issue #1354: There may be other useful metadata to return to the user.
     UniValue err = this->getError();
     if (!err.isNull()) {
@@ -37,6 +37,13 @@ typedef enum class operationStateEnum {
     SUCCESS
 } OperationStatus;
 
+// Queued operations of a higher priority are started first
+typedef enum class operationPriorityEnum {
+    INTERACTIVE = 0,
+    BULK,
+    COUNT
+} OperationPriority;
+
 class AsyncRPCOperation {
 public:
     AsyncRPCOperation();
@@ -47,6 +54,35 @@ public:
 
     // Override this method if you can interrupt execution of main() in your subclass.
     void cancel();
+
+    // Override this method to queue your subclass behind interactive operations.
+    virtual OperationPriority getPriority() const {
+        return OperationPriority::INTERACTIVE;
+    }
+
+    // Override this method to return true if your subclass creates proofs, so the
+    // queue can limit how many of these memory-hungry operations run at once.
+    virtual bool isProving() const {
+        return false;
+    }
+
+    /**
+     * Adds the time between its construction and destruction to a phase of the
+     * operation (e.g. "proving", "signing" or "broadcast"), which getStatus()
+     * reports under "timings".
+     */
+    class PhaseTimer {
+    public:
+        PhaseTimer(AsyncRPCOperation* op, const std::string& phase) :
+            op_(op), phase_(phase), start_(std::chrono::system_clock::now()) {}
+        ~PhaseTimer() {
+            op_->add_phase_time(phase_, std::chrono::system_clock::now() - start_);
+        }
+    private:
+        AsyncRPCOperation* op_;
+        std::string phase_;
+        std::chrono::time_point<std::chrono::system_clock> start_;
+    };
     
     // Getters and setters
 
@@ -115,9 +151,11 @@ protected:
     std::string error_message_;
     std::atomic<OperationStatus> state_;
     std::chrono::time_point<std::chrono::system_clock> start_time_, end_time_;  
+    std::map<std::string, double> phase_secs_;
 
     void start_execution_clock();
     void stop_execution_clock();
+    void add_phase_time(const std::string& phase, std::chrono::duration<double> elapsed);
 
     void set_state(OperationStatus state) {
         this->state_.store(state);
@@ -147,6 +185,7 @@ private:
     // Initialized in the operation constructor, never to be modified again.
     AsyncRPCOperationId id_;
     int64_t creation_time_;
+    std::chrono::time_point<std::chrono::system_clock> creation_clock_;
 };
 
 #endif /* ASYNCRPCOPERATION_H */
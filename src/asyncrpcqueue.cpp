@@ -4,6 +4,8 @@
 
 #include "asyncrpcqueue.h"
 
+#include <assert.h>
+
 static std::atomic<size_t> workerCounter(0);
 
 /**
@@ -28,33 +30,33 @@ AsyncRPCQueue::~AsyncRPCQueue() {
 void AsyncRPCQueue::run(size_t workerId) {
 
     while (true) {
-        AsyncRPCOperationId key;
+        QueuedOperation next;
         std::shared_ptr<AsyncRPCOperation> operation;
         {
             std::unique_lock<std::mutex> guard(lock_);
-            while (operation_id_queue_.empty() && !isClosed() && !isFinishing()) {
-                this->condition_.wait(guard);
-            }
+            while (true) {
+                // Exit if the queue is closing.
+                if (isClosed()) {
+                    for (auto& queue : operation_id_queue_) {
+                        queue.clear();
+                    }
+                    return;
+                }
 
-            // Exit if the queue is empty and we are finishing up
-            if (isFinishing() && operation_id_queue_.empty()) {
-                break;
-            }
+                if (take_next_operation(next)) {
+                    break;
+                }
 
-            // Exit if the queue is closing.
-            if (isClosed()) {
-                while (!operation_id_queue_.empty()) {
-                    operation_id_queue_.pop();
+                // Exit if the queue is empty and we are finishing up
+                if (isFinishing() && queued_operation_count() == 0) {
+                    return;
                 }
-                break;
-            }
 
-            // Get operation id
-            key = operation_id_queue_.front();
-            operation_id_queue_.pop();
+                this->condition_.wait(guard);
+            }
 
             // Search operation map
-            AsyncRPCOperationMap::const_iterator iter = operation_map_.find(key);
+            AsyncRPCOperationMap::const_iterator iter = operation_map_.find(next.id);
             if (iter != operation_map_.end()) {
                 operation = iter->second;
             }
@@ -67,6 +69,59 @@ void AsyncRPCQueue::run(size_t workerId) {
         } else {
             operation->main();
         }
+
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            if (next.fProving) {
+                executing_proving_--;
+            }
+            if (operation && operation_map_.count(next.id)) {
+                finished_time_[next.id] = std::chrono::steady_clock::now();
+            }
+            // A proving operation may have been waiting for this one to finish
+            this->condition_.notify_all();
+        }
+    }
+}
+
+/**
+ * Take the first queued operation of the highest priority that can be started
+ * without exceeding the limit on concurrent proving operations.
+ * Caller must hold lock_.
+ */
+bool AsyncRPCQueue::take_next_operation(QueuedOperation& next) {
+    for (auto& queue : operation_id_queue_) {
+        for (auto it = queue.begin(); it != queue.end(); ++it) {
+            if (it->fProving && max_proving_ > 0 && executing_proving_ >= max_proving_) {
+                continue;
+            }
+            next = *it;
+            queue.erase(it);
+            if (next.fProving) {
+                executing_proving_++;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Remove operations which finished more than the result TTL ago.
+ * Caller must hold lock_.
+ */
+void AsyncRPCQueue::evict_expired_operations() const {
+    if (result_ttl_.count() == 0) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = finished_time_.begin(); it != finished_time_.end(); ) {
+        if (now - it->second >= result_ttl_) {
+            operation_map_.erase(it->first);
+            it = finished_time_.erase(it);
+        } else {
+            ++it;
+        }
     }
 }
 
@@ -89,9 +144,13 @@ void AsyncRPCQueue::addOperation(const std::shared_ptr<AsyncRPCOperation> &ptrOp
         return;
     }
 
+    evict_expired_operations();
+
     AsyncRPCOperationId id = ptrOperation->getId();
     operation_map_.emplace(id, ptrOperation);
-    operation_id_queue_.push(id);
+    size_t priority = static_cast<size_t>(ptrOperation->getPriority());
+    assert(priority < static_cast<size_t>(OperationPriority::COUNT));
+    operation_id_queue_[priority].push_back(QueuedOperation {id, ptrOperation->isProving()});
     this->condition_.notify_one();
 }
 
@@ -102,6 +161,7 @@ std::shared_ptr<AsyncRPCOperation> AsyncRPCQueue::getOperationForId(AsyncRPCOper
     std::shared_ptr<AsyncRPCOperation> ptr;
 
     std::lock_guard<std::mutex> guard(lock_);
+    evict_expired_operations();
     AsyncRPCOperationMap::const_iterator iter = operation_map_.find(id);
     if (iter != operation_map_.end()) {
         ptr = iter->second;
@@ -119,6 +179,7 @@ std::shared_ptr<AsyncRPCOperation> AsyncRPCQueue::popOperationForId(AsyncRPCOper
         // Note: if the id still exists in the operationIdQueue, when it gets processed by a worker
         // there will no operation in the map to execute, so nothing will happen.
         operation_map_.erase(id);
+        finished_time_.erase(id);
     }
     return ptr;
 }
@@ -168,7 +229,32 @@ void AsyncRPCQueue::cancelAllOperations() {
  */
 size_t AsyncRPCQueue::getOperationCount() const {
     std::lock_guard<std::mutex> guard(lock_);
-    return operation_id_queue_.size();
+    return queued_operation_count();
+}
+
+size_t AsyncRPCQueue::queued_operation_count() const {
+    size_t count = 0;
+    for (const auto& queue : operation_id_queue_) {
+        count += queue.size();
+    }
+    return count;
+}
+
+/**
+ * Limit the number of operations which create proofs that run at the same time.
+ */
+void AsyncRPCQueue::setMaxProvingOperations(size_t n) {
+    std::lock_guard<std::mutex> guard(lock_);
+    max_proving_ = n;
+    this->condition_.notify_all();
+}
+
+/**
+ * Forget finished operations whose results have not been fetched after ttl.
+ */
+void AsyncRPCQueue::setResultTTL(std::chrono::seconds ttl) {
+    std::lock_guard<std::mutex> guard(lock_);
+    result_ttl_ = ttl;
 }
 
 /**
@@ -192,6 +278,7 @@ size_t AsyncRPCQueue::getNumberOfWorkers() const {
  */
 std::vector<AsyncRPCOperationId> AsyncRPCQueue::getAllOperationIds() const {
     std::lock_guard<std::mutex> guard(lock_);
+    evict_expired_operations();
     std::vector<AsyncRPCOperationId> v;
     for(auto & entry: operation_map_) {
         v.push_back(entry.first);
@@ -10,7 +10,7 @@
 #include <iostream>
 #include <string>
 #include <chrono>
-#include <queue>
+#include <deque>
 #include <unordered_map>
 #include <vector>
 #include <future>
@@ -21,6 +21,17 @@
 
 typedef std::unordered_map<AsyncRPCOperationId, std::shared_ptr<AsyncRPCOperation> > AsyncRPCOperationMap; 
 
+/** Default for -rpcasyncthreads */
+static const int DEFAULT_ASYNC_RPC_THREADS = 1;
+/**
+ * Default for -rpcasyncmaxproving, 0 = no limit. Operations that create proofs
+ * also spend notes, so running one at a time keeps them from selecting the
+ * same notes.
+ */
+static const int DEFAULT_ASYNC_RPC_MAX_PROVING = 1;
+/** Default for -rpcasyncresultttl, in seconds; 0 = keep until z_getoperationresult */
+static const int64_t DEFAULT_ASYNC_RPC_RESULT_TTL = 24 * 60 * 60;
+
 
 class AsyncRPCQueue {
 public:
@@ -49,20 +60,35 @@ public:
     std::shared_ptr<AsyncRPCOperation> popOperationForId(AsyncRPCOperationId);
     void addOperation(const std::shared_ptr<AsyncRPCOperation> &ptrOperation);
     std::vector<AsyncRPCOperationId> getAllOperationIds() const;
+    void setMaxProvingOperations(size_t n); // 0 = no limit
+    void setResultTTL(std::chrono::seconds ttl); // 0 = keep until popped
 
 private:
+    struct QueuedOperation {
+        AsyncRPCOperationId id;
+        bool fProving;
+    };
+
     // addWorker() will spawn a new thread on run())
     void run(size_t workerId);
     void wait_for_worker_threads();
+    bool take_next_operation(QueuedOperation& next);
+    size_t queued_operation_count() const;
+    void evict_expired_operations() const;
 
     // Why this is not a recursive lock: http://www.zaval.org/resources/library/butenhof1.html
     mutable std::mutex lock_;
     std::condition_variable condition_;
     std::atomic<bool> closed_;
     std::atomic<bool> finish_;
-    AsyncRPCOperationMap operation_map_;
-    std::queue <AsyncRPCOperationId> operation_id_queue_;
+    // Finished operations are evicted from operation_map_ by const accessors too
+    mutable AsyncRPCOperationMap operation_map_;
+    std::deque<QueuedOperation> operation_id_queue_[static_cast<size_t>(OperationPriority::COUNT)];
     std::vector<std::thread> workers_;
+    size_t max_proving_ = DEFAULT_ASYNC_RPC_MAX_PROVING;
+    size_t executing_proving_ = 0;
+    std::chrono::seconds result_ttl_{DEFAULT_ASYNC_RPC_RESULT_TTL};
+    mutable std::unordered_map<AsyncRPCOperationId, std::chrono::steady_clock::time_point> finished_time_;
 };
 
 #endif
@@ -0,0 +1,80 @@
+// Copyright (c) 2019 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcache.h"
+
+#include "primitives/block.h"
+#include "version.h"
+
+CSerializedBlockCache::CSerializedBlockCache(size_t nMaxSizeIn) : nMaxSize(nMaxSizeIn), nTotalSize(0)
+{
+}
+
+void CSerializedBlockCache::SetMaxSize(size_t nMaxSizeIn)
+{
+    LOCK(cs);
+    nMaxSize = nMaxSizeIn;
+    Trim();
+}
+
+void CSerializedBlockCache::Trim()
+{
+    while (nTotalSize > nMaxSize) {
+        std::map<uint256, entry_type>::iterator it = mapBlocks.find(listRecent.back());
+        assert(it != mapBlocks.end());
+        nTotalSize -= it->second.first->size();
+        mapBlocks.erase(it);
+        listRecent.pop_back();
+    }
+}
+
+std::shared_ptr<const CDataStream> CSerializedBlockCache::Get(const uint256& hash)
+{
+    LOCK(cs);
+    std::map<uint256, entry_type>::iterator it = mapBlocks.find(hash);
+    if (it == mapBlocks.end())
+        return std::shared_ptr<const CDataStream>();
+    listRecent.splice(listRecent.begin(), listRecent, it->second.second);
+    return it->second.first;
+}
+
+std::shared_ptr<const CDataStream> CSerializedBlockCache::Insert(const uint256& hash, const CBlock& block)
+{
+    std::shared_ptr<const CDataStream> pdata = Get(hash);
+    if (pdata)
+        return pdata;
+
+    // Serialize outside the lock; senders only ever need the bytes.
+    std::shared_ptr<CDataStream> pdataNew(new CDataStream(SER_NETWORK, PROTOCOL_VERSION));
+    *pdataNew << block;
+
+    LOCK(cs);
+    if (pdataNew->size() > nMaxSize || mapBlocks.count(hash))
+        return pdataNew;
+    listRecent.push_front(hash);
+    mapBlocks.insert(std::make_pair(hash, entry_type(pdataNew, listRecent.begin())));
+    nTotalSize += pdataNew->size();
+    Trim();
+    return pdataNew;
+}
+
+void CSerializedBlockCache::Clear()
+{
+    LOCK(cs);
+    mapBlocks.clear();
+    listRecent.clear();
+    nTotalSize = 0;
+}
+
+size_t CSerializedBlockCache::GetTotalSize() const
+{
+    LOCK(cs);
+    return nTotalSize;
+}
+
+size_t CSerializedBlockCache::GetCount() const
+{
+    LOCK(cs);
+    return mapBlocks.size();
+}
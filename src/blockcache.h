@@ -0,0 +1,55 @@
+// Copyright (c) 2019 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKCACHE_H
+#define BITCOIN_BLOCKCACHE_H
+
+#include "streams.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <list>
+#include <map>
+#include <memory>
+
+class CBlock;
+
+/**
+ * Recent blocks kept in network serialization, so that a block requested by
+ * many peers at once is read from disk and encoded only once. Entries are
+ * shared with whoever is sending them, and the least recently used ones are
+ * dropped when the total size goes over the limit. A block never changes
+ * once its hash is known, so entries never need to be invalidated.
+ */
+class CSerializedBlockCache
+{
+private:
+    typedef std::list<uint256> lru_list;
+    typedef std::pair<std::shared_ptr<const CDataStream>, lru_list::iterator> entry_type;
+
+    mutable CCriticalSection cs;
+    size_t nMaxSize;
+    size_t nTotalSize;
+    //! Most recently used first
+    lru_list listRecent;
+    std::map<uint256, entry_type> mapBlocks;
+
+    void Trim();
+
+public:
+    CSerializedBlockCache(size_t nMaxSizeIn = 0);
+
+    /** Change the limit on the total size of the cached blocks, in bytes. 0 disables the cache. */
+    void SetMaxSize(size_t nMaxSizeIn);
+    /** Return the serialized block, or an empty pointer if it is not cached. */
+    std::shared_ptr<const CDataStream> Get(const uint256& hash);
+    /** Serialize a block into the cache, and return its serialized form. */
+    std::shared_ptr<const CDataStream> Insert(const uint256& hash, const CBlock& block);
+    void Clear();
+
+    size_t GetTotalSize() const;
+    size_t GetCount() const;
+};
+
+#endif // BITCOIN_BLOCKCACHE_H
@@ -5,8 +5,24 @@
 
 #include "chain.h"
 
+#include "main.h"
+#include "txdb.h"
+
 using namespace std;
 
+/**
+ * CBlockIndex implementation
+ */
+std::vector<unsigned char> CBlockIndex::GetSolution() const
+{
+    if (HasSolution())
+        return nSolution;
+    CDiskBlockIndex dbindex;
+    if (!pblocktree->ReadDiskBlockIndex(GetBlockHash(), dbindex))
+        throw std::runtime_error(strprintf("%s: failed to read block index entry for %s", __func__, GetBlockHash().ToString()));
+    return dbindex.nSolution;
+}
+
 /**
  * CChain implementation
  */
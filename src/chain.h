@@ -12,6 +12,7 @@
 #include "tinyformat.h"
 #include "uint256.h"
 
+#include <memory>
 #include <vector>
 
 static const int SPROUT_VALUE_VERSION = 1001400;
@@ -235,6 +236,8 @@ public:
     unsigned int nTime;
     unsigned int nBits;
     uint256 nNonce;
+    //! Only kept in memory until the entry is written to the block tree
+    //! database, see GetSolution()
     std::vector<unsigned char> nSolution;
 
     //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
@@ -318,10 +321,27 @@ public:
         block.nTime          = nTime;
         block.nBits          = nBits;
         block.nNonce         = nNonce;
-        block.nSolution      = nSolution;
+        block.nSolution      = GetSolution();
         return block;
     }
 
+    /**
+     * Returns the Equihash solution of the block header, reading it from the
+     * block tree database if it is no longer held in memory.
+     */
+    std::vector<unsigned char> GetSolution() const;
+
+    bool HasSolution() const
+    {
+        return !nSolution.empty();
+    }
+
+    /** Drop the solution from memory; only valid once the entry is on disk. */
+    void TrimSolution()
+    {
+        std::vector<unsigned char>().swap(nSolution);
+    }
+
     uint256 GetBlockHash() const
     {
         return *phashBlock;
@@ -399,6 +419,8 @@ public:
 
     explicit CDiskBlockIndex(const CBlockIndex* pindex) : CBlockIndex(*pindex) {
         hashPrev = (pprev ? pprev->GetBlockHash() : uint256());
+        if (!HasSolution())
+            nSolution = pindex->GetSolution();
     }
 
     ADD_SERIALIZE_METHODS;
@@ -484,6 +506,46 @@ public:
     }
 };
 
+/**
+ * Storage for the entries of the block index. Entries are allocated in chunks
+ * of contiguous memory, so loading the block index takes one allocation per
+ * chunk rather than one per block, and entries loaded together sit next to
+ * each other in memory. Entries are only ever freed all at once.
+ */
+class CBlockIndexArena
+{
+private:
+    std::vector<std::unique_ptr<CBlockIndex[]> > vChunks;
+    const size_t nChunkSize;
+    //! Number of entries handed out from the last chunk
+    size_t nUsed;
+    size_t nSize;
+
+public:
+    explicit CBlockIndexArena(size_t nChunkSizeIn) : nChunkSize(nChunkSizeIn), nUsed(0), nSize(0) {}
+
+    /** Returns a new, default-constructed entry owned by the arena. */
+    CBlockIndex* Allocate()
+    {
+        if (vChunks.empty() || nUsed == nChunkSize) {
+            vChunks.emplace_back(new CBlockIndex[nChunkSize]);
+            nUsed = 0;
+        }
+        nSize++;
+        return &vChunks.back()[nUsed++];
+    }
+
+    size_t size() const { return nSize; }
+
+    /** Frees all entries. */
+    void Clear()
+    {
+        vChunks.clear();
+        nUsed = 0;
+        nSize = 0;
+    }
+};
+
 /** An in-memory indexed chain of blocks. */
 class CChain {
 private:
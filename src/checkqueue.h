@@ -52,6 +52,9 @@ private:
     //! The temporary evaluation result.
     bool fAllOk;
 
+    //! The first verification that failed, handed to the master by Wait().
+    T checkFailed;
+
     /**
      * Number of verifications that haven't completed yet.
      * This includes elements that are no longer queued, but still in the
@@ -66,11 +69,12 @@ private:
     unsigned int nBatchSize;
 
     /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    bool Loop(bool fMaster = false, T* pcheckFailed = NULL)
     {
         boost::condition_variable& cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
+        T checkLocalFailed;
         unsigned int nNow = 0;
         bool fOk = true;
         do {
@@ -78,6 +82,9 @@ private:
                 boost::unique_lock<boost::mutex> lock(mutex);
                 // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
                 if (nNow) {
+                    // keep the check that failed first, so the master can report why
+                    if (fAllOk && !fOk)
+                        checkFailed.swap(checkLocalFailed);
                     fAllOk &= fOk;
                     nTodo -= nNow;
                     if (nTodo == 0 && !fMaster)
@@ -93,8 +100,13 @@ private:
                         nTotal--;
                         bool fRet = fAllOk;
                         // reset the status for new work later
-                        if (fMaster)
+                        if (fMaster) {
                             fAllOk = true;
+                            T check;
+                            checkFailed.swap(check);
+                            if (pcheckFailed != NULL)
+                                pcheckFailed->swap(check);
+                        }
                         // return the current status
                         return fRet;
                     }
@@ -119,9 +131,13 @@ private:
                 fOk = fAllOk;
             }
             // execute work
-            BOOST_FOREACH (T& check, vChecks)
-                if (fOk)
+            BOOST_FOREACH (T& check, vChecks) {
+                if (fOk) {
                     fOk = check();
+                    if (!fOk)
+                        checkLocalFailed.swap(check);
+                }
+            }
             vChecks.clear();
         } while (true);
     }
@@ -137,9 +153,10 @@ public:
     }
 
     //! Wait until execution finishes, and return whether all evaluations were successful.
-    bool Wait()
+    //! If one failed and pcheckFailed is not NULL, the first failing check is swapped into it.
+    bool Wait(T* pcheckFailed = NULL)
     {
-        return Loop(true);
+        return Loop(true, pcheckFailed);
     }
 
     //! Add a batch of checks to the queue
@@ -190,11 +207,11 @@ public:
         }
     }
 
-    bool Wait()
+    bool Wait(T* pcheckFailed = NULL)
     {
         if (pqueue == NULL)
             return true;
-        bool fRet = pqueue->Wait();
+        bool fRet = pqueue->Wait(pcheckFailed);
         fDone = true;
         return fRet;
     }
@@ -46,6 +46,15 @@
 #include <unistd.h>
 #endif
 
+// poll() (and epoll on Linux) lift select()'s FD_SETSIZE limit on peer sockets
+#if !defined(WIN32) && defined(HAVE_POLL_H)
+#define USE_POLL
+#include <poll.h>
+#if defined(HAVE_SYS_EPOLL_H)
+#define USE_EPOLL
+#endif
+#endif
+
 #ifdef WIN32
 #define MSG_DONTWAIT        0
 #else
@@ -94,7 +103,7 @@ size_t strnlen( const char *start, size_t max_len);
 #endif // HAVE_DECL_STRNLEN
 
 bool static inline IsSelectableSocket(SOCKET s) {
-#ifdef WIN32
+#if defined(WIN32) || defined(USE_POLL)
     return true;
 #else
     return (s < FD_SETSIZE);
@@ -0,0 +1,173 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Double SHA-256 of eight 64-byte inputs at once, one per 32-bit lane of an
+// AVX2 register. This file is compiled with -mavx -mavx2; its code only runs
+// after SHA256AutoDetect() has checked that the CPU and OS support it.
+
+#ifdef ENABLE_AVX2
+
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "crypto/common.h"
+
+namespace sha256d64_avx2 {
+namespace {
+
+const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+__m256i inline Set(uint32_t x) { return _mm256_set1_epi32(x); }
+__m256i inline Add(__m256i x, __m256i y) { return _mm256_add_epi32(x, y); }
+__m256i inline Add(__m256i x, __m256i y, __m256i z) { return Add(Add(x, y), z); }
+__m256i inline Add(__m256i x, __m256i y, __m256i z, __m256i w) { return Add(Add(x, y), Add(z, w)); }
+__m256i inline Add(__m256i x, __m256i y, __m256i z, __m256i w, __m256i v) { return Add(Add(x, y, z), Add(w, v)); }
+__m256i inline Xor(__m256i x, __m256i y) { return _mm256_xor_si256(x, y); }
+__m256i inline Xor(__m256i x, __m256i y, __m256i z) { return Xor(Xor(x, y), z); }
+__m256i inline Or(__m256i x, __m256i y) { return _mm256_or_si256(x, y); }
+__m256i inline And(__m256i x, __m256i y) { return _mm256_and_si256(x, y); }
+__m256i inline ShR(__m256i x, int n) { return _mm256_srli_epi32(x, n); }
+__m256i inline ShL(__m256i x, int n) { return _mm256_slli_epi32(x, n); }
+
+__m256i inline Ch(__m256i x, __m256i y, __m256i z) { return Xor(z, And(x, Xor(y, z))); }
+__m256i inline Maj(__m256i x, __m256i y, __m256i z) { return Or(And(x, y), And(z, Or(x, y))); }
+__m256i inline Sigma0(__m256i x) { return Xor(Or(ShR(x, 2), ShL(x, 30)), Or(ShR(x, 13), ShL(x, 19)), Or(ShR(x, 22), ShL(x, 10))); }
+__m256i inline Sigma1(__m256i x) { return Xor(Or(ShR(x, 6), ShL(x, 26)), Or(ShR(x, 11), ShL(x, 21)), Or(ShR(x, 25), ShL(x, 7))); }
+__m256i inline sigma0(__m256i x) { return Xor(Or(ShR(x, 7), ShL(x, 25)), Or(ShR(x, 18), ShL(x, 14)), ShR(x, 3)); }
+__m256i inline sigma1(__m256i x) { return Xor(Or(ShR(x, 17), ShL(x, 15)), Or(ShR(x, 19), ShL(x, 13)), ShR(x, 10)); }
+
+/** One round of SHA-256, with k the sum of the round constant and message word. */
+void inline __attribute__((always_inline)) Round(__m256i a, __m256i b, __m256i c, __m256i& d, __m256i e, __m256i f, __m256i g, __m256i& h, __m256i k)
+{
+    __m256i t1 = Add(h, Sigma1(e), Ch(e, f, g), k);
+    __m256i t2 = Add(Sigma0(a), Maj(a, b, c));
+    d = Add(d, t1);
+    h = Add(t1, t2);
+}
+
+/** Extend the message schedule in place: w[j] becomes message word j + 16. */
+__m256i inline __attribute__((always_inline)) Expand(__m256i* w, int j)
+{
+    w[j] = Add(w[j], sigma1(w[(j + 14) & 15]), w[(j + 9) & 15], sigma0(w[(j + 1) & 15]));
+    return w[j];
+}
+
+/** Eight rounds of SHA-256 starting at round i, rotating the working variables back into place. */
+#define ROUNDS8(i, W) \
+    Round(a, b, c, d, e, f, g, h, Add(Set(K[(i) + 0]), W(0))); \
+    Round(h, a, b, c, d, e, f, g, Add(Set(K[(i) + 1]), W(1))); \
+    Round(g, h, a, b, c, d, e, f, Add(Set(K[(i) + 2]), W(2))); \
+    Round(f, g, h, a, b, c, d, e, Add(Set(K[(i) + 3]), W(3))); \
+    Round(e, f, g, h, a, b, c, d, Add(Set(K[(i) + 4]), W(4))); \
+    Round(d, e, f, g, h, a, b, c, Add(Set(K[(i) + 5]), W(5))); \
+    Round(c, d, e, f, g, h, a, b, Add(Set(K[(i) + 6]), W(6))); \
+    Round(b, c, d, e, f, g, h, a, Add(Set(K[(i) + 7]), W(7)));
+
+/** Perform one SHA-256 transformation on each lane of s, with the message words in w (clobbered). */
+void inline __attribute__((always_inline)) Transform(__m256i* s, __m256i* w)
+{
+    __m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+
+#define W_LOAD_LO(n) w[(n)]
+#define W_LOAD_HI(n) w[8 + (n)]
+#define W_EXPAND_LO(n) Expand(w, (n))
+#define W_EXPAND_HI(n) Expand(w, 8 + (n))
+    ROUNDS8(0, W_LOAD_LO);
+    ROUNDS8(8, W_LOAD_HI);
+    for (int i = 16; i < 64; i += 16) {
+        ROUNDS8(i, W_EXPAND_LO);
+        ROUNDS8(i + 8, W_EXPAND_HI);
+    }
+#undef W_LOAD_LO
+#undef W_LOAD_HI
+#undef W_EXPAND_LO
+#undef W_EXPAND_HI
+
+    s[0] = Add(s[0], a);
+    s[1] = Add(s[1], b);
+    s[2] = Add(s[2], c);
+    s[3] = Add(s[3], d);
+    s[4] = Add(s[4], e);
+    s[5] = Add(s[5], f);
+    s[6] = Add(s[6], g);
+    s[7] = Add(s[7], h);
+}
+
+#undef ROUNDS8
+
+void inline Initialize(__m256i* s)
+{
+    s[0] = Set(0x6a09e667ul);
+    s[1] = Set(0xbb67ae85ul);
+    s[2] = Set(0x3c6ef372ul);
+    s[3] = Set(0xa54ff53aul);
+    s[4] = Set(0x510e527ful);
+    s[5] = Set(0x9b05688cul);
+    s[6] = Set(0x1f83d9abul);
+    s[7] = Set(0x5be0cd19ul);
+}
+
+/** Read a big-endian 32-bit word at offset from each of the eight 64-byte inputs. */
+__m256i inline Read8(const unsigned char* in, int offset)
+{
+    return _mm256_set_epi32(ReadBE32(in + offset), ReadBE32(in + 64 + offset), ReadBE32(in + 128 + offset), ReadBE32(in + 192 + offset),
+                            ReadBE32(in + 256 + offset), ReadBE32(in + 320 + offset), ReadBE32(in + 384 + offset), ReadBE32(in + 448 + offset));
+}
+
+/** Write each lane of v as a big-endian 32-bit word at offset in the eight 32-byte outputs. */
+void inline Write8(unsigned char* out, int offset, __m256i v)
+{
+    WriteBE32(out + offset, _mm256_extract_epi32(v, 7));
+    WriteBE32(out + 32 + offset, _mm256_extract_epi32(v, 6));
+    WriteBE32(out + 64 + offset, _mm256_extract_epi32(v, 5));
+    WriteBE32(out + 96 + offset, _mm256_extract_epi32(v, 4));
+    WriteBE32(out + 128 + offset, _mm256_extract_epi32(v, 3));
+    WriteBE32(out + 160 + offset, _mm256_extract_epi32(v, 2));
+    WriteBE32(out + 192 + offset, _mm256_extract_epi32(v, 1));
+    WriteBE32(out + 224 + offset, _mm256_extract_epi32(v, 0));
+}
+
+}
+
+void Transform_8way(unsigned char* out, const unsigned char* in)
+{
+    __m256i s[8], t[8], w[16];
+
+    // First hash: the 64-byte input, then its padding block.
+    Initialize(s);
+    for (int i = 0; i < 16; i++)
+        w[i] = Read8(in, 4 * i);
+    Transform(s, w);
+    w[0] = Set(0x80000000ul);
+    for (int i = 1; i < 15; i++)
+        w[i] = Set(0);
+    w[15] = Set(512);
+    Transform(s, w);
+
+    // Second hash: the 32-byte result and its padding, in a single block.
+    Initialize(t);
+    for (int i = 0; i < 8; i++)
+        w[i] = s[i];
+    w[8] = Set(0x80000000ul);
+    for (int i = 9; i < 15; i++)
+        w[i] = Set(0);
+    w[15] = Set(256);
+    Transform(t, w);
+
+    for (int i = 0; i < 8; i++)
+        Write8(out, 4 * i, t[i]);
+}
+
+}
+
+#endif
@@ -46,11 +46,19 @@ private:
     const CDBWrapper &parent;
     leveldb::WriteBatch batch;
 
+    size_t size_estimate;
+
 public:
     /**
      * @param[in] _parent   CDBWrapper that this batch is to be submitted to
      */
-    CDBBatch(const CDBWrapper &_parent) : parent(_parent) { };
+    CDBBatch(const CDBWrapper &_parent) : parent(_parent), size_estimate(0) { };
+
+    void Clear()
+    {
+        batch.Clear();
+        size_estimate = 0;
+    }
 
     template <typename K, typename V>
     void Write(const K& key, const V& value)
@@ -66,6 +74,14 @@ public:
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
         batch.Put(slKey, slValue);
+        // LevelDB serializes writes as:
+        // - byte: header
+        // - varint: key length (1 byte up to 127B, 2 bytes up to 16383B, ...)
+        // - byte[]: key
+        // - varint: value length
+        // - byte[]: value
+        // The formula below assumes the key and value are both less than 16k.
+        size_estimate += 3 + (slKey.size() > 127) + slKey.size() + (slValue.size() > 127) + slValue.size();
     }
 
     template <typename K>
@@ -77,7 +93,15 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         batch.Delete(slKey);
+        // LevelDB serializes erases as:
+        // - byte: header
+        // - varint: key length
+        // - byte[]: key
+        // The formula below assumes the key is less than 16kB.
+        size_estimate += 2 + (slKey.size() > 127) + slKey.size();
     }
+
+    size_t SizeEstimate() const { return size_estimate; }
 };
 
 class CDBIterator
@@ -140,6 +164,12 @@ public:
         return piter->value().size();
     }
 
+    /** Copy the serialized value, e.g. to deserialize it on another thread. */
+    void GetValueRaw(std::string& value) {
+        leveldb::Slice slValue = piter->value();
+        value.assign(slValue.data(), slValue.size());
+    }
+
 };
 
 class CDBWrapper
@@ -259,6 +289,23 @@ public:
      * Return true if the database managed by this class contains no entries.
      */
     bool IsEmpty();
+
+    /**
+     * Compact the range of keys [key_begin, key_end] on disk, reclaiming
+     * the space used by entries that have been erased from it.
+     */
+    template<typename K>
+    void CompactRange(const K& key_begin, const K& key_end) const
+    {
+        CDataStream ssKey1(SER_DISK, CLIENT_VERSION), ssKey2(SER_DISK, CLIENT_VERSION);
+        ssKey1.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
+        ssKey2.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
+        ssKey1 << key_begin;
+        ssKey2 << key_end;
+        leveldb::Slice slKey1(&ssKey1[0], ssKey1.size());
+        leveldb::Slice slKey2(&ssKey2[0], ssKey2.size());
+        pdb->CompactRange(&slKey1, &slKey2);
+    }
 };
 
 #endif // BITCOIN_DBWRAPPER_H
@@ -234,6 +234,30 @@ TEST_F(ContextualCheckBlockTest, BlockSaplingRulesAcceptSaplingTx) {
     ExpectValidBlockFromTx(CTransaction(mtx));
 }
 
+// Test that Sapling proofs are left for ConnectBlock to verify, while
+// ContextualCheckTransaction on its own still rejects them.
+TEST_F(ContextualCheckBlockTest, BlockSaplingRulesDeferSaplingProofs) {
+    SelectParams(CBaseChainParams::REGTEST);
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_OVERWINTER, 1);
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_SAPLING, 1);
+
+    CMutableTransaction mtx = GetFirstBlockCoinbaseTx();
+
+    // Make it a Sapling transaction with an invalid output description
+    mtx.fOverwintered = true;
+    mtx.nVersion = SAPLING_TX_VERSION;
+    mtx.nVersionGroupId = SAPLING_VERSION_GROUP_ID;
+    mtx.vShieldedOutput.resize(1);
+    CTransaction tx {mtx};
+
+    SCOPED_TRACE("BlockSaplingRulesDeferSaplingProofs");
+    ExpectValidBlockFromTx(tx);
+
+    MockCValidationState state;
+    EXPECT_CALL(state, DoS(100, false, REJECT_INVALID, "bad-txns-sapling-output-description-invalid", false)).Times(1);
+    EXPECT_FALSE(ContextualCheckTransaction(tx, state, Params(), 1, 100));
+}
+
 // TEST PLAN: next, check that each ruleset will not accept other transaction
 // types. Currently (May 2018) this means we'll test Sprout-Overwinter,
 // Sprout-Sapling, Overwinter-Sprout, Overwinter-Sapling, Sapling-Sprout, and
@@ -6,6 +6,8 @@
 #include "core_io.h"
 #include "main.h"
 #include "primitives/transaction.h"
+#include "pubkey.h"
+#include "script/standard.h"
 #include "txmempool.h"
 #include "policy/fees.h"
 #include "util.h"
@@ -31,19 +33,18 @@ public:
         return false;
     }
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const {
+        if (outpoint.n != 0) {
+            return false;
+        }
         CTxOut txOut;
         txOut.nValue = 4288035;
-        CCoins newCoins;
-        newCoins.vout.resize(2);
-        newCoins.vout[0] = txOut;
-        newCoins.nHeight = 92045;
-        coins.swap(newCoins);
+        coin = Coin(txOut, 92045, false);
         return true;
     }
 
-    bool HaveCoins(const uint256 &txid) const {
-        return true;
+    bool HaveCoin(const COutPoint &outpoint) const {
+        return outpoint.n == 0;
     }
 
     uint256 GetBestBlock() const {
@@ -317,3 +318,68 @@ TEST(Mempool, ExpiringSoonTxRejection) {
     // Revert to default
     UpdateNetworkUpgradeParameters(Consensus::UPGRADE_OVERWINTER, Consensus::NetworkUpgrade::NO_ACTIVATION_HEIGHT);
 }
+
+// insightexplorer
+TEST(Mempool, AddressAndSpentIndex) {
+    CTxMemPool pool(::minRelayTxFee);
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+
+    CKeyID keyA(uint160(ParseHex("0000000000000000000000000000000000000001")));
+    CKeyID keyB(uint160(ParseHex("0000000000000000000000000000000000000002")));
+
+    CMutableTransaction mtxPrev;
+    mtxPrev.vout.push_back(CTxOut(5 * COIN, GetScriptForDestination(keyA)));
+    CTransaction txPrev(mtxPrev);
+    AddCoins(view, txPrev, 1);
+
+    CMutableTransaction mtx;
+    mtx.vin.push_back(CTxIn(COutPoint(txPrev.GetHash(), 0)));
+    mtx.vout.push_back(CTxOut(4 * COIN, GetScriptForDestination(keyB)));
+    CTransaction tx(mtx);
+
+    // The indexes are only updated when enabled and given the coins spent
+    CTxMemPoolEntry entry(tx, 1 * COIN, 1000, 0.0, 1, true, false, 0);
+    size_t nUsage = pool.DynamicMemoryUsage();
+    fAddressIndex = true;
+    fSpentIndex = true;
+    pool.addUnchecked(tx.GetHash(), entry, true, &view);
+    fAddressIndex = false;
+    fSpentIndex = false;
+
+    // The index entries are counted as mempool memory usage
+    CTxMemPool poolWithoutIndexes(::minRelayTxFee);
+    poolWithoutIndexes.addUnchecked(tx.GetHash(), entry, true, &view);
+    EXPECT_GT(pool.DynamicMemoryUsage(), poolWithoutIndexes.DynamicMemoryUsage());
+    EXPECT_GT(pool.DynamicMemoryUsage(), nUsage);
+
+    std::vector<std::pair<uint160, int> > addresses;
+    addresses.push_back(std::make_pair(keyA, CScript::P2PKH));
+    addresses.push_back(std::make_pair(keyB, CScript::P2PKH));
+    std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > results;
+    pool.getAddressIndex(addresses, results);
+    ASSERT_EQ(results.size(), 2);
+    EXPECT_EQ(results[0].first.addressBytes, keyA);
+    EXPECT_EQ(results[0].first.spending, 1);
+    EXPECT_EQ(results[0].second.amount, -5 * COIN);
+    EXPECT_EQ(results[0].second.prevhash, txPrev.GetHash());
+    EXPECT_EQ(results[1].first.addressBytes, keyB);
+    EXPECT_EQ(results[1].first.spending, 0);
+    EXPECT_EQ(results[1].second.amount, 4 * COIN);
+
+    CSpentIndexValue value;
+    EXPECT_TRUE(pool.getSpentIndex(CSpentIndexKey(txPrev.GetHash(), 0), value));
+    EXPECT_EQ(value.txid, tx.GetHash());
+    EXPECT_EQ(value.inputIndex, 0);
+    EXPECT_EQ(value.satoshis, 5 * COIN);
+    EXPECT_FALSE(pool.getSpentIndex(CSpentIndexKey(txPrev.GetHash(), 1), value));
+
+    // Removing the transaction removes its index entries
+    std::list<CTransaction> removed;
+    pool.remove(tx, removed);
+    results.clear();
+    pool.getAddressIndex(addresses, results);
+    EXPECT_EQ(results.size(), 0);
+    EXPECT_FALSE(pool.getSpentIndex(CSpentIndexKey(txPrev.GetHash(), 0), value));
+    EXPECT_EQ(pool.DynamicMemoryUsage(), nUsage);
+}
@@ -21,6 +21,7 @@
 #include "utilstrencodings.h"
 #include "version.h"
 #include "serialize.h"
+#include "random.h"
 #include "streams.h"
 
 #include "zcash/IncrementalMerkleTree.hpp"
@@ -342,3 +343,61 @@ TEST(merkletree, testZeroElements) {
         ASSERT_TRUE(newTree.root() == oldroot);
     }
 }
+
+template<typename Tree, typename Witness, typename Updater>
+void test_witness_updater(size_t numCommitments)
+{
+    Tree tree;
+    std::vector<Witness> witnesses;
+
+    // Witness every third commitment appended before the updater is created.
+    for (size_t i = 0; i < numCommitments / 2; i++) {
+        tree.append(GetRandHash());
+        for (Witness& wit : witnesses) {
+            wit.append(tree.last());
+        }
+        if (i % 3 == 0) {
+            witnesses.push_back(tree.witness());
+        }
+    }
+
+    // Advance a copy of each witness one commitment at a time, and the
+    // originals through the updater in a single pass. Every other commitment
+    // appended to the updater is witnessed from its tree, as the wallet does
+    // for its own notes in the middle of a block.
+    std::vector<Witness> expected(witnesses);
+    Updater updater(tree);
+    for (size_t i = numCommitments / 2; i < numCommitments; i++) {
+        uint256 cm = GetRandHash();
+        tree.append(cm);
+        updater.append(cm);
+        for (Witness& wit : expected) {
+            wit.append(cm);
+        }
+        if (i % 2 == 0) {
+            witnesses.push_back(updater.tree().witness());
+            expected.push_back(tree.witness());
+        }
+    }
+
+    ASSERT_TRUE(updater.tree() == tree);
+    for (size_t i = 0; i < witnesses.size(); i++) {
+        updater.update(witnesses[i]);
+        ASSERT_TRUE(witnesses[i] == expected[i]);
+        ASSERT_TRUE(witnesses[i].root() == tree.root());
+    }
+
+    // A witness to a commitment the updater has not seen cannot be updated.
+    Tree smaller = tree;
+    tree.append(GetRandHash());
+    Witness ahead = tree.witness();
+    ASSERT_THROW(Updater(smaller).update(ahead), std::runtime_error);
+}
+
+TEST(merkletree, WitnessUpdater) {
+    // The testing trees hold 16 commitments; leave room for one more.
+    for (size_t n = 2; n < 16; n++) {
+        test_witness_updater<SproutTestingMerkleTree, SproutTestingWitness, SproutTestingWitnessUpdater>(n);
+        test_witness_updater<SaplingTestingMerkleTree, SaplingTestingWitness, SaplingTestingWitnessUpdater>(n);
+    }
+}
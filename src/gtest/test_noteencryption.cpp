@@ -158,6 +158,63 @@ TEST(noteencryption, NotePlaintext)
     ASSERT_TRUE(bar.rcm == pt.rcm);
 }
 
+TEST(noteencryption, NotePlaintextBatch)
+{
+    using namespace libzcash;
+    std::array<unsigned char, ZC_MEMO_SIZE> memo = {};
+
+    // Three recipients, of which only the first two are ours
+    std::vector<SaplingIncomingViewingKey> ivks;
+    std::vector<SaplingEncCiphertext> cts;
+    std::vector<uint256> epks;
+    std::vector<uint256> cmus;
+    for (size_t i = 0; i < 3; i++) {
+        auto ivk = SaplingSpendingKey::random().expanded_spending_key().full_viewing_key().in_viewing_key();
+        auto addr = *ivk.address({0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0});
+        SaplingNote note(addr, 1000 + i);
+        auto res = SaplingNotePlaintext(note, memo).encrypt(addr.pk_d);
+        ASSERT_TRUE(res);
+        ivks.push_back(ivk);
+        cts.push_back(res->first);
+        epks.push_back(res->second.get_epk());
+        cmus.push_back(*note.cm());
+    }
+
+    // Encrypted to the second, first and third recipients
+    std::vector<SaplingEncDecryptionInput> outputs {
+        {&cts[1], epks[1]},
+        {&cts[0], epks[0]},
+        {&cts[2], epks[2]},
+    };
+    std::vector<uint256> outputCmus {cmus[1], cmus[0], cmus[2]};
+    std::vector<uint256> ourIvks {ivks[0], ivks[1]};
+
+    for (size_t nThreads : {0, 1, 4}) {
+        auto matches = AttemptSaplingEncDecryptionBatch(outputs, ourIvks, nThreads);
+        ASSERT_EQ(2, matches.size());
+        EXPECT_EQ(0, matches[0].output);
+        EXPECT_EQ(1, matches[0].ivk);
+        EXPECT_EQ(1, matches[1].output);
+        EXPECT_EQ(0, matches[1].ivk);
+
+        auto notes = SaplingNotePlaintext::decrypt_batch(outputs, outputCmus, ourIvks, nThreads);
+        ASSERT_EQ(2, notes.size());
+        EXPECT_EQ(1, notes.at(0).first);
+        EXPECT_EQ(1001, notes.at(0).second.value());
+        EXPECT_EQ(0, notes.at(1).first);
+        EXPECT_EQ(1000, notes.at(1).second.value());
+    }
+
+    // A note that does not match its commitment is not returned
+    outputCmus[1] = uint256();
+    auto notes = SaplingNotePlaintext::decrypt_batch(outputs, outputCmus, ourIvks, 1);
+    ASSERT_EQ(1, notes.size());
+    EXPECT_EQ(1, notes.count(0));
+
+    // Nothing can be decrypted without keys
+    EXPECT_TRUE(AttemptSaplingEncDecryptionBatch(outputs, {}, 1).empty());
+}
+
 TEST(noteencryption, SaplingApi)
 {
     using namespace libzcash;
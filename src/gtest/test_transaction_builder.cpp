@@ -39,11 +39,11 @@ public:
         return false;
     }
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const {
         return false;
     }
 
-    bool HaveCoins(const uint256 &txid) const {
+    bool HaveCoin(const COutPoint &outpoint) const {
         return false;
     }
 
@@ -188,6 +188,49 @@ TEST(TransactionBuilder, SaplingToSprout) {
     RegtestDeactivateSapling();
 }
 
+TEST(TransactionBuilder, SaplingToManySproutWithProofThreads) {
+    auto consensusParams = RegtestActivateSapling();
+
+    auto sk = libzcash::SaplingSpendingKey::random();
+    auto expsk = sk.expanded_spending_key();
+    auto pa = sk.default_address();
+
+    auto testNote = GetTestSaplingNote(pa, 40000);
+
+    std::vector<libzcash::SproutPaymentAddress> sproutAddrs;
+    for (int i = 0; i < 3; i++) {
+        sproutAddrs.push_back(libzcash::SproutSpendingKey::random().address());
+    }
+
+    // Create a Sapling-to-Sprout transaction, proving the Sapling spend and
+    // the independent JoinSplits on several threads
+    // - 0.0004 Sapling-ZEC in      - 0.00007 Sprout-ZEC out (2 JoinSplits)
+    //                              - 0.00023 Sapling-ZEC change
+    //                              - 0.0001 t-ZEC fee
+    auto builder = TransactionBuilder(consensusParams, 2, expiryDelta, nullptr, params);
+    builder.SetProofThreads(4);
+    builder.AddSaplingSpend(expsk, testNote.note, testNote.tree.root(), testNote.tree.witness());
+    for (int i = 0; i < 3; i++) {
+        builder.AddSproutOutput(sproutAddrs[i], 1000 << i);
+    }
+    auto tx = builder.Build().GetTxOrThrow();
+
+    // The JoinSplits stay in the order of their outputs
+    EXPECT_EQ(tx.vjoinsplit.size(), 2);
+    EXPECT_EQ(tx.vjoinsplit[0].vpub_old, 3000);
+    EXPECT_EQ(tx.vjoinsplit[1].vpub_old, 4000);
+    EXPECT_EQ(tx.vShieldedSpend.size(), 1);
+    EXPECT_EQ(tx.vShieldedOutput.size(), 1);
+    EXPECT_EQ(tx.valueBalance, 17000);
+
+    CValidationState state;
+    EXPECT_TRUE(ContextualCheckTransaction(tx, state, Params(), 3, 0));
+    EXPECT_EQ(state.GetRejectReason(), "");
+
+    // Revert to default
+    RegtestDeactivateSapling();
+}
+
 TEST(TransactionBuilder, SproutToSproutAndSapling) {
     auto consensusParams = RegtestActivateSapling();
 
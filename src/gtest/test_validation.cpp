@@ -3,8 +3,11 @@
 #include "consensus/upgrades.h"
 #include "consensus/validation.h"
 #include "main.h"
+#include "transaction_builder.h"
 #include "utiltest.h"
 
+#include <boost/thread.hpp>
+
 extern ZCJoinSplit* params;
 
 extern bool ReceivedBlockTransactions(
@@ -38,11 +41,11 @@ public:
         return false;
     }
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const {
         return false;
     }
 
-    bool HaveCoins(const uint256 &txid) const {
+    bool HaveCoin(const COutPoint &outpoint) const {
         return false;
     }
 
@@ -165,3 +168,131 @@ TEST(Validation, ReceivedBlockTransactions) {
         ExpectOptionalAmount(30, fakeIndex2.nChainSproutValue);
     }
 }
+
+// A view at the tip of a chain with empty commitment trees, holding coins
+// for the outpoints in `coins`
+class ConnectBlockCoinsView : public FakeCoinsViewDB {
+public:
+    uint256 hashBestBlock;
+    std::set<COutPoint> coins;
+
+    bool GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const {
+        tree = SproutMerkleTree();
+        return true;
+    }
+
+    bool GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const {
+        tree = SaplingMerkleTree();
+        return true;
+    }
+
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const {
+        if (!coins.count(outpoint)) {
+            return false;
+        }
+        coin = Coin(CTxOut(10 * COIN, CScript() << OP_TRUE), 1, false);
+        return true;
+    }
+
+    bool HaveCoin(const COutPoint &outpoint) const {
+        return coins.count(outpoint) > 0;
+    }
+
+    uint256 GetBestBlock() const {
+        return hashBestBlock;
+    }
+
+    uint256 GetBestAnchor(ShieldedType type) const {
+        if (type == SPROUT) {
+            return SproutMerkleTree::empty_root();
+        }
+        return SaplingMerkleTree::empty_root();
+    }
+};
+
+// Connect a block holding tx with the shielded checks queued for a worker
+// thread rather than run inline, as a node with -par > 1 does, and expect
+// the block to be rejected with the reason of the check that failed.
+void ExpectConnectBlockRejects(const CChainParams& chainParams, int nHeight,
+                               const CTransaction& tx, const std::string& strRejectReason) {
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vin[0].scriptSig = CScript() << nHeight << OP_0;
+    coinbase.vout.resize(1);
+    coinbase.vout[0].nValue = 0;
+
+    CBlock prev;
+    CBlockIndex indexPrev(prev);
+    indexPrev.nHeight = nHeight - 1;
+    uint256 hashPrev = prev.GetHash();
+    indexPrev.phashBlock = &hashPrev;
+
+    CBlock block;
+    block.nVersion = 4;
+    block.hashPrevBlock = hashPrev;
+    block.vtx.push_back(CTransaction(coinbase));
+    block.vtx.push_back(tx);
+    CBlockIndex index(block);
+    index.nHeight = nHeight;
+    index.pprev = &indexPrev;
+
+    ConnectBlockCoinsView fakeDB;
+    fakeDB.hashBestBlock = hashPrev;
+    for (const CTxIn& txin : tx.vin) {
+        fakeDB.coins.insert(txin.prevout);
+    }
+    CCoinsViewCache view(&fakeDB);
+
+    boost::thread_group threadGroup;
+    threadGroup.create_thread(&ThreadScriptCheck);
+    int nScriptCheckThreadsOld = nScriptCheckThreads;
+    nScriptCheckThreads = 2;
+
+    {
+        LOCK(cs_main);
+        mapBlockIndex.insert(std::make_pair(hashPrev, &indexPrev));
+        CValidationState state;
+        EXPECT_FALSE(ConnectBlock(block, state, &index, view, chainParams, true));
+        int nDoS;
+        EXPECT_TRUE(state.IsInvalid(nDoS));
+        EXPECT_EQ(100, nDoS);
+        EXPECT_EQ(strRejectReason, state.GetRejectReason());
+        mapBlockIndex.erase(hashPrev);
+    }
+
+    nScriptCheckThreads = nScriptCheckThreadsOld;
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+TEST(Validation, ConnectBlockRejectsInvalidJoinSplitSig) {
+    SelectParams(CBaseChainParams::MAIN);
+
+    // A JoinSplit transaction whose signature does not match
+    auto sk = libzcash::SproutSpendingKey::random();
+    CMutableTransaction mtx(GetValidSproutReceive(*params, sk, 5, true));
+    mtx.joinSplitSig[0] ^= 1;
+
+    ExpectConnectBlockRejects(Params(), 2, CTransaction(mtx), "bad-txns-invalid-joinsplit-signature");
+}
+
+TEST(Validation, ConnectBlockRejectsInvalidSaplingOutputProof) {
+    auto consensusParams = RegtestActivateSapling();
+
+    // A Sapling transaction whose output proof does not verify
+    CBasicKeyStore keystore;
+    CKey tsk = AddTestCKeyToKeyStore(keystore);
+    auto scriptPubKey = GetScriptForDestination(tsk.GetPubKey().GetID());
+    auto sk = GetTestMasterSaplingSpendingKey();
+    auto builder = TransactionBuilder(consensusParams, 2, expiryDelta, &keystore);
+    builder.SetFee(0);
+    builder.AddTransparentInput(COutPoint(uint256S("1234"), 0), scriptPubKey, 10 * COIN);
+    builder.AddSaplingOutput(sk.expsk.full_viewing_key().ovk, sk.DefaultAddress(), 10 * COIN, {});
+    CMutableTransaction mtx(builder.Build().GetTxOrThrow());
+    mtx.vShieldedOutput[0].zkproof[0] ^= 1;
+
+    ExpectConnectBlockRejects(Params(), 2, CTransaction(mtx), "bad-txns-sapling-output-description-invalid");
+
+    RegtestDeactivateSapling();
+}
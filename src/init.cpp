@@ -9,7 +9,9 @@
 
 #include "init.h"
 #include "crypto/common.h"
+#include "crypto/sha256.h"
 #include "addrman.h"
+#include "asyncrpcqueue.h"
 #include "amount.h"
 #include "checkpoints.h"
 #include "compat/sanity.h"
@@ -151,9 +153,9 @@ class CCoinsViewErrorCatcher : public CCoinsViewBacked
 {
 public:
     CCoinsViewErrorCatcher(CCoinsView* view) : CCoinsViewBacked(view) {}
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const {
         try {
-            return CCoinsViewBacked::GetCoins(txid, coins);
+            return CCoinsViewBacked::GetCoin(outpoint, coin);
         } catch(const std::runtime_error& e) {
             uiInterface.ThreadSafeMessageBox(_("Error reading from database, shutting down."), "", CClientUIInterface::MSG_ERROR);
             LogPrintf("Error reading from database: %s\n", e.what());
@@ -167,7 +169,6 @@ public:
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB *pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher *pcoinscatcher = NULL;
 static boost::scoped_ptr<ECCVerifyHandle> globalVerifyHandle;
 
@@ -241,6 +242,12 @@ void Shutdown()
         pwalletMain->Flush(true);
 #endif
 
+    if (pblocktemplatebuilder) {
+        UnregisterValidationInterface(pblocktemplatebuilder);
+        delete pblocktemplatebuilder;
+        pblocktemplatebuilder = NULL;
+    }
+
 #if ENABLE_ZMQ
     if (pzmqNotificationInterface) {
         UnregisterValidationInterface(pzmqNotificationInterface);
@@ -339,6 +346,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-?", _("This help message"));
     strUsage += HelpMessageOpt("-alerts", strprintf(_("Receive and display P2P network alerts (default: %u)"), DEFAULT_ALERTS));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
+    strUsage += HelpMessageOpt("-blockcachesize=<n>", strprintf(_("Keep up to <n> megabytes of recent blocks ready to send to peers, 0 to disable (default: %u)"), DEFAULT_BLOCK_CACHE_SIZE));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
     strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), 288));
     strUsage += HelpMessageOpt("-checklevel=<n>", strprintf(_("How thorough the block verification of -checkblocks is (0-4, default: %u)"), 3));
@@ -353,9 +361,17 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-exportdir=<dir>", _("Specify directory to be used when exporting data"));
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file") + " " + _("on startup"));
+    strUsage += HelpMessageOpt("-loadsnapshot=<file>", _("Initialize a new data directory from a UTXO snapshot written by dumptxoutset. "
+            "Blocks below the snapshot are not downloaded, so this requires -prune and -snapshothash"));
+    strUsage += HelpMessageOpt("-snapshothash=<hex>", _("Only load the -loadsnapshot file if its hash, as reported by dumptxoutset, is <hex>"));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+    strUsage += HelpMessageOpt("-maxmempool=<n>", strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE));
+    strUsage += HelpMessageOpt("-mempoolexpiry=<n>", strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY));
     strUsage += HelpMessageOpt("-mempooltxinputlimit=<n>", _("[DEPRECATED FROM OVERWINTER] Set the maximum number of transparent inputs in a transaction that the mempool will accept (default: 0 = no limit applied)"));
-    strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
+#ifndef WIN32
+    strUsage += HelpMessageOpt("-mmapblocks", strprintf(_("Read blocks from memory mapped block files, faster for rescans and serving many blocks (default: %u)"), DEFAULT_MMAP_BLOCK_FILES));
+#endif
+    strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script and proof verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file (default: %s)"), "bitzec.pid"));
@@ -364,6 +380,8 @@ std::string HelpMessage(HelpMessageMode mode)
             "Warning: Reverting this setting requires re-downloading the entire blockchain. "
             "(default: 0 = disable pruning blocks, >%u = target size in MiB to use for block files)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
     strUsage += HelpMessageOpt("-reindex", _("Rebuild block chain index from current blk000??.dat files on startup"));
+    strUsage += HelpMessageOpt("-reindexthreads=<n>", strprintf(_("Set the number of threads that scan and read block files during -reindex (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
+        -GetNumCores(), MAX_REINDEX_THREADS, DEFAULT_REINDEX_THREADS));
 #if !defined(WIN32)
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
@@ -414,6 +432,8 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-paytxfee=<amt>", strprintf(_("Fee (in %s/kB) to add to transactions you send (default: %s)"),
         CURRENCY_UNIT, FormatMoney(payTxFee.GetFeePerK())));
     strUsage += HelpMessageOpt("-rescan", _("Rescan the block chain for missing wallet transactions") + " " + _("on startup"));
+    strUsage += HelpMessageOpt("-rescanthreads=<n>", strprintf(_("Set the number of threads that read and trial-decrypt blocks during a wallet rescan (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
+        -GetNumCores(), MAX_RESCAN_THREADS, DEFAULT_RESCAN_THREADS));
     strUsage += HelpMessageOpt("-salvagewallet", _("Attempt to recover private keys from a corrupt wallet.dat") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-sendfreetransactions", strprintf(_("Send transactions as zero-fee transactions if possible (default: %u)"), 0));
     strUsage += HelpMessageOpt("-spendzeroconfchange", strprintf(_("Spend unconfirmed change when sending transactions (default: %u)"), 1));
@@ -468,6 +488,10 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-logtimestamps", strprintf(_("Prepend debug output with timestamp (default: %u)"), 1));
     if (showDebug)
     {
+        strUsage += HelpMessageOpt("-limitancestorcount=<n>", strprintf("Do not accept transactions if number of in-mempool ancestors is <n> or more (default: %u)", DEFAULT_ANCESTOR_LIMIT));
+        strUsage += HelpMessageOpt("-limitancestorsize=<n>", strprintf("Do not accept transactions whose size with all in-mempool ancestors exceeds <n> kilobytes (default: %u)", DEFAULT_ANCESTOR_SIZE_LIMIT));
+        strUsage += HelpMessageOpt("-limitdescendantcount=<n>", strprintf("Do not accept transactions if any ancestor would have <n> or more in-mempool descendants (default: %u)", DEFAULT_DESCENDANT_LIMIT));
+        strUsage += HelpMessageOpt("-limitdescendantsize=<n>", strprintf("Do not accept transactions if any ancestor would have more than <n> kilobytes of in-mempool descendants (default: %u).", DEFAULT_DESCENDANT_SIZE_LIMIT));
         strUsage += HelpMessageOpt("-limitfreerelay=<n>", strprintf("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default: %u)", 15));
         strUsage += HelpMessageOpt("-relaypriority", strprintf("Require high priority for relaying free or low-fee transactions (default: %u)", 0));
         strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf("Limit size of signature cache to <n> MiB (default: %u)", DEFAULT_MAX_SIG_CACHE_SIZE));
@@ -527,8 +551,11 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-rpcservertimeout=<n>", strprintf("Timeout during HTTP requests (default: %d)", DEFAULT_HTTP_SERVER_TIMEOUT));
     }
 
-    // Disabled until we can lock notes and also tune performance of libsnark which by default uses multiple threads
-    //strUsage += HelpMessageOpt("-rpcasyncthreads=<n>", strprintf(_("Set the number of threads to service Async RPC calls (default: %d)"), 1));
+    strUsage += HelpMessageOpt("-rpcasyncresultttl=<n>", strprintf(_("Forget the results of finished async RPC operations that have not been fetched after <n> seconds, 0 = never (default: %d)"), DEFAULT_ASYNC_RPC_RESULT_TTL));
+    if (showDebug) {
+        strUsage += HelpMessageOpt("-rpcasyncthreads=<n>", strprintf("Set the number of threads to service Async RPC calls (default: %d)", DEFAULT_ASYNC_RPC_THREADS));
+        strUsage += HelpMessageOpt("-rpcasyncmaxproving=<n>", strprintf("Maximum number of async RPC operations creating proofs at the same time, 0 = no limit. Above 1, concurrent operations may select the same notes (default: %d)", DEFAULT_ASYNC_RPC_MAX_PROVING));
+    }
 
     if (mode == HMM_BITCOIND) {
         strUsage += HelpMessageGroup(_("Metrics Options (only if -daemon and -printtoconsole are not set):"));
@@ -611,17 +638,13 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     // -reindex
     if (fReindex) {
         CImportingNow imp;
-        int nFile = 0;
-        while (true) {
-            CDiskBlockPos pos(nFile, 0);
-            if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
-                break; // No block files left to reindex
-            FILE *file = OpenBlockFile(pos, true);
-            if (!file)
-                break; // This error is logged in OpenBlockFile
-            LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
-            LoadExternalBlockFile(chainparams, file, &pos);
-            nFile++;
+        CSequentialBlockReads sequential(mappedBlockFiles);
+        // Keep the reindexing flag unless every block file was processed, so
+        // that an interrupted reindex starts over on the next run instead of
+        // leaving an incomplete block index behind.
+        if (!ReindexBlockFiles(chainparams)) {
+            LogPrintf("Reindexing was interrupted; it will start over on the next run\n");
+            return;
         }
         pblocktree->WriteReindexing(false);
         fReindex = false;
@@ -914,9 +937,14 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
 
     // Make sure enough file descriptors are available
-    int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
     nMaxConnections = GetArg("-maxconnections", DEFAULT_MAX_PEER_CONNECTIONS);
+#ifdef USE_POLL
+    nMaxConnections = std::max(nMaxConnections, 0);
+#else
+    // select() cannot watch descriptors at or above FD_SETSIZE
+    int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
     nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+#endif
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -938,6 +966,17 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 #endif
     }
 
+    // a node started from a UTXO snapshot has no blocks below it, just like a pruned node
+    if (mapArgs.count("-loadsnapshot")) {
+        if (!GetArg("-prune", 0))
+            return InitError(_("-loadsnapshot requires -prune."));
+        if (GetBoolArg("-reindex", false))
+            return InitError(_("-loadsnapshot is incompatible with -reindex."));
+        std::string strSnapshotHash = GetArg("-snapshothash", "");
+        if (strSnapshotHash.size() != 64 || !IsHex(strSnapshotHash))
+            return InitError(_("-loadsnapshot requires -snapshothash=<hex> with the snapshot hash reported by dumptxoutset."));
+    }
+
     // ********************************************************* Step 3: parameter-to-internal-flags
 
     fDebug = !mapMultiArgs["-debug"].empty();
@@ -1108,6 +1147,19 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
 #endif
 
+    // mempool limits
+    int64_t nMempoolSizeMax = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    int64_t nMempoolSizeMin = 5 * MAX_BLOCK_SIZE;
+    if (nMempoolSizeMax < 0 || nMempoolSizeMax < nMempoolSizeMin)
+        return InitError(strprintf(_("-maxmempool must be at least %d MB"), std::ceil(nMempoolSizeMin / 1000000.0)));
+    if (GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) <= 0)
+        return InitError(_("-mempoolexpiry must be positive"));
+
+    serializedBlockCache.SetMaxSize(std::max((int64_t)0, GetArg("-blockcachesize", DEFAULT_BLOCK_CACHE_SIZE)) * 1000000);
+#ifndef WIN32
+    fMmapBlockFiles = GetBoolArg("-mmapblocks", DEFAULT_MMAP_BLOCK_FILES);
+#endif
+
     // Default value of 0 for mempooltxinputlimit means no limit is applied
     if (mapArgs.count("-mempooltxinputlimit")) {
         int64_t limit = GetArg("-mempooltxinputlimit", 0);
@@ -1158,6 +1210,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         return false;
     }
 
+    std::string sha256_algo = SHA256AutoDetect();
+    LogPrintf("Using the '%s' SHA256 implementation\n", sha256_algo);
+
     // Initialize elliptic curve code
     ECC_Start();
     globalVerifyHandle.reset(new ECCVerifyHandle());
@@ -1206,8 +1261,10 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("Using at most %i connections (%i file descriptors available)\n", nMaxConnections, nFD);
     std::ostringstream strErrors;
 
-    LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+    LogPrintf("Using %u threads for script and proof verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
+        // Script, Sapling and JoinSplit checks share one queue, so all of
+        // these threads work on whichever checks a block contains.
         for (int i=0; i<nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
     }
@@ -1419,6 +1476,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
 #endif
 
+    pblocktemplatebuilder = new CBlockTemplateBuilder(chainparams);
+    RegisterValidationInterface(pblocktemplatebuilder);
+
     // ********************************************************* Step 7: load block chain
 
     fReindex = GetBoolArg("-reindex", false);
@@ -1505,6 +1565,26 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                         CleanupBlockRevFiles();
                 }
 
+                // If necessary, upgrade from older database format.
+                if (!pcoinsdbview->Upgrade()) {
+                    strLoadError = _("Error upgrading chainstate database");
+                    break;
+                }
+
+                if (mapArgs.count("-loadsnapshot")) {
+                    boost::filesystem::path pathSnapshot = GetArg("-loadsnapshot", "");
+                    uint256 hashSnapshot = uint256S(GetArg("-snapshothash", ""));
+                    if (!LoadUTXOSnapshot(chainparams, boost::filesystem::absolute(pathSnapshot, GetDataDir()), hashSnapshot, strLoadError)) {
+                        break;
+                    }
+                } else {
+                    bool fSnapshotLoaded;
+                    if (pblocktree->ReadFlag("utxosnapshot", fSnapshotLoaded) && !fSnapshotLoaded) {
+                        strLoadError = _("Loading a UTXO snapshot was interrupted; restart with the same -loadsnapshot");
+                        break;
+                    }
+                }
+
                 if (!LoadBlockIndex()) {
                     strLoadError = _("Error loading block database");
                     break;
@@ -298,6 +298,18 @@ public:
         }
     }
 
+    void GetSaplingIncomingViewingKeys(std::vector<libzcash::SaplingIncomingViewingKey> &ivks) const
+    {
+        ivks.clear();
+        {
+            LOCK(cs_SpendingKeyStore);
+            ivks.reserve(mapSaplingFullViewingKeys.size());
+            for (const auto &entry : mapSaplingFullViewingKeys) {
+                ivks.push_back(entry.first);
+            }
+        }
+    }
+
     virtual bool AddSproutViewingKey(const libzcash::SproutViewingKey &vk);
     virtual bool RemoveSproutViewingKey(const libzcash::SproutViewingKey &vk);
     virtual bool HaveSproutViewingKey(const libzcash::SproutPaymentAddress &address) const;
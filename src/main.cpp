@@ -10,6 +10,7 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -56,6 +57,8 @@ using namespace std;
 
 CCriticalSection cs_main;
 
+/** Owns the entries of mapBlockIndex. */
+static CBlockIndexArena blockIndexArena(BLOCK_INDEX_ARENA_CHUNK_SIZE);
 BlockMap mapBlockIndex;
 CChain chainActive;
 CBlockIndex *pindexBestHeader = NULL;
@@ -76,6 +79,7 @@ bool fPruneMode = false;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
 bool fCheckpointsEnabled = true;
+bool fMmapBlockFiles = DEFAULT_MMAP_BLOCK_FILES;
 bool fCoinbaseEnforcedProtectionEnabled = true;
 size_t nCoinCacheUsage = 5000 * 300;
 uint64_t nPruneTarget = 0;
@@ -90,6 +94,8 @@ unsigned int expiryDelta = DEFAULT_TX_EXPIRY_DELTA;
 CFeeRate minRelayTxFee = CFeeRate(DEFAULT_MIN_RELAY_TX_FEE);
 
 CTxMemPool mempool(::minRelayTxFee);
+CSerializedBlockCache serializedBlockCache(DEFAULT_BLOCK_CACHE_SIZE * 1000000);
+CMappedBlockFiles mappedBlockFiles;
 
 struct COrphanTx {
     CTransaction tx;
@@ -204,6 +210,7 @@ namespace {
         int64_t nTime;           //!< Time of "getdata" request in microseconds.
         bool fValidatedHeaders;  //!< Whether this block has validated headers at the time of request.
         int64_t nTimeDisconnect; //!< The timeout for this block request (for disconnecting a slow peer)
+        std::unique_ptr<PartiallyDownloadedBlock> partialBlock; //!< Optional, used for "cmpctblock" downloads
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -267,6 +274,10 @@ struct CNodeState {
     int nBlocksInFlightValidHeaders;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether this peer wants new blocks announced with "cmpctblock" instead of "inv".
+    bool fPreferHeaderAndIDs;
+    //! Whether this peer will send us a "cmpctblock" if we request one.
+    bool fProvidesHeaderAndIDs;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -280,12 +291,17 @@ struct CNodeState {
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
         fPreferredDownload = false;
+        fPreferHeaderAndIDs = false;
+        fProvidesHeaderAndIDs = false;
     }
 };
 
 /** Map maintaining per-node state. Requires cs_main. */
 map<NodeId, CNodeState> mapNodeState;
 
+/** Peers we asked to announce new blocks with "cmpctblock", oldest first. Requires cs_main. */
+list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
 // Requires cs_main.
 CNodeState *State(NodeId pnode) {
     map<NodeId, CNodeState>::iterator it = mapNodeState.find(pnode);
@@ -338,6 +354,7 @@ void FinalizeNode(NodeId nodeid) {
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
 
     mapNodeState.erase(nodeid);
 }
@@ -360,20 +377,78 @@ bool MarkBlockAsReceived(const uint256& hash) {
 }
 
 // Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL) {
+// Returns false if the block was already in flight from this peer, in which
+// case nothing changes. If pit is given, it is pointed at the queue entry; a
+// newly created entry then also gets a PartiallyDownloadedBlock.
+bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL, list<QueuedBlock>::iterator **pit = NULL) {
     CNodeState *state = State(nodeid);
     assert(state != NULL);
 
+    // Short-circuit in case it is already requested from the same peer.
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == nodeid) {
+        if (pit)
+            *pit = &itInFlight->second.second;
+        return false;
+    }
+
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
     int64_t nNow = GetTimeMicros();
-    QueuedBlock newentry = {hash, pindex, nNow, pindex != NULL, GetBlockTimeout(nNow, nQueuedValidatedHeaders, consensusParams)};
-    nQueuedValidatedHeaders += newentry.fValidatedHeaders;
-    list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
+    bool fValidatedHeaders = pindex != NULL;
+    list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), QueuedBlock());
+    it->hash = hash;
+    it->pindex = pindex;
+    it->nTime = nNow;
+    it->fValidatedHeaders = fValidatedHeaders;
+    it->nTimeDisconnect = GetBlockTimeout(nNow, nQueuedValidatedHeaders, consensusParams);
+    if (pit)
+        it->partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+    nQueuedValidatedHeaders += fValidatedHeaders;
     state->nBlocksInFlight++;
-    state->nBlocksInFlightValidHeaders += newentry.fValidatedHeaders;
-    mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+    state->nBlocksInFlightValidHeaders += fValidatedHeaders;
+    itInFlight = mapBlocksInFlight.insert(std::make_pair(hash, std::make_pair(nodeid, it))).first;
+    if (pit)
+        *pit = &itInFlight->second.second;
+    return true;
+}
+
+// Requires cs_main.
+// Ask pfrom to announce new blocks to us with "cmpctblock" directly, as it just
+// gave us a new tip. Only the three most recent such peers are kept in this mode.
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(const CNodeState* nodestate, CNode* pfrom) {
+    if (!nodestate->fProvidesHeaderAndIDs)
+        return;
+    NodeId nodeid = pfrom->GetId();
+    for (list<NodeId>::iterator it = lNodesAnnouncingHeaderAndIDs.begin(); it != lNodesAnnouncingHeaderAndIDs.end(); it++) {
+        if (*it == nodeid) {
+            lNodesAnnouncingHeaderAndIDs.erase(it);
+            lNodesAnnouncingHeaderAndIDs.push_back(nodeid);
+            return;
+        }
+    }
+    uint64_t nCMPCTBLOCKVersion = 1;
+    if (lNodesAnnouncingHeaderAndIDs.size() >= 3) {
+        NodeId nodeidStop = lNodesAnnouncingHeaderAndIDs.front();
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes) {
+            if (pnode->GetId() == nodeidStop) {
+                pnode->PushMessage("sendcmpct", false, nCMPCTBLOCKVersion);
+                break;
+            }
+        }
+    }
+    pfrom->PushMessage("sendcmpct", true, nCMPCTBLOCKVersion);
+    lNodesAnnouncingHeaderAndIDs.push_back(nodeid);
+}
+
+// Requires cs_main.
+// Whether our tip is recent enough that we fetch announced blocks directly.
+bool CanDirectFetch(const Consensus::Params &consensusParams)
+{
+    return chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - consensusParams.nPowTargetSpacing * 20;
 }
 
 /** Check whether the last unknown block a peer advertized is not yet known. */
@@ -567,6 +642,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
+CCoinsViewDB *pcoinsdbview = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -894,7 +970,8 @@ bool ContextualCheckTransaction(
         const CChainParams& chainparams,
         const int nHeight,
         const int dosLevel,
-        bool (*isInitBlockDownload)(const CChainParams&))
+        bool (*isInitBlockDownload)(const CChainParams&),
+        bool fCheckShieldedProofs)
 {
     bool overwinterActive = NetworkUpgradeActive(nHeight, chainparams.GetConsensus(), Consensus::UPGRADE_OVERWINTER);
     bool saplingActive = NetworkUpgradeActive(nHeight, chainparams.GetConsensus(), Consensus::UPGRADE_SAPLING);
@@ -995,7 +1072,7 @@ bool ContextualCheckTransaction(
         }
     }
 
-    if (!tx.vjoinsplit.empty())
+    if (fCheckShieldedProofs && !tx.vjoinsplit.empty())
     {
         BOOST_STATIC_ASSERT(crypto_sign_PUBLICKEYBYTES == 32);
 
@@ -1011,57 +1088,15 @@ bool ContextualCheckTransaction(
         }
     }
 
-    if (!tx.vShieldedSpend.empty() ||
-        !tx.vShieldedOutput.empty())
+    if (fCheckShieldedProofs &&
+        (!tx.vShieldedSpend.empty() ||
+         !tx.vShieldedOutput.empty()))
     {
-        auto ctx = librustzcash_sapling_verification_ctx_init();
-
-        for (const SpendDescription &spend : tx.vShieldedSpend) {
-            if (!librustzcash_sapling_check_spend(
-                ctx,
-                spend.cv.begin(),
-                spend.anchor.begin(),
-                spend.nullifier.begin(),
-                spend.rk.begin(),
-                spend.zkproof.begin(),
-                spend.spendAuthSig.begin(),
-                dataToBeSigned.begin()
-            ))
-            {
-                librustzcash_sapling_verification_ctx_free(ctx);
-                return state.DoS(100, error("ContextualCheckTransaction(): Sapling spend description invalid"),
-                                      REJECT_INVALID, "bad-txns-sapling-spend-description-invalid");
-            }
-        }
-
-        for (const OutputDescription &output : tx.vShieldedOutput) {
-            if (!librustzcash_sapling_check_output(
-                ctx,
-                output.cv.begin(),
-                output.cm.begin(),
-                output.ephemeralKey.begin(),
-                output.zkproof.begin()
-            ))
-            {
-                librustzcash_sapling_verification_ctx_free(ctx);
-                return state.DoS(100, error("ContextualCheckTransaction(): Sapling output description invalid"),
-                                      REJECT_INVALID, "bad-txns-sapling-output-description-invalid");
-            }
-        }
-
-        if (!librustzcash_sapling_final_check(
-            ctx,
-            tx.valueBalance,
-            tx.bindingSig.begin(),
-            dataToBeSigned.begin()
-        ))
-        {
-            librustzcash_sapling_verification_ctx_free(ctx);
-            return state.DoS(100, error("ContextualCheckTransaction(): Sapling binding signature invalid"),
-                                  REJECT_INVALID, "bad-txns-sapling-binding-signature-invalid");
+        CSaplingCheck check(tx, dataToBeSigned);
+        if (!check()) {
+            return state.DoS(100, error("ContextualCheckTransaction(): %s", check.GetRejectReason()),
+                                  REJECT_INVALID, check.GetRejectReason());
         }
-
-        librustzcash_sapling_verification_ctx_free(ctx);
     }
     return true;
 }
@@ -1353,8 +1388,20 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
+static void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age)
+{
+    int expired = pool.Expire(GetTime() - age);
+    if (expired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
+
+    std::vector<COutPoint> vNoSpendsRemaining;
+    pool.TrimToSize(limit, &vNoSpendsRemaining);
+    BOOST_FOREACH(const COutPoint& removed, vNoSpendsRemaining)
+        pcoinsTip->Uncache(removed);
+}
+
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee)
+                        bool* pfMissingInputs, bool fRejectAbsurdFee, bool fOverrideMempoolLimit)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1454,25 +1501,28 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         view.SetBackend(viewMemPool);
 
         // do we already have it?
-        if (view.HaveCoins(hash))
-            return false;
+        for (size_t out = 0; out < tx.vout.size(); out++) {
+            if (view.HaveCoin(COutPoint(hash, out)))
+                return false;
+        }
 
         // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // and only helps with filling in pfMissingInputs (to determine missing vs spent).
         BOOST_FOREACH(const CTxIn txin, tx.vin) {
-            if (!view.HaveCoins(txin.prevout.hash)) {
+            if (!view.HaveCoin(txin.prevout)) {
+                // Are inputs missing because we already have the tx?
+                for (size_t out = 0; out < tx.vout.size(); out++) {
+                    // Optimistically just do efficient check of cache for outputs
+                    if (pcoinsTip->HaveCoinInCache(COutPoint(hash, out))) {
+                        return false;
+                    }
+                }
+                // Otherwise assume this might be an orphan tx for which we just haven't seen parents yet
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
                 return false;
             }
         }
 
-        // are the actual inputs available?
-        if (!view.HaveInputs(tx))
-            return state.Invalid(error("AcceptToMemoryPool: inputs already spent"),
-                                 REJECT_DUPLICATE, "bad-txns-inputs-spent");
-
         // are the joinsplits' and sapling spends' requirements met in tx(valid anchors/nullifiers)?
         if (!view.HaveShieldedRequirements(tx))
             return state.Invalid(error("AcceptToMemoryPool: joinsplit requirements not met"),
@@ -1512,8 +1562,8 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         // during reorgs to ensure COINBASE_MATURITY is still met.
         bool fSpendsCoinbase = false;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            const CCoins *coins = view.AccessCoins(txin.prevout.hash);
-            if (coins->IsCoinBase()) {
+            const Coin &coin = view.AccessCoin(txin.prevout);
+            if (coin.IsCoinBase()) {
                 fSpendsCoinbase = true;
                 break;
             }
@@ -1539,6 +1589,15 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                                 REJECT_INSUFFICIENTFEE, "insufficient fee");
         }
 
+        // Once the mempool has had to evict transactions, newcomers must outbid
+        // what was evicted. This applies to transactions with joinsplits too.
+        CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+        if (mempoolRejectFee > 0 && nFees < mempoolRejectFee) {
+            return state.DoS(0, error("AcceptToMemoryPool: mempool min fee not met %s, %d < %d",
+                                    hash.ToString(), nFees, mempoolRejectFee),
+                            REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+        }
+
         // Require that free transactions have sufficient priority to be mined in the next block.
         if (GetBoolArg("-relaypriority", false) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
@@ -1576,6 +1635,18 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
             return state.Error("AcceptToMemoryPool: " + errmsg);
         }
 
+        // Calculate in-mempool ancestors, up to a limit.
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
+        std::string errString;
+        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
+            return state.DoS(0, error("AcceptToMemoryPool: too-long-mempool-chain %s, %s", hash.ToString(), errString),
+                             REJECT_NONSTANDARD, "too-long-mempool-chain", false);
+        }
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         PrecomputedTransactionData txdata(tx);
@@ -1599,7 +1670,14 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         }
 
         // Store transaction in memory
-        pool.addUnchecked(hash, entry, !IsInitialBlockDownload(Params()));
+        pool.addUnchecked(hash, entry, setAncestors, !IsInitialBlockDownload(Params()), &view);
+
+        // trim mempool and check if tx was trimmed
+        if (!fOverrideMempoolLimit) {
+            LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+            if (!pool.exists(hash))
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+        }
     }
 
     SyncWithWallets(tx, NULL);
@@ -1615,6 +1693,40 @@ bool GetSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value)
     return pblocktree->ReadSpentIndex(key, value);
 }
 
+bool GetAddressIndex(const uint160& addressHash, int type,
+                     std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
+                     int start, int end)
+{
+    AssertLockHeld(cs_main);
+    if (!fAddressIndex)
+        return error("address index not enabled");
+    if (!pblocktree->ReadAddressIndex(addressHash, type, addressIndex, start, end))
+        return error("unable to get txids for address");
+    return true;
+}
+
+bool GetAddressUnspent(const uint160& addressHash, int type,
+                       std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs)
+{
+    AssertLockHeld(cs_main);
+    if (!fAddressIndex)
+        return error("address index not enabled");
+    if (!pblocktree->ReadAddressUnspentIndex(addressHash, type, unspentOutputs))
+        return error("unable to get txids for address");
+    return true;
+}
+
+bool GetTimestampIndex(unsigned int high, unsigned int low, bool fActiveOnly,
+                       std::vector<std::pair<uint256, unsigned int> > &hashes)
+{
+    AssertLockHeld(cs_main);
+    if (!fTimestampIndex)
+        return error("timestamp index not enabled");
+    if (!pblocktree->ReadTimestampIndex(high, low, fActiveOnly, hashes))
+        return error("unable to get hashes for timestamps");
+    return true;
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::Params& consensusParams, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1651,10 +1763,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::P
     if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
         int nHeight = -1;
         {
-            CCoinsViewCache &view = *pcoinsTip;
-            const CCoins* coins = view.AccessCoins(hash);
-            if (coins)
-                nHeight = coins->nHeight;
+            const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+            if (!coin.IsSpent())
+                nHeight = coin.nHeight;
         }
         if (nHeight > 0)
             pindexSlow = chainActive[nHeight];
@@ -1707,18 +1818,52 @@ bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHea
     return true;
 }
 
+/**
+ * Deserialize the block at pos straight from the mapped block file. Returns
+ * false without touching block if the file can't be mapped, in which case the
+ * caller falls back to reading the file; throws if the data is bad.
+ */
+static bool ReadBlockFromMappedFile(CBlock& block, const CDiskBlockPos& pos)
+{
+    // Every block is preceded by the message start and its serialized size
+    if (pos.nPos < 4)
+        throw std::ios_base::failure("block position out of range");
+    boost::filesystem::path path = GetBlockPosFilename(pos, "blk");
+    std::shared_ptr<const CMappedFile> pfile = mappedBlockFiles.Get(pos.nFile, path, pos.nPos);
+    if (!pfile)
+        return false;
+    if (pfile->size() < pos.nPos)
+        throw std::ios_base::failure("block position past end of file");
+    unsigned int nSize = ReadLE32((const unsigned char*)pfile->data() + pos.nPos - 4);
+    if (nSize > MAX_BLOCK_SIZE)
+        throw std::ios_base::failure(strprintf("block size %u too large", nSize));
+    if (pfile->size() < (size_t)pos.nPos + nSize) {
+        // Written to the file after it was mapped
+        pfile = mappedBlockFiles.Get(pos.nFile, path, (size_t)pos.nPos + nSize);
+        if (!pfile)
+            return false;
+        if (pfile->size() < (size_t)pos.nPos + nSize)
+            throw std::ios_base::failure("block extends past end of file");
+    }
+
+    CMemoryReader reader(pfile->data() + pos.nPos, pfile->data() + pos.nPos + nSize, SER_DISK, CLIENT_VERSION);
+    reader >> block;
+    return true;
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
-
     // Read block
     try {
-        filein >> block;
+        if (!fMmapBlockFiles || !ReadBlockFromMappedFile(block, pos)) {
+            // Open history file to read
+            CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+            filein >> block;
+        }
     }
     catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
@@ -1742,6 +1887,20 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
     return true;
 }
 
+bool ReadSerializedBlock(std::shared_ptr<const CDataStream>& pblockdata, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
+{
+    uint256 hash = pindex->GetBlockHash();
+    pblockdata = serializedBlockCache.Get(hash);
+    if (pblockdata)
+        return true;
+
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex, consensusParams))
+        return false;
+    pblockdata = serializedBlockCache.Insert(hash, block);
+    return true;
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     CAmount nSubsidy = 21000 * COIN;
@@ -1978,20 +2137,9 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
-            unsigned nPos = txin.prevout.n;
-
-            if (nPos >= coins->vout.size() || coins->vout[nPos].IsNull())
-                assert(false);
-            // mark an outpoint spent, and construct undo information
-            txundo.vprevout.push_back(CTxInUndo(coins->vout[nPos]));
-            coins->Spend(nPos);
-            if (coins->vout.size() == 0) {
-                CTxInUndo& undo = txundo.vprevout.back();
-                undo.nHeight = coins->nHeight;
-                undo.fCoinBase = coins->fCoinBase;
-                undo.nVersion = coins->nVersion;
-            }
+            txundo.vprevout.emplace_back();
+            bool is_spent = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
+            assert(is_spent);
         }
     }
 
@@ -1999,7 +2147,7 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
     inputs.SetNullifiers(tx, true);
 
     // add outputs
-    inputs.ModifyNewCoins(tx.GetHash())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight)
@@ -2016,6 +2164,122 @@ bool CScriptCheck::operator()() {
     return true;
 }
 
+bool CSaplingCheck::operator()() {
+    auto ctx = librustzcash_sapling_verification_ctx_init();
+
+    for (const SpendDescription &spend : ptx->vShieldedSpend) {
+        if (!librustzcash_sapling_check_spend(
+            ctx,
+            spend.cv.begin(),
+            spend.anchor.begin(),
+            spend.nullifier.begin(),
+            spend.rk.begin(),
+            spend.zkproof.begin(),
+            spend.spendAuthSig.begin(),
+            dataToBeSigned.begin()
+        ))
+        {
+            librustzcash_sapling_verification_ctx_free(ctx);
+            strRejectReason = "bad-txns-sapling-spend-description-invalid";
+            return ::error("CSaplingCheck(): %s: Sapling spend description invalid", ptx->GetHash().ToString());
+        }
+    }
+
+    for (const OutputDescription &output : ptx->vShieldedOutput) {
+        if (!librustzcash_sapling_check_output(
+            ctx,
+            output.cv.begin(),
+            output.cm.begin(),
+            output.ephemeralKey.begin(),
+            output.zkproof.begin()
+        ))
+        {
+            librustzcash_sapling_verification_ctx_free(ctx);
+            strRejectReason = "bad-txns-sapling-output-description-invalid";
+            return ::error("CSaplingCheck(): %s: Sapling output description invalid", ptx->GetHash().ToString());
+        }
+    }
+
+    if (!librustzcash_sapling_final_check(
+        ctx,
+        ptx->valueBalance,
+        ptx->bindingSig.begin(),
+        dataToBeSigned.begin()
+    ))
+    {
+        librustzcash_sapling_verification_ctx_free(ctx);
+        strRejectReason = "bad-txns-sapling-binding-signature-invalid";
+        return ::error("CSaplingCheck(): %s: Sapling binding signature invalid", ptx->GetHash().ToString());
+    }
+
+    librustzcash_sapling_verification_ctx_free(ctx);
+    return true;
+}
+
+bool CJoinSplitCheck::operator()() {
+    // We rely on libsodium to check that the signature is canonical.
+    // https://github.com/jedisct1/libsodium/commit/62911edb7ff2275cccd74bf1c8aefcc4d76924e0
+    if (crypto_sign_verify_detached(&ptx->joinSplitSig[0],
+                                    dataToBeSigned.begin(), 32,
+                                    ptx->joinSplitPubKey.begin()
+                                    ) != 0) {
+        strRejectReason = "bad-txns-invalid-joinsplit-signature";
+        return ::error("CJoinSplitCheck(): %s: invalid joinsplit signature", ptx->GetHash().ToString());
+    }
+
+    if (fCheckProofs) {
+        auto verifier = libzcash::ProofVerifier::Strict();
+        for (const JSDescription &joinsplit : ptx->vjoinsplit) {
+            if (!joinsplit.Verify(*pzcashParams, verifier, ptx->joinSplitPubKey)) {
+                strRejectReason = "bad-txns-joinsplit-verification-failed";
+                return ::error("CJoinSplitCheck(): %s: joinsplit does not verify", ptx->GetHash().ToString());
+            }
+        }
+    }
+    return true;
+}
+
+std::string CScriptCheck::GetRejectReason() const {
+    return strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(error));
+}
+
+namespace {
+
+class RunBlockCheck : public boost::static_visitor<bool>
+{
+public:
+    template <typename T>
+    bool operator()(T& check) const { return check(); }
+};
+
+class BlockCheckRejectReason : public boost::static_visitor<std::string>
+{
+public:
+    template <typename T>
+    std::string operator()(const T& check) const { return check.GetRejectReason(); }
+};
+
+class BlockCheckTxHash : public boost::static_visitor<uint256>
+{
+public:
+    template <typename T>
+    uint256 operator()(const T& check) const { return check.GetTxHash(); }
+};
+
+} // anon namespace
+
+bool CBlockCheck::operator()() {
+    return boost::apply_visitor(RunBlockCheck(), check);
+}
+
+std::string CBlockCheck::GetRejectReason() const {
+    return boost::apply_visitor(BlockCheckRejectReason(), check);
+}
+
+uint256 CBlockCheck::GetTxHash() const {
+    return boost::apply_visitor(BlockCheckTxHash(), check);
+}
+
 int GetSpendHeight(const CCoinsViewCache& inputs)
 {
     LOCK(cs_main);
@@ -2040,14 +2304,14 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
         for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
             const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins *coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
-            if (coins->IsCoinBase()) {
+            if (coin.IsCoinBase()) {
                 // Ensure that coinbases are matured
-                if (nSpendHeight - coins->nHeight < COINBASE_MATURITY) {
+                if (nSpendHeight - coin.nHeight < COINBASE_MATURITY) {
                     return state.Invalid(
-                        error("CheckInputs(): tried to spend coinbase at depth %d", nSpendHeight - coins->nHeight),
+                        error("CheckInputs(): tried to spend coinbase at depth %d", nSpendHeight - coin.nHeight),
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase");
                 }
 
@@ -2063,8 +2327,8 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, error("CheckInputs(): txin values out of range"),
                                  REJECT_INVALID, "bad-txns-inputvalues-outofrange");
 
@@ -2124,11 +2388,11 @@ bool ContextualCheckInputs(
         if (fScriptChecks) {
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore, consensusBranchId, &txdata);
+                CScriptCheck check(coin.out, tx, i, flags, cacheStore, consensusBranchId, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -2140,7 +2404,7 @@ bool ContextualCheckInputs(
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check2(*coins, tx, i,
+                        CScriptCheck check2(coin.out, tx, i,
                                 flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, consensusBranchId, &txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
@@ -2237,46 +2501,49 @@ bool AbortNode(CValidationState& state, const std::string& strMessage, const std
 
 } // anon namespace
 
+enum DisconnectResult
+{
+    DISCONNECT_OK,      // All good.
+    DISCONNECT_UNCLEAN, // Rolled back, but UTXO set was inconsistent with block.
+    DISCONNECT_FAILED   // Something else went wrong.
+};
+
 /**
- * Apply the undo operation of a CTxInUndo to the given chain state.
- * @param undo The undo object.
+ * Restore the UTXO in a Coin at a given COutPoint.
+ * @param undo The Coin to be restored.
  * @param view The coins view to which to apply the changes.
  * @param out The out point that corresponds to the tx input.
- * @return True on success.
+ * @return A DisconnectResult
  */
-static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out)
+static DisconnectResult ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
 {
     bool fClean = true;
 
-    CCoinsModifier coins = view.ModifyCoins(out.hash);
-    if (undo.nHeight != 0) {
-        // undo data contains height: this is the last output of the prevout tx being spent
-        if (!coins->IsPruned())
-            fClean = fClean && error("%s: undo data overwriting existing transaction", __func__);
-        coins->Clear();
-        coins->fCoinBase = undo.fCoinBase;
-        coins->nHeight = undo.nHeight;
-        coins->nVersion = undo.nVersion;
-    } else {
-        if (coins->IsPruned())
-            fClean = fClean && error("%s: undo data adding output to missing transaction", __func__);
+    if (view.HaveCoin(out))
+        fClean = error("%s: undo data overwriting existing output", __func__);
+
+    if (undo.nHeight == 0) {
+        // Missing undo metadata (height and coinbase). Older versions included this
+        // information only in undo records for the last spend of a transactions'
+        // outputs. This implies that it must be present for some other output of the same tx.
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (!alternate.IsSpent()) {
+            undo.nHeight = alternate.nHeight;
+            undo.fCoinBase = alternate.fCoinBase;
+        } else {
+            error("%s: undo data adding output to missing transaction", __func__);
+            return DISCONNECT_FAILED;
+        }
     }
-    if (coins->IsAvailable(out.n))
-        fClean = fClean && error("%s: undo data overwriting existing output", __func__);
-    if (coins->vout.size() < out.n+1)
-        coins->vout.resize(out.n+1);
-    coins->vout[out.n] = undo.txout;
+    // The possible_overwrite parameter to AddCoin is only allowed to be false if we know for
+    // sure that the coin did not already exist in the cache. As we have queried for that above
+    // using HaveCoin, we don't need to guess. When fClean is false, a coin already existed and
+    // it is an overwrite.
+    view.AddCoin(out, std::move(undo), !fClean);
 
-    return fClean;
+    return fClean ? DISCONNECT_OK : DISCONNECT_UNCLEAN;
 }
 
-enum DisconnectResult
-{
-    DISCONNECT_OK,      // All good.
-    DISCONNECT_UNCLEAN, // Rolled back, but UTXO set was inconsistent with block.
-    DISCONNECT_FAILED   // Something else went wrong.
-};
-
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
  *  When UNCLEAN or FAILED is returned, view is left in an indeterminate state.
  *  The addressIndex and spentIndex will be updated if requested.
@@ -2337,21 +2604,15 @@ static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& s
 
         // Check that all outputs are available and match the outputs in the block itself
         // exactly.
-        {
-        CCoinsModifier outs = view.ModifyCoins(hash);
-        outs->ClearUnspendable();
-
-        CCoins outsBlock(tx, pindex->nHeight);
-        // The CCoins serialization does not serialize negative numbers.
-        // No network rules currently depend on the version here, so an inconsistency is harmless
-        // but it must be corrected before txout nversion ever influences a network rule.
-        if (outsBlock.nVersion < 0)
-            outs->nVersion = outsBlock.nVersion;
-        if (*outs != outsBlock)
-            fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
-
-        // remove outputs
-        outs->Clear();
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (!tx.vout[o].scriptPubKey.IsUnspendable()) {
+                COutPoint out(hash, o);
+                Coin coin;
+                bool is_spent = view.SpendCoin(out, &coin);
+                if (!is_spent || tx.vout[o] != coin.out || pindex->nHeight != coin.nHeight || tx.IsCoinBase() != coin.IsCoinBase()) {
+                    fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
+                }
+            }
         }
 
         // unspend nullifiers
@@ -2359,22 +2620,24 @@ static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& s
 
         // restore inputs
         if (i > 0) { // not coinbases
-            const CTxUndo &txundo = blockUndo.vtxundo[i-1];
+            CTxUndo &txundo = blockUndo.vtxundo[i-1];
             if (txundo.vprevout.size() != tx.vin.size()) {
                 error("DisconnectBlock(): transaction and undo data inconsistent");
                 return DISCONNECT_FAILED;
             }
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
-                const CTxInUndo &undo = txundo.vprevout[j];
-                if (!ApplyTxInUndo(undo, view, out))
-                    fClean = false;
+                DisconnectResult res = ApplyTxInUndo(std::move(txundo.vprevout[j]), view, out);
+                if (res == DISCONNECT_FAILED)
+                    return DISCONNECT_FAILED;
+                fClean = fClean && res != DISCONNECT_UNCLEAN;
 
                 // insightexplorer
                 // https://github.com/bitpay/bitcoin/commit/017f548ea6d89423ef568117447e61dd5707ec42#diff-7ec3c68a81efff79b6ca22ac1f1eabbaR2304
                 const CTxIn input = tx.vin[j];
                 if (fAddressIndex && updateIndices) {
-                    const CTxOut &prevout = view.GetOutputFor(input);
+                    const Coin &coin = view.AccessCoin(input.prevout);
+                    const CTxOut &prevout = coin.out;
                     CScript::ScriptType scriptType = prevout.scriptPubKey.GetType();
                     if (scriptType != CScript::UNKNOWN) {
                         uint160 const addrHash = prevout.scriptPubKey.AddressHash();
@@ -2387,7 +2650,7 @@ static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& s
                         // restore unspent index
                         addressUnspentIndex.push_back(make_pair(
                             CAddressUnspentKey(scriptType, addrHash, input.prevout.hash, input.prevout.n),
-                            CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, undo.nHeight)));
+                            CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, coin.nHeight)));
                     }
                 }
                 // insightexplorer
@@ -2447,8 +2710,10 @@ void static FlushBlockFile(bool fFinalize = false)
 
     FILE *fileOld = OpenBlockFile(posOld);
     if (fileOld) {
-        if (fFinalize)
+        if (fFinalize) {
             TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nSize);
+            mappedBlockFiles.Invalidate(nLastBlockFile);
+        }
         FileCommit(fileOld);
         fclose(fileOld);
     }
@@ -2464,7 +2729,7 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+static CCheckQueue<CBlockCheck> scriptcheckqueue(128);
 
 void ThreadScriptCheck() {
     RenameThread("zcash-scriptch");
@@ -2554,11 +2819,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
     }
 
-    auto verifier = libzcash::ProofVerifier::Strict();
     auto disabledVerifier = libzcash::ProofVerifier::Disabled();
 
-    // Check it again to verify JoinSplit proofs, and in case a previous version let a bad block in
-    if (!CheckBlock(block, state, chainparams, fExpensiveChecks ? verifier : disabledVerifier, !fJustCheck, !fJustCheck))
+    // Check it again in case a previous version let a bad block in. JoinSplit
+    // proofs are verified below, concurrently with the other transaction checks.
+    if (!CheckBlock(block, state, chainparams, disabledVerifier, !fJustCheck, !fJustCheck))
         return false;
 
     // verify that the view's current state corresponds to the previous block
@@ -2611,10 +2876,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
     BOOST_FOREACH(const CTransaction& tx, block.vtx) {
-        const CCoins* coins = view.AccessCoins(tx.GetHash());
-        if (coins && !coins->IsPruned())
-            return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
-                             REJECT_INVALID, "bad-txns-BIP30");
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (view.HaveCoin(COutPoint(tx.GetHash(), o)))
+                return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
+                                 REJECT_INVALID, "bad-txns-BIP30");
+        }
     }
 
     unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
@@ -2623,7 +2889,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     CBlockUndo blockundo;
 
-    CCheckQueueControl<CScriptCheck> control(fExpensiveChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    // Shielded proofs and signatures are verified here rather than in
+    // CheckBlock and ContextualCheckBlock, so that they are checked
+    // concurrently with each other and with the scripts.
+    CCheckQueueControl<CBlockCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
     int64_t nTimeStart = GetTimeMicros();
     CAmount nFees = 0;
@@ -2728,14 +2997,55 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
         txdata.emplace_back(tx);
 
+        uint256 dataToBeSigned;
+        if (!tx.vjoinsplit.empty() || !tx.vShieldedSpend.empty() || !tx.vShieldedOutput.empty()) {
+            // Empty output script.
+            CScript scriptCode;
+            try {
+                dataToBeSigned = SignatureHash(scriptCode, tx, NOT_AN_INPUT, SIGHASH_ALL, 0, consensusBranchId);
+            } catch (std::logic_error ex) {
+                return state.DoS(100, error("ConnectBlock(): error computing signature hash"),
+                                 REJECT_INVALID, "error-computing-signature-hash");
+            }
+        }
+
+        if (!tx.vjoinsplit.empty()) {
+            CJoinSplitCheck check(tx, dataToBeSigned, fExpensiveChecks);
+            if (nScriptCheckThreads) {
+                std::vector<CBlockCheck> vChecks;
+                vChecks.push_back(CBlockCheck(std::move(check)));
+                control.Add(vChecks);
+            } else if (!check()) {
+                return state.DoS(100, error("ConnectBlock(): %s: %s", tx.GetHash().ToString(), check.GetRejectReason()),
+                                 REJECT_INVALID, check.GetRejectReason());
+            }
+        }
+
+        if (!tx.vShieldedSpend.empty() || !tx.vShieldedOutput.empty()) {
+            CSaplingCheck check(tx, dataToBeSigned);
+            if (nScriptCheckThreads) {
+                std::vector<CBlockCheck> vChecks;
+                vChecks.push_back(CBlockCheck(std::move(check)));
+                control.Add(vChecks);
+            } else if (!check()) {
+                return state.DoS(100, error("ConnectBlock(): %s: %s", tx.GetHash().ToString(), check.GetRejectReason()),
+                                 REJECT_INVALID, check.GetRejectReason());
+            }
+        }
+
         if (!tx.IsCoinBase())
         {
             nFees += view.GetValueIn(tx)-tx.GetValueOut();
 
-            std::vector<CScriptCheck> vChecks;
+            std::vector<CScriptCheck> vScriptChecks;
             bool fCacheResults = fJustCheck; /* Don't cache results if we're actually connecting blocks (still consult the cache, though) */
-            if (!ContextualCheckInputs(tx, state, view, fExpensiveChecks, flags, fCacheResults, txdata[i], chainparams.GetConsensus(), consensusBranchId, nScriptCheckThreads ? &vChecks : NULL))
+            if (!ContextualCheckInputs(tx, state, view, fExpensiveChecks, flags, fCacheResults, txdata[i], chainparams.GetConsensus(), consensusBranchId, nScriptCheckThreads ? &vScriptChecks : NULL))
                 return false;
+            std::vector<CBlockCheck> vChecks;
+            vChecks.reserve(vScriptChecks.size());
+            for (CScriptCheck& check : vScriptChecks) {
+                vChecks.push_back(CBlockCheck(std::move(check)));
+            }
             control.Add(vChecks);
         }
 
@@ -2810,8 +3120,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                                block.vtx[0].GetValueOut(), blockReward),
                                REJECT_INVALID, "bad-cb-amount");
 
-    if (!control.Wait())
-        return state.DoS(100, false);
+    CBlockCheck checkFailed;
+    if (!control.Wait(&checkFailed))
+        return state.DoS(100, error("ConnectBlock(): %s: %s", checkFailed.GetTxHash().ToString(), checkFailed.GetRejectReason()),
+                         REJECT_INVALID, checkFailed.GetRejectReason());
     int64_t nTime2 = GetTimeMicros(); nTimeVerify += nTime2 - nTimeStart;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime2 - nTimeStart), nInputs <= 1 ? 0 : 0.001 * (nTime2 - nTimeStart) / (nInputs-1), nTimeVerify * 0.000001);
 
@@ -2975,15 +3287,16 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
                 vFiles.push_back(make_pair(*it, &vinfoBlockFile[*it]));
                 setDirtyFileInfo.erase(it++);
             }
-            std::vector<const CBlockIndex*> vBlocks;
-            vBlocks.reserve(setDirtyBlockIndex.size());
-            for (set<CBlockIndex*>::iterator it = setDirtyBlockIndex.begin(); it != setDirtyBlockIndex.end(); ) {
-                vBlocks.push_back(*it);
-                setDirtyBlockIndex.erase(it++);
-            }
+            std::vector<CBlockIndex*> vDirtyBlocks(setDirtyBlockIndex.begin(), setDirtyBlockIndex.end());
+            std::vector<const CBlockIndex*> vBlocks(vDirtyBlocks.begin(), vDirtyBlocks.end());
+            setDirtyBlockIndex.clear();
             if (!pblocktree->WriteBatchSync(vFiles, nLastBlockFile, vBlocks)) {
                 return AbortNode(state, "Files to write to block index database");
             }
+            // The Equihash solutions can be read back from disk when needed
+            BOOST_FOREACH(CBlockIndex* pindex, vDirtyBlocks) {
+                pindex->TrimSolution();
+            }
         }
         // Finally remove any pruned files
         if (fFlushForPrune)
@@ -2992,12 +3305,12 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
     if (fDoFullFlush) {
-        // Typical CCoins structures on disk are around 128 bytes in size.
+        // Typical Coin structures on disk are around 48 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
         // an overestimation, as most will delete an existing entry or
         // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
         if (!pcoinsTip->Flush())
@@ -3074,13 +3387,23 @@ bool static DisconnectTip(CValidationState &state, const CChainParams& chainpara
 
     if (!fBare) {
         // Resurrect mempool transactions from the disconnected block.
+        std::vector<uint256> vHashUpdate;
         BOOST_FOREACH(const CTransaction &tx, block.vtx) {
             // ignore validation errors in resurrected transactions
             list<CTransaction> removed;
             CValidationState stateDummy;
-            if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+            if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, false, true)) {
                 mempool.remove(tx, removed, true);
+            } else if (mempool.exists(tx.GetHash())) {
+                vHashUpdate.push_back(tx.GetHash());
+            }
         }
+        // AcceptToMemoryPool/addUnchecked all assume that new mempool entries have
+        // no in-mempool children, which is generally not true when adding
+        // previously-confirmed transactions back to the mempool.
+        // UpdateTransactionsFromBlock finds descendants of any transactions in this
+        // block that were added back and cleans up the mempool state.
+        mempool.UpdateTransactionsFromBlock(vHashUpdate);
         if (sproutAnchorBeforeDisconnect != sproutAnchorAfterDisconnect) {
             // The anchor may not change between block disconnects,
             // in which case we don't want to evict from the mempool yet!
@@ -3350,6 +3673,7 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
 
     if (fBlocksDisconnected) {
         mempool.removeForReorg(pcoinsTip, chainActive.Tip()->nHeight + 1, STANDARD_LOCKTIME_VERIFY_FLAGS);
+        LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
     }
     mempool.removeWithoutBranchId(
         CurrentEpochBranchId(chainActive.Tip()->nHeight + 1, chainparams.GetConsensus()));
@@ -3396,15 +3720,39 @@ bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams,
         // Notifications/callbacks that can run without cs_main
         if (!fInitialDownload) {
             uint256 hashNewTip = pindexNewTip->GetBlockHash();
+            // Peers are about to ask for the new tip; have it ready to send.
+            if (pblock && pblock->GetHash() == hashNewTip)
+                serializedBlockCache.Insert(hashNewTip, *pblock);
             // Relay inventory, but don't relay old inventory during initial block download.
             int nBlockEstimate = 0;
             if (fCheckpointsEnabled)
                 nBlockEstimate = Checkpoints::GetTotalBlocksEstimate(chainparams.Checkpoints());
+            // Peers that asked for it get the block itself as a compact block,
+            // saving them the "getdata" round trip.
+            std::unique_ptr<CBlockHeaderAndShortTxIDs> pcmpctblock;
+            if (pblock && pblock->GetHash() == hashNewTip)
+                pcmpctblock.reset(new CBlockHeaderAndShortTxIDs(*pblock));
             {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                LOCK2(cs_main, cs_vNodes);
+                CInv inv(MSG_BLOCK, hashNewTip);
+                BOOST_FOREACH(CNode* pnode, vNodes) {
+                    if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                        continue;
+                    CNodeState *nodestate = State(pnode->GetId());
+                    if (pcmpctblock && nodestate && nodestate->fPreferHeaderAndIDs) {
+                        bool fKnown;
+                        {
+                            LOCK(pnode->cs_inventory);
+                            fKnown = pnode->setInventoryKnown.count(inv);
+                        }
+                        if (!fKnown) {
+                            pnode->PushMessage("cmpctblock", *pcmpctblock);
+                            pnode->AddInventoryKnown(inv);
+                        }
+                    } else {
+                        pnode->PushInventory(inv);
+                    }
+                }
             }
             // Notify external listeners about the new tip.
             GetMainSignals().UpdatedBlockTip(pindexNewTip);
@@ -3504,8 +3852,8 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = blockIndexArena.Allocate();
+    *pindexNew = CBlockIndex(block);
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
@@ -3885,8 +4233,9 @@ bool ContextualCheckBlock(
     // Check that all transactions are finalized
     BOOST_FOREACH(const CTransaction& tx, block.vtx) {
 
-        // Check transaction contextually against consensus rules at block height
-        if (!ContextualCheckTransaction(tx, state, chainparams, nHeight, 100)) {
+        // Check transaction contextually against consensus rules at block height.
+        // Shielded proofs and signatures are verified in ConnectBlock.
+        if (!ContextualCheckTransaction(tx, state, chainparams, nHeight, 100, IsInitialBlockDownload, false)) {
             return false; // Failure reason has been set in validation state object
         }
 
@@ -3937,7 +4286,11 @@ bool ContextualCheckBlock(
     return true;
 }
 
-static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL)
+/**
+ * Add a block header to the block index. fCheckPOW may only be false if the
+ * header's Equihash solution and proof of work have already been checked.
+ */
+static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL, bool fCheckPOW=true)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
@@ -3954,7 +4307,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
         return true;
     }
 
-    if (!CheckBlockHeader(block, state, chainparams))
+    if (!CheckBlockHeader(block, state, chainparams, fCheckPOW))
         return false;
 
     // Get prev block index
@@ -3986,8 +4339,9 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
  * - AcceptBlock doesn't perform script checks either.
  * - The only caller of AcceptBlock verifies JoinSplit proofs elsewhere.
  * If dbp is non-NULL, the file is known to already reside on disk
+ * If fChecked is true, CheckBlock has already passed for the block
  */
-static bool AcceptBlock(const CBlock& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, CDiskBlockPos* dbp)
+static bool AcceptBlock(const CBlock& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, CDiskBlockPos* dbp, bool fChecked = false)
 {
     AssertLockHeld(cs_main);
 
@@ -4019,7 +4373,7 @@ static bool AcceptBlock(const CBlock& block, CValidationState& state, const CCha
 
     // See method docstring for why this is always disabled
     auto verifier = libzcash::ProofVerifier::Disabled();
-    if ((!CheckBlock(block, state, chainparams, verifier)) || !ContextualCheckBlock(block, state, chainparams, pindex->pprev)) {
+    if ((!fChecked && !CheckBlock(block, state, chainparams, verifier)) || !ContextualCheckBlock(block, state, chainparams, pindex->pprev)) {
         if (state.IsInvalid() && !state.CorruptionPossible()) {
             pindex->nStatus |= BLOCK_FAILED_VALID;
             setDirtyBlockIndex.insert(pindex);
@@ -4173,6 +4527,7 @@ void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
 {
     for (set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
+        mappedBlockFiles.Invalidate(*it);
         boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
         boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
@@ -4285,9 +4640,7 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex(): new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockIndexArena.Allocate();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
@@ -4297,23 +4650,33 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
 bool static LoadBlockIndexDB()
 {
     const CChainParams& chainparams = Params();
-    if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
+    int64_t nStart = GetTimeMillis();
+    int nThreads = std::max(1, std::min(GetNumCores(), MAX_BLOCK_INDEX_LOAD_THREADS));
+    if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex, nThreads))
         return false;
+    LogPrintf("%s: loaded %u block index entries in %dms using %d threads\n", __func__,
+        mapBlockIndex.size(), GetTimeMillis() - nStart, nThreads);
 
     boost::this_thread::interruption_point();
 
+    // Order the entries by height. Heights are dense, so the entries are
+    // counted per height and placed directly instead of sorted.
+    int64_t nStartChainWork = GetTimeMillis();
+    int nMaxHeight = -1;
+    BOOST_FOREACH(const BlockMap::value_type& item, mapBlockIndex)
+        nMaxHeight = std::max(nMaxHeight, item.second->nHeight);
+    vector<size_t> vHeightStart(nMaxHeight + 2, 0);
+    BOOST_FOREACH(const BlockMap::value_type& item, mapBlockIndex)
+        vHeightStart[item.second->nHeight + 1]++;
+    for (int nHeight = 0; nHeight <= nMaxHeight; nHeight++)
+        vHeightStart[nHeight + 1] += vHeightStart[nHeight];
+    vector<CBlockIndex*> vSortedByHeight(mapBlockIndex.size());
+    BOOST_FOREACH(const BlockMap::value_type& item, mapBlockIndex)
+        vSortedByHeight[vHeightStart[item.second->nHeight]++] = item.second;
+
     // Calculate nChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
-    {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight)
     {
-        CBlockIndex* pindex = item.second;
         pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
         // We can link the chain of blocks for which we've received transactions at some point.
         // Pruned nodes may have deleted the block.
@@ -4376,8 +4739,10 @@ bool static LoadBlockIndexDB()
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
     }
+    LogPrintf("%s: computed chain work in %dms\n", __func__, GetTimeMillis() - nStartChainWork);
 
     // Load block file info
+    int64_t nStartFiles = GetTimeMillis();
     pblocktree->ReadLastBlockFile(nLastBlockFile);
     vinfoBlockFile.resize(nLastBlockFile + 1);
     LogPrintf("%s: last block file = %i\n", __func__, nLastBlockFile);
@@ -4397,9 +4762,8 @@ bool static LoadBlockIndexDB()
     // Check presence of blk files
     LogPrintf("Checking all blk files are present...\n");
     set<int> setBlkDataFiles;
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    BOOST_FOREACH(const CBlockIndex* pindex, vSortedByHeight)
     {
-        CBlockIndex* pindex = item.second;
         if (pindex->nStatus & BLOCK_HAVE_DATA) {
             setBlkDataFiles.insert(pindex->nFile);
         }
@@ -4411,6 +4775,7 @@ bool static LoadBlockIndexDB()
             return false;
         }
     }
+    LogPrintf("%s: loaded and checked block file info in %dms\n", __func__, GetTimeMillis() - nStartFiles);
 
     // Check whether we have ever pruned block & undo files
     pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
@@ -4432,11 +4797,11 @@ bool static LoadBlockIndexDB()
     LogPrintf("%s: insight explorer %s\n", __func__, fAddressIndex ? "enabled" : "disabled");
     fAddressIndex = fInsightExplorer;
     fSpentIndex = fInsightExplorer;
+    fTimestampIndex = fInsightExplorer;
 
     // Fill in-memory data
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight)
     {
-        CBlockIndex* pindex = item.second;
         // - This relationship will always be true even if pprev has multiple
         //   children, because hashSproutAnchor is technically a property of pprev,
         //   not its children.
@@ -4464,6 +4829,8 @@ bool static LoadBlockIndexDB()
 
     EnforceNodeDeprecation(chainActive.Height(), true);
 
+    LogPrintf("%s: done in %dms\n", __func__, GetTimeMillis() - nStart);
+
     return true;
 }
 
@@ -4503,6 +4870,11 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
         uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
         if (pindex->nHeight < chainActive.Height()-nCheckDepth)
             break;
+        if (fPruneMode && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            // If pruning, only go back as far as we have data.
+            LogPrintf("VerifyDB(): block verification stopping at height %d (pruning, no data)\n", pindex->nHeight);
+            break;
+        }
         CBlock block;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()))
@@ -4699,8 +5071,8 @@ bool RewindBlockIndex(const CChainParams& chainparams, bool& clearWitnessCaches)
     for (auto pindex : vBlocks) {
         auto ret = mapBlockIndex.find(*pindex->phashBlock);
         if (ret != mapBlockIndex.end()) {
+            // The entry itself is freed with the rest of the block index
             mapBlockIndex.erase(ret);
-            delete pindex;
         }
     }
 
@@ -4739,42 +5111,230 @@ void UnloadBlockIndex()
     mapNodeState.clear();
     recentRejects.reset(NULL);
 
-    BOOST_FOREACH(BlockMap::value_type& entry, mapBlockIndex) {
-        delete entry.second;
-    }
     mapBlockIndex.clear();
+    blockIndexArena.Clear();
     fHavePruned = false;
 }
 
-bool LoadBlockIndex()
+//! Number of block index entries written to the block tree database in one batch.
+static const size_t SNAPSHOT_BLOCK_INDEX_BATCH = 4096;
+
+bool DumpUTXOSnapshot(CAutoFile& fileout, CSnapshotMetadata& metadata, CSnapshotStats& stats, uint256& hashSnapshot)
 {
-    // Load block index from databases
-    if (!fReindex && !LoadBlockIndexDB())
+    CHashForwarder<CAutoFile> hashout(&fileout);
+    boost::scoped_ptr<CDBIterator> pcursor;
+    {
+        LOCK(cs_main);
+        FlushStateToDisk();
+        // The cursor sees the chainstate as of this flush, so the rest of
+        // the snapshot can be written without holding cs_main.
+        pcursor.reset(pcoinsdbview->SnapshotCursor());
+
+        CBlockIndex* pindex = chainActive.Tip();
+        assert(pindex->GetBlockHash() == pcoinsdbview->GetBestBlock());
+        metadata.hashGenesisBlock = chainActive.Genesis()->GetBlockHash();
+        metadata.hashBlock = pindex->GetBlockHash();
+        metadata.nHeight = pindex->nHeight;
+        metadata.hashSproutAnchor = pcoinsdbview->GetBestAnchor(SPROUT);
+        metadata.hashSaplingAnchor = pcoinsdbview->GetBestAnchor(SAPLING);
+        hashout << metadata;
+
+        // The block index of the active chain, so that the loading node can
+        // continue from the snapshot without downloading the headers first.
+        for (int nHeight = 0; nHeight <= pindex->nHeight; nHeight++) {
+            boost::this_thread::interruption_point();
+            CDiskBlockIndex diskindex(chainActive[nHeight]);
+            diskindex.nStatus &= ~BLOCK_HAVE_MASK;
+            hashout << diskindex;
+        }
+    }
+
+    if (!pcoinsdbview->DumpSnapshot(*pcursor, hashout, stats)) {
         return false;
+    }
+    hashSnapshot = hashout.GetHash();
+    fileout << hashSnapshot;
     return true;
 }
 
-bool InitBlockIndex(const CChainParams& chainparams) 
+/**
+ * Read the block index section of a UTXO snapshot, checking that it forms a
+ * chain from the genesis block to the snapshot block, and write it to the
+ * block tree database if fApply is set.
+ */
+static bool LoadSnapshotBlockIndex(const CChainParams& chainparams, CHashVerifier<CAutoFile>& filein,
+                                   const CSnapshotMetadata& metadata, bool fApply, std::string& strError)
 {
-    LOCK(cs_main);
-
-    // Initialize global variables that cannot be constructed at startup.
-    recentRejects.reset(new CRollingBloomFilter(120000, 0.000001));
+    const Consensus::Params& consensusParams = chainparams.GetConsensus();
+    std::vector<CDiskBlockIndex> vindex;
+    uint256 hashPrev;
+    for (int nHeight = 0; nHeight <= metadata.nHeight; nHeight++) {
+        boost::this_thread::interruption_point();
+        CDiskBlockIndex diskindex;
+        filein >> diskindex;
+        uint256 hash = diskindex.GetBlockHash();
+        if (diskindex.nHeight != nHeight || diskindex.hashPrev != hashPrev) {
+            strError = strprintf(_("UTXO snapshot block index is not a chain (height %d)"), nHeight);
+            return false;
+        }
+        // Equihash solutions are not checked here; the snapshot is trusted
+        // to the extent that its hash is.
+        if (nHeight == 0 ? hash != consensusParams.hashGenesisBlock : !CheckProofOfWork(hash, diskindex.nBits, consensusParams)) {
+            strError = strprintf(_("UTXO snapshot contains an invalid block header at height %d"), nHeight);
+            return false;
+        }
+        if ((diskindex.nStatus & BLOCK_HAVE_MASK) || !diskindex.IsValid(BLOCK_VALID_TRANSACTIONS) || diskindex.nTx == 0) {
+            strError = strprintf(_("UTXO snapshot contains an unvalidated block at height %d"), nHeight);
+            return false;
+        }
+        hashPrev = hash;
+        if (fApply) {
+            vindex.push_back(diskindex);
+            if (vindex.size() == SNAPSHOT_BLOCK_INDEX_BATCH) {
+                if (!pblocktree->WriteBlockIndex(vindex)) {
+                    strError = _("Failed to write to block index database");
+                    return false;
+                }
+                vindex.clear();
+            }
+        }
+    }
+    if (hashPrev != metadata.hashBlock) {
+        strError = _("UTXO snapshot block index does not end at the snapshot block");
+        return false;
+    }
+    if (fApply && !pblocktree->WriteBlockIndex(vindex)) {
+        strError = _("Failed to write to block index database");
+        return false;
+    }
+    return true;
+}
 
-    // Check whether we're already initialized
-    if (chainActive.Genesis() != NULL)
+bool LoadUTXOSnapshot(const CChainParams& chainparams, const boost::filesystem::path& path, const uint256& hashPinned, std::string& strError)
+{
+    if (!pcoinsdbview->GetBestBlock().IsNull()) {
+        LogPrintf("%s: chainstate is not empty, ignoring -loadsnapshot\n", __func__);
         return true;
+    }
+    // A partially loaded snapshot can be loaded again over itself, but any
+    // other existing block index means this is not a new data directory.
+    int nFile;
+    bool fSnapshotLoaded;
+    if (pblocktree->ReadLastBlockFile(nFile) && !pblocktree->ReadFlag("utxosnapshot", fSnapshotLoaded)) {
+        strError = _("-loadsnapshot can only be used with a new data directory");
+        return false;
+    }
 
-    // Use the provided setting for -txindex in the new database
-    fTxIndex = GetBoolArg("-txindex", false);
-    pblocktree->WriteFlag("txindex", fTxIndex);
+    // The first pass checks the snapshot hash without writing anything, the
+    // second pass writes the snapshot to the databases.
+    for (int nPass = 0; nPass < 2; nPass++) {
+        bool fApply = nPass == 1;
+        int64_t nStart = GetTimeMillis();
+        uiInterface.InitMessage(fApply ? _("Loading UTXO snapshot...") : _("Verifying UTXO snapshot..."));
 
-    // Use the provided setting for -insightexplorer in the new database
-    fInsightExplorer = GetBoolArg("-insightexplorer", false);
-    pblocktree->WriteFlag("insightexplorer", fInsightExplorer);
-    fAddressIndex = fInsightExplorer;
-    fSpentIndex = fInsightExplorer;
-    fTimestampIndex = fInsightExplorer;
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull()) {
+            strError = strprintf(_("Unable to open UTXO snapshot %s"), path.string());
+            return false;
+        }
+
+        CSnapshotMetadata metadata;
+        CSnapshotStats stats;
+        try {
+            CHashVerifier<CAutoFile> hashin(&filein);
+            hashin >> metadata;
+            if (metadata.nMagic != CSnapshotMetadata::SNAPSHOT_MAGIC || metadata.nVersion != CSnapshotMetadata::CURRENT_VERSION) {
+                strError = strprintf(_("%s is not a supported UTXO snapshot"), path.string());
+                return false;
+            }
+            if (metadata.hashGenesisBlock != chainparams.GetConsensus().hashGenesisBlock) {
+                strError = _("UTXO snapshot was taken on a different network");
+                return false;
+            }
+
+            if (fApply && !pblocktree->WriteFlag("utxosnapshot", false)) {
+                strError = _("Failed to write to block index database");
+                return false;
+            }
+            if (!LoadSnapshotBlockIndex(chainparams, hashin, metadata, fApply, strError)) {
+                return false;
+            }
+            if (!pcoinsdbview->LoadSnapshot(hashin, fApply, stats)) {
+                strError = _("Error reading UTXO snapshot");
+                return false;
+            }
+
+            uint256 hashSnapshot = hashin.GetHash();
+            uint256 hashExpected;
+            filein >> hashExpected;
+            if (hashSnapshot != hashExpected) {
+                strError = _("UTXO snapshot hash does not match its contents");
+                return false;
+            }
+            // The hash at the end of the file only detects corruption; anyone
+            // able to alter the file can recompute it, so the contents are
+            // only trusted if they match the hash given with -snapshothash.
+            if (hashSnapshot != hashPinned) {
+                strError = strprintf(_("UTXO snapshot hash %s does not match -snapshothash"), hashSnapshot.GetHex());
+                return false;
+            }
+        } catch (const std::exception& e) {
+            strError = strprintf(_("Error reading UTXO snapshot: %s"), e.what());
+            return false;
+        }
+
+        if (fApply) {
+            // Setting the best block last marks the chainstate as complete.
+            CCoinsMap mapCoins;
+            CAnchorsSproutMap mapSproutAnchors;
+            CAnchorsSaplingMap mapSaplingAnchors;
+            CNullifiersMap mapSproutNullifiers;
+            CNullifiersMap mapSaplingNullifiers;
+            if (!pcoinsdbview->BatchWrite(mapCoins, metadata.hashBlock, metadata.hashSproutAnchor, metadata.hashSaplingAnchor,
+                                          mapSproutAnchors, mapSaplingAnchors, mapSproutNullifiers, mapSaplingNullifiers) ||
+                !pblocktree->WriteFlag("prunedblockfiles", true) ||
+                !pblocktree->WriteFlag("utxosnapshot", true)) {
+                strError = _("Failed to write UTXO snapshot to the databases");
+                return false;
+            }
+        }
+        LogPrintf("%s: %s snapshot of block %s (height %d): %u transactions, %u outputs, %u/%u anchors, %u/%u nullifiers, %dms\n",
+            __func__, fApply ? "loaded" : "verified", metadata.hashBlock.ToString(), metadata.nHeight,
+            stats.nTransactions, stats.nCoins, stats.nSproutAnchors, stats.nSaplingAnchors,
+            stats.nSproutNullifiers, stats.nSaplingNullifiers, GetTimeMillis() - nStart);
+    }
+    return true;
+}
+
+bool LoadBlockIndex()
+{
+    // Load block index from databases
+    if (!fReindex && !LoadBlockIndexDB())
+        return false;
+    return true;
+}
+
+bool InitBlockIndex(const CChainParams& chainparams) 
+{
+    LOCK(cs_main);
+
+    // Initialize global variables that cannot be constructed at startup.
+    recentRejects.reset(new CRollingBloomFilter(120000, 0.000001));
+
+    // Check whether we're already initialized
+    if (chainActive.Genesis() != NULL)
+        return true;
+
+    // Use the provided setting for -txindex in the new database
+    fTxIndex = GetBoolArg("-txindex", false);
+    pblocktree->WriteFlag("txindex", fTxIndex);
+
+    // Use the provided setting for -insightexplorer in the new database
+    fInsightExplorer = GetBoolArg("-insightexplorer", false);
+    pblocktree->WriteFlag("insightexplorer", fInsightExplorer);
+    fAddressIndex = fInsightExplorer;
+    fSpentIndex = fInsightExplorer;
+    fTimestampIndex = fInsightExplorer;
 
     LogPrintf("Initializing databases...\n");
 
@@ -4907,6 +5467,356 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
     return nLoaded > 0;
 }
 
+namespace {
+
+/**
+ * Runs a job for each index in [0, nJobs) on worker threads and hands the
+ * results back in index order from Next(). Workers run at most nWindow jobs
+ * ahead of the consumer. With no worker threads, Next() runs the jobs itself.
+ */
+template <typename T>
+class CReindexPipeline
+{
+private:
+    const std::function<void(size_t, T&)> job;
+    const size_t nJobs;
+
+    boost::mutex mutex;
+    boost::condition_variable condReady;
+    boost::condition_variable condSpace;
+    std::map<size_t, std::shared_ptr<T> > mapReady;
+    size_t nNextClaim;
+    size_t nNextConsume;
+    size_t nWindow;
+    bool fStop;
+    boost::thread_group threadGroup;
+
+    void Thread()
+    {
+        while (true) {
+            size_t i;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && nNextClaim < nJobs && nNextClaim >= nNextConsume + nWindow) {
+                    condSpace.wait(lock);
+                }
+                if (fStop || nNextClaim >= nJobs) {
+                    return;
+                }
+                i = nNextClaim++;
+            }
+            std::shared_ptr<T> item = std::make_shared<T>();
+            job(i, *item);
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                mapReady[i] = item;
+            }
+            condReady.notify_all();
+        }
+    }
+
+public:
+    CReindexPipeline(const std::function<void(size_t, T&)>& jobIn, size_t nJobsIn, int nThreads, size_t nWindowIn) :
+        job(jobIn), nJobs(nJobsIn), nNextClaim(0), nNextConsume(0), nWindow(nWindowIn), fStop(false)
+    {
+        for (int i = 0; i < nThreads; i++) {
+            threadGroup.create_thread([this] { Thread(); });
+        }
+    }
+
+    ~CReindexPipeline()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+        }
+        condSpace.notify_all();
+        threadGroup.join_all();
+    }
+
+    //! Returns the result of the next job, waiting for a worker if necessary.
+    std::shared_ptr<T> Next()
+    {
+        assert(nNextConsume < nJobs);
+        if (threadGroup.size() == 0) {
+            std::shared_ptr<T> item = std::make_shared<T>();
+            job(nNextConsume++, *item);
+            return item;
+        }
+        std::shared_ptr<T> item;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (mapReady.count(nNextConsume) == 0) {
+                condReady.wait(lock);
+            }
+            item = mapReady[nNextConsume];
+            mapReady.erase(nNextConsume);
+            nNextConsume++;
+        }
+        condSpace.notify_all();
+        return item;
+    }
+};
+
+/** A block header found in a block file during -reindex. */
+struct CReindexHeader
+{
+    CBlockHeader header;
+    uint256 hash;
+    CDiskBlockPos pos;
+};
+
+/** The block headers found in one block file during -reindex. */
+struct CReindexFile
+{
+    std::vector<CReindexHeader> vHeaders;
+    //! Whether the whole file was scanned
+    bool fComplete;
+
+    CReindexFile() : fComplete(false) {}
+};
+
+/** A block read back from disk during -reindex, ahead of connecting it. */
+struct CReindexBlock
+{
+    CBlock block;
+    bool fRead;
+    //! Whether the block passed CheckBlock
+    bool fChecked;
+
+    CReindexBlock() : fRead(false), fChecked(false) {}
+};
+
+/**
+ * Find the blocks in block file nFile, skipping garbage between them like
+ * LoadExternalBlockFile does. Only headers are deserialized; headers with an
+ * invalid Equihash solution or proof of work are left out. The file is only
+ * marked complete if the scan was not stopped by a shutdown or an I/O error.
+ */
+void ScanBlockFile(const CChainParams& chainparams, int nFile, CReindexFile& file)
+{
+    std::vector<CReindexHeader>& vHeaders = file.vHeaders;
+    CDiskBlockPos pos(nFile, 0);
+    FILE* fileIn = OpenBlockFile(pos, true);
+    if (!fileIn)
+        return; // This error is logged in OpenBlockFile
+    FileAdviseSequential(fileIn);
+    LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
+
+    try {
+        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
+        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
+        std::vector<char> vSkip;
+        uint64_t nRewind = blkdat.GetPos();
+        while (!blkdat.eof()) {
+            // Worker threads are not interrupted at shutdown, so check for it
+            // here; the partial result is discarded.
+            if (ShutdownRequested())
+                return;
+            blkdat.SetPos(nRewind);
+            nRewind++; // start one byte further next time, in case of failure
+            blkdat.SetLimit(); // remove former limit
+            unsigned int nSize = 0;
+            try {
+                // locate a header
+                unsigned char buf[MESSAGE_START_SIZE];
+                blkdat.FindByte(chainparams.MessageStart()[0]);
+                nRewind = blkdat.GetPos()+1;
+                blkdat >> FLATDATA(buf);
+                if (memcmp(buf, chainparams.MessageStart(), MESSAGE_START_SIZE))
+                    continue;
+                // read size
+                blkdat >> nSize;
+                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                    continue;
+            } catch (const std::exception&) {
+                // no valid block header found; don't complain
+                break;
+            }
+            try {
+                // read the header and skip the transactions, which are
+                // deserialized when the block is connected
+                uint64_t nBlockPos = blkdat.GetPos();
+                blkdat.SetLimit(nBlockPos + nSize);
+                blkdat.SetPos(nBlockPos);
+                CReindexHeader item;
+                blkdat >> item.header;
+                vSkip.resize(nBlockPos + nSize - blkdat.GetPos());
+                if (!vSkip.empty())
+                    blkdat.read(&vSkip[0], vSkip.size());
+                nRewind = blkdat.GetPos();
+
+                CValidationState state;
+                if (!CheckBlockHeader(item.header, state, chainparams)) {
+                    LogPrintf("%s: Invalid block header at %s\n", __func__, CDiskBlockPos(nFile, nBlockPos).ToString());
+                    continue;
+                }
+                item.hash = item.header.GetHash();
+                item.pos = CDiskBlockPos(nFile, nBlockPos);
+                vHeaders.push_back(item);
+            } catch (const std::exception& e) {
+                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+            }
+        }
+    } catch (const std::runtime_error& e) {
+        AbortNode(std::string("System error: ") + e.what());
+        return;
+    }
+    file.fComplete = true;
+}
+
+/**
+ * Add a header found by ScanBlockFile to the block index, followed by any
+ * headers found earlier that were waiting for it. Blocks still to be
+ * connected are appended to vBlocks, parents before children.
+ */
+void AcceptReindexedHeader(const CReindexHeader& item, const CChainParams& chainparams,
+                           std::multimap<uint256, CReindexHeader>& mapUnknownParent,
+                           std::vector<std::pair<CBlockIndex*, CDiskBlockPos> >& vBlocks)
+{
+    AssertLockHeld(cs_main);
+    if (item.hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.count(item.header.hashPrevBlock) == 0) {
+        LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, item.hash.ToString(),
+                item.header.hashPrevBlock.ToString());
+        mapUnknownParent.insert(std::make_pair(item.header.hashPrevBlock, item));
+        return;
+    }
+
+    deque<CReindexHeader> queue;
+    queue.push_back(item);
+    while (!queue.empty()) {
+        CReindexHeader head = queue.front();
+        queue.pop_front();
+
+        // The header was checked by ScanBlockFile
+        CValidationState state;
+        CBlockIndex* pindex = NULL;
+        if (!AcceptBlockHeader(head.header, state, chainparams, &pindex, false))
+            continue;
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+            vBlocks.push_back(std::make_pair(pindex, head.pos));
+
+        std::pair<std::multimap<uint256, CReindexHeader>::iterator, std::multimap<uint256, CReindexHeader>::iterator> range = mapUnknownParent.equal_range(head.hash);
+        for (std::multimap<uint256, CReindexHeader>::iterator it = range.first; it != range.second; ++it)
+            queue.push_back(it->second);
+        mapUnknownParent.erase(range.first, range.second);
+    }
+}
+
+/** Read a block to be connected and run the context-free checks on it. */
+void ReadReindexedBlock(const std::pair<CBlockIndex*, CDiskBlockPos>& entry, const CChainParams& chainparams, CReindexBlock& item)
+{
+    // ReadBlockFromDisk checks the Equihash solution and proof of work
+    item.fRead = ReadBlockFromDisk(item.block, entry.second, chainparams.GetConsensus()) &&
+                 item.block.GetHash() == entry.first->GetBlockHash();
+    if (!item.fRead)
+        return;
+    CValidationState state;
+    auto verifier = libzcash::ProofVerifier::Disabled();
+    item.fChecked = CheckBlock(item.block, state, chainparams, verifier, false);
+}
+
+/**
+ * ProcessNewBlock for a block read by ReadReindexedBlock, skipping the
+ * checks it already ran.
+ */
+bool ProcessReindexedBlock(CValidationState& state, const CChainParams& chainparams, const CReindexBlock& item, CDiskBlockPos* dbp)
+{
+    if (!item.fChecked)
+        return ProcessNewBlock(state, chainparams, NULL, &item.block, true, dbp);
+
+    {
+        LOCK(cs_main);
+        MarkBlockAsReceived(item.block.GetHash());
+        CBlockIndex *pindex = NULL;
+        bool ret = AcceptBlock(item.block, state, chainparams, &pindex, true, dbp, true);
+        CheckBlockIndex(chainparams.GetConsensus());
+        if (!ret)
+            return error("%s: AcceptBlock FAILED", __func__);
+    }
+
+    if (!ActivateBestChain(state, chainparams, &item.block))
+        return error("%s: ActivateBestChain failed", __func__);
+
+    return true;
+}
+
+} // anon namespace
+
+bool ReindexBlockFiles(const CChainParams& chainparams)
+{
+    int64_t nStart = GetTimeMillis();
+
+    int nFiles = 0;
+    while (boost::filesystem::exists(GetBlockPosFilename(CDiskBlockPos(nFiles, 0), "blk")))
+        nFiles++;
+
+    // -reindexthreads=0 means autodetect; <0 leaves that many cores free
+    int nThreads = GetArg("-reindexthreads", DEFAULT_REINDEX_THREADS);
+    if (nThreads <= 0)
+        nThreads += GetNumCores();
+    if (nThreads <= 1)
+        nThreads = 0;
+    else if (nThreads > MAX_REINDEX_THREADS)
+        nThreads = MAX_REINDEX_THREADS;
+    LogPrintf("Reindexing %d block files using %d threads\n", nFiles, std::max(nThreads, 1));
+
+    // Scan the block files in parallel and rebuild the block index from the
+    // headers found, in file order.
+    std::vector<std::pair<CBlockIndex*, CDiskBlockPos> > vBlocks;
+    {
+        std::multimap<uint256, CReindexHeader> mapUnknownParent;
+        CReindexPipeline<CReindexFile> scan(
+            [&chainparams](size_t i, CReindexFile& file) { ScanBlockFile(chainparams, i, file); },
+            nFiles, nThreads, nThreads);
+        for (int nFile = 0; nFile < nFiles; nFile++) {
+            boost::this_thread::interruption_point();
+            std::shared_ptr<CReindexFile> file = scan.Next();
+            if (!file->fComplete) {
+                LogPrintf("%s: Scanning block file blk%05u.dat did not complete\n", __func__, (unsigned int)nFile);
+                return false;
+            }
+            LOCK(cs_main);
+            for (const CReindexHeader& item : file->vHeaders)
+                AcceptReindexedHeader(item, chainparams, mapUnknownParent, vBlocks);
+        }
+        if (!mapUnknownParent.empty())
+            LogPrintf("%s: %u blocks with unknown parent ignored\n", __func__, mapUnknownParent.size());
+    }
+    LogPrintf("Reindex: found %u new block headers in %dms\n", vBlocks.size(), GetTimeMillis() - nStart);
+
+    // Connect the blocks, parents first, while worker threads read and check
+    // the next ones.
+    int64_t nStartConnect = GetTimeMillis();
+    int nLoaded = 0;
+    {
+        CReindexPipeline<CReindexBlock> prefetch(
+            [&vBlocks, &chainparams](size_t i, CReindexBlock& item) { ReadReindexedBlock(vBlocks[i], chainparams, item); },
+            vBlocks.size(), nThreads, nThreads * REINDEX_PREFETCH_BLOCKS_PER_THREAD);
+        for (size_t i = 0; i < vBlocks.size(); i++) {
+            boost::this_thread::interruption_point();
+            std::shared_ptr<CReindexBlock> item = prefetch.Next();
+            if (!item->fRead) {
+                LogPrintf("%s: Failed to read block %s at %s\n", __func__,
+                    vBlocks[i].first->GetBlockHash().ToString(), vBlocks[i].second.ToString());
+                continue;
+            }
+            CValidationState state;
+            if (ProcessReindexedBlock(state, chainparams, *item, &vBlocks[i].second))
+                nLoaded++;
+            if (state.IsError()) {
+                LogPrintf("%s: Connecting block %s failed: %s\n", __func__,
+                    vBlocks[i].first->GetBlockHash().ToString(), state.GetRejectReason());
+                return false;
+            }
+            if (ShutdownRequested())
+                return false;
+        }
+    }
+    LogPrintf("Reindex: connected %i blocks in %dms\n", nLoaded, GetTimeMillis() - nStartConnect);
+    return true;
+}
+
 void static CheckBlockIndex(const Consensus::Params& consensusParams)
 {
     if (!fCheckBlockIndex) {
@@ -5181,10 +6091,13 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
                 recentRejects->reset();
             }
 
+            // Use pcoinsTip->HaveCoinInCache as a quick approximation to exclude
+            // requesting or processing some txs which have already been included in a block
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
                    mapOrphanTransactions.count(inv.hash) ||
-                   pcoinsTip->HaveCoins(inv.hash);
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) ||
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
         }
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash);
@@ -5213,7 +6126,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
@@ -5238,14 +6151,20 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                 // it's available before trying to send.
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
-                        assert(!"cannot load block from disk");
                     if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
                     {
+                        // Send block from the cache of recent blocks, or from disk
+                        std::shared_ptr<const CDataStream> pblockdata;
+                        if (!ReadSerializedBlock(pblockdata, (*mi).second, consensusParams))
+                            assert(!"cannot load block from disk");
+                        pfrom->PushMessage("block", *pblockdata);
+                    }
+                    else if (inv.type == MSG_FILTERED_BLOCK)
+                    {
+                        // Send block from disk
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
+                            assert(!"cannot load block from disk");
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
@@ -5265,6 +6184,20 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                         // else
                             // no response
                     }
+                    else // MSG_CMPCT_BLOCK
+                    {
+                        // A peer asking for an old block is unlikely to have a mempool
+                        // that helps reconstructing it, so send the full block instead.
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
+                            assert(!"cannot load block from disk");
+                        if (mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
+                            CBlockHeaderAndShortTxIDs cmpctblock(block);
+                            pfrom->PushMessage("cmpctblock", cmpctblock);
+                        } else {
+                            pfrom->PushMessage("block", block);
+                        }
+                    }
 
                     // Trigger the peer node to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -5321,7 +6254,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             // Track requests for our stuff.
             GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -5340,6 +6273,41 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
     }
 }
 
+// Process a block received from pfrom, either in full or reconstructed from a
+// compact block. Must be called without cs_main held.
+void static ProcessBlockFromPeer(CNode* pfrom, const string& strCommand, const CBlock& block, const CChainParams& chainparams)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    pfrom->AddInventoryKnown(inv);
+
+    CValidationState state;
+    // Process all blocks from whitelisted peers, even if not requested,
+    // unless we're still syncing with the network.
+    // Such an unrequested block may still be processed, subject to the
+    // conditions in AcceptBlock().
+    bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload(chainparams);
+    ProcessNewBlock(state, chainparams, pfrom, &block, forceProcessing, NULL);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
+        return;
+    }
+
+    // A peer that gave us a new tip is a good candidate to announce the next
+    // one with a compact block.
+    LOCK(cs_main);
+    if (chainActive.Tip()->GetBlockHash() == inv.hash && !IsInitialBlockDownload(chainparams)) {
+        CNodeState *nodestate = State(pfrom->GetId());
+        if (nodestate)
+            MaybeSetPeerAsAnnouncingHeaderAndIDs(nodestate, pfrom);
+    }
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     const CChainParams& chainparams = Params();
@@ -5504,6 +6472,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
+            // Tell the peer we can reconstruct compact blocks, but want them
+            // announced by "inv" until it proves to be a good source of blocks.
+            bool fAnnounceUsingCMPCTBLOCK = false;
+            uint64_t nCMPCTBLOCKVersion = 1;
+            pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+        }
     }
 
 
@@ -5630,9 +6606,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     // not a direct successor.
                     pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
                     CNodeState *nodestate = State(pfrom->GetId());
-                    if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - chainparams.GetConsensus().nPowTargetSpacing * 20 &&
+                    if (CanDirectFetch(chainparams.GetConsensus()) &&
                         nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                        vToFetch.push_back(inv);
+                        // Peers that support it send the block as a compact block, which
+                        // we can mostly reconstruct from our mempool.
+                        vToFetch.push_back(CInv(nodestate->fProvidesHeaderAndIDs ? MSG_CMPCT_BLOCK : MSG_BLOCK, inv.hash));
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
                         MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus());
@@ -5954,28 +6932,225 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CBlock block;
         vRecv >> block;
 
-        CInv inv(MSG_BLOCK, block.GetHash());
-        LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
+        LogPrint("net", "received block %s peer=%d\n", block.GetHash().ToString(), pfrom->id);
 
-        pfrom->AddInventoryKnown(inv);
+        ProcessBlockFromPeer(pfrom, strCommand, block, chainparams);
+    }
 
-        CValidationState state;
-        // Process all blocks from whitelisted peers, even if not requested,
-        // unless we're still syncing with the network.
-        // Such an unrequested block may still be processed, subject to the
-        // conditions in AcceptBlock().
-        bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload(chainparams);
-        ProcessNewBlock(state, chainparams, pfrom, &block, forceProcessing, NULL);
-        int nDoS;
-        if (state.IsInvalid(nDoS)) {
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0) {
-                LOCK(cs_main);
-                Misbehaving(pfrom->GetId(), nDoS);
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == 1) {
+            LOCK(cs_main);
+            CNodeState *nodestate = State(pfrom->GetId());
+            nodestate->fProvidesHeaderAndIDs = true;
+            nodestate->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrint("net", "peer=%d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        if (mi->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // Answering with the full block makes the peer receive everything
+            // we read from disk, which keeps this from being a cheap way to
+            // make us do disk reads.
+            LogPrint("net", "peer=%d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom, chainparams.GetConsensus());
+            return true;
+        }
+
+        // Recent blocks are usually in the serialized block cache
+        std::shared_ptr<const CDataStream> pblockdata;
+        if (!ReadSerializedBlock(pblockdata, mi->second, chainparams.GetConsensus()))
+            assert(!"cannot load block from disk");
+        CBlock block;
+        CDataStream ssBlock(*pblockdata);
+        ssBlock >> block;
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("peer=%d sent us a getblocktxn with out-of-bounds tx indices\n", pfrom->id);
+                return true;
             }
+            resp.txn[i] = block.vtx[req.indexes[i]];
         }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        uint256 hash = cmpctblock.header.GetHash();
+        LogPrint("net", "received cmpctblock %s peer=%d\n", hash.ToString(), pfrom->id);
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+
+            if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+                // Doesn't connect (or is genesis), ask for the headers in between
+                if (!IsInitialBlockDownload(chainparams))
+                    pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+                return true;
+            }
+
+            CBlockIndex *pindex = NULL;
+            CValidationState state;
+            if (!AcceptBlockHeader(cmpctblock.header, state, chainparams, &pindex)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS)) {
+                    if (nDoS > 0)
+                        Misbehaving(pfrom->GetId(), nDoS);
+                    return error("invalid header received in cmpctblock");
+                }
+            }
+            assert(pindex);
+            UpdateBlockAvailability(pfrom->GetId(), hash);
+            pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+            bool fAlreadyInFlight = itInFlight != mapBlocksInFlight.end();
+
+            if (pindex->nStatus & BLOCK_HAVE_DATA) // Nothing to do here
+                return true;
+
+            if (pindex->nChainWork <= chainActive.Tip()->nChainWork || // We know something better
+                    pindex->nTx != 0) { // We had this block at some point, but pruned it
+                if (fAlreadyInFlight) {
+                    // We requested this block, but our mempool will probably
+                    // be of no use, so get it in full.
+                    vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                    pfrom->PushMessage("getdata", vInv);
+                }
+                return true;
+            }
+
+            // If we're not close to the tip yet, leave it to parallel block download
+            if (!fAlreadyInFlight && !CanDirectFetch(chainparams.GetConsensus()))
+                return true;
+
+            CNodeState *nodestate = State(pfrom->GetId());
+
+            if (pindex->nHeight > chainActive.Height() + 2) {
+                // Too far ahead for our mempool to help; if we asked for it, get
+                // the block in full, otherwise the header alone will get it scheduled.
+                if (fAlreadyInFlight) {
+                    vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                    pfrom->PushMessage("getdata", vInv);
+                }
+                return true;
+            }
+
+            if (fAlreadyInFlight ? itInFlight->second.first != pfrom->GetId()
+                                 : nodestate->nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER)
+                return true;
+
+            list<QueuedBlock>::iterator *pitQueued = NULL;
+            if (!MarkBlockAsInFlight(pfrom->GetId(), hash, chainparams.GetConsensus(), pindex, &pitQueued)) {
+                if ((*pitQueued)->partialBlock) {
+                    LogPrint("net", "peer=%d sent us a compact block we were already reconstructing\n", pfrom->id);
+                    return true;
+                }
+                (*pitQueued)->partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+            }
+
+            PartiallyDownloadedBlock& partialBlock = *(*pitQueued)->partialBlock;
+            ReadStatus status = partialBlock.InitData(cmpctblock);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(hash); // Reset in-flight state in case of whitelist
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us an invalid compact block", pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                // Short ID collision in the mempool; the block is in flight, so just get it in full
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                pfrom->PushMessage("getdata", vInv);
+                return true;
+            }
+
+            BlockTransactionsRequest req;
+            for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                if (!partialBlock.IsTxAvailable(i))
+                    req.indexes.push_back(i);
+            }
+            if (!req.indexes.empty()) {
+                LogPrint("net", "requesting %u of %u transactions of cmpctblock %s from peer=%d\n",
+                    req.indexes.size(), cmpctblock.BlockTxCount(), hash.ToString(), pfrom->id);
+                req.blockhash = hash;
+                pfrom->PushMessage("getblocktxn", req);
+                return true;
+            }
+
+            status = partialBlock.FillBlock(block, std::vector<CTransaction>());
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(hash); // Reset in-flight state in case of whitelist
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us an invalid compact block", pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                pfrom->PushMessage("getdata", vInv);
+                return true;
+            }
+            fBlockReconstructed = true;
+        } // Don't hold cs_main when processing the block
+
+        if (fBlockReconstructed)
+            ProcessBlockFromPeer(pfrom, strCommand, block, chainparams);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(resp.blockhash);
+            if (itInFlight == mapBlocksInFlight.end() || !itInFlight->second.second->partialBlock ||
+                    itInFlight->second.first != pfrom->GetId()) {
+                LogPrint("net", "peer=%d sent us block transactions for a block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+
+            PartiallyDownloadedBlock& partialBlock = *itInFlight->second.second->partialBlock;
+            ReadStatus status = partialBlock.FillBlock(block, resp.txn);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(resp.blockhash); // Reset in-flight state in case of whitelist
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us an invalid compact block or non-matching block transactions", pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                // Might have been a short ID collision; fall back to the full block
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, resp.blockhash));
+                pfrom->PushMessage("getdata", vInv);
+                return true;
+            }
+        } // Don't hold cs_main when processing the block
 
+        ProcessBlockFromPeer(pfrom, strCommand, block, chainparams);
     }
 
 
@@ -6641,10 +7816,8 @@ public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        blockIndexArena.Clear();
 
         // orphan transactions
         mapOrphanTransactions.clear();
@@ -11,11 +11,13 @@
 #endif
 
 #include "amount.h"
+#include "blockcache.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "coins.h"
 #include "consensus/consensus.h"
 #include "consensus/upgrades.h"
+#include "mappedblockfiles.h"
 #include "net.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
@@ -40,13 +42,18 @@
 #include <vector>
 
 #include <boost/unordered_map.hpp>
+#include <boost/variant.hpp>
 
+class CAutoFile;
 class CBlockIndex;
 class CBlockTreeDB;
+class CCoinsViewDB;
 class CBloomFilter;
 class CChainParams;
 class CInv;
 class CScriptCheck;
+class CSnapshotMetadata;
+struct CSnapshotStats;
 class CValidationInterface;
 class CValidationState;
 class PrecomputedTransactionData;
@@ -72,6 +79,26 @@ static const unsigned int MAX_STANDARD_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 static const unsigned int DEFAULT_MIN_RELAY_TX_FEE = 100;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -blockcachesize, megabytes of recent blocks kept serialized for sending to peers */
+static const unsigned int DEFAULT_BLOCK_CACHE_SIZE = 16;
+/** Default for -mmapblocks */
+static const bool DEFAULT_MMAP_BLOCK_FILES = false;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/**
+ * Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors.
+ * Shielded transactions can be much larger than transparent ones, so this
+ * allows a maximum-size transaction to spend an output of another one.
+ */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 2 * MAX_TX_SIZE_AFTER_SAPLING / 1000;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 2 * MAX_TX_SIZE_AFTER_SAPLING / 1000;
 /** Default for -txexpirydelta, in number of blocks */
 static const unsigned int DEFAULT_TX_EXPIRY_DELTA = 20;
 /** The number of blocks within expiry height when a tx is considered to be expiring soon */
@@ -86,10 +113,22 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Number of block index entries allocated at a time */
+static const size_t BLOCK_INDEX_ARENA_CHUNK_SIZE = 16384;
+/** -reindexthreads default (0 = one thread per core) */
+static const int DEFAULT_REINDEX_THREADS = 0;
+/** Maximum number of threads that scan and read block files during -reindex */
+static const int MAX_REINDEX_THREADS = 8;
+/** Number of blocks each -reindex thread may read ahead of the block being connected */
+static const unsigned int REINDEX_PREFETCH_BLOCKS_PER_THREAD = 8;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
+/** Maximum depth of a block we answer a "cmpctblock" request for; older blocks are sent in full. */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Maximum depth of a block we answer a "getblocktxn" request for; older blocks are sent in full. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached its tip. Changing this value is a protocol upgrade. */
 static const unsigned int MAX_HEADERS_RESULTS = 160;
@@ -123,6 +162,8 @@ extern unsigned int expiryDelta;
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
+extern CSerializedBlockCache serializedBlockCache;
+extern CMappedBlockFiles mappedBlockFiles;
 typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
 extern BlockMap mapBlockIndex;
 extern uint64_t nLastBlockTx;
@@ -149,11 +190,16 @@ extern bool fAddressIndex;
 // Maintain a full spent index, used to query the spending txid and input index for an outpoint
 extern bool fSpentIndex;
 
+// Maintain a timestamp index, used to query for blocks within a range of timestamps
+extern bool fTimestampIndex;
+
 // END insightexplorer
 
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
 extern bool fCheckpointsEnabled;
+/** Read blocks through mappedBlockFiles instead of opening the block file each time. */
+extern bool fMmapBlockFiles;
 // TODO: remove this flag by structuring our code such that
 // it is unneeded for testing
 extern bool fCoinbaseEnforcedProtectionEnabled;
@@ -216,12 +262,32 @@ FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/**
+ * Rebuild the block index from the block files for -reindex. The files are
+ * scanned in parallel and the block headers indexed first; then the blocks
+ * are connected in order while worker threads read and check the next ones.
+ * Returns false if the pass did not complete, for example on shutdown, in
+ * which case the reindex must be started again.
+ */
+bool ReindexBlockFiles(const CChainParams& chainparams);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex(const CChainParams& chainparams);
 /** Load the block tree and coins database from disk */
 bool LoadBlockIndex();
 /** Unload database information */
 void UnloadBlockIndex();
+/**
+ * Write the active chain's block index, coins, anchors and nullifiers to a
+ * UTXO snapshot file, followed by a hash committing to its contents.
+ */
+bool DumpUTXOSnapshot(CAutoFile& fileout, CSnapshotMetadata& metadata, CSnapshotStats& stats, uint256& hashSnapshot);
+/**
+ * Bulk-load a UTXO snapshot written by DumpUTXOSnapshot into empty block
+ * tree and chainstate databases. The blocks below the snapshot are not
+ * available afterwards, as if they had been pruned. The snapshot is refused
+ * unless its hash matches hashPinned, which must come from outside the file.
+ */
+bool LoadUTXOSnapshot(const CChainParams& chainparams, const boost::filesystem::path& path, const uint256& hashPinned, std::string& strError);
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
 /**
@@ -231,7 +297,7 @@ bool ProcessMessages(CNode* pfrom);
  * @param[in]   fSendTrickle    When true send the trickled data, otherwise trickle the data until true.
  */
 bool SendMessages(CNode* pto, bool fSendTrickle);
-/** Run an instance of the script checking thread */
+/** Run an instance of the script and proof checking thread */
 void ThreadScriptCheck();
 /** Try to detect Partition (network isolation) attacks against us */
 void PartitionCheck(bool (*initialDownloadCheck)(const CChainParams&), CCriticalSection& cs, const CBlockIndex *const &bestHeader, int64_t nPowTargetSpacing);
@@ -280,7 +346,7 @@ void PruneAndFlush();
 
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee=false);
+                        bool* pfMissingInputs, bool fRejectAbsurdFee=false, bool fOverrideMempoolLimit=false);
 
 
 struct CNodeStateStats {
@@ -340,10 +406,16 @@ bool ContextualCheckInputs(const CTransaction& tx, CValidationState &state, cons
                            const Consensus::Params& consensusParams, uint32_t consensusBranchId,
                            std::vector<CScriptCheck> *pvChecks = NULL);
 
-/** Check a transaction contextually against a set of consensus rules */
+/**
+ * Check a transaction contextually against a set of consensus rules.
+ * If fCheckShieldedProofs is false, the joinSplitSig, Sapling proofs and the
+ * binding signature are left to be verified later (ConnectBlock does this for
+ * whole blocks).
+ */
 bool ContextualCheckTransaction(const CTransaction& tx, CValidationState &state,
                                 const CChainParams& chainparams, int nHeight, int dosLevel,
-                                bool (*isInitBlockDownload)(const CChainParams&) = IsInitialBlockDownload);
+                                bool (*isInitBlockDownload)(const CChainParams&) = IsInitialBlockDownload,
+                                bool fCheckShieldedProofs = true);
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
@@ -416,8 +488,8 @@ private:
 
 public:
     CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), consensusBranchId(0), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, uint32_t consensusBranchIdIn, PrecomputedTransactionData* txdataIn) :
-        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey), amount(txFromIn.vout[txToIn.vin[nInIn].prevout.n].nValue),
+    CScriptCheck(const CTxOut& outIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, uint32_t consensusBranchIdIn, PrecomputedTransactionData* txdataIn) :
+        scriptPubKey(outIn.scriptPubKey), amount(outIn.nValue),
         ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), consensusBranchId(consensusBranchIdIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
 
     bool operator()();
@@ -435,14 +507,116 @@ public:
     }
 
     ScriptError GetScriptError() const { return error; }
+
+    std::string GetRejectReason() const;
+
+    uint256 GetTxHash() const { return ptxTo ? ptxTo->GetHash() : uint256(); }
+};
+
+/**
+ * Closure representing the Sapling spend/output proof and binding signature
+ * verification of one transaction.
+ * Note that this stores a reference to the transaction
+ */
+class CSaplingCheck
+{
+private:
+    const CTransaction *ptx;
+    uint256 dataToBeSigned;
+    std::string strRejectReason;
+
+public:
+    CSaplingCheck(): ptx(0) {}
+    CSaplingCheck(const CTransaction& txIn, const uint256& dataToBeSignedIn) :
+        ptx(&txIn), dataToBeSigned(dataToBeSignedIn) { }
+
+    bool operator()();
+
+    void swap(CSaplingCheck &check) {
+        std::swap(ptx, check.ptx);
+        std::swap(dataToBeSigned, check.dataToBeSigned);
+        strRejectReason.swap(check.strRejectReason);
+    }
+
+    const std::string& GetRejectReason() const { return strRejectReason; }
+
+    uint256 GetTxHash() const { return ptx ? ptx->GetHash() : uint256(); }
 };
 
+/**
+ * Closure representing the joinSplitSig and JoinSplit proof verification of
+ * one transaction. Proofs are only checked if fCheckProofs is set.
+ * Note that this stores a reference to the transaction
+ */
+class CJoinSplitCheck
+{
+private:
+    const CTransaction *ptx;
+    uint256 dataToBeSigned;
+    bool fCheckProofs;
+    std::string strRejectReason;
+
+public:
+    CJoinSplitCheck(): ptx(0), fCheckProofs(false) {}
+    CJoinSplitCheck(const CTransaction& txIn, const uint256& dataToBeSignedIn, bool fCheckProofsIn) :
+        ptx(&txIn), dataToBeSigned(dataToBeSignedIn), fCheckProofs(fCheckProofsIn) { }
+
+    bool operator()();
+
+    void swap(CJoinSplitCheck &check) {
+        std::swap(ptx, check.ptx);
+        std::swap(dataToBeSigned, check.dataToBeSigned);
+        std::swap(fCheckProofs, check.fCheckProofs);
+        strRejectReason.swap(check.strRejectReason);
+    }
+
+    const std::string& GetRejectReason() const { return strRejectReason; }
+
+    uint256 GetTxHash() const { return ptx ? ptx->GetHash() : uint256(); }
+};
+
+/**
+ * One of the checks that ConnectBlock defers: a script check, or the
+ * JoinSplit or Sapling checks of a transaction. All of them go through one
+ * check queue, so every -par thread works on whichever kind a block needs.
+ */
+class CBlockCheck
+{
+private:
+    boost::variant<CScriptCheck, CJoinSplitCheck, CSaplingCheck> check;
+
+public:
+    CBlockCheck() {}
+    CBlockCheck(CScriptCheck&& checkIn) : check(std::move(checkIn)) {}
+    CBlockCheck(CJoinSplitCheck&& checkIn) : check(std::move(checkIn)) {}
+    CBlockCheck(CSaplingCheck&& checkIn) : check(std::move(checkIn)) {}
+
+    bool operator()();
+
+    void swap(CBlockCheck &other) {
+        check.swap(other.check);
+    }
+
+    std::string GetRejectReason() const;
+    uint256 GetTxHash() const;
+};
+
+// insightexplorer
 bool GetSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value);
+bool GetAddressIndex(const uint160& addressHash, int type,
+                     std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
+                     int start = 0, int end = 0);
+bool GetAddressUnspent(const uint160& addressHash, int type,
+                       std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs);
+bool GetTimestampIndex(unsigned int high, unsigned int low, bool fActiveOnly,
+                       std::vector<std::pair<uint256, unsigned int> > &hashes);
 
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/** Get a block in network serialization, from the cache of recent blocks or from disk */
+bool ReadSerializedBlock(std::shared_ptr<const CDataStream>& pblockdata, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -509,6 +683,9 @@ extern CCoinsViewCache *pcoinsTip;
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/** Global variable that points to the coins database (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
 /**
  * Return the spend height, which is one more than the inputs.GetBestBlock().
  * While checking, GetBestBlock() refers to the parent block. (protected by cs_main)
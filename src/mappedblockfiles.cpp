@@ -0,0 +1,104 @@
+// Copyright (c) 2019 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "mappedblockfiles.h"
+
+#include "util.h"
+
+#include <assert.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CMappedFile::~CMappedFile()
+{
+#ifndef WIN32
+    munmap(pdata, nSize);
+#endif
+}
+
+void CMappedFile::Advise(bool fSequential) const
+{
+#ifndef WIN32
+    posix_madvise(pdata, nSize, fSequential ? POSIX_MADV_SEQUENTIAL : POSIX_MADV_NORMAL);
+#endif
+}
+
+std::shared_ptr<const CMappedFile> CMappedBlockFiles::Get(int nFile, const boost::filesystem::path& path, size_t nMinSize)
+{
+    LOCK(cs);
+    std::map<int, std::shared_ptr<const CMappedFile> >::iterator it = mapFiles.find(nFile);
+    if (it != mapFiles.end() && it->second->size() >= nMinSize)
+        return it->second;
+
+#ifdef WIN32
+    return std::shared_ptr<const CMappedFile>();
+#else
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1) {
+        LogPrintf("%s: unable to open %s\n", __func__, path.string());
+        return std::shared_ptr<const CMappedFile>();
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return std::shared_ptr<const CMappedFile>();
+    }
+    size_t nSize = st.st_size;
+    void* pdata = mmap(NULL, nSize, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+    if (pdata == MAP_FAILED) {
+        LogPrintf("%s: unable to map %s\n", __func__, path.string());
+        return std::shared_ptr<const CMappedFile>();
+    }
+
+    std::shared_ptr<const CMappedFile> pfile(new CMappedFile((char*)pdata, nSize));
+    if (nSequentialReaders > 0)
+        pfile->Advise(true);
+    mapFiles[nFile] = pfile;
+    return pfile;
+#endif
+}
+
+void CMappedBlockFiles::Invalidate(int nFile)
+{
+    LOCK(cs);
+    mapFiles.erase(nFile);
+}
+
+void CMappedBlockFiles::Clear()
+{
+    LOCK(cs);
+    mapFiles.clear();
+}
+
+void CMappedBlockFiles::BeginSequentialReads()
+{
+    LOCK(cs);
+    if (nSequentialReaders++ > 0)
+        return;
+    for (std::map<int, std::shared_ptr<const CMappedFile> >::iterator it = mapFiles.begin(); it != mapFiles.end(); ++it)
+        it->second->Advise(true);
+}
+
+void CMappedBlockFiles::EndSequentialReads()
+{
+    LOCK(cs);
+    assert(nSequentialReaders > 0);
+    if (--nSequentialReaders > 0)
+        return;
+    for (std::map<int, std::shared_ptr<const CMappedFile> >::iterator it = mapFiles.begin(); it != mapFiles.end(); ++it)
+        it->second->Advise(false);
+}
+
+size_t CMappedBlockFiles::GetCount() const
+{
+    LOCK(cs);
+    return mapFiles.size();
+}
@@ -0,0 +1,82 @@
+// Copyright (c) 2019 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MAPPEDBLOCKFILES_H
+#define BITCOIN_MAPPEDBLOCKFILES_H
+
+#include "sync.h"
+
+#include <map>
+#include <memory>
+
+#include <boost/filesystem/path.hpp>
+
+/** A read-only memory mapping of a whole file, unmapped when destroyed. */
+class CMappedFile
+{
+private:
+    // Disallow copies
+    CMappedFile(const CMappedFile&);
+    CMappedFile& operator=(const CMappedFile&);
+
+    char* pdata;
+    size_t nSize;
+
+public:
+    CMappedFile(char* pdataIn, size_t nSizeIn) : pdata(pdataIn), nSize(nSizeIn) {}
+    ~CMappedFile();
+
+    const char* data() const { return pdata; }
+    size_t size() const { return nSize; }
+
+    /** Hint the kernel about how the mapping will be read (sequentially or not). */
+    void Advise(bool fSequential) const;
+};
+
+/**
+ * Block files kept mapped read-only, so blocks can be deserialized straight
+ * from the page cache without a file open, seek and read for each of them.
+ * The file being appended to grows after it is mapped; it is mapped again
+ * when a read needs more of it. Readers hold a reference to the mapping they
+ * use, so remapping or dropping a file never pulls it from under them.
+ */
+class CMappedBlockFiles
+{
+private:
+    mutable CCriticalSection cs;
+    std::map<int, std::shared_ptr<const CMappedFile> > mapFiles;
+    //! Number of active sequential readers, see CSequentialBlockReads
+    int nSequentialReaders;
+
+public:
+    CMappedBlockFiles() : nSequentialReaders(0) {}
+
+    /**
+     * Return a mapping of block file nFile at path covering at least its first
+     * nMinSize bytes, (re)mapping the file if needed. The mapping is shorter if
+     * the file is. Returns an empty pointer if the file can't be mapped.
+     */
+    std::shared_ptr<const CMappedFile> Get(int nFile, const boost::filesystem::path& path, size_t nMinSize);
+    /** Drop the mapping of a file that is being truncated or deleted. */
+    void Invalidate(int nFile);
+    void Clear();
+
+    void BeginSequentialReads();
+    void EndSequentialReads();
+
+    size_t GetCount() const;
+};
+
+/** Hints sequential access to all mapped block files during its lifetime, e.g. for a rescan. */
+class CSequentialBlockReads
+{
+private:
+    CMappedBlockFiles& files;
+
+public:
+    CSequentialBlockReads(CMappedBlockFiles& filesIn) : files(filesIn) { files.BeginSequentialReads(); }
+    ~CSequentialBlockReads() { files.EndSequentialReads(); }
+};
+
+#endif // BITCOIN_MAPPEDBLOCKFILES_H
@@ -33,7 +33,6 @@
 #include "sodium.h"
 
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 #ifdef ENABLE_MINING
 #include <functional>
 #endif
@@ -46,405 +45,892 @@ using namespace std;
 // BitcoinMiner
 //
 
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+
+CBlockTemplateBuilder* pblocktemplatebuilder = NULL;
+
+// Scripts only depend on the transaction, the outputs it spends (which its
+// txid commits to) and the consensus branch, so a transaction whose scripts
+// passed while assembling one block need not have them checked again for the
+// next one on the same branch. Inputs, fees and the turnstile are still
+// checked against every block, and every template is run through
+// TestBlockValidity before it is served, which checks all scripts again.
+// Guarded by cs_main.
+static std::set<uint256> setScriptChecked;
+static uint32_t nScriptCheckedBranchId = 0;
+
 //
 // Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
+// transactions in the memory pool. The mempool tracks, for every entry, the
+// aggregate size and fee of the entry together with all of its in-mempool
+// ancestors, so blocks are filled package by package in ancestor fee rate
+// order: selecting a transaction selects the unconfirmed parents it needs.
+// As packages are added, the ancestor state of their remaining descendants is
+// adjusted in a side index (mapModifiedTx) instead of touching the mempool.
 //
-class COrphan
-{
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
+namespace {
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+// Container for tracking updates to ancestor feerate as we include (parent)
+// transactions in a block
+struct CTxMemPoolModifiedEntry {
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
     {
+        iter = entry;
+        nSizeWithAncestors = entry->GetSizeWithAncestors();
+        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
     }
-};
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+};
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
-{
-    bool byFee;
+// This matches the calculation in CompareTxMemPoolEntryByAncestorFee,
+// except operating on CTxMemPoolModifiedEntry.
+struct CompareModifiedEntry {
+    bool operator()(const CTxMemPoolModifiedEntry &a, const CTxMemPoolModifiedEntry &b) const
+    {
+        double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
+        double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
+        if (f1 == f2) {
+            return CTxMemPool::CompareIteratorByHash()(a.iter, b.iter);
+        }
+        return f1 > f2;
+    }
+};
 
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
+// A comparator that sorts transactions based on number of ancestors.
+// This is sufficient to sort an ancestor package in an order that is valid
+// to appear in a block.
+struct CompareTxIterByAncestorCount {
+    bool operator()(const CTxMemPool::txiter &a, const CTxMemPool::txiter &b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator() (const CTxMemPoolModifiedEntry &entry) const
     {
-        if (byFee)
-        {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        }
-        else
-        {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
-        }
+        return entry.iter;
     }
 };
 
-void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CTxMemPool::CompareIteratorByHash
+        >,
+        // sorted by modified ancestor fee rate
+        boost::multi_index::ordered_non_unique<
+            // Reuse same tag from CTxMemPool's similar index
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareModifiedEntry
+        >
+    >
+> indexed_modified_transaction_set;
+
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
+
+struct update_for_parent_inclusion
 {
-    pblock->nTime = std::max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
 
-    // Updating time can change work required on testnet:
-    if (consensusParams.nPowAllowMinDifficultyBlocksAfterHeight != boost::none) {
-        pblock->nBits = GetNextWorkRequired(pindexPrev, pblock, consensusParams);
+    void operator() (CTxMemPoolModifiedEntry &e)
+    {
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
     }
-}
 
-CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const CScript& scriptPubKeyIn)
+    CTxMemPool::txiter iter;
+};
+
+// We want to sort transactions by coin age priority
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+
+struct TxCoinAgePriorityCompare
 {
-    // Create new block
-    std::unique_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
-    if(!pblocktemplate.get())
-        return NULL;
-    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b)
+    {
+        if (a.first == b.first)
+            return CompareTxMemPoolEntryByFee()(*(b.second), *(a.second)); //Reverse order to make sort less than
+        return a.first < b.first;
+    }
+};
 
-    // -regtest only: allow overriding block.nVersion with
-    // -blockversion=N to test forking scenarios
-    if (chainparams.MineBlocksOnDemand())
-        pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
+/**
+ * Fills a block template from the mempool: first the high-priority area by
+ * coin age, then ancestor packages by fee rate. Transactions are checked
+ * against a scratch view layered on the block's view, one package at a time,
+ * so that a package is only added if every transaction in it is valid.
+ * Requires cs_main and mempool.cs to be held for its whole lifetime.
+ */
+class BlockAssembler
+{
+private:
+    const CChainParams& chainparams;
+    CBlockTemplate* pblocktemplate;
+    CCoinsViewCache& view;
+    SaplingMerkleTree& sapling_tree;
+
+    // Configuration parameters for the block size
+    unsigned int nBlockMaxSize, nBlockMinSize;
+
+    // Information on the current status of the block
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+    CTxMemPool::setEntries inBlock;
+    std::set<uint256> setBlockTxids;
+
+    // Chain context for the block
+    int nHeight;
+    int64_t nLockTimeCutoff;
+    uint32_t consensusBranchId;
+
+    // We want to track the value pool, but if the miner gets
+    // invoked on an old block before the hardcoded fallback
+    // is active we don't want to trip up any assertions. So,
+    // we only adhere to the turnstile (as a miner) if we
+    // actually have all of the information necessary to do
+    // so.
+    CAmount sproutValue;
+    CAmount saplingValue;
+    bool monitoring_pool_balances;
+
+    bool fPrintPriority;
 
-    // Add dummy coinbase tx as first transaction
-    pblock->vtx.push_back(CTransaction());
-    pblocktemplate->vTxFees.push_back(-1); // updated at end
-    pblocktemplate->vTxSigOps.push_back(-1); // updated at end
+public:
+    BlockAssembler(const CChainParams& _chainparams, CBlockTemplate* _pblocktemplate,
+                   CCoinsViewCache& _view, SaplingMerkleTree& _sapling_tree,
+                   const CBlockIndex* pindexPrev, int64_t _nLockTimeCutoff);
+
+    /** Add transactions based on coin age priority, up to -blockprioritysize */
+    void addPriorityTxs();
+    /** Add transactions based on ancestor feerate, package by package */
+    void addPackageTxs();
+    /** Append a transaction that entered the mempool after the block was
+     *  assembled. Returns false if it should be in the block but can only
+     *  be placed by assembling the block again: one of its in-mempool
+     *  parents is not in the block, or it does not fit. */
+    bool addNewTx(CTxMemPool::txiter iter);
+    /** Forget the mempool entries added so far. Must be called before
+     *  mempool.cs is released if the assembler is used again later, as
+     *  the entries may not outlive the lock; the block itself is kept. */
+    void releaseEntries() { inBlock.clear(); }
+
+    uint64_t GetBlockSize() const { return nBlockSize; }
+    uint64_t GetBlockTx() const { return nBlockTx; }
+    CAmount GetFees() const { return nFees; }
+
+private:
+    /** Check every transaction of a package (sorted parents first) against
+     *  the block so far, and add them all if they are all valid. On failure
+     *  failedIt is set to the transaction that could not be added. */
+    bool TestAndAddPackage(const std::vector<CTxMemPool::txiter>& sortedEntries, CTxMemPool::txiter& failedIt);
+    /** Return true if given transaction from mapTx has already been evaluated,
+     *  or if the transaction's cached data in mapTx is incorrect. */
+    bool SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set& mapModifiedTx, CTxMemPool::setEntries& failedTx);
+    /** Add descendants of given transactions to mapModifiedTx with ancestor
+     *  state updated assuming given transactions are inBlock. */
+    void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx);
+    /** Return true if any in-mempool parent of the transaction is not yet in the block */
+    bool isStillDependent(CTxMemPool::txiter iter);
+};
+
+BlockAssembler::BlockAssembler(const CChainParams& _chainparams, CBlockTemplate* _pblocktemplate,
+                               CCoinsViewCache& _view, SaplingMerkleTree& _sapling_tree,
+                               const CBlockIndex* pindexPrev, int64_t _nLockTimeCutoff)
+    : chainparams(_chainparams), pblocktemplate(_pblocktemplate), view(_view), sapling_tree(_sapling_tree),
+      nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0),
+      nHeight(pindexPrev->nHeight + 1), nLockTimeCutoff(_nLockTimeCutoff),
+      sproutValue(0), saplingValue(0), monitoring_pool_balances(true)
+{
+    consensusBranchId = CurrentEpochBranchId(nHeight, chainparams.GetConsensus());
+
+    if (nScriptCheckedBranchId != consensusBranchId) {
+        setScriptChecked.clear();
+        nScriptCheckedBranchId = consensusBranchId;
+    }
+    for (std::set<uint256>::iterator it = setScriptChecked.begin(); it != setScriptChecked.end(); ) {
+        if (!mempool.exists(*it))
+            setScriptChecked.erase(it++);
+        else
+            ++it;
+    }
 
     // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
     // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
     nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
 
-    // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
-
     // Minimum block size you want to create; block will be filled with free transactions
     // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
     nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
 
-    // Collect memory pool transactions into the block
-    CAmount nFees = 0;
+    if (chainparams.ZIP209Enabled()) {
+        if (pindexPrev->nChainSproutValue) {
+            sproutValue = *pindexPrev->nChainSproutValue;
+        } else {
+            monitoring_pool_balances = false;
+        }
+        if (pindexPrev->nChainSaplingValue) {
+            saplingValue = *pindexPrev->nChainSaplingValue;
+        } else {
+            monitoring_pool_balances = false;
+        }
+    }
 
-    {
-        LOCK2(cs_main, mempool.cs);
-        CBlockIndex* pindexPrev = chainActive.Tip();
-        const int nHeight = pindexPrev->nHeight + 1;
-        uint32_t consensusBranchId = CurrentEpochBranchId(nHeight, chainparams.GetConsensus());
-        pblock->nTime = GetAdjustedTime();
-        const int64_t nMedianTimePast = pindexPrev->GetMedianTimePast();
-        CCoinsViewCache view(pcoinsTip);
+    fPrintPriority = GetBoolArg("-printpriority", false);
+}
 
-        SaplingMerkleTree sapling_tree;
-        assert(view.GetSaplingAnchorAt(view.GetBestAnchor(SAPLING), sapling_tree));
+bool BlockAssembler::TestAndAddPackage(const std::vector<CTxMemPool::txiter>& sortedEntries, CTxMemPool::txiter& failedIt)
+{
+    // Spend the package in a scratch view, so a failure part way through
+    // leaves the block's view untouched.
+    CCoinsViewCache packageView(&view);
+    SaplingMerkleTree packageTree = sapling_tree;
+    CAmount packageSproutValue = sproutValue;
+    CAmount packageSaplingValue = saplingValue;
+    uint64_t nPackageSize = 0;
+    unsigned int nPackageSigOps = 0;
+    std::vector<CAmount> vTxFees;
+    std::vector<unsigned int> vTxSigOps;
+
+    BOOST_FOREACH(CTxMemPool::txiter it, sortedEntries) {
+        const CTransaction& tx = it->GetTx();
+        failedIt = it;
+
+        if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, nLockTimeCutoff) || IsExpiredTx(tx, nHeight))
+            return false;
+
+        // Size limits
+        unsigned int nTxSize = it->GetTxSize();
+        if (nBlockSize + nPackageSize + nTxSize >= nBlockMaxSize)
+            return false;
+
+        // Legacy limits on sigOps:
+        unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+        if (nBlockSigOps + nPackageSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        if (!packageView.HaveInputs(tx))
+            return false;
+
+        CAmount nTxFees = packageView.GetValueIn(tx)-tx.GetValueOut();
+
+        nTxSigOps += GetP2SHSigOpCount(tx, packageView);
+        if (nBlockSigOps + nPackageSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        // Note that flags: we don't want to set mempool/IsStandard()
+        // policy here, but we still have to ensure that the block we
+        // create only contains transactions that are valid in new blocks.
+        CValidationState state;
+        PrecomputedTransactionData txdata(tx);
+        bool fScriptChecks = !setScriptChecked.count(tx.GetHash());
+        if (!ContextualCheckInputs(tx, state, packageView, fScriptChecks, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata, chainparams.GetConsensus(), consensusBranchId))
+            return false;
+        setScriptChecked.insert(tx.GetHash());
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
+        if (chainparams.ZIP209Enabled() && monitoring_pool_balances) {
+            // Does this transaction lead to a turnstile violation?
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi)
-        {
-            const CTransaction& tx = mi->GetTx();
+            CAmount sproutValueDummy = packageSproutValue;
+            CAmount saplingValueDummy = packageSaplingValue;
 
-            int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
-                                    ? nMedianTimePast
-                                    : pblock->GetBlockTime();
+            saplingValueDummy += -tx.valueBalance;
 
-            if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, nLockTimeCutoff) || IsExpiredTx(tx, nHeight))
-                continue;
+            for (auto js : tx.vjoinsplit) {
+                sproutValueDummy += js.vpub_old;
+                sproutValueDummy -= js.vpub_new;
+            }
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
+            if (sproutValueDummy < 0) {
+                LogPrintf("CreateNewBlock(): tx %s appears to violate Sprout turnstile\n", tx.GetHash().ToString());
+                return false;
+            }
+            if (saplingValueDummy < 0) {
+                LogPrintf("CreateNewBlock(): tx %s appears to violate Sapling turnstile\n", tx.GetHash().ToString());
+                return false;
+            }
 
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx.find(txin.prevout.hash)->GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
+            packageSproutValue = sproutValueDummy;
+            packageSaplingValue = saplingValueDummy;
+        }
 
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
+        UpdateCoins(tx, packageView, nHeight);
 
-                int nConf = nHeight - coins->nHeight;
+        BOOST_FOREACH(const OutputDescription &outDescription, tx.vShieldedOutput) {
+            packageTree.append(outDescription.cm);
+        }
 
-                dPriority += (double)nValueIn * nConf;
-            }
-            nTotalIn += tx.GetShieldedValueIn();
+        nPackageSize += nTxSize;
+        nPackageSigOps += nTxSigOps;
+        vTxFees.push_back(nTxFees);
+        vTxSigOps.push_back(nTxSigOps);
+    }
 
-            if (fMissingInputs) continue;
+    // Every transaction in the package is valid; commit it to the block.
+    packageView.Flush();
+    sapling_tree = packageTree;
+    sproutValue = packageSproutValue;
+    saplingValue = packageSaplingValue;
+
+    for (size_t i = 0; i < sortedEntries.size(); i++) {
+        CTxMemPool::txiter it = sortedEntries[i];
+        pblocktemplate->block.vtx.push_back(it->GetTx());
+        pblocktemplate->vTxFees.push_back(vTxFees[i]);
+        pblocktemplate->vTxSigOps.push_back(vTxSigOps[i]);
+        nBlockSize += it->GetTxSize();
+        ++nBlockTx;
+        nBlockSigOps += vTxSigOps[i];
+        nFees += vTxFees[i];
+        inBlock.insert(it);
+        setBlockTxids.insert(it->GetTx().GetHash());
+
+        if (fPrintPriority)
+        {
+            double dPriority = it->GetPriority(nHeight);
+            CAmount dummy;
+            mempool.ApplyDeltas(it->GetTx().GetHash(), dPriority, dummy);
+            LogPrintf("priority %.1f fee %s txid %s\n",
+                      dPriority,
+                      CFeeRate(it->GetModifiedFee(), it->GetTxSize()).ToString(),
+                      it->GetTx().GetHash().ToString());
+        }
+    }
+    return true;
+}
 
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
+bool BlockAssembler::isStillDependent(CTxMemPool::txiter iter)
+{
+    BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter))
+    {
+        if (!inBlock.count(parent)) {
+            return true;
+        }
+    }
+    return false;
+}
 
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
+void BlockAssembler::addPriorityTxs()
+{
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
 
-            CFeeRate feeRate(nTotalIn-tx.GetValueOut(), nTxSize);
+    if (nBlockPrioritySize == 0) {
+        return;
+    }
+
+    // This vector will be sorted into a priority queue:
+    std::vector<TxCoinAgePriority> vecPriority;
+    TxCoinAgePriorityCompare pricomparer;
+    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+    typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
+    double actualPriority = -1;
+
+    vecPriority.reserve(mempool.mapTx.size());
+    for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
+         mi != mempool.mapTx.end(); ++mi)
+    {
+        double dPriority = mi->GetPriority(nHeight);
+        CAmount dummy;
+        mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+        vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+    }
+    std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+
+    CTxMemPool::txiter iter;
+    while (!vecPriority.empty()) {
+        iter = vecPriority.front().second;
+        actualPriority = vecPriority.front().first;
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+        vecPriority.pop_back();
+
+        // If tx is dependent on other mempool txs which haven't yet been included
+        // then put it in the waitSet
+        if (isStillDependent(iter)) {
+            waitPriMap.insert(std::make_pair(iter, actualPriority));
+            continue;
+        }
+
+        // If this tx fits in the block add it, otherwise keep looping
+        std::vector<CTxMemPool::txiter> single(1, iter);
+        CTxMemPool::txiter failedIt;
+        if (TestAndAddPackage(single, failedIt)) {
+            // If now that this txs is added we've surpassed our desired priority size
+            // or have dropped below the AllowFreeThreshold, then we're done adding priority txs
+            if (nBlockSize >= nBlockPrioritySize || !AllowFree(actualPriority)) {
+                break;
+            }
 
-            if (porphan)
+            // This tx was successfully added, so
+            // add transactions that depend on this one to the priority queue to try again
+            BOOST_FOREACH(CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter))
             {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
+                waitPriIter wpiter = waitPriMap.find(child);
+                if (wpiter != waitPriMap.end()) {
+                    vecPriority.push_back(TxCoinAgePriority(wpiter->second, child));
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                    waitPriMap.erase(wpiter);
+                }
             }
-            else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &(mi->GetTx())));
         }
+    }
+}
+
+bool BlockAssembler::SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set& mapModifiedTx, CTxMemPool::setEntries& failedTx)
+{
+    assert(it != mempool.mapTx.end());
+    return mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it);
+}
 
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        // We want to track the value pool, but if the miner gets
-        // invoked on an old block before the hardcoded fallback
-        // is active we don't want to trip up any assertions. So,
-        // we only adhere to the turnstile (as a miner) if we
-        // actually have all of the information necessary to do
-        // so.
-        CAmount sproutValue = 0;
-        CAmount saplingValue = 0;
-        bool monitoring_pool_balances = true;
-        if (chainparams.ZIP209Enabled()) {
-            if (pindexPrev->nChainSproutValue) {
-                sproutValue = *pindexPrev->nChainSproutValue;
+void BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded,
+                                            indexed_modified_transaction_set& mapModifiedTx)
+{
+    BOOST_FOREACH(const CTxMemPool::txiter it, alreadyAdded) {
+        CTxMemPool::setEntries descendants;
+        mempool.CalculateDescendants(it, descendants);
+        // Insert all descendants (not yet in block) into the modified set
+        BOOST_FOREACH(CTxMemPool::txiter desc, descendants) {
+            if (inBlock.count(desc))
+                continue;
+            modtxiter mit = mapModifiedTx.find(desc);
+            if (mit == mapModifiedTx.end()) {
+                CTxMemPoolModifiedEntry modEntry(desc);
+                modEntry.nSizeWithAncestors -= it->GetTxSize();
+                modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
+                mapModifiedTx.insert(modEntry);
             } else {
-                monitoring_pool_balances = false;
+                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
             }
-            if (pindexPrev->nChainSaplingValue) {
-                saplingValue = *pindexPrev->nChainSaplingValue;
+        }
+    }
+}
+
+void BlockAssembler::addPackageTxs()
+{
+    // mapModifiedTx will store sorted packages after they are modified
+    // because some of their txs are already in the block
+    indexed_modified_transaction_set mapModifiedTx;
+    // Keep track of entries that failed inclusion, to avoid duplicate work
+    CTxMemPool::setEntries failedTx;
+
+    // Start by adding all descendants of previously added txs to mapModifiedTx
+    // and modifying them for their already included ancestors
+    UpdatePackagesForAdded(inBlock, mapModifiedTx);
+
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+    CTxMemPool::txiter iter;
+    while (mi != mempool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty())
+    {
+        // First try to find a new transaction in mapTx to evaluate.
+        if (mi != mempool.mapTx.get<ancestor_score>().end() &&
+                SkipMapTxEntry(mempool.mapTx.project<0>(mi), mapModifiedTx, failedTx)) {
+            ++mi;
+            continue;
+        }
+
+        // Now that mi is not stale, determine which transaction to evaluate:
+        // the next entry from mapTx, or the best from mapModifiedTx?
+        bool fUsingModified = false;
+
+        modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
+        if (mi == mempool.mapTx.get<ancestor_score>().end()) {
+            // We're out of entries in mapTx; use the entry from mapModifiedTx
+            iter = modit->iter;
+            fUsingModified = true;
+        } else {
+            // Try to compare the mapTx entry to the mapModifiedTx entry
+            iter = mempool.mapTx.project<0>(mi);
+            if (modit != mapModifiedTx.get<ancestor_score>().end() &&
+                    CompareModifiedEntry()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                // The best entry in mapModifiedTx has higher score
+                // than the one from mapTx.
+                // Switch which transaction (package) to consider
+                iter = modit->iter;
+                fUsingModified = true;
             } else {
-                monitoring_pool_balances = false;
+                // Either no entry in mapModifiedTx, or it's worse than mapTx.
+                // Increment mi for the next loop iteration.
+                ++mi;
             }
         }
 
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+        // We skip mapTx entries that are inBlock, and mapModifiedTx shouldn't
+        // contain anything that is inBlock.
+        assert(!inBlock.count(iter));
+
+        uint64_t packageSize = iter->GetSizeWithAncestors();
+        CAmount packageFees = iter->GetModFeesWithAncestors();
+        if (fUsingModified) {
+            packageSize = modit->nSizeWithAncestors;
+            packageFees = modit->nModFeesWithAncestors;
+            // Since we always look at the best entry in mapModifiedTx, we
+            // must erase it so that the next best is considered next time.
+            mapModifiedTx.get<ancestor_score>().erase(modit);
+        }
 
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
+        if (packageFees < ::minRelayTxFee.GetFee(packageSize) && nBlockSize >= nBlockMinSize) {
+            // Everything else we might consider has a lower fee rate
+            return;
+        }
 
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+        if (nBlockSize + packageSize >= nBlockMaxSize) {
+            failedTx.insert(iter);
+            continue;
+        }
 
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
+        CTxMemPool::setEntries ancestors;
+        uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+        std::string dummy;
+        mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+
+        // Drop ancestors that are already in the block; a package resting on
+        // a transaction that failed cannot be added either.
+        bool fFailedAncestor = false;
+        for (CTxMemPool::setEntries::iterator ait = ancestors.begin(); ait != ancestors.end(); ) {
+            if (failedTx.count(*ait))
+                fFailedAncestor = true;
+            if (inBlock.count(*ait))
+                ancestors.erase(ait++);
+            else
+                ++ait;
+        }
+        if (fFailedAncestor) {
+            failedTx.insert(iter);
+            continue;
+        }
+        ancestors.insert(iter);
 
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
+        // Sort the entries in a valid order, parents first.
+        std::vector<CTxMemPool::txiter> sortedEntries(ancestors.begin(), ancestors.end());
+        std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
 
-            if (!view.HaveInputs(tx))
-                continue;
+        CTxMemPool::txiter failedIt;
+        if (!TestAndAddPackage(sortedEntries, failedIt)) {
+            failedTx.insert(failedIt);
+            failedTx.insert(iter);
+            continue;
+        }
 
-            CAmount nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
+        // Erase the package from the modified set, and update
+        // transactions that depend on each of these
+        BOOST_FOREACH(CTxMemPool::txiter it, sortedEntries) {
+            mapModifiedTx.erase(it);
+        }
+        UpdatePackagesForAdded(ancestors, mapModifiedTx);
+    }
+}
 
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+bool BlockAssembler::addNewTx(CTxMemPool::txiter iter)
+{
+    if (setBlockTxids.count(iter->GetTx().GetHash()))
+        return true;
+
+    // Below the fee rate the package selection stops at, the transaction
+    // would not have made it into the block either.
+    if (iter->GetModFeesWithAncestors() < ::minRelayTxFee.GetFee(iter->GetSizeWithAncestors()) &&
+            nBlockSize >= nBlockMinSize)
+        return true;
+
+    BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter)) {
+        if (!setBlockTxids.count(parent->GetTx().GetHash()))
+            return false;
+    }
 
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            PrecomputedTransactionData txdata(tx);
-            if (!ContextualCheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata, chainparams.GetConsensus(), consensusBranchId))
-                continue;
+    // With its parents already paid for, only its own fee rate counts.
+    if (iter->GetModifiedFee() < ::minRelayTxFee.GetFee(iter->GetTxSize()) &&
+            nBlockSize >= nBlockMinSize)
+        return true;
 
-            if (chainparams.ZIP209Enabled() && monitoring_pool_balances) {
-                // Does this transaction lead to a turnstile violation?
+    std::vector<CTxMemPool::txiter> single(1, iter);
+    CTxMemPool::txiter failedIt;
+    return TestAndAddPackage(single, failedIt);
+}
 
-                CAmount sproutValueDummy = sproutValue;
-                CAmount saplingValueDummy = saplingValue;
+} // anon namespace
 
-                saplingValueDummy += -tx.valueBalance;
+void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
+{
+    pblock->nTime = std::max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
 
-                for (auto js : tx.vjoinsplit) {
-                    sproutValueDummy += js.vpub_old;
-                    sproutValueDummy -= js.vpub_new;
-                }
+    // Updating time can change work required on testnet:
+    if (consensusParams.nPowAllowMinDifficultyBlocksAfterHeight != boost::none) {
+        pblock->nBits = GetNextWorkRequired(pindexPrev, pblock, consensusParams);
+    }
+}
 
-                if (sproutValueDummy < 0) {
-                    LogPrintf("CreateNewBlock(): tx %s appears to violate Sprout turnstile\n", tx.GetHash().ToString());
-                    continue;
-                }
-                if (saplingValueDummy < 0) {
-                    LogPrintf("CreateNewBlock(): tx %s appears to violate Sapling turnstile\n", tx.GetHash().ToString());
-                    continue;
-                }
+// Start a template on top of pindexPrev with a placeholder coinbase, and
+// return the lock time cutoff its transactions have to be final at.
+static int64_t InitBlockTemplate(const CChainParams& chainparams, CBlockTemplate* pblocktemplate, const CBlockIndex* pindexPrev)
+{
+    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
 
-                sproutValue = sproutValueDummy;
-                saplingValue = saplingValueDummy;
-            }
+    // -regtest only: allow overriding block.nVersion with
+    // -blockversion=N to test forking scenarios
+    if (chainparams.MineBlocksOnDemand())
+        pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
 
-            UpdateCoins(tx, view, nHeight);
+    // Add dummy coinbase tx as first transaction
+    pblock->vtx.push_back(CTransaction());
+    pblocktemplate->vTxFees.push_back(-1); // updated at end
+    pblocktemplate->vTxSigOps.push_back(-1); // updated at end
 
-            BOOST_FOREACH(const OutputDescription &outDescription, tx.vShieldedOutput) {
-                sapling_tree.append(outDescription.cm);
-            }
+    pblock->nTime = GetAdjustedTime();
+    return (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+           ? pindexPrev->GetMedianTimePast()
+           : pblock->GetBlockTime();
+}
 
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+// Fill in the coinbase and the header once the transactions are in place.
+static void FinalizeBlockTemplate(const CChainParams& chainparams, CBlockTemplate* pblocktemplate,
+                                  const CScript& scriptPubKeyIn, const CBlockIndex* pindexPrev,
+                                  CAmount nFees, const SaplingMerkleTree& sapling_tree)
+{
+    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
+    const int nHeight = pindexPrev->nHeight + 1;
+
+    // Create coinbase tx
+    CMutableTransaction txNew = CreateNewContextualCMutableTransaction(chainparams.GetConsensus(), nHeight);
+    txNew.vin.resize(1);
+    txNew.vin[0].prevout.SetNull();
+    txNew.vout.resize(1);
+    txNew.vout[0].scriptPubKey = scriptPubKeyIn;
+    txNew.vout[0].nValue = GetBlockSubsidy(nHeight, chainparams.GetConsensus());
+    // Set to 0 so expiry height does not apply to coinbase txs
+    txNew.nExpiryHeight = 0;
+
+    if ((nHeight > 0) && (nHeight <= chainparams.GetConsensus().GetLastFoundersRewardBlockHeight())) {
+        // Founders reward is 20% of the block subsidy
+        auto vFoundersReward = txNew.vout[0].nValue / 5;
+        // Take some reward away from us
+        txNew.vout[0].nValue -= vFoundersReward;
+
+        // And give it to the founders
+        txNew.vout.push_back(CTxOut(vFoundersReward, chainparams.GetFoundersRewardScriptAtHeight(nHeight)));
+    }
 
-            if (fPrintPriority)
-            {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
+    // Add fees
+    txNew.vout[0].nValue += nFees;
+    txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
+
+    pblock->vtx[0] = txNew;
+    pblocktemplate->vTxFees[0] = -nFees;
+
+    // Randomise nonce
+    arith_uint256 nonce = UintToArith256(GetRandHash());
+    // Clear the top and bottom 16 bits (for local use as thread flags and counters)
+    nonce <<= 32;
+    nonce >>= 16;
+    pblock->nNonce = ArithToUint256(nonce);
+
+    // Fill in header
+    pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
+    pblock->hashFinalSaplingRoot   = sapling_tree.root();
+    UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev);
+    pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, chainparams.GetConsensus());
+    pblock->nSolution.clear();
+    pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
+}
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const CScript& scriptPubKeyIn)
+{
+    // Create new block
+    std::unique_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
+    if(!pblocktemplate.get())
+        return NULL;
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
-        LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
-
-        // Create coinbase tx
-        CMutableTransaction txNew = CreateNewContextualCMutableTransaction(chainparams.GetConsensus(), nHeight);
-        txNew.vin.resize(1);
-        txNew.vin[0].prevout.SetNull();
-        txNew.vout.resize(1);
-        txNew.vout[0].scriptPubKey = scriptPubKeyIn;
-        txNew.vout[0].nValue = GetBlockSubsidy(nHeight, chainparams.GetConsensus());
-        // Set to 0 so expiry height does not apply to coinbase txs
-        txNew.nExpiryHeight = 0;
-
-        if ((nHeight > 0) && (nHeight <= chainparams.GetConsensus().GetLastFoundersRewardBlockHeight())) {
-            // Founders reward is 20% of the block subsidy
-            auto vFoundersReward = txNew.vout[0].nValue / 5;
-            // Take some reward away from us
-            txNew.vout[0].nValue -= vFoundersReward;
-
-            // And give it to the founders
-            txNew.vout.push_back(CTxOut(vFoundersReward, chainparams.GetFoundersRewardScriptAtHeight(nHeight)));
-        }
+    {
+        LOCK2(cs_main, mempool.cs);
+        CBlockIndex* pindexPrev = chainActive.Tip();
+        int64_t nLockTimeCutoff = InitBlockTemplate(chainparams, pblocktemplate.get(), pindexPrev);
+        CCoinsViewCache view(pcoinsTip);
 
-        // Add fees
-        txNew.vout[0].nValue += nFees;
-        txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
+        SaplingMerkleTree sapling_tree;
+        assert(view.GetSaplingAnchorAt(view.GetBestAnchor(SAPLING), sapling_tree));
 
-        pblock->vtx[0] = txNew;
-        pblocktemplate->vTxFees[0] = -nFees;
+        // Collect memory pool transactions into the block
+        BlockAssembler assembler(chainparams, pblocktemplate.get(), view, sapling_tree, pindexPrev, nLockTimeCutoff);
+        assembler.addPriorityTxs();
+        assembler.addPackageTxs();
 
-        // Randomise nonce
-        arith_uint256 nonce = UintToArith256(GetRandHash());
-        // Clear the top and bottom 16 bits (for local use as thread flags and counters)
-        nonce <<= 32;
-        nonce >>= 16;
-        pblock->nNonce = ArithToUint256(nonce);
+        nLastBlockTx = assembler.GetBlockTx();
+        nLastBlockSize = assembler.GetBlockSize();
+        LogPrintf("CreateNewBlock(): total size %u\n", nLastBlockSize);
 
-        // Fill in header
-        pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
-        pblock->hashFinalSaplingRoot   = sapling_tree.root();
-        UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev);
-        pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, chainparams.GetConsensus());
-        pblock->nSolution.clear();
-        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
+        FinalizeBlockTemplate(chainparams, pblocktemplate.get(), scriptPubKeyIn, pindexPrev, assembler.GetFees(), sapling_tree);
 
         CValidationState state;
-        if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false))
+        if (!TestBlockValidity(state, chainparams, pblocktemplate->block, pindexPrev, false, false))
             throw std::runtime_error("CreateNewBlock(): TestBlockValidity failed");
     }
 
     return pblocktemplate.release();
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Template builder
+//
+
+// Everything needed to keep adding to a template: the block's view of the
+// coins and Sapling tree, and the assembler that has been filling it.
+struct CBlockTemplateBuilder::State
+{
+    CBlockIndex* pindexPrev;
+    CScript scriptPubKey;
+    CBlockTemplate blocktemplate;
+    int64_t nLockTimeCutoff;
+    CCoinsViewCache view;
+    SaplingMerkleTree sapling_tree;
+    BlockAssembler assembler;
+
+    State(const CChainParams& chainparams, CBlockIndex* pindexPrevIn, const CScript& scriptPubKeyIn)
+        : pindexPrev(pindexPrevIn), scriptPubKey(scriptPubKeyIn),
+          nLockTimeCutoff(InitBlockTemplate(chainparams, &blocktemplate, pindexPrevIn)),
+          view(pcoinsTip),
+          assembler(chainparams, &blocktemplate, view, sapling_tree, pindexPrevIn, nLockTimeCutoff)
+    {
+        assert(view.GetSaplingAnchorAt(view.GetBestAnchor(SAPLING), sapling_tree));
+    }
+};
+
+CBlockTemplateBuilder::CBlockTemplateBuilder(const CChainParams& _chainparams)
+    : chainparams(_chainparams), fNeedsRebuild(false), nLastRebuild(0)
+{
+}
+
+CBlockTemplateBuilder::~CBlockTemplateBuilder()
+{
+}
+
+bool CBlockTemplateBuilder::Update()
+{
+    LOCK2(cs_main, mempool.cs);
+    LOCK(cs);
+    if (!state || state->pindexPrev != chainActive.Tip())
+        return false;
+    // Placing what could not be appended means assembling the block again,
+    // which is rate limited like the template refresh it replaces.
+    if (fNeedsRebuild && GetTime() - nLastRebuild > 5)
+        return false;
+    if (vPending.empty())
+        return true;
+
+    unsigned int nAdded = 0;
+    BOOST_FOREACH(const uint256& hash, vPending) {
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        if (it == mempool.mapTx.end())
+            continue;
+        unsigned int nTx = state->assembler.GetBlockTx();
+        if (!state->assembler.addNewTx(it))
+            fNeedsRebuild = true;
+        nAdded += state->assembler.GetBlockTx() - nTx;
+    }
+    state->assembler.releaseEntries();
+    vPending.clear();
+
+    if (nAdded > 0) {
+        FinalizeBlockTemplate(chainparams, &state->blocktemplate, state->scriptPubKey, state->pindexPrev,
+                              state->assembler.GetFees(), state->sapling_tree);
+
+        // Appending skips the checks that assembling a whole block ends
+        // with, so check the block before serving it. If it is invalid,
+        // discard it so that the next template is assembled from scratch.
+        CValidationState valstate;
+        if (!TestBlockValidity(valstate, chainparams, state->blocktemplate.block, state->pindexPrev, false, false)) {
+            LogPrintf("CBlockTemplateBuilder::Update(): TestBlockValidity failed: %s\n", valstate.GetRejectReason());
+            state.reset();
+            vPending.clear();
+            return false;
+        }
+
+        nLastBlockTx = state->assembler.GetBlockTx();
+        nLastBlockSize = state->assembler.GetBlockSize();
+        LogPrint("mempool", "CBlockTemplateBuilder: appended %u txs, total size %u\n", nAdded, nLastBlockSize);
+    }
+    return true;
+}
+
+void CBlockTemplateBuilder::Rebuild(const CScript& scriptPubKeyIn)
+{
+    LOCK2(cs_main, mempool.cs);
+    LOCK(cs);
+    // Clear the state first, so a failure leaves nothing to extend.
+    state.reset();
+    vPending.clear();
+    fNeedsRebuild = false;
+    nLastRebuild = GetTime();
+
+    std::unique_ptr<State> stateNew(new State(chainparams, chainActive.Tip(), scriptPubKeyIn));
+    stateNew->assembler.addPriorityTxs();
+    stateNew->assembler.addPackageTxs();
+    stateNew->assembler.releaseEntries();
+
+    nLastBlockTx = stateNew->assembler.GetBlockTx();
+    nLastBlockSize = stateNew->assembler.GetBlockSize();
+    LogPrintf("CBlockTemplateBuilder::Rebuild(): total size %u\n", nLastBlockSize);
+
+    FinalizeBlockTemplate(chainparams, &stateNew->blocktemplate, scriptPubKeyIn, stateNew->pindexPrev,
+                          stateNew->assembler.GetFees(), stateNew->sapling_tree);
+
+    CValidationState valstate;
+    if (!TestBlockValidity(valstate, chainparams, stateNew->blocktemplate.block, stateNew->pindexPrev, false, false))
+        throw std::runtime_error("CBlockTemplateBuilder::Rebuild(): TestBlockValidity failed");
+
+    state.swap(stateNew);
+}
+
+void CBlockTemplateBuilder::GetTemplate(CBlockTemplate& blocktemplate)
+{
+    LOCK(cs);
+    assert(state);
+    blocktemplate = state->blocktemplate;
+}
+
+void CBlockTemplateBuilder::UpdatedBlockTip(const CBlockIndex *pindex)
+{
+    LOCK(cs);
+    // The next request rebuilds on the new tip; drop what was queued for
+    // the old one. The tip may already have been picked up by a rebuild.
+    if (state && state->pindexPrev != pindex) {
+        state.reset();
+        vPending.clear();
+    }
+}
+
+void CBlockTemplateBuilder::SyncTransaction(const CTransaction &tx, const CBlock *pblock)
+{
+    // Only transactions entering the mempool; those in blocks arrive with a
+    // new tip, which discards the template.
+    if (pblock)
+        return;
+    LOCK(cs);
+    if (!state)
+        return;
+    // Nobody may be asking for templates; stop queueing once a rebuild is
+    // due anyway.
+    if (vPending.size() >= MAX_BLOCK_SIZE / 100) {
+        fNeedsRebuild = true;
+        return;
+    }
+    vPending.push_back(tx.GetHash());
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Internal miner
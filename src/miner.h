@@ -7,8 +7,11 @@
 #define BITCOIN_MINER_H
 
 #include "primitives/block.h"
+#include "sync.h"
+#include "validationinterface.h"
 
 #include <boost/optional.hpp>
+#include <memory>
 #include <stdint.h>
 
 class CBlockIndex;
@@ -26,6 +29,53 @@ struct CBlockTemplate
 /** Generate a new block, without valid proof-of-work */
 CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const CScript& scriptPubKeyIn);
 
+/**
+ * Keeps the block template handed out by getblocktemplate between calls.
+ *
+ * Transactions accepted to the mempool are queued as they arrive and
+ * appended to the existing template on the next request, so a request only
+ * does work for what changed since the last one. The template is assembled
+ * from scratch when the tip changes, or at most every few seconds when a
+ * queued transaction cannot simply be appended (its parents are not in the
+ * block, or the block is full). Transactions leaving the mempool without a
+ * new tip (eviction, expiry by age) remain valid, so they are left in the
+ * template until the next rebuild.
+ */
+class CBlockTemplateBuilder : public CValidationInterface
+{
+public:
+    CBlockTemplateBuilder(const CChainParams& chainparams);
+    ~CBlockTemplateBuilder();
+
+    /** Append queued mempool transactions to the template and check it with
+     *  TestBlockValidity. Returns false if the template has to be rebuilt
+     *  instead, including when the check fails. Requires cs_main. */
+    bool Update();
+    /** Assemble the template from scratch on the current tip, paying the
+     *  coinbase to scriptPubKeyIn. Throws if the block is invalid. Requires cs_main. */
+    void Rebuild(const CScript& scriptPubKeyIn);
+    /** Copy the current template. Requires a successful Update() or Rebuild(). */
+    void GetTemplate(CBlockTemplate& blocktemplate);
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex *pindex);
+    void SyncTransaction(const CTransaction &tx, const CBlock *pblock);
+
+private:
+    struct State;
+
+    const CChainParams& chainparams;
+
+    CCriticalSection cs;
+    std::unique_ptr<State> state;
+    std::vector<uint256> vPending;
+    bool fNeedsRebuild;
+    int64_t nLastRebuild;
+};
+
+/** The template builder serving getblocktemplate */
+extern CBlockTemplateBuilder* pblocktemplatebuilder;
+
 #ifdef ENABLE_MINING
 /** Get script for -mineraddress */
 void GetScriptForMinerAddress(boost::shared_ptr<CReserveScript> &script);
@@ -24,7 +24,14 @@
 #include <fcntl.h>
 #endif
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#include <atomic>
+
 #include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
 // Dump addresses to peers.dat every 15 minutes (900s)
@@ -50,6 +57,15 @@ using namespace std;
 namespace {
     const int MAX_OUTBOUND_CONNECTIONS = 8;
 
+    // Upper bound on how long ThreadSocketHandler waits for socket readiness (ms)
+#ifdef WIN32
+    const int SOCKET_HANDLER_IDLE_WAIT = 50; // no Wake() support on Windows
+#else
+    const int SOCKET_HANDLER_IDLE_WAIT = 250;
+#endif
+    // ... and when a node's send/receive state could not be inspected (ms)
+    const int SOCKET_HANDLER_CONTENDED_WAIT = 50;
+
     struct ListenSocket {
         SOCKET socket;
         bool whitelisted;
@@ -96,6 +112,7 @@ CCriticalSection cs_nLastNodeId;
 
 static CSemaphore *semOutbound = NULL;
 static boost::condition_variable messageHandlerCondition;
+static void WakeSocketHandler();
 
 // Signals for message handling
 static CNodeSignals g_signals;
@@ -395,6 +412,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        WakeSocketHandler();
 
         pnode->nTimeConnected = GetTime();
 
@@ -971,6 +989,334 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
     }
 }
 
+/**
+ * Readiness notification for the sockets serviced by ThreadSocketHandler.
+ *
+ * Sockets are registered once and their interest is only updated when it
+ * changes, so waiting costs O(ready sockets) with epoll rather than a full
+ * fd_set rebuild per iteration. poll() is used where epoll is unavailable and
+ * select() on Windows. Other threads interrupt a pending Wait() via Wake().
+ */
+class CSocketEvents
+{
+public:
+    enum {
+        EVENT_RECV = (1 << 0),
+        EVENT_SEND = (1 << 1),
+        EVENT_ERR  = (1 << 2),
+    };
+
+    CSocketEvents();
+    ~CSocketEvents();
+
+    /** Set the events of interest on hSocket for the next Wait(). nOwner is the node id, or -1 for listen sockets. */
+    void Watch(SOCKET hSocket, int64_t nOwner, int nEvents);
+    /** Keep the interest from the previous round on hSocket, or register it for errors only if it is new. */
+    void Retain(SOCKET hSocket, int64_t nOwner);
+    /**
+     * Wait up to nTimeoutMs for readiness and fill mapReady with the events that
+     * fired. Sockets not passed to Watch() or Retain() since the previous call
+     * are unregistered first.
+     */
+    bool Wait(int nTimeoutMs, std::map<SOCKET, int>& mapReady);
+    /** Make a concurrent or subsequent Wait() return early. */
+    void Wake();
+
+private:
+    struct Interest {
+        int64_t nOwner;
+        int nEvents;
+        bool fSeen;
+    };
+    std::map<SOCKET, Interest> mapInterest;
+#ifdef USE_EPOLL
+    int epollfd;
+    std::vector<struct epoll_event> vEpollEvents;
+#endif
+#ifndef WIN32
+    int wakeRead;
+    int wakeWrite;
+#endif
+    std::atomic<bool> fWakePending;
+
+    void DrainWake();
+};
+
+CSocketEvents::CSocketEvents() : fWakePending(false)
+{
+#ifndef WIN32
+    wakeRead = wakeWrite = -1;
+    int fds[2];
+    if (pipe(fds) == 0) {
+        for (int i = 0; i < 2; i++) {
+            fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL, 0) | O_NONBLOCK);
+            fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        }
+        wakeRead = fds[0];
+        wakeWrite = fds[1];
+    } else {
+        LogPrintf("%s: pipe() failed: %s\n", __func__, NetworkErrorString(errno));
+    }
+#endif
+#ifdef USE_EPOLL
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd == -1) {
+        LogPrintf("%s: epoll_create1() failed, using poll(): %s\n", __func__, NetworkErrorString(errno));
+    } else if (wakeRead != -1) {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = wakeRead;
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, wakeRead, &ev);
+    }
+#endif
+}
+
+CSocketEvents::~CSocketEvents()
+{
+#ifdef USE_EPOLL
+    if (epollfd != -1)
+        close(epollfd);
+#endif
+#ifndef WIN32
+    if (wakeRead != -1)
+        close(wakeRead);
+    if (wakeWrite != -1)
+        close(wakeWrite);
+#endif
+}
+
+void CSocketEvents::Watch(SOCKET hSocket, int64_t nOwner, int nEvents)
+{
+    std::map<SOCKET, Interest>::iterator it = mapInterest.find(hSocket);
+    bool fNew = it == mapInterest.end() || it->second.nOwner != nOwner;
+    if (!fNew && it->second.nEvents == nEvents) {
+        it->second.fSeen = true;
+        return;
+    }
+#ifdef USE_EPOLL
+    if (epollfd != -1) {
+        struct epoll_event ev = {};
+        ev.events = ((nEvents & EVENT_RECV) ? EPOLLIN : 0) | ((nEvents & EVENT_SEND) ? EPOLLOUT : 0);
+        ev.data.fd = hSocket;
+        // A descriptor is dropped from the epoll set when it is closed, and the
+        // number may since have been handed out again (possibly to another node),
+        // so fall back between ADD and MOD on the corresponding errors.
+        if (epoll_ctl(epollfd, fNew ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, hSocket, &ev) != 0 &&
+            epoll_ctl(epollfd, errno == EEXIST ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, hSocket, &ev) != 0) {
+            LogPrintf("%s: epoll_ctl() failed for socket %d: %s\n", __func__, hSocket, NetworkErrorString(errno));
+            if (it != mapInterest.end())
+                mapInterest.erase(it);
+            return;
+        }
+    }
+#endif
+    Interest& interest = mapInterest[hSocket];
+    interest.nOwner = nOwner;
+    interest.nEvents = nEvents;
+    interest.fSeen = true;
+}
+
+void CSocketEvents::Retain(SOCKET hSocket, int64_t nOwner)
+{
+    std::map<SOCKET, Interest>::iterator it = mapInterest.find(hSocket);
+    if (it != mapInterest.end() && it->second.nOwner == nOwner)
+        it->second.fSeen = true;
+    else
+        Watch(hSocket, nOwner, EVENT_ERR);
+}
+
+void CSocketEvents::DrainWake()
+{
+#ifndef WIN32
+    char buf[64];
+    while (read(wakeRead, buf, sizeof(buf)) > 0) {}
+    // Cleared after draining: a Wake() racing with this either lands before the
+    // flag is reset (and is satisfied by the Wait() returning now) or writes a
+    // fresh byte that the next Wait() will see.
+    fWakePending = false;
+#endif
+}
+
+void CSocketEvents::Wake()
+{
+#ifndef WIN32
+    if (wakeWrite != -1 && !fWakePending.exchange(true)) {
+        char c = 0;
+        if (write(wakeWrite, &c, 1) != 1) {
+            // The pipe is non-blocking; a full pipe already has a wakeup queued.
+        }
+    }
+#endif
+}
+
+bool CSocketEvents::Wait(int nTimeoutMs, std::map<SOCKET, int>& mapReady)
+{
+    mapReady.clear();
+
+    for (std::map<SOCKET, Interest>::iterator it = mapInterest.begin(); it != mapInterest.end(); ) {
+        if (!it->second.fSeen) {
+#ifdef USE_EPOLL
+            // Usually fails because the socket has already been closed; that is fine.
+            if (epollfd != -1)
+                epoll_ctl(epollfd, EPOLL_CTL_DEL, it->first, NULL);
+#endif
+            mapInterest.erase(it++);
+        } else {
+            it->second.fSeen = false;
+            ++it;
+        }
+    }
+
+#ifdef USE_EPOLL
+    if (epollfd != -1) {
+        vEpollEvents.resize(mapInterest.size() + 1);
+        int nReady = epoll_wait(epollfd, &vEpollEvents[0], vEpollEvents.size(), nTimeoutMs);
+        if (nReady < 0) {
+            if (errno == EINTR)
+                return true;
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+            MilliSleep(nTimeoutMs);
+            return false;
+        }
+        for (int i = 0; i < nReady; i++) {
+            const struct epoll_event& ev = vEpollEvents[i];
+            if (ev.data.fd == wakeRead) {
+                DrainWake();
+                continue;
+            }
+            int nEvents = 0;
+            if (ev.events & EPOLLIN)
+                nEvents |= EVENT_RECV;
+            if (ev.events & EPOLLOUT)
+                nEvents |= EVENT_SEND;
+            if (ev.events & (EPOLLERR | EPOLLHUP))
+                nEvents |= EVENT_ERR;
+            mapReady[ev.data.fd] |= nEvents;
+        }
+        return true;
+    }
+#endif
+
+#ifdef USE_POLL
+    std::vector<struct pollfd> vPollFds;
+    vPollFds.reserve(mapInterest.size() + 1);
+    if (wakeRead != -1) {
+        struct pollfd pfd = {};
+        pfd.fd = wakeRead;
+        pfd.events = POLLIN;
+        vPollFds.push_back(pfd);
+    }
+    for (std::map<SOCKET, Interest>::const_iterator it = mapInterest.begin(); it != mapInterest.end(); ++it) {
+        struct pollfd pfd = {};
+        pfd.fd = it->first;
+        pfd.events = ((it->second.nEvents & EVENT_RECV) ? POLLIN : 0) | ((it->second.nEvents & EVENT_SEND) ? POLLOUT : 0);
+        vPollFds.push_back(pfd);
+    }
+    int nReady = poll(vPollFds.empty() ? NULL : &vPollFds[0], vPollFds.size(), nTimeoutMs);
+    if (nReady < 0) {
+        if (errno == EINTR)
+            return true;
+        LogPrintf("socket poll error %s\n", NetworkErrorString(errno));
+        MilliSleep(nTimeoutMs);
+        return false;
+    }
+    for (size_t i = 0; i < vPollFds.size() && nReady > 0; i++) {
+        const struct pollfd& pfd = vPollFds[i];
+        if (pfd.revents == 0)
+            continue;
+        nReady--;
+        if (pfd.fd == wakeRead) {
+            DrainWake();
+            continue;
+        }
+        int nEvents = 0;
+        if (pfd.revents & POLLIN)
+            nEvents |= EVENT_RECV;
+        if (pfd.revents & POLLOUT)
+            nEvents |= EVENT_SEND;
+        if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+            nEvents |= EVENT_ERR;
+        mapReady[pfd.fd] |= nEvents;
+    }
+    return true;
+#else
+    struct timeval timeout;
+    timeout.tv_sec  = nTimeoutMs / 1000;
+    timeout.tv_usec = (nTimeoutMs % 1000) * 1000;
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+#ifndef WIN32
+    if (wakeRead != -1) {
+        FD_SET(wakeRead, &fdsetRecv);
+        hSocketMax = wakeRead;
+        have_fds = true;
+    }
+#endif
+    for (std::map<SOCKET, Interest>::const_iterator it = mapInterest.begin(); it != mapInterest.end(); ++it) {
+        if (it->second.nEvents & EVENT_RECV)
+            FD_SET(it->first, &fdsetRecv);
+        if (it->second.nEvents & EVENT_SEND)
+            FD_SET(it->first, &fdsetSend);
+        FD_SET(it->first, &fdsetError);
+        hSocketMax = max(hSocketMax, it->first);
+        have_fds = true;
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+        }
+        MilliSleep(nTimeoutMs);
+        return false;
+    }
+
+#ifndef WIN32
+    if (wakeRead != -1 && FD_ISSET(wakeRead, &fdsetRecv))
+        DrainWake();
+#endif
+    for (std::map<SOCKET, Interest>::const_iterator it = mapInterest.begin(); it != mapInterest.end(); ++it) {
+        int nEvents = 0;
+        if (FD_ISSET(it->first, &fdsetRecv))
+            nEvents |= EVENT_RECV;
+        if (FD_ISSET(it->first, &fdsetSend))
+            nEvents |= EVENT_SEND;
+        if (FD_ISSET(it->first, &fdsetError))
+            nEvents |= EVENT_ERR;
+        if (nEvents)
+            mapReady[it->first] = nEvents;
+    }
+    return true;
+#endif
+}
+
+static boost::scoped_ptr<CSocketEvents> socketEvents;
+
+static void WakeSocketHandler()
+{
+    if (socketEvents)
+        socketEvents->Wake();
+}
+
+/** Whether pnode's receive buffer is too full to read more from its socket (cs_vRecvMsg must be held). */
+static bool IsReceiveFlooded(CNode* pnode)
+{
+    return !pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete() &&
+           pnode->GetTotalRecvSize() > ReceiveFloodSize();
+}
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
@@ -1042,43 +1388,25 @@ void ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
+        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+            socketEvents->Watch(hListenSocket.socket, -1, CSocketEvents::EVENT_RECV);
 
+        bool fContended = false;
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodes)
             {
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
 
                 // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
+                // * If there is data to send, wait for the socket to become writable. As
+                //   this only happens when optimistic write failed, we choose to first
+                //   drain the write buffer in this case before receiving more. This avoids
                 //   needlessly queueing received data, if the remote peer is not themselves
                 //   receiving data. This means properly utilizing TCP flow control signaling.
                 // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
+                //   or there is space left in the buffer, wait for data to be received.
                 // * (if neither of the above applies, there is certainly one message
                 //   in the receiver buffer ready to be processed).
                 // Together, that means that at least one of the following is always possible,
@@ -1086,47 +1414,44 @@ void ThreadSocketHandler()
                 // * We send some data.
                 // * We wait for data to be received (and disconnect after timeout).
                 // * We process a message in the buffer (message handler thread).
+                // Errors are always of interest. When another thread holds one of the
+                // locks we cannot tell, so keep the socket registered for errors only
+                // and come back soon rather than spinning on a readiness we can't act on.
+                int nEvents = CSocketEvents::EVENT_ERR;
+                bool fKnown = true;
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
+                    if (!lockSend)
+                        fKnown = false;
+                    else if (!pnode->vSendMsg.empty())
+                        nEvents |= CSocketEvents::EVENT_SEND;
                 }
+                if (!(nEvents & CSocketEvents::EVENT_SEND))
                 {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
+                    if (!lockRecv)
+                        fKnown = false;
+                    else if (!IsReceiveFlooded(pnode))
+                        nEvents |= CSocketEvents::EVENT_RECV;
                 }
+                fContended |= !fKnown;
+                socketEvents->Watch(pnode->hSocket, pnode->id, nEvents);
             }
         }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        // Without contention, nothing but readiness or a Wake() (new outbound node,
+        // queued send data, drained receive buffer) needs the loop to run early;
+        // the timeout only bounds disconnect and inactivity handling latency.
+        std::map<SOCKET, int> mapReady;
+        socketEvents->Wait(fContended ? SOCKET_HANDLER_CONTENDED_WAIT : SOCKET_HANDLER_IDLE_WAIT, mapReady);
         boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
-        }
-
         //
         // Accept new connections
         //
         BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            if (hListenSocket.socket != INVALID_SOCKET && mapReady.count(hListenSocket.socket))
             {
                 AcceptConnection(hListenSocket);
             }
@@ -1151,7 +1476,9 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            std::map<SOCKET, int>::const_iterator itReady = mapReady.find(pnode->hSocket);
+            int nReady = itReady == mapReady.end() ? 0 : itReady->second;
+            if (nReady & (CSocketEvents::EVENT_RECV | CSocketEvents::EVENT_ERR))
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
@@ -1195,7 +1522,7 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (nReady & CSocketEvents::EVENT_SEND)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
@@ -1556,8 +1883,13 @@ void ThreadMessageHandler()
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
                 {
+                    bool fFlooded = IsReceiveFlooded(pnode);
                     if (!g_signals.ProcessMessages(pnode))
                         pnode->CloseSocketDisconnect();
+                    // The socket handler stopped reading from this peer; tell it
+                    // there is room again.
+                    if (fFlooded && !IsReceiveFlooded(pnode))
+                        WakeSocketHandler();
 
                     if (pnode->nSendSize < SendBufferSize())
                     {
@@ -1779,6 +2111,7 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
         threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "dnsseed", &ThreadDNSAddressSeed));
 
     // Send and receive from sockets, accept connections
+    socketEvents.reset(new CSocketEvents());
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
     // Initiate outbound connections from -addnode
@@ -2210,8 +2543,12 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
     nSendSize += (*it).size();
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (it == vSendMsg.begin()) {
         SocketSendData(this);
+        // Whatever didn't fit now needs the socket handler to wait for writability
+        if (!vSendMsg.empty())
+            WakeSocketHandler();
+    }
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
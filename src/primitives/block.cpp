@@ -5,6 +5,7 @@
 
 #include "primitives/block.h"
 
+#include "crypto/sha256.h"
 #include "hash.h"
 #include "tinyformat.h"
 #include "utilstrencodings.h"
@@ -60,15 +61,20 @@ uint256 CBlock::BuildMerkleTree(bool* fMutated) const
     bool mutated = false;
     for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
     {
-        for (int i = 0; i < nSize; i += 2)
-        {
-            int i2 = std::min(i+1, nSize-1);
-            if (i2 == i + 1 && i2 + 1 == nSize && vMerkleTree[j+i] == vMerkleTree[j+i2]) {
-                // Two identical hashes at the end of the list at a particular level.
-                mutated = true;
-            }
-            vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                       BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
+        if (nSize % 2 == 0 && vMerkleTree[j+nSize-2] == vMerkleTree[j+nSize-1]) {
+            // Two identical hashes at the end of the list at a particular level.
+            mutated = true;
+        }
+        // Each pair of adjacent hashes is the 64-byte input for a node of the
+        // next level, so hash all complete pairs of the level in one batch.
+        int nPairs = nSize / 2;
+        size_t nOut = vMerkleTree.size();
+        vMerkleTree.resize(nOut + (nSize + 1) / 2);
+        SHA256D64(vMerkleTree[nOut].begin(), vMerkleTree[j].begin(), nPairs);
+        if (nSize % 2 == 1) {
+            // An odd hash at the end is paired with itself.
+            const uint256& last = vMerkleTree[j+nSize-1];
+            vMerkleTree[nOut+nPairs] = Hash(BEGIN(last), END(last), BEGIN(last), END(last));
         }
         j += nSize;
     }
@@ -13,12 +13,15 @@
 #include "rpc/server.h"
 #include "streams.h"
 #include "sync.h"
+#include "txdb.h"
 #include "util.h"
 
 #include <stdint.h>
 
 #include <univalue.h>
 
+#include <boost/filesystem.hpp>
+
 #include <regex>
 
 using namespace std;
@@ -112,7 +115,7 @@ UniValue blockheaderToJSON(const CBlockIndex* blockindex)
     result.push_back(Pair("finalsaplingroot", blockindex->hashFinalSaplingRoot.GetHex()));
     result.push_back(Pair("time", (int64_t)blockindex->nTime));
     result.push_back(Pair("nonce", blockindex->nNonce.GetHex()));
-    result.push_back(Pair("solution", HexStr(blockindex->nSolution)));
+    result.push_back(Pair("solution", HexStr(blockindex->GetSolution())));
     result.push_back(Pair("bits", strprintf("%08x", blockindex->nBits)));
     result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
     result.push_back(Pair("chainwork", blockindex->nChainWork.GetHex()));
@@ -240,6 +243,12 @@ UniValue mempoolToJSON(bool fVerbose = false)
             info.push_back(Pair("height", (int)e.GetHeight()));
             info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
             info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
+            info.push_back(Pair("descendantcount", e.GetCountWithDescendants()));
+            info.push_back(Pair("descendantsize", e.GetSizeWithDescendants()));
+            info.push_back(Pair("descendantfees", e.GetModFeesWithDescendants()));
+            info.push_back(Pair("ancestorcount", e.GetCountWithAncestors()));
+            info.push_back(Pair("ancestorsize", e.GetSizeWithAncestors()));
+            info.push_back(Pair("ancestorfees", e.GetModFeesWithAncestors()));
             const CTransaction& tx = e.GetTx();
             set<string> setDepends;
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
@@ -294,6 +303,12 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
             "    \"height\" : n,           (numeric) block height when transaction entered pool\n"
             "    \"startingpriority\" : n, (numeric) priority when transaction entered pool\n"
             "    \"currentpriority\" : n,  (numeric) transaction priority now\n"
+            "    \"descendantcount\" : n,  (numeric) number of in-mempool descendant transactions (including this one)\n"
+            "    \"descendantsize\" : n,   (numeric) size of in-mempool descendants (including this one)\n"
+            "    \"descendantfees\" : n,   (numeric) fees in zatoshis of in-mempool descendants, with prioritisetransaction deltas (including this one)\n"
+            "    \"ancestorcount\" : n,    (numeric) number of in-mempool ancestor transactions (including this one)\n"
+            "    \"ancestorsize\" : n,     (numeric) size of in-mempool ancestors (including this one)\n"
+            "    \"ancestorfees\" : n,     (numeric) fees in zatoshis of in-mempool ancestors, with prioritisetransaction deltas (including this one)\n"
             "    \"depends\" : [           (array) unconfirmed transactions used as inputs for this transaction\n"
             "        \"transactionid\",    (string) parent transaction id\n"
             "       ... ]\n"
@@ -338,6 +353,81 @@ UniValue getblockhash(const UniValue& params, bool fHelp)
     return pblockindex->GetBlockHash().GetHex();
 }
 
+// insightexplorer
+UniValue getblockhashes(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() < 2 || params.size() > 3)
+        throw runtime_error(
+            "getblockhashes high low ( {\"noOrphans\": true|false, \"logicalTimes\": true|false} )\n"
+            "\nReturns array of hashes of blocks within the timestamp range provided,\n"
+            "\ngreater or equal to low, less than high (requires -insightexplorer).\n"
+            "\nArguments:\n"
+            "1. high                            (numeric, required) The newer block timestamp\n"
+            "2. low                             (numeric, required) The older block timestamp\n"
+            "3. options                         (string, optional) A json object\n"
+            "    {\n"
+            "      \"noOrphans\":true|false      (boolean) will only include blocks on the main chain\n"
+            "      \"logicalTimes\":true|false   (boolean) will include logical timestamps with hashes\n"
+            "    }\n"
+            "\nResult:\n"
+            "[\n"
+            "  \"hash\"         (string) The block hash\n"
+            "]\n"
+            "[\n"
+            "  {\n"
+            "    \"blockhash\": (string) The block hash\n"
+            "    \"logicalts\": (numeric) The logical timestamp\n"
+            "  }\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockhashes", "1558141697 1558141576")
+            + HelpExampleRpc("getblockhashes", "1558141697, 1558141576")
+            + HelpExampleCli("getblockhashes", "1558141697 1558141576 '{\"noOrphans\":false, \"logicalTimes\":true}'")
+            );
+
+    if (!fTimestampIndex) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Timestamp index not enabled (requires -insightexplorer)");
+    }
+
+    unsigned int high = params[0].get_int();
+    unsigned int low = params[1].get_int();
+    bool fActiveOnly = false;
+    bool fLogicalTS = false;
+
+    if (params.size() > 2) {
+        UniValue noOrphans = find_value(params[2].get_obj(), "noOrphans");
+        if (!noOrphans.isNull()) {
+            fActiveOnly = noOrphans.get_bool();
+        }
+        UniValue returnLogical = find_value(params[2].get_obj(), "logicalTimes");
+        if (!returnLogical.isNull()) {
+            fLogicalTS = returnLogical.get_bool();
+        }
+    }
+
+    std::vector<std::pair<uint256, unsigned int> > blockHashes;
+    {
+        LOCK(cs_main);
+        if (!GetTimestampIndex(high, low, fActiveOnly, blockHashes)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY,
+                "No information available for block hashes");
+        }
+    }
+
+    UniValue result(UniValue::VARR);
+    for (const auto& it : blockHashes) {
+        if (fLogicalTS) {
+            UniValue item(UniValue::VOBJ);
+            item.push_back(Pair("blockhash", it.first.GetHex()));
+            item.push_back(Pair("logicalts", (int)it.second));
+            result.push_back(item);
+        } else {
+            result.push_back(it.first.GetHex());
+        }
+    }
+    return result;
+}
+
 UniValue getblockheader(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -545,6 +635,79 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
     return ret;
 }
 
+UniValue dumptxoutset(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset \"path\"\n"
+            "\nWrites the unspent transaction output set, the Sprout and Sapling anchors and nullifiers,\n"
+            "and the block index of the active chain to a snapshot file that can be loaded with -loadsnapshot.\n"
+            "Note this call may take some time, and blocks are not connected while the block index is written.\n"
+            "\nArguments:\n"
+            "1. \"path\"     (string, required) The file to write, relative to the data directory if not absolute\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"path\": \"path\",           (string) the absolute path of the snapshot\n"
+            "  \"base_hash\": \"hex\",       (string) the hash of the block at which the snapshot was taken\n"
+            "  \"base_height\": n,          (numeric) the height of that block\n"
+            "  \"transactions\": n,         (numeric) the number of transactions with unspent outputs\n"
+            "  \"coins_written\": n,        (numeric) the number of unspent outputs\n"
+            "  \"sprout_anchors\": n,       (numeric) the number of Sprout anchors\n"
+            "  \"sapling_anchors\": n,      (numeric) the number of Sapling anchors\n"
+            "  \"sprout_nullifiers\": n,    (numeric) the number of Sprout nullifiers\n"
+            "  \"sapling_nullifiers\": n,   (numeric) the number of Sapling nullifiers\n"
+            "  \"snapshot_hash\": \"hex\"    (string) the hash committing to the contents of the snapshot\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumptxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("dumptxoutset", "\"utxo.dat\"")
+        );
+
+    boost::filesystem::path path = boost::filesystem::absolute(params[0].get_str(), GetDataDir());
+    // Write to a temporary file, so that an interrupted dump is never mistaken for a snapshot.
+    boost::filesystem::path temppath = path.string() + ".incomplete";
+    if (boost::filesystem::exists(path)) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists");
+    }
+
+    CAutoFile fileout(fopen(temppath.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull()) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Unable to open " + temppath.string() + " for writing");
+    }
+
+    CSnapshotMetadata metadata;
+    CSnapshotStats stats;
+    uint256 hashSnapshot;
+    bool fWritten = false;
+    try {
+        fWritten = DumpUTXOSnapshot(fileout, metadata, stats, hashSnapshot);
+        if (fWritten) {
+            FileCommit(fileout.Get());
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+    }
+    fileout.fclose();
+    if (!fWritten) {
+        boost::filesystem::remove(temppath);
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to write UTXO snapshot");
+    }
+    boost::filesystem::rename(temppath, path);
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("path", path.string()));
+    ret.push_back(Pair("base_hash", metadata.hashBlock.GetHex()));
+    ret.push_back(Pair("base_height", metadata.nHeight));
+    ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
+    ret.push_back(Pair("coins_written", (int64_t)stats.nCoins));
+    ret.push_back(Pair("sprout_anchors", (int64_t)stats.nSproutAnchors));
+    ret.push_back(Pair("sapling_anchors", (int64_t)stats.nSaplingAnchors));
+    ret.push_back(Pair("sprout_nullifiers", (int64_t)stats.nSproutNullifiers));
+    ret.push_back(Pair("sapling_nullifiers", (int64_t)stats.nSaplingNullifiers));
+    ret.push_back(Pair("snapshot_hash", hashSnapshot.GetHex()));
+    return ret;
+}
+
 UniValue gettxout(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -570,7 +733,6 @@ UniValue gettxout(const UniValue& params, bool fHelp)
             "        ,...\n"
             "     ]\n"
             "  },\n"
-            "  \"version\" : n,              (numeric) The version\n"
             "  \"coinbase\" : true|false     (boolean) Coinbase or not\n"
             "}\n"
 
@@ -594,33 +756,32 @@ UniValue gettxout(const UniValue& params, bool fHelp)
     if (params.size() > 2)
         fMempool = params[2].get_bool();
 
-    CCoins coins;
+    COutPoint out(hash, n);
+    Coin coin;
     if (fMempool) {
         LOCK(mempool.cs);
         CCoinsViewMemPool view(pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
+        if (!view.GetCoin(out, coin) || mempool.isSpent(out)) {
             return NullUniValue;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
+        }
     } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
+        if (!pcoinsTip->GetCoin(out, coin)) {
             return NullUniValue;
+        }
     }
-    if (n<0 || (unsigned int)n>=coins.vout.size() || coins.vout[n].IsNull())
-        return NullUniValue;
 
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     CBlockIndex *pindex = it->second;
     ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
-    if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
+    if (coin.nHeight == MEMPOOL_HEIGHT)
         ret.push_back(Pair("confirmations", 0));
     else
-        ret.push_back(Pair("confirmations", pindex->nHeight - coins.nHeight + 1));
-    ret.push_back(Pair("value", ValueFromAmount(coins.vout[n].nValue)));
+        ret.push_back(Pair("confirmations", (int64_t)(pindex->nHeight - coin.nHeight + 1)));
+    ret.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
     UniValue o(UniValue::VOBJ);
-    ScriptPubKeyToJSON(coins.vout[n].scriptPubKey, o, true);
+    ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
     ret.push_back(Pair("scriptPubKey", o));
-    ret.push_back(Pair("version", coins.nVersion));
-    ret.push_back(Pair("coinbase", coins.fCoinBase));
+    ret.push_back(Pair("coinbase", (bool)coin.fCoinBase));
 
     return ret;
 }
@@ -928,6 +1089,10 @@ UniValue mempoolInfoToJSON()
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
     ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    size_t maxmempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    ret.push_back(Pair("maxmempool", (int64_t) maxmempool));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(maxmempool).GetFeePerK())));
+    ret.push_back(Pair("mempoolexpiry", GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY)));
 
     return ret;
 }
@@ -943,6 +1108,9 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
             "  \"usage\": xxxxx               (numeric) Total memory usage for the mempool\n"
+            "  \"maxmempool\": xxxxx          (numeric) Maximum memory usage for the mempool\n"
+            "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee rate in " + CURRENCY_UNIT + "/kB for a transaction to be accepted\n"
+            "  \"mempoolexpiry\": xxxxx       (numeric) Hours after which an unmined transaction is dropped from the mempool\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmempoolinfo", "")
@@ -1032,11 +1200,13 @@ UniValue reconsiderblock(const UniValue& params, bool fHelp)
 static const CRPCCommand commands[] =
 { //  category              name                      actor (function)         okSafeMode
   //  --------------------- ------------------------  -----------------------  ----------
+    { "blockchain",         "dumptxoutset",           &dumptxoutset,           true  },
     { "blockchain",         "getblockchaininfo",      &getblockchaininfo,      true  },
     { "blockchain",         "getbestblockhash",       &getbestblockhash,       true  },
     { "blockchain",         "getblockcount",          &getblockcount,          true  },
     { "blockchain",         "getblock",               &getblock,               true  },
     { "blockchain",         "getblockhash",           &getblockhash,           true  },
+    { "blockchain",         "getblockhashes",         &getblockhashes,         true  },
     { "blockchain",         "getblockheader",         &getblockheader,         true  },
     { "blockchain",         "getchaintips",           &getchaintips,           true  },
     { "blockchain",         "getdifficulty",          &getdifficulty,          true  },
@@ -47,6 +47,9 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "getbalance", 1 },
     { "getbalance", 2 },
     { "getblockhash", 0 },
+    { "getblockhashes", 0 },
+    { "getblockhashes", 1 },
+    { "getblockhashes", 2 },
     { "move", 2 },
     { "move", 3 },
     { "sendfrom", 2 },
@@ -74,6 +77,13 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "getblockheader", 1 },
     { "gettransaction", 1 },
     { "getrawtransaction", 1 },
+    // insightexplorer
+    { "getaddressbalance", 0 },
+    { "getaddressdeltas", 0 },
+    { "getaddressmempool", 0 },
+    { "getaddresstxids", 0 },
+    { "getaddressutxos", 0 },
+    { "getspentinfo", 0 },
     { "createrawtransaction", 0 },
     { "createrawtransaction", 1 },
     { "createrawtransaction", 2 },
@@ -105,6 +115,8 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "zcrawjoinsplit", 4 },
     { "zcbenchmark", 1 },
     { "zcbenchmark", 2 },
+    { "zcbenchmark", 3 },
+    { "zcbenchmark", 4 },
     { "getblocksubsidy", 0},
     { "z_listaddresses", 0},
     { "z_listreceivedbyaddress", 1},
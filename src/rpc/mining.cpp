@@ -585,28 +585,12 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
         // TODO: Maybe recheck connections/IBD and (if something wrong) send an expires-immediately template to stop miners?
     }
 
-    // Update block
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static CBlockTemplate* pblocktemplate;
-    if (pindexPrev != chainActive.Tip() ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+    // Update block: queued mempool transactions are appended to the
+    // template, which is only assembled again for a new tip or when an
+    // appended transaction does not fit.
+    assert(pblocktemplatebuilder);
+    if (!pblocktemplatebuilder->Update())
     {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = NULL;
-
-        // Store the pindexBest used before CreateNewBlockWithKey, to avoid races
-        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrevNew = chainActive.Tip();
-        nStart = GetTime();
-
-        // Create new block
-        if(pblocktemplate)
-        {
-            delete pblocktemplate;
-            pblocktemplate = NULL;
-        }
-
         boost::shared_ptr<CReserveScript> coinbaseScript;
         GetMainSignals().ScriptForMining(coinbaseScript);
 
@@ -614,16 +598,16 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
         if (!coinbaseScript->reserveScript.size())
             throw JSONRPCError(RPC_INTERNAL_ERROR, "No coinbase script available (mining requires a wallet or -mineraddress)");
 
-        pblocktemplate = CreateNewBlock(Params(), coinbaseScript->reserveScript);
-        if (!pblocktemplate)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+        pblocktemplatebuilder->Rebuild(coinbaseScript->reserveScript);
 
         // Mark script as important because it was used at least for one coinbase output
         coinbaseScript->KeepScript();
-
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
     }
+    nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    CBlockTemplate blocktemplate;
+    pblocktemplatebuilder->GetTemplate(blocktemplate);
+    CBlockTemplate* pblocktemplate = &blocktemplate;
     CBlock* pblock = &pblocktemplate->block; // pointer for convenience
 
     // Update nTime
@@ -17,6 +17,7 @@
 #include "wallet/walletdb.h"
 #endif
 
+#include <set>
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp>
@@ -452,6 +453,527 @@ UniValue verifymessage(const UniValue& params, bool fHelp)
     return (pubkey.GetID() == *keyID);
 }
 
+// insightexplorer
+static bool getAddressFromIndex(int type, const uint160 &hash, std::string &address)
+{
+    if (type == CScript::P2SH) {
+        address = EncodeDestination(CScriptID(hash));
+    } else if (type == CScript::P2PKH) {
+        address = EncodeDestination(CKeyID(hash));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// insightexplorer
+// Returns the RIPEMD-160 hash and the index script type of a transparent address.
+static bool getIndexKey(const std::string& str, uint160& hashBytes, int& type)
+{
+    CTxDestination dest = DecodeDestination(str);
+    if (!IsValidDestination(dest)) {
+        return false;
+    }
+    if (const CKeyID *keyID = boost::get<CKeyID>(&dest)) {
+        hashBytes = *keyID;
+        type = CScript::P2PKH;
+        return true;
+    }
+    if (const CScriptID *scriptID = boost::get<CScriptID>(&dest)) {
+        hashBytes = *scriptID;
+        type = CScript::P2SH;
+        return true;
+    }
+    return false;
+}
+
+// insightexplorer
+// The first parameter of the address RPCs is either a single address or an
+// object with an "addresses" array.
+static void getAddressesFromParams(const UniValue& params, std::vector<std::pair<uint160, int> > &addresses)
+{
+    std::vector<UniValue> values;
+    if (params[0].isStr()) {
+        values.push_back(params[0]);
+    } else if (params[0].isObject()) {
+        UniValue addressValues = find_value(params[0].get_obj(), "addresses");
+        if (!addressValues.isArray()) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Addresses is expected to be an array");
+        }
+        values = addressValues.getValues();
+    } else {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
+    }
+
+    for (const UniValue& value : values) {
+        if (!value.isStr()) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
+        }
+        uint160 hashBytes;
+        int type = 0;
+        if (!getIndexKey(value.get_str(), hashBytes, type)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
+        }
+        addresses.push_back(std::make_pair(hashBytes, type));
+    }
+}
+
+// insightexplorer
+// Reads the optional "start" and "end" block heights (inclusive) from the
+// options object; zero means unbounded.
+static void getHeightRange(const UniValue& params, int& start, int& end)
+{
+    start = 0;
+    end = 0;
+    if (!params[0].isObject()) {
+        return;
+    }
+    UniValue startValue = find_value(params[0].get_obj(), "start");
+    UniValue endValue = find_value(params[0].get_obj(), "end");
+    if (!startValue.isNull()) {
+        start = startValue.get_int();
+    }
+    if (!endValue.isNull()) {
+        end = endValue.get_int();
+    }
+    if (start < 0 || end < 0) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Start and end must be non-negative");
+    }
+    if (start > 0 && end > 0 && end < start) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "End value is expected to be greater than start");
+    }
+}
+
+static bool getChainInfoFlag(const UniValue& params)
+{
+    if (!params[0].isObject()) {
+        return false;
+    }
+    UniValue chainInfo = find_value(params[0].get_obj(), "chainInfo");
+    return chainInfo.isBool() && chainInfo.get_bool();
+}
+
+static void checkAddressIndexEnabled()
+{
+    if (!fAddressIndex) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled (requires -insightexplorer)");
+    }
+}
+
+static void getAddressIndexEntries(
+    const std::vector<std::pair<uint160, int> > &addresses, int start, int end,
+    std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex)
+{
+    for (const auto& it : addresses) {
+        if (!GetAddressIndex(it.first, it.second, addressIndex, start, end)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+        }
+    }
+}
+
+static const std::string addressesHelp =
+    "1. {\n"
+    "     \"addresses\":\n"
+    "       [\n"
+    "         \"taddr\"  (string) The base58check encoded address\n"
+    "         ,...\n"
+    "       ]\n";
+
+UniValue getaddressbalance(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance {\"addresses\": [\"taddr\", ...]}\n"
+            "\nReturns the balance for addresses (requires -insightexplorer).\n"
+            "\nArguments:\n"
+            + addressesHelp +
+            "   }\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"balance\"   (numeric) The current balance in zatoshis\n"
+            "  \"received\"  (numeric) The total number of zatoshis received (including change)\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressbalance", "'{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"]}'")
+            + HelpExampleRpc("getaddressbalance", "{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"]}")
+        );
+
+    checkAddressIndexEnabled();
+
+    std::vector<std::pair<uint160, int> > addresses;
+    getAddressesFromParams(params, addresses);
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    {
+        LOCK(cs_main);
+        getAddressIndexEntries(addresses, 0, 0, addressIndex);
+    }
+
+    CAmount balance = 0;
+    CAmount received = 0;
+    for (const auto& it : addressIndex) {
+        if (it.second > 0) {
+            received += it.second;
+        }
+        balance += it.second;
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("balance", balance));
+    result.push_back(Pair("received", received));
+    return result;
+}
+
+UniValue getaddressdeltas(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1 || !params[0].isObject())
+        throw runtime_error(
+            "getaddressdeltas {\"addresses\": [\"taddr\", ...], \"start\": n, \"end\": n, \"chainInfo\": true|false}\n"
+            "\nReturns all changes for an address (requires -insightexplorer).\n"
+            "Large histories can be paged through with successive height ranges.\n"
+            "\nArguments:\n"
+            + addressesHelp +
+            "     \"start\"     (number, optional) The start block height\n"
+            "     \"end\"       (number, optional) The end block height\n"
+            "     \"chainInfo\" (boolean, optional, default=false) Include chain info in results\n"
+            "   }\n"
+            "\nResult (if chainInfo is false):\n"
+            "[\n"
+            "  {\n"
+            "    \"satoshis\"    (number) The difference of zatoshis\n"
+            "    \"txid\"        (string) The related txid\n"
+            "    \"index\"       (number) The related input or output index\n"
+            "    \"blockindex\"  (number) The transaction index within the block\n"
+            "    \"height\"      (number) The block height\n"
+            "    \"address\"     (string) The base58check encoded address\n"
+            "  }, ...\n"
+            "]\n"
+            "\nResult (if chainInfo is true):\n"
+            "{\n"
+            "  \"deltas\": [ ... ],  (array) As above\n"
+            "  \"start\": { \"hash\": \"hash\", \"height\": n },  (object) The start block\n"
+            "  \"end\": { \"hash\": \"hash\", \"height\": n }     (object) The end block\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressdeltas", "'{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"], \"start\": 1000, \"end\": 2000}'")
+            + HelpExampleRpc("getaddressdeltas", "{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"], \"start\": 1000, \"end\": 2000}")
+        );
+
+    checkAddressIndexEnabled();
+
+    int start = 0;
+    int end = 0;
+    getHeightRange(params, start, end);
+    bool fChainInfo = getChainInfoFlag(params);
+
+    std::vector<std::pair<uint160, int> > addresses;
+    getAddressesFromParams(params, addresses);
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    UniValue result(UniValue::VOBJ);
+    {
+        LOCK(cs_main);
+        getAddressIndexEntries(addresses, start, end, addressIndex);
+
+        if (fChainInfo) {
+            int startHeight = start > 0 ? start : 0;
+            int endHeight = end > 0 ? end : chainActive.Height();
+            if (startHeight > chainActive.Height() || endHeight > chainActive.Height()) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Start or end is outside chain range");
+            }
+            UniValue startInfo(UniValue::VOBJ);
+            startInfo.push_back(Pair("hash", chainActive[startHeight]->GetBlockHash().GetHex()));
+            startInfo.push_back(Pair("height", startHeight));
+            UniValue endInfo(UniValue::VOBJ);
+            endInfo.push_back(Pair("hash", chainActive[endHeight]->GetBlockHash().GetHex()));
+            endInfo.push_back(Pair("height", endHeight));
+            result.push_back(Pair("start", startInfo));
+            result.push_back(Pair("end", endInfo));
+        }
+    }
+
+    UniValue deltas(UniValue::VARR);
+    for (const auto& it : addressIndex) {
+        std::string address;
+        if (!getAddressFromIndex(it.first.type, it.first.hashBytes, address)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
+        }
+        UniValue delta(UniValue::VOBJ);
+        delta.push_back(Pair("satoshis", it.second));
+        delta.push_back(Pair("txid", it.first.txhash.GetHex()));
+        delta.push_back(Pair("index", (int)it.first.index));
+        delta.push_back(Pair("blockindex", (int)it.first.txindex));
+        delta.push_back(Pair("height", it.first.blockHeight));
+        delta.push_back(Pair("address", address));
+        deltas.push_back(delta);
+    }
+
+    if (!fChainInfo) {
+        return deltas;
+    }
+    result.push_back(Pair("deltas", deltas));
+    return result;
+}
+
+UniValue getaddressmempool(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressmempool {\"addresses\": [\"taddr\", ...]}\n"
+            "\nReturns all mempool deltas for an address (requires -insightexplorer).\n"
+            "\nArguments:\n"
+            + addressesHelp +
+            "   }\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"address\"    (string) The base58check encoded address\n"
+            "    \"txid\"       (string) The related txid\n"
+            "    \"index\"      (number) The related input or output index\n"
+            "    \"satoshis\"   (number) The difference of zatoshis\n"
+            "    \"timestamp\"  (number) The time the transaction entered the mempool (seconds)\n"
+            "    \"prevtxid\"   (string) The previous txid (if spending)\n"
+            "    \"prevout\"    (number) The previous transaction output index (if spending)\n"
+            "  }, ...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressmempool", "'{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"]}'")
+            + HelpExampleRpc("getaddressmempool", "{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"]}")
+        );
+
+    checkAddressIndexEnabled();
+
+    std::vector<std::pair<uint160, int> > addresses;
+    getAddressesFromParams(params, addresses);
+
+    std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > indexes;
+    mempool.getAddressIndex(addresses, indexes);
+    std::sort(indexes.begin(), indexes.end(),
+        [](const std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> &a,
+           const std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> &b) {
+            return a.second.time < b.second.time;
+        });
+
+    UniValue result(UniValue::VARR);
+    for (const auto& it : indexes) {
+        std::string address;
+        if (!getAddressFromIndex(it.first.type, it.first.addressBytes, address)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
+        }
+        UniValue delta(UniValue::VOBJ);
+        delta.push_back(Pair("address", address));
+        delta.push_back(Pair("txid", it.first.txhash.GetHex()));
+        delta.push_back(Pair("index", (int)it.first.index));
+        delta.push_back(Pair("satoshis", it.second.amount));
+        delta.push_back(Pair("timestamp", it.second.time));
+        if (it.first.spending) {
+            delta.push_back(Pair("prevtxid", it.second.prevhash.GetHex()));
+            delta.push_back(Pair("prevout", (int)it.second.prevout));
+        }
+        result.push_back(delta);
+    }
+    return result;
+}
+
+UniValue getaddressutxos(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressutxos {\"addresses\": [\"taddr\", ...], \"chainInfo\": true|false}\n"
+            "\nReturns all unspent outputs for an address (requires -insightexplorer).\n"
+            "\nArguments:\n"
+            + addressesHelp +
+            "     \"chainInfo\" (boolean, optional, default=false) Include chain info with results\n"
+            "   }\n"
+            "\nResult (if chainInfo is false):\n"
+            "[\n"
+            "  {\n"
+            "    \"address\"      (string) The address base58check encoded\n"
+            "    \"txid\"         (string) The output txid\n"
+            "    \"outputIndex\"  (number) The output index\n"
+            "    \"script\"       (string) The script hex encoded\n"
+            "    \"satoshis\"     (number) The number of zatoshis of the output\n"
+            "    \"height\"       (number) The block height\n"
+            "  }, ...\n"
+            "]\n"
+            "\nResult (if chainInfo is true):\n"
+            "{\n"
+            "  \"utxos\": [ ... ],  (array) As above\n"
+            "  \"hash\"             (string) The block hash of the chain tip\n"
+            "  \"height\"           (numeric) The height of the chain tip\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressutxos", "'{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"], \"chainInfo\": true}'")
+            + HelpExampleRpc("getaddressutxos", "{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"], \"chainInfo\": true}")
+        );
+
+    checkAddressIndexEnabled();
+
+    bool fChainInfo = getChainInfoFlag(params);
+
+    std::vector<std::pair<uint160, int> > addresses;
+    getAddressesFromParams(params, addresses);
+
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > unspentOutputs;
+    UniValue result(UniValue::VOBJ);
+    {
+        LOCK(cs_main);
+        for (const auto& it : addresses) {
+            if (!GetAddressUnspent(it.first, it.second, unspentOutputs)) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+            }
+        }
+        if (fChainInfo) {
+            result.push_back(Pair("hash", chainActive.Tip()->GetBlockHash().GetHex()));
+            result.push_back(Pair("height", (int)chainActive.Height()));
+        }
+    }
+
+    std::sort(unspentOutputs.begin(), unspentOutputs.end(),
+        [](const std::pair<CAddressUnspentKey, CAddressUnspentValue> &a,
+           const std::pair<CAddressUnspentKey, CAddressUnspentValue> &b) {
+            return a.second.blockHeight < b.second.blockHeight;
+        });
+
+    UniValue utxos(UniValue::VARR);
+    for (const auto& it : unspentOutputs) {
+        std::string address;
+        if (!getAddressFromIndex(it.first.type, it.first.hashBytes, address)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
+        }
+        UniValue output(UniValue::VOBJ);
+        output.push_back(Pair("address", address));
+        output.push_back(Pair("txid", it.first.txhash.GetHex()));
+        output.push_back(Pair("outputIndex", (int)it.first.index));
+        output.push_back(Pair("script", HexStr(it.second.script.begin(), it.second.script.end())));
+        output.push_back(Pair("satoshis", it.second.satoshis));
+        output.push_back(Pair("height", it.second.blockHeight));
+        utxos.push_back(output);
+    }
+
+    if (!fChainInfo) {
+        return utxos;
+    }
+    result.push_back(Pair("utxos", utxos));
+    return result;
+}
+
+UniValue getaddresstxids(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddresstxids {\"addresses\": [\"taddr\", ...], \"start\": n, \"end\": n}\n"
+            "\nReturns the txids for given transparent addresses within the given (inclusive)\n"
+            "block height range, default is the full blockchain (requires -insightexplorer).\n"
+            "Large histories can be paged through with successive height ranges.\n"
+            "\nArguments:\n"
+            + addressesHelp +
+            "     \"start\" (number, optional) The start block height\n"
+            "     \"end\"   (number, optional) The end block height\n"
+            "   }\n"
+            "\nResult:\n"
+            "[\n"
+            "  \"transactionid\"  (string) The transaction id\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddresstxids", "'{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"], \"start\": 1000, \"end\": 2000}'")
+            + HelpExampleRpc("getaddresstxids", "{\"addresses\": [\"tmYXBYJj1K7vhejSec5osXK2QsGa5MTisUQ\"], \"start\": 1000, \"end\": 2000}")
+        );
+
+    checkAddressIndexEnabled();
+
+    int start = 0;
+    int end = 0;
+    getHeightRange(params, start, end);
+
+    std::vector<std::pair<uint160, int> > addresses;
+    getAddressesFromParams(params, addresses);
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    {
+        LOCK(cs_main);
+        getAddressIndexEntries(addresses, start, end, addressIndex);
+    }
+
+    // Results from a single address are already sorted by height; merge
+    // multiple addresses by height and remove duplicate txids.
+    std::vector<std::pair<int, uint256> > txids;
+    txids.reserve(addressIndex.size());
+    for (const auto& it : addressIndex) {
+        txids.push_back(std::make_pair(it.first.blockHeight, it.first.txhash));
+    }
+    if (addresses.size() > 1) {
+        std::stable_sort(txids.begin(), txids.end(),
+            [](const std::pair<int, uint256> &a, const std::pair<int, uint256> &b) {
+                return a.first < b.first;
+            });
+    }
+
+    std::set<uint256> seen;
+    UniValue result(UniValue::VARR);
+    for (const auto& it : txids) {
+        if (seen.insert(it.second).second) {
+            result.push_back(it.second.GetHex());
+        }
+    }
+    return result;
+}
+
+UniValue getspentinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1 || !params[0].isObject())
+        throw runtime_error(
+            "getspentinfo {\"txid\": \"txidhex\", \"index\": n}\n"
+            "\nReturns the txid and index where an output is spent (requires -insightexplorer).\n"
+            "Spends by mempool transactions are included, with a height of -1.\n"
+            "\nArguments:\n"
+            "{\n"
+            "  \"txid\"   (string) The hex string of the txid\n"
+            "  \"index\"  (number) The vout (output) index\n"
+            "}\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"txid\"   (string) The transaction id\n"
+            "  \"index\"  (number) The spending (vin, input) index\n"
+            "  \"height\" (number) The height of the block containing the spending transaction\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getspentinfo", "'{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}'")
+            + HelpExampleRpc("getspentinfo", "{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}")
+        );
+
+    if (!fSpentIndex) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Spent index not enabled (requires -insightexplorer)");
+    }
+
+    UniValue txidValue = find_value(params[0].get_obj(), "txid");
+    UniValue indexValue = find_value(params[0].get_obj(), "index");
+    if (!txidValue.isStr() || !indexValue.isNum()) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid txid or index");
+    }
+    uint256 txid = ParseHashV(txidValue, "txid");
+    int outputIndex = indexValue.get_int();
+    if (outputIndex < 0) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid index");
+    }
+
+    CSpentIndexKey key(txid, outputIndex);
+    CSpentIndexValue value;
+    {
+        LOCK(cs_main);
+        if (!mempool.getSpentIndex(key, value) && !GetSpentIndex(key, value)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
+        }
+    }
+
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("txid", value.txid.GetHex()));
+    obj.push_back(Pair("index", (int)value.inputIndex));
+    obj.push_back(Pair("height", value.blockHeight));
+    return obj;
+}
+
 UniValue setmocktime(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -492,6 +1014,15 @@ static const CRPCCommand commands[] =
     { "util",               "createmultisig",         &createmultisig,         true  },
     { "util",               "verifymessage",          &verifymessage,          true  },
 
+    // START insightexplorer
+    { "addressindex",       "getaddressbalance",      &getaddressbalance,      true  },
+    { "addressindex",       "getaddressdeltas",       &getaddressdeltas,       true  },
+    { "addressindex",       "getaddressmempool",      &getaddressmempool,      true  },
+    { "addressindex",       "getaddresstxids",        &getaddresstxids,        true  },
+    { "addressindex",       "getaddressutxos",        &getaddressutxos,        true  },
+    { "blockchain",         "getspentinfo",           &getspentinfo,           true  },
+    // END insightexplorer
+
     /* Not shown in help */
     { "hidden",             "setmocktime",            &setmocktime,            true  },
 };
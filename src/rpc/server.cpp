@@ -303,20 +303,19 @@ bool StartRPC()
     fRPCRunning = true;
     g_rpcSignals.Started();
 
-    // Launch one async rpc worker.  The ability to launch multiple workers is not recommended at present and thus the option is disabled.
-    getAsyncRPCQueue()->addWorker();
-/*
-    int n = GetArg("-rpcasyncthreads", 1);
-    if (n<1) {
-        LogPrintf("ERROR: Invalid value %d for -rpcasyncthreads.  Must be at least 1.\n", n);
-        strerr = strprintf(_("An error occurred while setting up the Async RPC threads, invalid parameter value of %d (must be at least 1)."), n);
-        uiInterface.ThreadSafeMessageBox(strerr, "", CClientUIInterface::MSG_ERROR);
-        StartShutdown();
-        return;
+    // Launch the async rpc workers. Operations that create proofs are limited by
+    // -rpcasyncmaxproving, which defaults to one at a time as they select notes
+    // to spend while they run.
+    std::shared_ptr<AsyncRPCQueue> q = getAsyncRPCQueue();
+    q->setMaxProvingOperations(std::max<int64_t>(GetArg("-rpcasyncmaxproving", DEFAULT_ASYNC_RPC_MAX_PROVING), 0));
+    q->setResultTTL(std::chrono::seconds(std::max<int64_t>(GetArg("-rpcasyncresultttl", DEFAULT_ASYNC_RPC_RESULT_TTL), 0)));
+    int n = GetArg("-rpcasyncthreads", DEFAULT_ASYNC_RPC_THREADS);
+    if (n < 1) {
+        LogPrintf("WARNING: Invalid value %d for -rpcasyncthreads, using 1.\n", n);
+        n = 1;
     }
     for (int i = 0; i < n; i++)
-        getAsyncRPCQueue()->addWorker();
-*/
+        q->addWorker();
     return true;
 }
 
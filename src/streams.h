@@ -389,6 +389,51 @@ public:
 
 
 
+/** Read-only stream over a range of memory it does not own, e.g. a memory
+ * mapped file. The memory must outlive the reader.
+ */
+class CMemoryReader
+{
+private:
+    const int nType;
+    const int nVersion;
+
+    const char* pbegin;
+    const char* pend;
+
+public:
+    CMemoryReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn) :
+        nType(nTypeIn), nVersion(nVersionIn), pbegin(pbeginIn), pend(pendIn) {}
+
+    int GetType() const          { return nType; }
+    int GetVersion() const       { return nVersion; }
+
+    size_t size() const          { return pend - pbegin; }
+
+    void read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::read(): end of data");
+        memcpy(pch, pbegin, nSize);
+        pbegin += nSize;
+    }
+
+    void ignore(size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::ignore(): end of data");
+        pbegin += nSize;
+    }
+
+    template<typename T>
+    CMemoryReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj);
+        return (*this);
+    }
+};
+
 /** Non-refcounted RAII wrapper for FILE*
  *
  * Will automatically close the file when it goes out of scope if not null.
@@ -0,0 +1,87 @@
+// Copyright (c) 2019 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "arith_uint256.h"
+#include "blockcache.h"
+#include "primitives/block.h"
+#include "version.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockcache_tests, BasicTestingSetup)
+
+static CBlock MakeBlock(int nNonce)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << nNonce;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1;
+    CBlock block;
+    block.vtx.push_back(tx);
+    block.nNonce = ArithToUint256(arith_uint256(nNonce));
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_roundtrip)
+{
+    CSerializedBlockCache cache(1000000);
+    CBlock block = MakeBlock(1);
+    uint256 hash = block.GetHash();
+
+    BOOST_CHECK(!cache.Get(hash));
+    std::shared_ptr<const CDataStream> pdata = cache.Insert(hash, block);
+    BOOST_CHECK(pdata);
+    BOOST_CHECK(cache.Get(hash) == pdata);
+    BOOST_CHECK_EQUAL(cache.GetTotalSize(), pdata->size());
+
+    // Inserting again shares the cached copy
+    BOOST_CHECK(cache.Insert(hash, block) == pdata);
+    BOOST_CHECK_EQUAL(cache.GetCount(), 1);
+
+    CDataStream ss(*pdata);
+    CBlock block2;
+    ss >> block2;
+    BOOST_CHECK(block2.GetHash() == hash);
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_eviction)
+{
+    std::vector<CBlock> blocks;
+    for (int i = 0; i < 4; i++)
+        blocks.push_back(MakeBlock(i + 1));
+    size_t nBlockSize = ::GetSerializeSize(blocks[0], SER_NETWORK, PROTOCOL_VERSION);
+
+    // Room for three blocks
+    CSerializedBlockCache cache(3 * nBlockSize);
+    for (int i = 0; i < 3; i++)
+        cache.Insert(blocks[i].GetHash(), blocks[i]);
+    BOOST_CHECK_EQUAL(cache.GetCount(), 3);
+
+    // Using the oldest block makes the second the least recently used
+    BOOST_CHECK(cache.Get(blocks[0].GetHash()));
+    cache.Insert(blocks[3].GetHash(), blocks[3]);
+    BOOST_CHECK_EQUAL(cache.GetCount(), 3);
+    BOOST_CHECK(cache.Get(blocks[0].GetHash()));
+    BOOST_CHECK(!cache.Get(blocks[1].GetHash()));
+    BOOST_CHECK(cache.Get(blocks[2].GetHash()));
+    BOOST_CHECK(cache.Get(blocks[3].GetHash()));
+    BOOST_CHECK_EQUAL(cache.GetTotalSize(), 3 * nBlockSize);
+
+    // Shrinking the cache drops the least recently used blocks
+    cache.SetMaxSize(nBlockSize);
+    BOOST_CHECK_EQUAL(cache.GetCount(), 1);
+    BOOST_CHECK(cache.Get(blocks[3].GetHash()));
+
+    // A block that does not fit is still serialized, but not kept
+    cache.SetMaxSize(nBlockSize - 1);
+    BOOST_CHECK_EQUAL(cache.GetCount(), 0);
+    BOOST_CHECK(cache.Insert(blocks[0].GetHash(), blocks[0]));
+    BOOST_CHECK_EQUAL(cache.GetCount(), 0);
+    BOOST_CHECK_EQUAL(cache.GetTotalSize(), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
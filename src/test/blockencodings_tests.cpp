@@ -0,0 +1,127 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "random.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockencodings_tests, BasicTestingSetup)
+
+static CBlock BuildBlockTestCase() {
+    CBlock block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig.resize(10);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+
+    block.vtx.resize(4);
+    block.vtx[0] = tx;
+    block.nVersion = 4;
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+
+    for (int i = 1; i < 4; i++) {
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].prevout.n = 0;
+        block.vtx[i] = tx;
+    }
+
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(SimpleRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    CBlock block(BuildBlockTestCase());
+
+    CMutableTransaction tx1(block.vtx[1]), tx3(block.vtx[3]);
+    pool.addUnchecked(block.vtx[1].GetHash(), entry.FromTx(tx1));
+    pool.addUnchecked(block.vtx[3].GetHash(), entry.FromTx(tx3));
+
+    // Send the compact block over the wire and reconstruct it from the mempool
+    CBlockHeaderAndShortTxIDs shortIDs(block);
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << shortIDs;
+
+    CBlockHeaderAndShortTxIDs shortIDs2;
+    stream >> shortIDs2;
+    BOOST_CHECK_EQUAL(shortIDs2.BlockTxCount(), block.vtx.size());
+
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(2));
+    BOOST_CHECK(partialBlock.IsTxAvailable(3));
+
+    CBlock block2;
+    std::vector<CTransaction> vtx_missing;
+    // Missing transaction not given
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing) == READ_STATUS_INVALID);
+
+    // Wrong transaction given
+    vtx_missing.push_back(block.vtx[1]);
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing) == READ_STATUS_FAILED);
+
+    vtx_missing[0] = block.vtx[2];
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block2.GetHash().ToString(), block.GetHash().ToString());
+    BOOST_CHECK_EQUAL(block2.vtx.size(), block.vtx.size());
+    for (size_t i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(block2.vtx[i].GetHash() == block.vtx[i].GetHash());
+
+    // Too many transactions given
+    vtx_missing.push_back(block.vtx[1]);
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing) == READ_STATUS_INVALID);
+}
+
+BOOST_AUTO_TEST_CASE(EmptyMempoolTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(CBlockHeaderAndShortTxIDs(block)) == READ_STATUS_OK);
+    // Only the coinbase is prefilled
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    for (size_t i = 1; i < block.vtx.size(); i++)
+        BOOST_CHECK(!partialBlock.IsTxAvailable(i));
+
+    CBlock block2;
+    std::vector<CTransaction> vtx_missing(block.vtx.begin() + 1, block.vtx.end());
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block2.GetHash().ToString(), block.GetHash().ToString());
+}
+
+BOOST_AUTO_TEST_CASE(TransactionsRequestSerializationTest)
+{
+    BlockTransactionsRequest req1;
+    req1.blockhash = GetRandHash();
+    req1.indexes.resize(4);
+    req1.indexes[0] = 0;
+    req1.indexes[1] = 1;
+    req1.indexes[2] = 3;
+    req1.indexes[3] = 4;
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req1;
+
+    BlockTransactionsRequest req2;
+    stream >> req2;
+
+    BOOST_CHECK_EQUAL(req1.blockhash.ToString(), req2.blockhash.ToString());
+    BOOST_CHECK_EQUAL(req1.indexes.size(), req2.indexes.size());
+    for (size_t i = 0; i < req1.indexes.size(); i++)
+        BOOST_CHECK_EQUAL(req1.indexes[i], req2.indexes[i]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "chainparams.h"
+#include "init.h"
 #include "main.h"
 
 #include "test/test_bitcoin.h"
@@ -10,6 +11,8 @@
 #include <boost/signals2/signal.hpp>
 #include <boost/test/unit_test.hpp>
 
+extern std::atomic<bool> fRequestShutdown;
+
 BOOST_FIXTURE_TEST_SUITE(main_tests, TestingSetup)
 
 static void TestBlockSubsidyHalvings(const Consensus::Params& consensusParams)
@@ -101,4 +104,38 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     BOOST_CHECK(Test());
 }
 
+BOOST_AUTO_TEST_CASE(trimmed_solution_test)
+{
+    const CBlock& genesis = Params().GenesisBlock();
+    CBlockIndex* pindex;
+    {
+        LOCK(cs_main);
+        pindex = chainActive.Genesis();
+    }
+    BOOST_REQUIRE(pindex);
+
+    // The genesis entry was flushed to disk by InitBlockIndex
+    BOOST_CHECK(!pindex->HasSolution());
+    BOOST_CHECK(pindex->GetSolution() == genesis.nSolution);
+    BOOST_CHECK(pindex->GetBlockHeader().GetHash() == genesis.GetHash());
+    BOOST_CHECK(CDiskBlockIndex(pindex).nSolution == genesis.nSolution);
+
+    // Entries not yet written keep their solution
+    CBlockIndex index(genesis.GetBlockHeader());
+    BOOST_CHECK(index.HasSolution());
+    BOOST_CHECK(index.GetSolution() == genesis.nSolution);
+}
+
+BOOST_AUTO_TEST_CASE(reindex_interrupted_test)
+{
+    // The genesis block file written by the test setup is scanned completely
+    BOOST_CHECK(ReindexBlockFiles(Params()));
+
+    // A shutdown during the scan must not be reported as a complete pass,
+    // or the reindexing flag would be cleared with most blocks missing
+    StartShutdown();
+    BOOST_CHECK(!ReindexBlockFiles(Params()));
+    fRequestShutdown = false;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,104 @@
+// Copyright (c) 2019 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "main.h"
+#include "mappedblockfiles.h"
+#include "streams.h"
+
+#include "test/test_bitcoin.h"
+
+#include <stdio.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(mappedblockfiles_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(memory_reader)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << (uint32_t)42 << std::string("zcash");
+
+    CMemoryReader reader(&ss[0], &ss[0] + ss.size(), SER_DISK, CLIENT_VERSION);
+    uint32_t n;
+    std::string str;
+    reader >> n >> str;
+    BOOST_CHECK_EQUAL(n, 42);
+    BOOST_CHECK_EQUAL(str, "zcash");
+    BOOST_CHECK_EQUAL(reader.size(), 0);
+    BOOST_CHECK_THROW(reader >> n, std::ios_base::failure);
+}
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(map_grow_invalidate)
+{
+    CMappedBlockFiles files;
+    boost::filesystem::path path = pathTemp / "mapped.dat";
+
+    // Missing and empty files can't be mapped
+    BOOST_CHECK(!files.Get(0, path, 0));
+    FILE* file = fopen(path.string().c_str(), "wb");
+    BOOST_REQUIRE(file);
+    BOOST_CHECK(!files.Get(0, path, 0));
+
+    fwrite("abcd", 1, 4, file);
+    fflush(file);
+    std::shared_ptr<const CMappedFile> pfile = files.Get(0, path, 4);
+    BOOST_REQUIRE(pfile);
+    BOOST_CHECK_EQUAL(pfile->size(), 4);
+    BOOST_CHECK_EQUAL(std::string(pfile->data(), 4), "abcd");
+    BOOST_CHECK(files.Get(0, path, 2) == pfile);
+
+    // Asking for more than is mapped maps the file again, without
+    // invalidating the old mapping
+    fwrite("efgh", 1, 4, file);
+    fclose(file);
+    std::shared_ptr<const CMappedFile> pfile2 = files.Get(0, path, 8);
+    BOOST_REQUIRE(pfile2);
+    BOOST_CHECK(pfile2 != pfile);
+    BOOST_CHECK_EQUAL(std::string(pfile2->data(), 8), "abcdefgh");
+    BOOST_CHECK_EQUAL(std::string(pfile->data(), 4), "abcd");
+
+    // A file shorter than asked for is still mapped in full
+    BOOST_CHECK_EQUAL(files.Get(0, path, 100)->size(), 8);
+
+    {
+        CSequentialBlockReads sequential(files);
+        BOOST_CHECK_EQUAL(std::string(files.Get(0, path, 8)->data(), 8), "abcdefgh");
+    }
+
+    BOOST_CHECK_EQUAL(files.GetCount(), 1);
+    files.Invalidate(0);
+    BOOST_CHECK_EQUAL(files.GetCount(), 0);
+    BOOST_CHECK_EQUAL(std::string(pfile2->data(), 8), "abcdefgh");
+}
+
+BOOST_AUTO_TEST_CASE(read_block_from_mapped_file)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    CBlockIndex* pindex = chainActive.Genesis();
+    BOOST_REQUIRE(pindex);
+
+    CBlock block;
+    BOOST_CHECK(ReadBlockFromDisk(block, pindex, params));
+
+    fMmapBlockFiles = true;
+    CBlock blockMapped;
+    BOOST_CHECK(ReadBlockFromDisk(blockMapped, pindex, params));
+    BOOST_CHECK_EQUAL(mappedBlockFiles.GetCount(), 1);
+    BOOST_CHECK(blockMapped.GetHash() == block.GetHash());
+    BOOST_CHECK(blockMapped.hashMerkleRoot == block.hashMerkleRoot);
+    BOOST_CHECK_EQUAL(blockMapped.vtx.size(), block.vtx.size());
+
+    // Positions not preceded by a valid size are rejected
+    CDiskBlockPos pos = pindex->GetBlockPos();
+    pos.nPos = 2;
+    BOOST_CHECK(!ReadBlockFromDisk(blockMapped, pos, params));
+
+    fMmapBlockFiles = DEFAULT_MMAP_BLOCK_FILES;
+    mappedBlockFiles.Clear();
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -157,6 +157,171 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
     BOOST_CHECK(it == pool.mapTx.get<1>().end());
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAncestorDescendantTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    // A parent with two children, one of which has a child of its own.
+    // All transactions have the same shape, and hence the same size.
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].prevout = COutPoint(uint256S("1"), 0);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(2);
+    for (int i = 0; i < 2; i++) {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = 10 * COIN;
+    }
+    CMutableTransaction txChild[2];
+    for (int i = 0; i < 2; i++) {
+        txChild[i] = txParent;
+        txChild[i].vin[0].prevout = COutPoint(txParent.GetHash(), i);
+    }
+    CMutableTransaction txGrandChild = txParent;
+    txGrandChild.vin[0].prevout = COutPoint(txChild[0].GetHash(), 0);
+
+    pool.addUnchecked(txParent.GetHash(), entry.Fee(1000LL).FromTx(txParent));
+    pool.addUnchecked(txChild[0].GetHash(), entry.Fee(10000LL).FromTx(txChild[0]));
+    pool.addUnchecked(txChild[1].GetHash(), entry.Fee(2000LL).FromTx(txChild[1]));
+    pool.addUnchecked(txGrandChild.GetHash(), entry.Fee(3000LL).FromTx(txGrandChild));
+    BOOST_CHECK_EQUAL(pool.size(), 4);
+
+    uint64_t nSize = ::GetSerializeSize(txParent, SER_NETWORK, PROTOCOL_VERSION);
+    CTxMemPool::txiter itParent = pool.mapTx.find(txParent.GetHash());
+    CTxMemPool::txiter itChild0 = pool.mapTx.find(txChild[0].GetHash());
+    CTxMemPool::txiter itChild1 = pool.mapTx.find(txChild[1].GetHash());
+    CTxMemPool::txiter itGrandChild = pool.mapTx.find(txGrandChild.GetHash());
+
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 4);
+    BOOST_CHECK_EQUAL(itParent->GetSizeWithDescendants(), 4 * nSize);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 16000);
+    BOOST_CHECK_EQUAL(itParent->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(itChild0->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(itChild0->GetModFeesWithDescendants(), 13000);
+    BOOST_CHECK_EQUAL(itChild1->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(itChild1->GetModFeesWithAncestors(), 3000);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(itGrandChild->GetSizeWithAncestors(), 3 * nSize);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 14000);
+
+    BOOST_CHECK(pool.GetMemPoolParents(itGrandChild).count(itChild0));
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(itParent).size(), 2);
+
+    // Ancestor and descendant limits
+    CTxMemPool::setEntries setAncestors;
+    std::string errString;
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(*itGrandChild, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 2);
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(*itGrandChild, setAncestors, 2, nNoLimit, nNoLimit, nNoLimit, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(*itGrandChild, setAncestors, nNoLimit, nNoLimit, 4, nNoLimit, errString));
+
+    // Eviction order, lowest descendant score first: the parent is protected
+    // by its high-fee child, so it goes after the grandchild
+    std::vector<uint256> vOrder;
+    CTxMemPool::indexed_transaction_set::index<descendant_score>::type::iterator dit;
+    for (dit = pool.mapTx.get<descendant_score>().begin(); dit != pool.mapTx.get<descendant_score>().end(); ++dit)
+        vOrder.push_back(dit->GetTx().GetHash());
+    BOOST_CHECK(vOrder[0] == txChild[1].GetHash());
+    BOOST_CHECK(vOrder[1] == txGrandChild.GetHash());
+    BOOST_CHECK(vOrder[2] == txParent.GetHash());
+    BOOST_CHECK(vOrder[3] == txChild[0].GetHash());
+
+    // Mining order, highest ancestor fee rate first
+    vOrder.clear();
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator ait;
+    for (ait = pool.mapTx.get<ancestor_score>().begin(); ait != pool.mapTx.get<ancestor_score>().end(); ++ait)
+        vOrder.push_back(ait->GetTx().GetHash());
+    BOOST_CHECK(vOrder[0] == txChild[0].GetHash());
+    BOOST_CHECK(vOrder[1] == txGrandChild.GetHash());
+    BOOST_CHECK(vOrder[2] == txChild[1].GetHash());
+    BOOST_CHECK(vOrder[3] == txParent.GetHash());
+
+    // Prioritisation is reflected in the aggregates of both directions
+    pool.PrioritiseTransaction(txParent.GetHash(), txParent.GetHash().ToString(), 0.0, 5000);
+    BOOST_CHECK_EQUAL(itParent->GetModifiedFee(), 6000);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 21000);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 19000);
+    BOOST_CHECK_EQUAL(itChild1->GetModFeesWithAncestors(), 8000);
+
+    // Removing the parent as if mined leaves its descendants with updated
+    // ancestor state
+    std::list<CTransaction> removed;
+    pool.remove(txParent, removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+    BOOST_CHECK_EQUAL(itChild0->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 13000);
+    BOOST_CHECK(pool.GetMemPoolParents(itChild0).empty());
+
+    // Putting it back, as on a reorg, relinks the children once
+    // UpdateTransactionsFromBlock is called. The prioritisation still applies.
+    pool.addUnchecked(txParent.GetHash(), entry.Fee(1000LL).FromTx(txParent));
+    itParent = pool.mapTx.find(txParent.GetHash());
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 1);
+    pool.UpdateTransactionsFromBlock(std::vector<uint256>(1, txParent.GetHash()));
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 4);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 21000);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 19000);
+    BOOST_CHECK_EQUAL(itChild1->GetCountWithAncestors(), 2);
+
+    // Recursive removal of a child takes the grandchild and updates the parent
+    removed.clear();
+    pool.remove(txChild[0], removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(itParent->GetSizeWithDescendants(), 2 * nSize);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 8000);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolLargeShieldedPackageTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    // A parent and child of 60 kB each, the size of transactions with a few
+    // shielded spends and outputs, exceed 101 kB together.
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].prevout = COutPoint(uint256S("1"), 0);
+    txParent.vin[0].scriptSig = CScript() << std::vector<unsigned char>(60000, 0x11);
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 10 * COIN;
+    CMutableTransaction txChild = txParent;
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+
+    pool.addUnchecked(txParent.GetHash(), entry.Fee(1000LL).FromTx(txParent));
+    CTxMemPoolEntry childEntry = entry.Fee(1000LL).FromTx(txChild);
+    BOOST_CHECK(childEntry.GetTxSize() + pool.mapTx.find(txParent.GetHash())->GetTxSize() > 101 * 1000);
+
+    // The child is accepted with the default limits, as AcceptToMemoryPool
+    // applies them...
+    CTxMemPool::setEntries setAncestors;
+    std::string errString;
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(childEntry, setAncestors,
+        DEFAULT_ANCESTOR_LIMIT, DEFAULT_ANCESTOR_SIZE_LIMIT * 1000,
+        DEFAULT_DESCENDANT_LIMIT, DEFAULT_DESCENDANT_SIZE_LIMIT * 1000, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 1);
+
+    // ...which leave room for two maximum-size transactions...
+    BOOST_CHECK(DEFAULT_ANCESTOR_SIZE_LIMIT * 1000 >= 2 * MAX_TX_SIZE_AFTER_SAPLING);
+    BOOST_CHECK(DEFAULT_DESCENDANT_SIZE_LIMIT * 1000 >= 2 * MAX_TX_SIZE_AFTER_SAPLING);
+
+    // ...but not with limits of 101 kB.
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(childEntry, setAncestors,
+        DEFAULT_ANCESTOR_LIMIT, 101 * 1000, DEFAULT_DESCENDANT_LIMIT, DEFAULT_DESCENDANT_SIZE_LIMIT * 1000, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(childEntry, setAncestors,
+        DEFAULT_ANCESTOR_LIMIT, DEFAULT_ANCESTOR_SIZE_LIMIT * 1000, DEFAULT_DESCENDANT_LIMIT, 101 * 1000, errString));
+}
+
 BOOST_AUTO_TEST_CASE(RemoveWithoutBranchId) {
     CTxMemPool pool(CFeeRate(0));
     TestMemPoolEntryHelper entry;
@@ -212,6 +377,137 @@ BOOST_AUTO_TEST_CASE(RemoveWithoutBranchId) {
     BOOST_CHECK_EQUAL(pool.size(), 0);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    SetMockTime(42);
+    CTxMemPool pool(CFeeRate(1000));
+    TestMemPoolEntryHelper entry;
+    entry.dPriority = 10.0;
+
+    CMutableTransaction tx1 = CMutableTransaction();
+    tx1.vin.resize(1);
+    tx1.vin[0].prevout = COutPoint(uint256S("1"), 0);
+    tx1.vin[0].scriptSig = CScript() << OP_1;
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx1.GetHash(), entry.Fee(10000LL).FromTx(tx1, &pool));
+
+    CMutableTransaction tx2 = CMutableTransaction();
+    tx2.vin.resize(1);
+    tx2.vin[0].prevout = COutPoint(uint256S("2"), 0);
+    tx2.vin[0].scriptSig = CScript() << OP_2;
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+    tx2.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx2.GetHash(), entry.Fee(5000LL).FromTx(tx2, &pool));
+
+    pool.TrimToSize(pool.DynamicMemoryUsage()); // should do nothing
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+
+    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4); // should remove the lower-feerate transaction
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+
+    // A high-fee child pays for its low-fee parent: the package of tx2 and tx3
+    // outbids tx1, which is evicted instead
+    pool.addUnchecked(tx2.GetHash(), entry.Fee(5000LL).FromTx(tx2, &pool));
+    CMutableTransaction tx3 = CMutableTransaction();
+    tx3.vin.resize(1);
+    tx3.vin[0].prevout = COutPoint(tx2.GetHash(), 0);
+    tx3.vin[0].scriptSig = CScript() << OP_2;
+    tx3.vout.resize(1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_3 << OP_EQUAL;
+    tx3.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx3.GetHash(), entry.Fee(20000LL).FromTx(tx3, &pool));
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+
+    std::vector<COutPoint> vNoSpendsRemaining;
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1, &vNoSpendsRemaining);
+    BOOST_CHECK(!pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+    BOOST_CHECK(pool.exists(tx3.GetHash()));
+    BOOST_CHECK_EQUAL(vNoSpendsRemaining.size(), 1);
+    BOOST_CHECK(vNoSpendsRemaining[0] == tx1.vin[0].prevout);
+
+    // The rolling minimum fee is the evicted package's fee rate plus the relay fee
+    size_t nTx1Size = ::GetSerializeSize(tx1, SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), CFeeRate(10000LL, nTx1Size).GetFeePerK() + ::minRelayTxFee.GetFeePerK());
+
+    // Evicting the parent takes the child along; tx3's input was tx2's output,
+    // which left with it, so only tx2's input is reported
+    vNoSpendsRemaining.clear();
+    pool.TrimToSize(1, &vNoSpendsRemaining);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    BOOST_CHECK_EQUAL(vNoSpendsRemaining.size(), 1);
+    BOOST_CHECK(vNoSpendsRemaining[0] == tx2.vin[0].prevout);
+
+    size_t nPackageSize = ::GetSerializeSize(tx2, SER_NETWORK, PROTOCOL_VERSION) +
+                          ::GetSerializeSize(tx3, SER_NETWORK, PROTOCOL_VERSION);
+    CAmount nMinFee = CFeeRate(25000LL, nPackageSize).GetFeePerK() + ::minRelayTxFee.GetFeePerK();
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), nMinFee);
+
+    // It only starts to decay once a block has been connected
+    SetMockTime(42 + CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), nMinFee);
+
+    std::vector<CTransaction> vtx;
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vtx, 1, conflicts);
+    SetMockTime(42 + 2 * CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), nMinFee / 2);
+
+    // ... faster while the pool is mostly empty
+    SetMockTime(42 + 2 * CTxMemPool::ROLLING_FEE_HALFLIFE + CTxMemPool::ROLLING_FEE_HALFLIFE / 4);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1000000).GetFeePerK(), nMinFee / 4);
+
+    // ... and drops to zero below half the minimum relay fee
+    SetMockTime(42 + 100 * CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), 0);
+
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolExpireTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    entry.nFee = 10000LL;
+
+    CMutableTransaction txOld = CMutableTransaction();
+    txOld.vin.resize(1);
+    txOld.vin[0].prevout = COutPoint(uint256S("1"), 0);
+    txOld.vin[0].scriptSig = CScript() << OP_1;
+    txOld.vout.resize(1);
+    txOld.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    txOld.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(txOld.GetHash(), entry.Time(100).FromTx(txOld, &pool));
+
+    CMutableTransaction txNew = CMutableTransaction();
+    txNew.vin.resize(1);
+    txNew.vin[0].prevout = COutPoint(uint256S("2"), 0);
+    txNew.vin[0].scriptSig = CScript() << OP_2;
+    txNew.vout.resize(1);
+    txNew.vout[0].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+    txNew.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(txNew.GetHash(), entry.Time(200).FromTx(txNew, &pool));
+
+    // A recent child of an expired transaction goes with it
+    CMutableTransaction txChild = CMutableTransaction();
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(txOld.GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_3 << OP_EQUAL;
+    txChild.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(txChild.GetHash(), entry.Time(300).FromTx(txChild, &pool));
+
+    BOOST_CHECK_EQUAL(pool.Expire(100), 0);
+    BOOST_CHECK_EQUAL(pool.Expire(150), 2);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK(pool.exists(txNew.GetHash()));
+}
+
 // Test that nCheckFrequency is set correctly when calling setSanityCheck().
 // https://github.com/zcash/zcash/issues/3134
 BOOST_AUTO_TEST_CASE(SetSanityCheck) {
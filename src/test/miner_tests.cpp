@@ -386,6 +386,55 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     delete pblocktemplate;
     mempool.clear();
 
+    // template builder appends new mempool transactions to its template
+    {
+        CBlockTemplateBuilder builder(chainparams);
+        RegisterValidationInterface(&builder);
+        BOOST_CHECK(!builder.Update());
+        builder.Rebuild(scriptPubKey);
+        BOOST_CHECK(builder.Update());
+        CBlockTemplate blocktemplate;
+        builder.GetTemplate(blocktemplate);
+        BOOST_CHECK_EQUAL(blocktemplate.block.vtx.size(), 1);
+
+        tx.vin[0].prevout.hash = txFirst[0]->GetHash();
+        tx.vin[0].scriptSig = CScript() << OP_1;
+        tx.vout[0].nValue = 49000LL;
+        tx.vout[0].scriptPubKey = CScript() << OP_1;
+        hash = tx.GetHash();
+        mempool.addUnchecked(hash, entry.Fee(10000).Time(GetTime()).SpendsCoinbase(true).FromTx(tx));
+        SyncWithWallets(tx, NULL);
+        BOOST_CHECK(builder.Update());
+        builder.GetTemplate(blocktemplate);
+        BOOST_CHECK_EQUAL(blocktemplate.block.vtx.size(), 2);
+        BOOST_CHECK(blocktemplate.block.vtx[1].GetHash() == hash);
+        BOOST_CHECK_EQUAL(blocktemplate.vTxFees[0], -blocktemplate.vTxFees[1]);
+
+        // A child whose parent is missing from the template needs a rebuild
+        // to be placed; the template is still served until then.
+        CMutableTransaction txParent(tx);
+        txParent.vin[0].prevout.hash = txFirst[1]->GetHash();
+        mempool.addUnchecked(txParent.GetHash(), entry.Fee(10000).Time(GetTime()).SpendsCoinbase(true).FromTx(txParent));
+        tx.vin[0].prevout.hash = txParent.GetHash();
+        tx.vout[0].nValue = 39000LL;
+        hash = tx.GetHash();
+        mempool.addUnchecked(hash, entry.Fee(10000).Time(GetTime()).SpendsCoinbase(false).FromTx(tx));
+        SyncWithWallets(tx, NULL);
+        BOOST_CHECK(builder.Update());
+        builder.GetTemplate(blocktemplate);
+        BOOST_CHECK_EQUAL(blocktemplate.block.vtx.size(), 2);
+        SetMockTime(GetTime() + 10);
+        BOOST_CHECK(!builder.Update());
+        builder.Rebuild(scriptPubKey);
+        builder.GetTemplate(blocktemplate);
+        BOOST_CHECK_EQUAL(blocktemplate.block.vtx.size(), 4);
+        SetMockTime(0);
+
+        UnregisterValidationInterface(&builder);
+        entry.nFee = 11;
+    }
+    mempool.clear();
+
     // subsidy changing
     int nHeight = chainActive.Height();
     chainActive.Tip()->nHeight = 209999;
@@ -24,6 +24,7 @@
 
 #include <array>
 #include <chrono>
+#include <mutex>
 #include <thread>
 
 #include <fstream>
@@ -832,6 +833,130 @@ BOOST_AUTO_TEST_CASE(rpc_wallet_async_operations_parallel_cancel)
     BOOST_CHECK(ids.size()==0);
 }
 
+// Records the order in which operations start, and how many proving
+// operations run at the same time
+std::vector<std::string> gStartOrder;
+std::mutex gStartOrderMutex;
+std::atomic<int> gProving(0);
+std::atomic<int> gMaxProving(0);
+
+class PriorityOperation : public AsyncRPCOperation {
+public:
+    PriorityOperation(std::string name, OperationPriority priority, bool fProving) :
+        name_(name), priority_(priority), fProving_(fProving) {}
+    virtual ~PriorityOperation() {}
+    virtual OperationPriority getPriority() const { return priority_; }
+    virtual bool isProving() const { return fProving_; }
+    virtual void main() {
+        set_state(OperationStatus::EXECUTING);
+        start_execution_clock();
+        {
+            std::lock_guard<std::mutex> guard(gStartOrderMutex);
+            gStartOrder.push_back(name_);
+        }
+        if (fProving_) {
+            int n = ++gProving;
+            int m = gMaxProving.load();
+            while (n > m && !gMaxProving.compare_exchange_weak(m, n)) {}
+        }
+        {
+            PhaseTimer timer(this, "proving");
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        }
+        if (fProving_) {
+            gProving--;
+        }
+        stop_execution_clock();
+        set_result(UniValue(UniValue::VSTR, name_));
+        set_state(OperationStatus::SUCCESS);
+    }
+private:
+    std::string name_;
+    OperationPriority priority_;
+    bool fProving_;
+};
+
+// This tests that interactive operations are started before bulk ones
+BOOST_AUTO_TEST_CASE(rpc_wallet_async_operations_priority)
+{
+    gStartOrder.clear();
+
+    std::shared_ptr<AsyncRPCQueue> q = std::make_shared<AsyncRPCQueue>();
+    q->addOperation(std::make_shared<PriorityOperation>("bulk1", OperationPriority::BULK, false));
+    q->addOperation(std::make_shared<PriorityOperation>("bulk2", OperationPriority::BULK, false));
+    q->addOperation(std::make_shared<PriorityOperation>("interactive", OperationPriority::INTERACTIVE, false));
+    BOOST_CHECK_EQUAL(q->getOperationCount(), 3);
+
+    q->addWorker();
+    q->finishAndWait();
+    BOOST_CHECK_EQUAL(q->getOperationCount(), 0);
+
+    std::vector<std::string> expected = {"interactive", "bulk1", "bulk2"};
+    BOOST_CHECK(gStartOrder == expected);
+}
+
+// This tests the limit on concurrently executing proving operations
+BOOST_AUTO_TEST_CASE(rpc_wallet_async_operations_max_proving)
+{
+    gStartOrder.clear();
+    gProving = 0;
+    gMaxProving = 0;
+
+    std::shared_ptr<AsyncRPCQueue> q = std::make_shared<AsyncRPCQueue>();
+    q->setMaxProvingOperations(1);
+    q->addWorker();
+    q->addWorker();
+    q->addWorker();
+    q->addOperation(std::make_shared<PriorityOperation>("proving1", OperationPriority::INTERACTIVE, true));
+    q->addOperation(std::make_shared<PriorityOperation>("proving2", OperationPriority::INTERACTIVE, true));
+    q->addOperation(std::make_shared<PriorityOperation>("proving3", OperationPriority::INTERACTIVE, true));
+    // Not held back by the proving operations ahead of it
+    auto op = std::make_shared<PriorityOperation>("other", OperationPriority::BULK, false);
+    q->addOperation(op);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    BOOST_CHECK_EQUAL(op->isExecuting() || op->isSuccess(), true);
+
+    q->finishAndWait();
+    BOOST_CHECK_EQUAL(gStartOrder.size(), 4);
+    BOOST_CHECK_EQUAL(gMaxProving.load(), 1);
+}
+
+// This tests eviction of finished operations and the timings in their status
+BOOST_AUTO_TEST_CASE(rpc_wallet_async_operations_result_ttl)
+{
+    std::shared_ptr<AsyncRPCQueue> q = std::make_shared<AsyncRPCQueue>();
+    q->setResultTTL(std::chrono::seconds(1));
+    auto op1 = std::make_shared<PriorityOperation>("op1", OperationPriority::INTERACTIVE, true);
+    q->addOperation(op1);
+    q->addWorker();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    BOOST_CHECK_EQUAL(op1->isSuccess(), true);
+    BOOST_CHECK(q->getOperationForId(op1->getId()) == op1);
+
+    UniValue status = op1->getStatus();
+    BOOST_CHECK(find_value(status, "queued_secs").isNum());
+    UniValue timings = find_value(status, "timings");
+    BOOST_CHECK(timings.isObject());
+    BOOST_CHECK(find_value(timings, "proving_secs").get_real() >= 0.2);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    BOOST_CHECK(!q->getOperationForId(op1->getId()));
+    BOOST_CHECK_EQUAL(q->getAllOperationIds().size(), 0);
+
+    q->finishAndWait();
+
+    // Operations that have not finished are never evicted
+    std::shared_ptr<AsyncRPCQueue> q2 = std::make_shared<AsyncRPCQueue>();
+    q2->setResultTTL(std::chrono::seconds(1));
+    auto op2 = std::make_shared<PriorityOperation>("op2", OperationPriority::INTERACTIVE, false);
+    q2->addOperation(op2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    BOOST_CHECK(q2->getOperationForId(op2->getId()) == op2);
+    q2->closeAndWait();
+}
+
 // This tests z_getoperationstatus, z_getoperationresult, z_listoperationids
 BOOST_AUTO_TEST_CASE(rpc_z_getoperations)
 {
@@ -100,4 +100,30 @@ BOOST_AUTO_TEST_CASE(getlocator_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(blockindexarena_test)
+{
+    CBlockIndexArena arena(3);
+    std::vector<CBlockIndex*> vIndex;
+    for (int i = 0; i < 10; i++) {
+        CBlockIndex* pindex = arena.Allocate();
+        BOOST_CHECK(pindex->pprev == NULL);
+        BOOST_CHECK_EQUAL(pindex->nHeight, 0);
+        pindex->nHeight = i;
+        pindex->pprev = i ? vIndex.back() : NULL;
+        vIndex.push_back(pindex);
+    }
+    BOOST_CHECK_EQUAL(arena.size(), 10);
+
+    // Entries stay in place as the arena grows
+    BOOST_CHECK(vIndex[1] == vIndex[0] + 1);
+    for (int i = 0; i < 10; i++) {
+        BOOST_CHECK_EQUAL(vIndex[i]->nHeight, i);
+        BOOST_CHECK(vIndex[i]->pprev == (i ? vIndex[i - 1] : NULL));
+    }
+
+    arena.Clear();
+    BOOST_CHECK_EQUAL(arena.size(), 0);
+    BOOST_CHECK_EQUAL(arena.Allocate()->nHeight, 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
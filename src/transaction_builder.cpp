@@ -10,6 +10,11 @@
 #include "script/sign.h"
 #include "utilmoneystr.h"
 
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+
 #include <boost/variant.hpp>
 #include <librustzcash.h>
 
@@ -60,7 +65,8 @@ TransactionBuilder::TransactionBuilder(
     keystore(keystore),
     sproutParams(sproutParams),
     coinsView(coinsView),
-    cs_coinsView(cs_coinsView)
+    cs_coinsView(cs_coinsView),
+    nProofThreads(std::max(nScriptCheckThreads, 1))
 {
     mtx = CreateNewContextualCMutableTransaction(consensusParams, nHeight, nExpiryDelta);
 }
@@ -171,6 +177,11 @@ void TransactionBuilder::SetFee(CAmount fee)
     this->fee = fee;
 }
 
+void TransactionBuilder::SetProofThreads(size_t nThreads)
+{
+    this->nProofThreads = std::max<size_t>(nThreads, 1);
+}
+
 void TransactionBuilder::SendChangeTo(libzcash::SaplingPaymentAddress changeAddr, uint256 ovk)
 {
     saplingChangeAddr = std::make_pair(ovk, changeAddr);
@@ -250,110 +261,57 @@ TransactionBuilderResult TransactionBuilder::Build()
     }
 
     //
-    // Sapling spends and outputs
+    // Sapling spends and outputs, and Sprout JoinSplits
     //
 
-    auto ctx = librustzcash_sapling_proving_ctx_init();
-
-    // Create Sapling SpendDescriptions
-    for (auto spend : spends) {
-        auto cm = spend.note.cm();
-        auto nf = spend.note.nullifier(
-            spend.expsk.full_viewing_key(), spend.witness.position());
-        if (!cm || !nf) {
-            librustzcash_sapling_proving_ctx_free(ctx);
-            return TransactionBuilderResult("Spend is invalid");
-        }
-
-        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-        ss << spend.witness.path();
-        std::vector<unsigned char> witness(ss.begin(), ss.end());
+    unsigned char joinSplitPrivKey[crypto_sign_SECRETKEYBYTES];
+    crypto_sign_keypair(mtx.joinSplitPubKey.begin(), joinSplitPrivKey);
 
-        SpendDescription sdesc;
-        if (!librustzcash_sapling_spend_proof(
-                ctx,
-                spend.expsk.full_viewing_key().ak.begin(),
-                spend.expsk.nsk.begin(),
-                spend.note.d.data(),
-                spend.note.r.begin(),
-                spend.alpha.begin(),
-                spend.note.value(),
-                spend.anchor.begin(),
-                witness.data(),
-                sdesc.cv.begin(),
-                sdesc.rk.begin(),
-                sdesc.zkproof.data())) {
-            librustzcash_sapling_proving_ctx_free(ctx);
-            return TransactionBuilderResult("Spend proof failed");
-        }
+    auto ctx = librustzcash_sapling_proving_ctx_init();
 
-        sdesc.anchor = spend.anchor;
-        sdesc.nullifier = *nf;
-        mtx.vShieldedSpend.push_back(sdesc);
+    // Every Sapling proof adds to the proving context that creates the binding
+    // signature, so the Sapling proofs are created one after the other. Any
+    // Sprout JoinSplits are proven on another thread in the meantime.
+    bool fSapling = !spends.empty() || !outputs.empty();
+    bool fSprout = !jsInputs.empty() || !jsOutputs.empty();
+    std::exception_ptr sproutError;
+    std::thread sproutThread;
+    if (fSapling && fSprout && nProofThreads > 1) {
+        sproutThread = std::thread([this, &sproutError]() {
+            try {
+                CreateJSDescriptions();
+            } catch (...) {
+                sproutError = std::current_exception();
+            }
+        });
     }
 
-    // Create Sapling OutputDescriptions
-    for (auto output : outputs) {
-        auto cm = output.note.cm();
-        if (!cm) {
-            librustzcash_sapling_proving_ctx_free(ctx);
-            return TransactionBuilderResult("Output is invalid");
-        }
-
-        libzcash::SaplingNotePlaintext notePlaintext(output.note, output.memo);
-
-        auto res = notePlaintext.encrypt(output.note.pk_d);
-        if (!res) {
-            librustzcash_sapling_proving_ctx_free(ctx);
-            return TransactionBuilderResult("Failed to encrypt note");
-        }
-        auto enc = res.get();
-        auto encryptor = enc.second;
+    auto saplingError = CreateSaplingDescriptions(ctx);
 
-        OutputDescription odesc;
-        if (!librustzcash_sapling_output_proof(
-                ctx,
-                encryptor.get_esk().begin(),
-                output.note.d.data(),
-                output.note.pk_d.begin(),
-                output.note.r.begin(),
-                output.note.value(),
-                odesc.cv.begin(),
-                odesc.zkproof.begin())) {
-            librustzcash_sapling_proving_ctx_free(ctx);
-            return TransactionBuilderResult("Output proof failed");
+    if (sproutThread.joinable()) {
+        sproutThread.join();
+    } else if (fSprout && !saplingError) {
+        try {
+            CreateJSDescriptions();
+        } catch (...) {
+            sproutError = std::current_exception();
         }
-
-        odesc.cm = *cm;
-        odesc.ephemeralKey = encryptor.get_epk();
-        odesc.encCiphertext = enc.first;
-
-        libzcash::SaplingOutgoingPlaintext outPlaintext(output.note.pk_d, encryptor.get_esk());
-        odesc.outCiphertext = outPlaintext.encrypt(
-            output.ovk,
-            odesc.cv,
-            odesc.cm,
-            encryptor);
-        mtx.vShieldedOutput.push_back(odesc);
     }
 
-    //
-    // Sprout JoinSplits
-    //
-
-    unsigned char joinSplitPrivKey[crypto_sign_SECRETKEYBYTES];
-    crypto_sign_keypair(mtx.joinSplitPubKey.begin(), joinSplitPrivKey);
+    if (saplingError) {
+        librustzcash_sapling_proving_ctx_free(ctx);
+        return TransactionBuilderResult(saplingError.get());
+    }
 
-    // Create Sprout JSDescriptions
-    if (!jsInputs.empty() || !jsOutputs.empty()) {
+    if (sproutError) {
         try {
-            CreateJSDescriptions();
+            std::rethrow_exception(sproutError);
         } catch (JSDescException e) {
             librustzcash_sapling_proving_ctx_free(ctx);
             return TransactionBuilderResult(e.what());
-        } catch (std::runtime_error e) {
+        } catch (...) {
             librustzcash_sapling_proving_ctx_free(ctx);
-            throw e;
+            throw;
         }
     }
 
@@ -427,6 +385,88 @@ TransactionBuilderResult TransactionBuilder::Build()
     return TransactionBuilderResult(CTransaction(mtx));
 }
 
+boost::optional<std::string> TransactionBuilder::CreateSaplingDescriptions(void* ctx)
+{
+    // Create Sapling SpendDescriptions
+    for (auto spend : spends) {
+        auto cm = spend.note.cm();
+        auto nf = spend.note.nullifier(
+            spend.expsk.full_viewing_key(), spend.witness.position());
+        if (!cm || !nf) {
+            return std::string("Spend is invalid");
+        }
+
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << spend.witness.path();
+        std::vector<unsigned char> witness(ss.begin(), ss.end());
+
+        SpendDescription sdesc;
+        if (!librustzcash_sapling_spend_proof(
+                ctx,
+                spend.expsk.full_viewing_key().ak.begin(),
+                spend.expsk.nsk.begin(),
+                spend.note.d.data(),
+                spend.note.r.begin(),
+                spend.alpha.begin(),
+                spend.note.value(),
+                spend.anchor.begin(),
+                witness.data(),
+                sdesc.cv.begin(),
+                sdesc.rk.begin(),
+                sdesc.zkproof.data())) {
+            return std::string("Spend proof failed");
+        }
+
+        sdesc.anchor = spend.anchor;
+        sdesc.nullifier = *nf;
+        mtx.vShieldedSpend.push_back(sdesc);
+    }
+
+    // Create Sapling OutputDescriptions
+    for (auto output : outputs) {
+        auto cm = output.note.cm();
+        if (!cm) {
+            return std::string("Output is invalid");
+        }
+
+        libzcash::SaplingNotePlaintext notePlaintext(output.note, output.memo);
+
+        auto res = notePlaintext.encrypt(output.note.pk_d);
+        if (!res) {
+            return std::string("Failed to encrypt note");
+        }
+        auto enc = res.get();
+        auto encryptor = enc.second;
+
+        OutputDescription odesc;
+        if (!librustzcash_sapling_output_proof(
+                ctx,
+                encryptor.get_esk().begin(),
+                output.note.d.data(),
+                output.note.pk_d.begin(),
+                output.note.r.begin(),
+                output.note.value(),
+                odesc.cv.begin(),
+                odesc.zkproof.begin())) {
+            return std::string("Output proof failed");
+        }
+
+        odesc.cm = *cm;
+        odesc.ephemeralKey = encryptor.get_epk();
+        odesc.encCiphertext = enc.first;
+
+        libzcash::SaplingOutgoingPlaintext outPlaintext(output.note.pk_d, encryptor.get_esk());
+        odesc.outCiphertext = outPlaintext.encrypt(
+            output.ovk,
+            odesc.cv,
+            odesc.cm,
+            encryptor);
+        mtx.vShieldedOutput.push_back(odesc);
+    }
+
+    return boost::none;
+}
+
 void TransactionBuilder::CreateJSDescriptions()
 {
     // Copy jsInputs and jsOutputs to more flexible containers
@@ -444,9 +484,9 @@ void TransactionBuilder::CreateJSDescriptions()
     // at the expense of leaking the sums of pairs of output values in vpub_old.
     if (jsInputs.empty()) {
         // Create joinsplits, where each output represents a zaddr recipient.
+        std::vector<std::pair<uint64_t, std::array<libzcash::JSOutput, ZC_NUM_JS_OUTPUTS>>> vOutputs;
         while (jsOutputsDeque.size() > 0) {
-            // Default array entries are dummy inputs and outputs
-            std::array<libzcash::JSInput, ZC_NUM_JS_INPUTS> vjsin;
+            // Default array entries are dummy outputs
             std::array<libzcash::JSOutput, ZC_NUM_JS_OUTPUTS> vjsout;
             uint64_t vpub_old = 0;
 
@@ -457,11 +497,54 @@ void TransactionBuilder::CreateJSDescriptions()
                 // Funds are removed from the value pool and enter the private pool
                 vpub_old += vjsout[n].value;
             }
+            vOutputs.push_back(std::make_pair(vpub_old, vjsout));
+        }
+
+        // These JoinSplits don't depend on each other, so their proofs are
+        // shared between threads. Only the Groth16 prover is known to be safe
+        // to call concurrently.
+        size_t nFirst = mtx.vjoinsplit.size();
+        std::vector<JSDescription> vjsdesc(vOutputs.size());
+        std::atomic<size_t> nextJoinSplit(0);
+        std::mutex errorMutex;
+        std::exception_ptr error;
+        auto worker = [&]() {
+            size_t i;
+            while ((i = nextJoinSplit++) < vOutputs.size()) {
+                // Default array entries are dummy inputs
+                std::array<libzcash::JSInput, ZC_NUM_JS_INPUTS> vjsin;
+                std::array<size_t, ZC_NUM_JS_INPUTS> inputMap;
+                std::array<size_t, ZC_NUM_JS_OUTPUTS> outputMap;
+                try {
+                    vjsdesc[i] = ProveJSDescription(
+                        nFirst + i, vOutputs[i].first, 0, vjsin, vOutputs[i].second, inputMap, outputMap);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(errorMutex);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                    nextJoinSplit = vOutputs.size();
+                }
+            }
+        };
 
-            std::array<size_t, ZC_NUM_JS_INPUTS> inputMap;
-            std::array<size_t, ZC_NUM_JS_OUTPUTS> outputMap;
-            CreateJSDescription(vpub_old, 0, vjsin, vjsout, inputMap, outputMap);
+        size_t nThreads = 1;
+        if (mtx.fOverwintered && (mtx.nVersion >= SAPLING_TX_VERSION)) {
+            nThreads = std::min(nProofThreads, vOutputs.size());
+        }
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < nThreads; t++) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto &thread : threads) {
+            thread.join();
         }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+
+        mtx.vjoinsplit.insert(mtx.vjoinsplit.end(), vjsdesc.begin(), vjsdesc.end());
         return;
     }
 
@@ -677,9 +760,24 @@ void TransactionBuilder::CreateJSDescription(
     std::array<libzcash::JSOutput, ZC_NUM_JS_OUTPUTS> vjsout,
     std::array<size_t, ZC_NUM_JS_INPUTS>& inputMap,
     std::array<size_t, ZC_NUM_JS_OUTPUTS>& outputMap)
+{
+    mtx.vjoinsplit.push_back(ProveJSDescription(
+        mtx.vjoinsplit.size(), vpub_old, vpub_new, vjsin, vjsout, inputMap, outputMap));
+
+    // TODO: Sprout payment disclosure
+}
+
+JSDescription TransactionBuilder::ProveJSDescription(
+    size_t index,
+    uint64_t vpub_old,
+    uint64_t vpub_new,
+    std::array<libzcash::JSInput, ZC_NUM_JS_INPUTS> vjsin,
+    std::array<libzcash::JSOutput, ZC_NUM_JS_OUTPUTS> vjsout,
+    std::array<size_t, ZC_NUM_JS_INPUTS>& inputMap,
+    std::array<size_t, ZC_NUM_JS_OUTPUTS>& outputMap) const
 {
     LogPrint("zrpcunsafe", "CreateJSDescription: creating joinsplit at index %d (vpub_old=%s, vpub_new=%s, in[0]=%s, in[1]=%s, out[0]=%s, out[1]=%s)\n",
-        mtx.vjoinsplit.size(),
+        index,
         FormatMoney(vpub_old), FormatMoney(vpub_new),
         FormatMoney(vjsin[0].note.value()), FormatMoney(vjsin[1].note.value()),
         FormatMoney(vjsout[0].value), FormatMoney(vjsout[1].value));
@@ -708,7 +806,5 @@ void TransactionBuilder::CreateJSDescription(
         }
     }
 
-    mtx.vjoinsplit.push_back(jsdesc);
-
-    // TODO: Sprout payment disclosure
+    return jsdesc;
 }
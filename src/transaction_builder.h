@@ -79,6 +79,7 @@ private:
     CCriticalSection* cs_coinsView;
     CMutableTransaction mtx;
     CAmount fee = 10000;
+    size_t nProofThreads = 1;
 
     std::vector<SpendDescriptionInfo> spends;
     std::vector<OutputDescriptionInfo> outputs;
@@ -103,6 +104,9 @@ public:
 
     void SetFee(CAmount fee);
 
+    // Sets the number of threads that create proofs in Build() (default: -par)
+    void SetProofThreads(size_t nThreads);
+
     // Throws if the anchor does not match the anchor used by
     // previously-added Sapling spends.
     void AddSaplingSpend(
@@ -143,6 +147,8 @@ public:
     TransactionBuilderResult Build();
 
 private:
+    boost::optional<std::string> CreateSaplingDescriptions(void* ctx);
+
     void CreateJSDescriptions();
 
     void CreateJSDescription(
@@ -152,6 +158,15 @@ private:
         std::array<libzcash::JSOutput, ZC_NUM_JS_OUTPUTS> vjsout,
         std::array<size_t, ZC_NUM_JS_INPUTS>& inputMap,
         std::array<size_t, ZC_NUM_JS_OUTPUTS>& outputMap);
+
+    JSDescription ProveJSDescription(
+        size_t index,
+        uint64_t vpub_old,
+        uint64_t vpub_new,
+        std::array<libzcash::JSInput, ZC_NUM_JS_INPUTS> vjsin,
+        std::array<libzcash::JSOutput, ZC_NUM_JS_OUTPUTS> vjsout,
+        std::array<size_t, ZC_NUM_JS_INPUTS>& inputMap,
+        std::array<size_t, ZC_NUM_JS_OUTPUTS>& outputMap) const;
 };
 
 #endif /* TRANSACTION_BUILDER_H */
@@ -7,8 +7,10 @@
 
 #include "chainparams.h"
 #include "hash.h"
+#include "init.h"
 #include "main.h"
 #include "pow.h"
+#include "ui_interface.h"
 #include "uint256.h"
 
 #include <stdint.h>
@@ -23,6 +25,7 @@ static const char DB_SPROUT_ANCHOR = 'A';
 static const char DB_SAPLING_ANCHOR = 'Z';
 static const char DB_NULLIFIER = 's';
 static const char DB_SAPLING_NULLIFIER = 'S';
+static const char DB_COIN = 'C';
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
@@ -42,6 +45,35 @@ static const char DB_SPENTINDEX = 'p';
 static const char DB_TIMESTAMPINDEX = 'T';
 static const char DB_BLOCKHASHINDEX = 'h';
 
+//! Size of the batches used to bulk-write the chainstate (upgrades and snapshot loading).
+static const size_t BULK_WRITE_BATCH_SIZE = 1 << 24;
+//! Maximum number of anchors or nullifiers in one chunk of a snapshot section.
+static const size_t SNAPSHOT_CHUNK_SIZE = 1024;
+
+namespace {
+
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN)  {}
+
+    template<typename Stream>
+    void Serialize(Stream &s) const {
+        s << key;
+        s << outpoint->hash;
+        s << VARINT(outpoint->n);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        s >> key;
+        s >> outpoint->hash;
+        s >> VARINT(outpoint->n);
+    }
+};
+
+}
+
 CCoinsViewDB::CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / dbName, nCacheSize, fMemory, fWipe) {
 }
 
@@ -90,12 +122,12 @@ bool CCoinsViewDB::GetNullifier(const uint256 &nf, ShieldedType type) const {
     return db.Read(make_pair(dbChar, nf), spent);
 }
 
-bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    return db.Read(CoinEntry(&outpoint), coin);
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) const {
+    return db.Exists(CoinEntry(&outpoint));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
@@ -171,10 +203,11 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
     size_t changed = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(make_pair(DB_COINS, it->first));
+            CoinEntry entry(&it->first);
+            if (it->second.coin.IsSpent())
+                batch.Erase(entry);
             else
-                batch.Write(make_pair(DB_COINS, it->first), it->second.coins);
+                batch.Write(entry, it->second.coin);
             changed++;
         }
         count++;
@@ -195,7 +228,7 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
     if (!hashSaplingAnchor.IsNull())
         batch.Write(DB_BEST_SAPLING_ANCHOR, hashSaplingAnchor);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    LogPrint("coindb", "Committing %u changed transaction outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
     return db.WriteBatch(batch);
 }
 
@@ -206,6 +239,10 @@ bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
     return Read(make_pair(DB_BLOCK_FILES, nFile), info);
 }
 
+bool CBlockTreeDB::ReadDiskBlockIndex(const uint256 &blockhash, CDiskBlockIndex &dbindex) {
+    return Read(make_pair(DB_BLOCK_INDEX, blockhash), dbindex);
+}
+
 bool CBlockTreeDB::WriteReindexing(bool fReindexing) {
     if (fReindexing)
         return Write(DB_REINDEX_FLAG, '1');
@@ -222,43 +259,59 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read(DB_LAST_BLOCK, nFile);
 }
 
+static void ApplyStats(CCoinsStats &stats, CHashWriter& ss, const std::map<uint32_t, Coin>& outputs)
+{
+    assert(!outputs.empty());
+    stats.nTransactions++;
+    for (const std::pair<const uint32_t, Coin>& output : outputs) {
+        stats.nTransactionOutputs++;
+        ss << VARINT(output.first + 1);
+        ss << output.second.out;
+    }
+    ss << VARINT(0);
+}
+
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
     boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
-    pcursor->Seek(DB_COINS);
+    pcursor->Seek(DB_COIN);
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
     CAmount nTotalAmount = 0;
+
+    // Outputs are stored individually, but are hashed per transaction so
+    // that the result matches the earlier per-transaction format.
+    uint256 prevkey;
+    std::map<uint32_t, Coin> outputs;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
-        std::pair<char, uint256> key;
-        CCoins coins;
-        if (pcursor->GetKey(key) && key.first == DB_COINS) {
-            if (pcursor->GetValue(coins)) {
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + pcursor->GetValueSize();
-                ss << VARINT(0);
-            } else {
+        COutPoint key;
+        CoinEntry entry(&key);
+        Coin coin;
+        if (pcursor->GetKey(entry) && entry.key == DB_COIN) {
+            if (!pcursor->GetValue(coin)) {
                 return error("CCoinsViewDB::GetStats() : unable to read value");
             }
+            if (!outputs.empty() && key.hash != prevkey) {
+                ApplyStats(stats, ss, outputs);
+                outputs.clear();
+            }
+            prevkey = key.hash;
+            nTotalAmount += coin.out.nValue;
+            outputs[key.n] = std::move(coin);
+            stats.nSerializedSize += 32 + pcursor->GetValueSize();
         } else {
             break;
         }
         pcursor->Next();
     }
+    if (!outputs.empty()) {
+        ApplyStats(stats, ss, outputs);
+    }
     {
         LOCK(cs_main);
         stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
@@ -268,6 +321,340 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     return true;
 }
 
+/** Legacy class to deserialize pre-pertxout database entries without reindex. */
+class CCoins
+{
+public:
+    //! whether transaction is a coinbase
+    bool fCoinBase;
+
+    //! unspent transaction outputs; spent outputs are .IsNull(); spent outputs at the end of the array are dropped
+    std::vector<CTxOut> vout;
+
+    //! at which height this transaction was included in the active block chain
+    int nHeight;
+
+    //! empty constructor
+    CCoins() : fCoinBase(false), vout(0), nHeight(0) { }
+
+    template<typename Stream>
+    void Unserialize(Stream &s) {
+        unsigned int nCode = 0;
+        // version
+        int nVersionDummy;
+        ::Unserialize(s, VARINT(nVersionDummy));
+        // header code
+        ::Unserialize(s, VARINT(nCode));
+        fCoinBase = nCode & 1;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 2) != 0;
+        vAvail[1] = (nCode & 4) != 0;
+        unsigned int nMaskCode = (nCode / 8) + ((nCode & 6) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])));
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight));
+    }
+};
+
+/** Upgrade the database from older formats.
+ *
+ * Currently implemented: from the per-tx utxo model to per-txout.
+ */
+bool CCoinsViewDB::Upgrade() {
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(make_pair(DB_COINS, uint256()));
+    if (!pcursor->Valid()) {
+        return true;
+    }
+
+    int64_t count = 0;
+    LogPrintf("Upgrading utxo-set database...\n");
+    LogPrintf("[0%%]...");
+    uiInterface.ShowProgress(_("Upgrading UTXO database"), 0);
+    CDBBatch batch(db);
+    int reportDone = 0;
+    std::pair<char, uint256> key;
+    std::pair<char, uint256> prev_key = make_pair(DB_COINS, uint256());
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested()) {
+            break;
+        }
+        if (pcursor->GetKey(key) && key.first == DB_COINS) {
+            if (count++ % 256 == 0) {
+                uint32_t high = 0x100 * *key.second.begin() + *(key.second.begin() + 1);
+                int percentageDone = (int)(high * 100.0 / 65536.0 + 0.5);
+                uiInterface.ShowProgress(_("Upgrading UTXO database"), percentageDone);
+                if (reportDone < percentageDone/10) {
+                    // report max. every 10% step
+                    LogPrintf("[%d%%]...", percentageDone);
+                    reportDone = percentageDone/10;
+                }
+            }
+            CCoins old_coins;
+            if (!pcursor->GetValue(old_coins)) {
+                return error("%s: cannot parse CCoins record", __func__);
+            }
+            COutPoint outpoint(key.second, 0);
+            for (size_t i = 0; i < old_coins.vout.size(); ++i) {
+                if (!old_coins.vout[i].IsNull() && !old_coins.vout[i].scriptPubKey.IsUnspendable()) {
+                    Coin newcoin(std::move(old_coins.vout[i]), old_coins.nHeight, old_coins.fCoinBase);
+                    outpoint.n = i;
+                    CoinEntry entry(&outpoint);
+                    batch.Write(entry, newcoin);
+                }
+            }
+            batch.Erase(key);
+            if (batch.SizeEstimate() > BULK_WRITE_BATCH_SIZE) {
+                db.WriteBatch(batch);
+                batch.Clear();
+                db.CompactRange(prev_key, key);
+                prev_key = key;
+            }
+            pcursor->Next();
+        } else {
+            break;
+        }
+    }
+    db.WriteBatch(batch);
+    db.CompactRange(make_pair(DB_COINS, uint256()), key);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s].\n", ShutdownRequested() ? "CANCELLED" : "DONE");
+    return !ShutdownRequested();
+}
+
+/*
+ * Snapshot sections. Coins are grouped by transaction: the txid, the number
+ * of unspent outputs and then each output index and Coin, terminated by a
+ * null txid. Anchors and nullifiers are written in chunks of at most
+ * SNAPSHOT_CHUNK_SIZE entries, terminated by an empty chunk. All sections are
+ * read from the database in key order, so they can be loaded back with
+ * sorted bulk writes.
+ */
+
+static void DumpCoins(CDBIterator& cursor, CHashForwarder<CAutoFile>& fileout, CSnapshotStats& stats)
+{
+    uint256 prevkey;
+    std::map<uint32_t, Coin> outputs;
+    cursor.Seek(DB_COIN);
+    while (cursor.Valid()) {
+        boost::this_thread::interruption_point();
+        COutPoint key;
+        CoinEntry entry(&key);
+        Coin coin;
+        if (!cursor.GetKey(entry) || entry.key != DB_COIN) {
+            break;
+        }
+        if (!cursor.GetValue(coin)) {
+            throw std::runtime_error("DumpCoins(): unable to read coin");
+        }
+        if (!outputs.empty() && key.hash != prevkey) {
+            fileout << prevkey << VARINT(outputs.size());
+            for (const std::pair<const uint32_t, Coin>& output : outputs) {
+                fileout << VARINT(output.first) << output.second;
+            }
+            stats.nTransactions++;
+            outputs.clear();
+        }
+        prevkey = key.hash;
+        outputs[key.n] = std::move(coin);
+        stats.nCoins++;
+        cursor.Next();
+    }
+    if (!outputs.empty()) {
+        fileout << prevkey << VARINT(outputs.size());
+        for (const std::pair<const uint32_t, Coin>& output : outputs) {
+            fileout << VARINT(output.first) << output.second;
+        }
+        stats.nTransactions++;
+    }
+    fileout << uint256();
+}
+
+template<typename Tree>
+static void DumpAnchors(CDBIterator& cursor, char dbChar, CHashForwarder<CAutoFile>& fileout, uint64_t& count)
+{
+    std::vector<std::pair<uint256, Tree> > chunk;
+    cursor.Seek(dbChar);
+    while (cursor.Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<char, uint256> key;
+        if (!cursor.GetKey(key) || key.first != dbChar) {
+            break;
+        }
+        chunk.push_back(std::make_pair(key.second, Tree()));
+        if (!cursor.GetValue(chunk.back().second)) {
+            throw std::runtime_error("DumpAnchors(): unable to read anchor");
+        }
+        count++;
+        if (chunk.size() == SNAPSHOT_CHUNK_SIZE) {
+            fileout << chunk;
+            chunk.clear();
+        }
+        cursor.Next();
+    }
+    if (!chunk.empty()) {
+        fileout << chunk;
+        chunk.clear();
+    }
+    fileout << chunk;
+}
+
+static void DumpNullifiers(CDBIterator& cursor, char dbChar, CHashForwarder<CAutoFile>& fileout, uint64_t& count)
+{
+    std::vector<uint256> chunk;
+    cursor.Seek(dbChar);
+    while (cursor.Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<char, uint256> key;
+        if (!cursor.GetKey(key) || key.first != dbChar) {
+            break;
+        }
+        chunk.push_back(key.second);
+        count++;
+        if (chunk.size() == SNAPSHOT_CHUNK_SIZE) {
+            fileout << chunk;
+            chunk.clear();
+        }
+        cursor.Next();
+    }
+    if (!chunk.empty()) {
+        fileout << chunk;
+        chunk.clear();
+    }
+    fileout << chunk;
+}
+
+CDBIterator* CCoinsViewDB::SnapshotCursor() const {
+    // LevelDB iterators read from an implicit snapshot taken when they are
+    // created, so later writes to the database are not visible through it.
+    return const_cast<CDBWrapper*>(&db)->NewIterator();
+}
+
+bool CCoinsViewDB::DumpSnapshot(CDBIterator& cursor, CHashForwarder<CAutoFile>& fileout, CSnapshotStats& stats) const {
+    try {
+        DumpCoins(cursor, fileout, stats);
+        DumpAnchors<SproutMerkleTree>(cursor, DB_SPROUT_ANCHOR, fileout, stats.nSproutAnchors);
+        DumpAnchors<SaplingMerkleTree>(cursor, DB_SAPLING_ANCHOR, fileout, stats.nSaplingAnchors);
+        DumpNullifiers(cursor, DB_NULLIFIER, fileout, stats.nSproutNullifiers);
+        DumpNullifiers(cursor, DB_SAPLING_NULLIFIER, fileout, stats.nSaplingNullifiers);
+    } catch (const std::exception& e) {
+        return error("%s: %s", __func__, e.what());
+    }
+    return true;
+}
+
+template<typename Tree>
+static void LoadAnchors(CDBWrapper& db, CDBBatch& batch, char dbChar, CHashVerifier<CAutoFile>& filein, bool fApply, uint64_t& count)
+{
+    std::vector<std::pair<uint256, Tree> > chunk;
+    do {
+        boost::this_thread::interruption_point();
+        filein >> chunk;
+        count += chunk.size();
+        if (fApply) {
+            for (const std::pair<uint256, Tree>& anchor : chunk) {
+                batch.Write(make_pair(dbChar, anchor.first), anchor.second);
+            }
+            if (batch.SizeEstimate() > BULK_WRITE_BATCH_SIZE) {
+                db.WriteBatch(batch);
+                batch.Clear();
+            }
+        }
+    } while (!chunk.empty());
+}
+
+static void LoadNullifiers(CDBWrapper& db, CDBBatch& batch, char dbChar, CHashVerifier<CAutoFile>& filein, bool fApply, uint64_t& count)
+{
+    std::vector<uint256> chunk;
+    do {
+        boost::this_thread::interruption_point();
+        filein >> chunk;
+        count += chunk.size();
+        if (fApply) {
+            for (const uint256& nf : chunk) {
+                batch.Write(make_pair(dbChar, nf), true);
+            }
+            if (batch.SizeEstimate() > BULK_WRITE_BATCH_SIZE) {
+                db.WriteBatch(batch);
+                batch.Clear();
+            }
+        }
+    } while (!chunk.empty());
+}
+
+bool CCoinsViewDB::LoadSnapshot(CHashVerifier<CAutoFile>& filein, bool fApply, CSnapshotStats& stats) {
+    CDBBatch batch(db);
+    try {
+        uint256 txid;
+        filein >> txid;
+        while (!txid.IsNull()) {
+            boost::this_thread::interruption_point();
+            uint64_t nOutputs = 0;
+            filein >> VARINT(nOutputs);
+            if (nOutputs == 0) {
+                return error("%s: transaction %s has no unspent outputs", __func__, txid.ToString());
+            }
+            COutPoint outpoint(txid, 0);
+            for (uint64_t i = 0; i < nOutputs; i++) {
+                Coin coin;
+                filein >> VARINT(outpoint.n) >> coin;
+                if (coin.IsSpent()) {
+                    return error("%s: output %s is spent", __func__, outpoint.ToString());
+                }
+                if (fApply) {
+                    batch.Write(CoinEntry(&outpoint), coin);
+                }
+            }
+            stats.nTransactions++;
+            stats.nCoins += nOutputs;
+            if (fApply && batch.SizeEstimate() > BULK_WRITE_BATCH_SIZE) {
+                db.WriteBatch(batch);
+                batch.Clear();
+            }
+            filein >> txid;
+        }
+        LoadAnchors<SproutMerkleTree>(db, batch, DB_SPROUT_ANCHOR, filein, fApply, stats.nSproutAnchors);
+        LoadAnchors<SaplingMerkleTree>(db, batch, DB_SAPLING_ANCHOR, filein, fApply, stats.nSaplingAnchors);
+        LoadNullifiers(db, batch, DB_NULLIFIER, filein, fApply, stats.nSproutNullifiers);
+        LoadNullifiers(db, batch, DB_SAPLING_NULLIFIER, filein, fApply, stats.nSaplingNullifiers);
+    } catch (const std::exception& e) {
+        return error("%s: %s", __func__, e.what());
+    }
+    if (fApply) {
+        db.WriteBatch(batch, true);
+        // The records were written in key order; compact them into the
+        // lower levels now rather than during block validation. Coin keys
+        // extend past the txid, so end the range at the next key prefix.
+        db.CompactRange(DB_COIN, (char)(DB_COIN + 1));
+    }
+    return true;
+}
+
+bool CBlockTreeDB::WriteBlockIndex(const std::vector<CDiskBlockIndex>& vindex) {
+    CDBBatch batch(*this);
+    for (std::vector<CDiskBlockIndex>::const_iterator it=vindex.begin(); it != vindex.end(); it++) {
+        batch.Write(make_pair(DB_BLOCK_INDEX, it->GetBlockHash()), *it);
+    }
+    return WriteBatch(batch);
+}
+
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
     CDBBatch batch(*this);
     for (std::vector<std::pair<int, const CBlockFileInfo*> >::const_iterator it=fileInfo.begin(); it != fileInfo.end(); it++) {
@@ -323,10 +710,11 @@ bool CBlockTreeDB::ReadAddressUnspentIndex(uint160 addressHash, int type, std::v
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         std::pair<char,CAddressUnspentKey> key;
-        if (!(pcursor->GetKey(key) && key.first == DB_ADDRESSUNSPENTINDEX && key.second.hashBytes == addressHash))
+        if (!(pcursor->GetKey(key) && key.first == DB_ADDRESSUNSPENTINDEX &&
+              key.second.type == (unsigned int)type && key.second.hashBytes == addressHash))
             break;
         CAddressUnspentValue nValue;
-        if (pcursor->GetValue(nValue))
+        if (!pcursor->GetValue(nValue))
             return error("failed to get address unspent value");
         unspentOutputs.push_back(make_pair(key.second, nValue));
         pcursor->Next();
@@ -355,7 +743,7 @@ bool CBlockTreeDB::ReadAddressIndex(
 {
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
 
-    if (start > 0 && end > 0) {
+    if (start > 0) {
         pcursor->Seek(make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorHeightKey(type, addressHash, start)));
     } else {
         pcursor->Seek(make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorKey(type, addressHash)));
@@ -364,7 +752,8 @@ bool CBlockTreeDB::ReadAddressIndex(
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         std::pair<char,CAddressIndexKey> key;
-        if (!(pcursor->GetKey(key) && key.first == DB_ADDRESSINDEX && key.second.hashBytes == addressHash))
+        if (!(pcursor->GetKey(key) && key.first == DB_ADDRESSINDEX &&
+              key.second.type == (unsigned int)type && key.second.hashBytes == addressHash))
             break;
         if (end > 0 && key.second.blockHeight > end)
             break;
@@ -456,54 +845,107 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex)
+namespace {
+
+/** A block index entry as read from the database, and then decoded. */
+struct CBlockIndexRecord
+{
+    uint256 hash;
+    std::string value;
+    CDiskBlockIndex diskindex;
+    std::string strError;
+};
+
+/**
+ * Decode records [nBegin, nEnd) of vRecords and check that each entry hashes
+ * to its key and has valid proof of work. The Equihash solutions are needed
+ * for the hash only; they are not kept in memory.
+ */
+void DecodeBlockIndexRecords(std::vector<CBlockIndexRecord>& vRecords, size_t nBegin, size_t nEnd, const Consensus::Params& params)
+{
+    for (size_t i = nBegin; i < nEnd; i++) {
+        CBlockIndexRecord& record = vRecords[i];
+        try {
+            CDataStream ssValue(record.value.data(), record.value.data() + record.value.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> record.diskindex;
+        } catch (const std::exception&) {
+            record.strError = "failed to read value";
+            continue;
+        }
+        std::string().swap(record.value);
+
+        if (record.diskindex.GetBlockHash() != record.hash)
+            record.strError = strprintf("block header inconsistency detected: on-disk = %s, key = %s",
+                record.diskindex.ToString(), record.hash.ToString());
+        else if (!CheckProofOfWork(record.hash, record.diskindex.nBits, params))
+            record.strError = strprintf("CheckProofOfWork failed: %s", record.diskindex.ToString());
+    }
+}
+
+}
+
+bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex, int nThreads)
 {
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    const Consensus::Params& params = Params().GetConsensus();
 
     pcursor->Seek(make_pair(DB_BLOCK_INDEX, uint256()));
 
-    // Load mapBlockIndex
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        std::pair<char, uint256> key;
-        if (pcursor->GetKey(key) && key.first == DB_BLOCK_INDEX) {
-            CDiskBlockIndex diskindex;
-            if (pcursor->GetValue(diskindex)) {
-                // Construct block index object
-                CBlockIndex* pindexNew = insertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = insertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->hashSproutAnchor     = diskindex.hashSproutAnchor;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->hashFinalSaplingRoot   = diskindex.hashFinalSaplingRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nSolution      = diskindex.nSolution;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nCachedBranchId = diskindex.nCachedBranchId;
-                pindexNew->nTx            = diskindex.nTx;
-                pindexNew->nSproutValue   = diskindex.nSproutValue;
-                pindexNew->nSaplingValue  = diskindex.nSaplingValue;
-
-                // Consistency checks
-                auto header = pindexNew->GetBlockHeader();
-                if (header.GetHash() != pindexNew->GetBlockHash())
-                    return error("LoadBlockIndex(): block header inconsistency detected: on-disk = %s, in-memory = %s",
-                       diskindex.ToString(),  pindexNew->ToString());
-                if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits, Params().GetConsensus()))
-                    return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
-
+    // Entries are read in batches. While one batch is read from the
+    // database, the previous one is decoded and checked by nThreads threads.
+    std::vector<CBlockIndexRecord> vReading, vDecoding;
+    boost::thread_group decoders;
+    bool fEnd = false;
+    while (true) {
+        vReading.clear();
+        while (!fEnd && vReading.size() < BLOCK_INDEX_LOAD_BATCH) {
+            std::pair<char, uint256> key;
+            if (pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_BLOCK_INDEX) {
+                vReading.push_back(CBlockIndexRecord());
+                vReading.back().hash = key.second;
+                pcursor->GetValueRaw(vReading.back().value);
                 pcursor->Next();
             } else {
-                return error("LoadBlockIndex() : failed to read value");
+                fEnd = true;
             }
-        } else {
+        }
+        decoders.join_all();
+        boost::this_thread::interruption_point();
+
+        // Load mapBlockIndex
+        for (CBlockIndexRecord& record : vDecoding) {
+            if (!record.strError.empty())
+                return error("LoadBlockIndex(): %s", record.strError);
+            const CDiskBlockIndex& diskindex = record.diskindex;
+
+            // Construct block index object
+            CBlockIndex* pindexNew = insertBlockIndex(record.hash);
+            pindexNew->pprev          = insertBlockIndex(diskindex.hashPrev);
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nDataPos       = diskindex.nDataPos;
+            pindexNew->nUndoPos       = diskindex.nUndoPos;
+            pindexNew->hashSproutAnchor     = diskindex.hashSproutAnchor;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->hashFinalSaplingRoot   = diskindex.hashFinalSaplingRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->nStatus        = diskindex.nStatus;
+            pindexNew->nCachedBranchId = diskindex.nCachedBranchId;
+            pindexNew->nTx            = diskindex.nTx;
+            pindexNew->nSproutValue   = diskindex.nSproutValue;
+            pindexNew->nSaplingValue  = diskindex.nSaplingValue;
+        }
+
+        if (vReading.empty())
             break;
+        vDecoding.swap(vReading);
+        size_t nPerThread = (vDecoding.size() + nThreads - 1) / nThreads;
+        for (size_t nBegin = 0; nBegin < vDecoding.size(); nBegin += nPerThread) {
+            size_t nEnd = std::min(nBegin + nPerThread, vDecoding.size());
+            decoders.create_thread([&vDecoding, nBegin, nEnd, &params] { DecodeBlockIndexRecords(vDecoding, nBegin, nEnd, params); });
         }
     }
 
@@ -9,6 +9,7 @@
 #include "coins.h"
 #include "dbwrapper.h"
 #include "chain.h"
+#include "hash.h"
 
 #include <map>
 #include <string>
@@ -45,6 +46,10 @@ static const int64_t nDefaultDbCache = 450;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! Number of block index entries read from the database at a time during startup
+static const size_t BLOCK_INDEX_LOAD_BATCH = 16384;
+//! Maximum number of threads decoding block index entries during startup
+static const int MAX_BLOCK_INDEX_LOAD_THREADS = 8;
 
 struct CDiskTxPos : public CDiskBlockPos
 {
@@ -71,6 +76,53 @@ struct CDiskTxPos : public CDiskBlockPos
     }
 };
 
+/** Header of a UTXO snapshot file, as written by the dumptxoutset RPC. */
+class CSnapshotMetadata
+{
+public:
+    static const uint32_t SNAPSHOT_MAGIC = 0x6f78747a; // "ztxo"
+    static const uint32_t CURRENT_VERSION = 1;
+
+    uint32_t nMagic;
+    uint32_t nVersion;
+    //! genesis block of the network the snapshot was taken on
+    uint256 hashGenesisBlock;
+    //! block at which the snapshot was taken, and its height
+    uint256 hashBlock;
+    int nHeight;
+    //! best Sprout and Sapling anchors as of hashBlock
+    uint256 hashSproutAnchor;
+    uint256 hashSaplingAnchor;
+
+    CSnapshotMetadata() : nMagic(SNAPSHOT_MAGIC), nVersion(CURRENT_VERSION), nHeight(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(nMagic);
+        READWRITE(nVersion);
+        READWRITE(hashGenesisBlock);
+        READWRITE(hashBlock);
+        READWRITE(nHeight);
+        READWRITE(hashSproutAnchor);
+        READWRITE(hashSaplingAnchor);
+    }
+};
+
+/** Number of chainstate records written to or read from a UTXO snapshot. */
+struct CSnapshotStats
+{
+    uint64_t nTransactions;
+    uint64_t nCoins;
+    uint64_t nSproutAnchors;
+    uint64_t nSaplingAnchors;
+    uint64_t nSproutNullifiers;
+    uint64_t nSaplingNullifiers;
+
+    CSnapshotStats() : nTransactions(0), nCoins(0), nSproutAnchors(0), nSaplingAnchors(0), nSproutNullifiers(0), nSaplingNullifiers(0) {}
+};
+
 /** CCoinsView backed by the coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
@@ -83,8 +135,8 @@ public:
     bool GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const;
     bool GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const;
     bool GetNullifier(const uint256 &nf, ShieldedType type) const;
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
     uint256 GetBestBlock() const;
     uint256 GetBestAnchor(ShieldedType type) const;
     bool BatchWrite(CCoinsMap &mapCoins,
@@ -96,6 +148,17 @@ public:
                     CNullifiersMap &mapSproutNullifiers,
                     CNullifiersMap &mapSaplingNullifiers);
     bool GetStats(CCoinsStats &stats) const;
+
+    //! Attempt to update from an older database format. Returns whether an error occurred.
+    bool Upgrade();
+
+    //! Cursor over a consistent view of the database, for use with DumpSnapshot.
+    CDBIterator* SnapshotCursor() const;
+    //! Write the coins, anchors and nullifiers visible through pcursor to a snapshot file.
+    bool DumpSnapshot(CDBIterator& cursor, CHashForwarder<CAutoFile>& fileout, CSnapshotStats& stats) const;
+    //! Read the sections written by DumpSnapshot and, if fApply is set, bulk-load them into
+    //! the database. The best block and anchors are left for the caller to write.
+    bool LoadSnapshot(CHashVerifier<CAutoFile>& filein, bool fApply, CSnapshotStats& stats);
 };
 
 /** Access to the block database (blocks/index/) */
@@ -109,7 +172,9 @@ private:
 public:
     bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo);
     bool EraseBatchSync(const std::vector<const CBlockIndex*>& blockinfo);
+    bool WriteBlockIndex(const std::vector<CDiskBlockIndex>& vindex);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
+    bool ReadDiskBlockIndex(const uint256 &blockhash, CDiskBlockIndex &dbindex);
     bool ReadLastBlockFile(int &nFile);
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool &fReindex);
@@ -134,7 +199,11 @@ public:
 
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
-    bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
+    /**
+     * Load all block index entries, creating them with insertBlockIndex.
+     * Entries are decoded and checked by nThreads threads.
+     */
+    bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex, int nThreads);
 };
 
 #endif // BITCOIN_TXDB_H
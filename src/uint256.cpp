@@ -123,7 +123,7 @@ static void inline HashFinal(uint32_t& a, uint32_t& b, uint32_t& c)
     c -= ((b << 24) | (b >> 8));
 }
 
-uint64_t uint256::GetHash(const uint256& salt) const
+uint64_t uint256::GetHash(const uint256& salt, uint32_t extra) const
 {
     uint32_t a, b, c;
     const uint32_t *pn = (const uint32_t*)data;
@@ -140,6 +140,7 @@ uint64_t uint256::GetHash(const uint256& salt) const
     HashMix(a, b, c);
     a += pn[6] ^ salt_pn[6];
     b += pn[7] ^ salt_pn[7];
+    c += extra;
     HashFinal(a, b, c);
 
     return ((((uint64_t)b) << 32) | c);
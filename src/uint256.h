@@ -132,10 +132,11 @@ public:
         return result;
     }
 
-    /** A more secure, salted hash function.
+    /** A more secure, salted hash function. The optional extra word is
+     * mixed into the result, for hashing (uint256, index) pairs.
      * @note This hash is not stable between little and big endian.
      */
-    uint64_t GetHash(const uint256& salt) const;
+    uint64_t GetHash(const uint256& salt, uint32_t extra = 0) const;
 };
 
 /* uint256 from const char *.
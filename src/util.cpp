@@ -773,6 +773,16 @@ void AllocateFileRange(FILE *file, unsigned int offset, unsigned int length) {
 #endif
 }
 
+/**
+ * this function tells the OS the file will be read from start to end, so it can read ahead more aggressively
+ * it is advisory
+ */
+void FileAdviseSequential(FILE *file) {
+#if defined(__linux__)
+    posix_fadvise(fileno(file), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
 void ShrinkDebugFile()
 {
     // Scroll debug.log if it's getting too big
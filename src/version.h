@@ -9,7 +9,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 175003;
+static const int PROTOCOL_VERSION = 175004;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -33,4 +33,7 @@ static const int MEMPOOL_GD_VERSION = 60002;
 //! "filter*" commands are disabled without NODE_BLOOM after and including this version
 static const int NO_BLOOM_VERSION = 175001;
 
+//! "sendcmpct", "cmpctblock", "getblocktxn" and "blocktxn" commands start with this version
+static const int SHORT_IDS_BLOCKS_VERSION = 175004;
+
 #endif // BITCOIN_VERSION_H
@@ -359,7 +359,10 @@ bool AsyncRPCOperation_mergetoaddress::main_impl()
 
 
         // Build the transaction
-        tx_ = builder_.Build().GetTxOrThrow();
+        {
+            PhaseTimer timer(this, "proving");
+            tx_ = builder_.Build().GetTxOrThrow();
+        }
 
         // Send the transaction
         // TODO: Use CWallet::CommitTransaction instead of sendrawtransaction
@@ -367,7 +370,11 @@ bool AsyncRPCOperation_mergetoaddress::main_impl()
         if (!testmode) {
             UniValue params = UniValue(UniValue::VARR);
             params.push_back(signedtxn);
-            UniValue sendResultValue = sendrawtransaction(params, false);
+            UniValue sendResultValue;
+            {
+                PhaseTimer timer(this, "broadcast");
+                sendResultValue = sendrawtransaction(params, false);
+            }
             if (sendResultValue.isNull()) {
                 throw JSONRPCError(RPC_WALLET_ERROR, "sendrawtransaction did not return an error or a txid.");
             }
@@ -761,7 +768,11 @@ void AsyncRPCOperation_mergetoaddress::sign_send_raw_transaction(UniValue obj)
 
     UniValue params = UniValue(UniValue::VARR);
     params.push_back(rawtxn);
-    UniValue signResultValue = signrawtransaction(params, false);
+    UniValue signResultValue;
+    {
+        PhaseTimer timer(this, "signing");
+        signResultValue = signrawtransaction(params, false);
+    }
     UniValue signResultObject = signResultValue.get_obj();
     UniValue completeValue = find_value(signResultObject, "complete");
     bool complete = completeValue.get_bool();
@@ -781,7 +792,11 @@ void AsyncRPCOperation_mergetoaddress::sign_send_raw_transaction(UniValue obj)
         params.clear();
         params.setArray();
         params.push_back(signedtxn);
-        UniValue sendResultValue = sendrawtransaction(params, false);
+        UniValue sendResultValue;
+        {
+            PhaseTimer timer(this, "broadcast");
+            sendResultValue = sendrawtransaction(params, false);
+        }
         if (sendResultValue.isNull()) {
             throw JSONRPCError(RPC_WALLET_ERROR, "Send raw transaction did not return an error or a txid.");
         }
@@ -841,6 +856,8 @@ UniValue AsyncRPCOperation_mergetoaddress::perform_joinsplit(
     std::vector<boost::optional<SproutWitness>> witnesses,
     uint256 anchor)
 {
+    PhaseTimer timer(this, "proving");
+
     if (anchor.IsNull()) {
         throw std::runtime_error("anchor is null");
     }
@@ -139,7 +139,11 @@ bool AsyncRPCOperation_saplingmigration::main_impl() {
         // the value of the Sapling output will be 0.0001 ZEC less.
         builder.SetFee(FEE);
         builder.AddSaplingOutput(ovkForShieldingFromTaddr(seed), migrationDestAddress, amountToSend - FEE);
-        CTransaction tx = builder.Build().GetTxOrThrow();
+        CTransaction tx;
+        {
+            PhaseTimer timer(this, "proving");
+            tx = builder.Build().GetTxOrThrow();
+        }
         if (isCancelled()) {
             LogPrint("zrpcunsafe", "%s: Canceled. Stopping.\n", getId());
             break;
@@ -24,6 +24,11 @@ public:
 
     virtual UniValue getStatus() const;
 
+    // Bulk operation, queued behind interactive sends
+    virtual OperationPriority getPriority() const { return OperationPriority::BULK; }
+
+    virtual bool isProving() const { return true; }
+
 private:
     int targetHeight_;
 
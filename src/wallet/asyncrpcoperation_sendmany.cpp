@@ -459,7 +459,10 @@ bool AsyncRPCOperation_sendmany::main_impl() {
         }
 
         // Build the transaction
-        tx_ = builder_.Build().GetTxOrThrow();
+        {
+            PhaseTimer timer(this, "proving");
+            tx_ = builder_.Build().GetTxOrThrow();
+        }
 
         // Send the transaction
         // TODO: Use CWallet::CommitTransaction instead of sendrawtransaction
@@ -467,7 +470,11 @@ bool AsyncRPCOperation_sendmany::main_impl() {
         if (!testmode) {
             UniValue params = UniValue(UniValue::VARR);
             params.push_back(signedtxn);
-            UniValue sendResultValue = sendrawtransaction(params, false);
+            UniValue sendResultValue;
+            {
+                PhaseTimer timer(this, "broadcast");
+                sendResultValue = sendrawtransaction(params, false);
+            }
             if (sendResultValue.isNull()) {
                 throw JSONRPCError(RPC_WALLET_ERROR, "sendrawtransaction did not return an error or a txid.");
             }
@@ -927,7 +934,11 @@ void AsyncRPCOperation_sendmany::sign_send_raw_transaction(UniValue obj)
 
     UniValue params = UniValue(UniValue::VARR);
     params.push_back(rawtxn);
-    UniValue signResultValue = signrawtransaction(params, false);
+    UniValue signResultValue;
+    {
+        PhaseTimer timer(this, "signing");
+        signResultValue = signrawtransaction(params, false);
+    }
     UniValue signResultObject = signResultValue.get_obj();
     UniValue completeValue = find_value(signResultObject, "complete");
     bool complete = completeValue.get_bool();
@@ -947,7 +958,11 @@ void AsyncRPCOperation_sendmany::sign_send_raw_transaction(UniValue obj)
         params.clear();
         params.setArray();
         params.push_back(signedtxn);
-        UniValue sendResultValue = sendrawtransaction(params, false);
+        UniValue sendResultValue;
+        {
+            PhaseTimer timer(this, "broadcast");
+            sendResultValue = sendrawtransaction(params, false);
+        }
         if (sendResultValue.isNull()) {
             throw JSONRPCError(RPC_WALLET_ERROR, "Send raw transaction did not return an error or a txid.");
         }
@@ -1112,6 +1127,8 @@ UniValue AsyncRPCOperation_sendmany::perform_joinsplit(
         std::vector<boost::optional < SproutWitness>> witnesses,
         uint256 anchor)
 {
+    PhaseTimer timer(this, "proving");
+
     if (anchor.IsNull()) {
         throw std::runtime_error("anchor is null");
     }
@@ -73,6 +73,8 @@ public:
 
     virtual UniValue getStatus() const;
 
+    virtual bool isProving() const { return true; }
+
     bool testmode = false;  // Set to true to disable sending txs and generating proofs
 
     bool paymentDisclosureMode = false; // Set to true to save esk for encrypted notes in payment disclosure database.
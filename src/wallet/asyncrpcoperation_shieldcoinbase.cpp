@@ -259,7 +259,10 @@ bool ShieldToAddress::operator()(const libzcash::SaplingPaymentAddress &zaddr) c
     m_op->builder_.SendChangeTo(zaddr, ovk);
 
     // Build the transaction
-    m_op->tx_ = m_op->builder_.Build().GetTxOrThrow();
+    {
+        AsyncRPCOperation::PhaseTimer timer(m_op, "proving");
+        m_op->tx_ = m_op->builder_.Build().GetTxOrThrow();
+    }
 
     // Send the transaction
     // TODO: Use CWallet::CommitTransaction instead of sendrawtransaction
@@ -267,7 +270,11 @@ bool ShieldToAddress::operator()(const libzcash::SaplingPaymentAddress &zaddr) c
     if (!m_op->testmode) {
         UniValue params = UniValue(UniValue::VARR);
         params.push_back(signedtxn);
-        UniValue sendResultValue = sendrawtransaction(params, false);
+        UniValue sendResultValue;
+        {
+            AsyncRPCOperation::PhaseTimer timer(m_op, "broadcast");
+            sendResultValue = sendrawtransaction(params, false);
+        }
         if (sendResultValue.isNull()) {
             throw JSONRPCError(RPC_WALLET_ERROR, "sendrawtransaction did not return an error or a txid.");
         }
@@ -309,7 +316,11 @@ void AsyncRPCOperation_shieldcoinbase::sign_send_raw_transaction(UniValue obj)
 
     UniValue params = UniValue(UniValue::VARR);
     params.push_back(rawtxn);
-    UniValue signResultValue = signrawtransaction(params, false);
+    UniValue signResultValue;
+    {
+        PhaseTimer timer(this, "signing");
+        signResultValue = signrawtransaction(params, false);
+    }
     UniValue signResultObject = signResultValue.get_obj();
     UniValue completeValue = find_value(signResultObject, "complete");
     bool complete = completeValue.get_bool();
@@ -329,7 +340,11 @@ void AsyncRPCOperation_shieldcoinbase::sign_send_raw_transaction(UniValue obj)
         params.clear();
         params.setArray();
         params.push_back(signedtxn);
-        UniValue sendResultValue = sendrawtransaction(params, false);
+        UniValue sendResultValue;
+        {
+            PhaseTimer timer(this, "broadcast");
+            sendResultValue = sendrawtransaction(params, false);
+        }
         if (sendResultValue.isNull()) {
             throw JSONRPCError(RPC_WALLET_ERROR, "Send raw transaction did not return an error or a txid.");
         }
@@ -362,6 +377,8 @@ void AsyncRPCOperation_shieldcoinbase::sign_send_raw_transaction(UniValue obj)
 
 
 UniValue AsyncRPCOperation_shieldcoinbase::perform_joinsplit(ShieldCoinbaseJSInfo & info) {
+    PhaseTimer timer(this, "proving");
+
     uint32_t consensusBranchId;
     uint256 anchor;
     {
@@ -61,6 +61,11 @@ public:
 
     virtual UniValue getStatus() const;
 
+    // Bulk operation, queued behind interactive sends
+    virtual OperationPriority getPriority() const { return OperationPriority::BULK; }
+
+    virtual bool isProving() const { return true; }
+
     bool testmode = false;  // Set to true to disable sending txs and generating proofs
 
     bool paymentDisclosureMode = false; // Set to true to save esk for encrypted notes in payment disclosure database.
@@ -340,6 +340,55 @@ TEST(WalletTests, FindUnspentSproutNotes) {
     mapBlockIndex.erase(blockHash3);
 }
 
+TEST(WalletTests, GetFilteredNotesByAddress) {
+    SelectParams(CBaseChainParams::TESTNET);
+    CWallet wallet;
+
+    std::vector<libzcash::SproutSpendingKey> sks;
+    std::vector<CWalletTx> wtxs;
+    for (int i = 0; i < 2; i++) {
+        auto sk = libzcash::SproutSpendingKey::random();
+        wallet.AddSproutSpendingKey(sk);
+
+        auto wtx = GetValidSproutReceive(sk, 10 * (i + 1), true);
+        auto note = GetSproutNote(sk, wtx, 0, 1);
+        mapSproutNoteData_t noteData;
+        JSOutPoint jsoutpt {wtx.GetHash(), 0, 1};
+        noteData[jsoutpt] = SproutNoteData {sk.address(), note.nullifier(sk)};
+        wtx.SetSproutNoteData(noteData);
+        wallet.AddToWallet(wtx, true, NULL);
+
+        sks.push_back(sk);
+        wtxs.push_back(wtx);
+    }
+
+    std::vector<SproutNoteEntry> sproutEntries;
+    std::vector<SaplingNoteEntry> saplingEntries;
+    wallet.GetFilteredNotes(sproutEntries, saplingEntries, "", -1);
+    EXPECT_EQ(2, sproutEntries.size());
+    sproutEntries.clear();
+
+    // Only the notes of the filtered address are returned, and returning a
+    // note again (now from the decrypted note cache) gives the same result
+    for (int n = 0; n < 2; n++) {
+        for (int i = 0; i < 2; i++) {
+            std::set<libzcash::PaymentAddress> addrs {sks[i].address()};
+            wallet.GetFilteredNotes(sproutEntries, saplingEntries, addrs, -1);
+            ASSERT_EQ(1, sproutEntries.size());
+            EXPECT_EQ(wtxs[i].GetHash(), sproutEntries[0].jsop.hash);
+            EXPECT_EQ(sks[i].address(), sproutEntries[0].address);
+            EXPECT_EQ(10 * CAmount(i + 1), sproutEntries[0].note.value());
+            EXPECT_EQ(-1, sproutEntries[0].confirmations);
+            sproutEntries.clear();
+        }
+    }
+
+    // Addresses that have not received any notes have none
+    std::set<libzcash::PaymentAddress> addrs {libzcash::SproutSpendingKey::random().address()};
+    wallet.GetFilteredNotes(sproutEntries, saplingEntries, addrs, -1);
+    EXPECT_EQ(0, sproutEntries.size());
+}
+
 
 TEST(WalletTests, SetSproutNoteAddrsInCWalletTx) {
     auto sk = libzcash::SproutSpendingKey::random();
@@ -523,6 +572,13 @@ TEST(WalletTests, FindMySaplingNotes) {
     noteMap = wallet.FindMySaplingNotes(wtx).first;
     EXPECT_EQ(2, noteMap.size());
 
+    // Searching with an explicit set of viewing keys, as a rescan does,
+    // finds the same notes, and nothing without the right key
+    std::vector<libzcash::SaplingIncomingViewingKey> ivks {fvk.in_viewing_key()};
+    EXPECT_TRUE(noteMap == wallet.FindMySaplingNotes(wtx, ivks).first);
+    ivks.clear();
+    EXPECT_EQ(0, wallet.FindMySaplingNotes(wtx, ivks).first.size());
+
     // Revert to default
     RegtestDeactivateSapling();
 }
@@ -550,6 +606,14 @@ TEST(WalletTests, FindMySproutNotes) {
     SproutNoteData nd {sk.address(), nullifier};
     EXPECT_EQ(1, noteMap.count(jsoutpt));
     EXPECT_EQ(nd, noteMap[jsoutpt]);
+
+    // Searching with an explicit set of decryptors, as a rescan does,
+    // finds the same notes, and nothing without the right decryptor
+    NoteDecryptorMap decryptors;
+    decryptors.insert(std::make_pair(sk.address(), ZCNoteDecryption(sk.receiving_key())));
+    EXPECT_TRUE(noteMap == wallet.FindMySproutNotes(wtx, decryptors));
+    decryptors.clear();
+    EXPECT_EQ(0, wallet.FindMySproutNotes(wtx, decryptors).size());
 }
 
 TEST(WalletTests, FindMySproutNotesInEncryptedWallet) {
@@ -1231,7 +1295,9 @@ TEST(WalletTests, CachedWitnessesChainTip) {
         index2.nHeight = 2;
         SproutMerkleTree sproutTree2 {sproutTree};
         SaplingMerkleTree saplingTree2 {saplingTree};
+        wallet.setNoteDataDirty.clear();
         wallet.IncrementNoteWitnesses(&index2, &block2, sproutTree2, saplingTree2);
+        EXPECT_EQ(1, wallet.setNoteDataDirty.count(wtx.GetHash()));
 
         auto anchors2 = GetWitnessesAndAnchors(wallet, sproutNotes, saplingNotes, sproutWitnesses, saplingWitnesses);
         EXPECT_NE(anchors2.first, anchors2.second);
@@ -1242,7 +1308,9 @@ TEST(WalletTests, CachedWitnessesChainTip) {
         EXPECT_NE(anchors1.second, anchors2.second);
 
         // Decrementing should give us the previous anchor
+        wallet.setNoteDataDirty.clear();
         wallet.DecrementNoteWitnesses(&index2);
+        EXPECT_EQ(1, wallet.setNoteDataDirty.count(wtx.GetHash()));
         auto anchors3 = GetWitnessesAndAnchors(wallet, sproutNotes, saplingNotes, sproutWitnesses, saplingWitnesses);
 
         EXPECT_FALSE((bool) sproutWitnesses[0]);
@@ -1276,6 +1344,83 @@ TEST(WalletTests, CachedWitnessesChainTip) {
     }
 }
 
+TEST(WalletTests, CachedWitnessesMidBlock) {
+    TestWallet wallet;
+    SproutMerkleTree sproutTree;
+    SaplingMerkleTree saplingTree;
+
+    auto sk = libzcash::SproutSpendingKey::random();
+    wallet.AddSproutSpendingKey(sk);
+
+    // Our note is followed in the block by a transaction that is not ours,
+    // so its witness is taken before the end of the block
+    auto wtx = GetValidSproutReceive(sk, 50, true, 4);
+    auto note = GetSproutNote(sk, wtx, 0, 1);
+    mapSproutNoteData_t sproutNoteData;
+    JSOutPoint jsoutpt {wtx.GetHash(), 0, 1};
+    SproutNoteData nd {sk.address(), note.nullifier(sk)};
+    sproutNoteData[jsoutpt] = nd;
+    wtx.SetSproutNoteData(sproutNoteData);
+    std::vector<SaplingOutPoint> saplingNotes = SetSaplingNoteData(wtx);
+    wallet.AddToWallet(wtx, true, NULL);
+
+    auto skOther = libzcash::SproutSpendingKey::random();
+    auto wtxOther = GetValidSproutReceive(skOther, 10, true, 4);
+
+    CBlock block;
+    block.vtx.push_back(wtx);
+    block.vtx.push_back(wtxOther);
+    CBlockIndex index(block);
+    index.nHeight = 1;
+    wallet.IncrementNoteWitnesses(&index, &block, sproutTree, saplingTree);
+
+    // The witnesses are the ones obtained by appending the rest of the
+    // block's commitments to them one at a time
+    SproutMerkleTree sproutExpectedTree;
+    SaplingMerkleTree saplingExpectedTree;
+    boost::optional<SproutWitness> sproutExpected;
+    boost::optional<SaplingWitness> saplingExpected;
+    for (const CTransaction& tx : block.vtx) {
+        for (size_t i = 0; i < tx.vjoinsplit.size(); i++) {
+            for (size_t j = 0; j < tx.vjoinsplit[i].commitments.size(); j++) {
+                const uint256& cm = tx.vjoinsplit[i].commitments[j];
+                sproutExpectedTree.append(cm);
+                if (sproutExpected) {
+                    sproutExpected->append(cm);
+                }
+                if (tx.GetHash() == jsoutpt.hash && i == jsoutpt.js && j == jsoutpt.n) {
+                    sproutExpected = sproutExpectedTree.witness();
+                }
+            }
+        }
+        for (uint32_t i = 0; i < tx.vShieldedOutput.size(); i++) {
+            const uint256& cm = tx.vShieldedOutput[i].cm;
+            saplingExpectedTree.append(cm);
+            if (saplingExpected) {
+                saplingExpected->append(cm);
+            }
+            if (tx.GetHash() == saplingNotes[0].hash && i == saplingNotes[0].n) {
+                saplingExpected = saplingExpectedTree.witness();
+            }
+        }
+    }
+    ASSERT_TRUE((bool) sproutExpected);
+    ASSERT_TRUE((bool) saplingExpected);
+    EXPECT_EQ(sproutExpectedTree.root(), sproutTree.root());
+    EXPECT_EQ(saplingExpectedTree.root(), saplingTree.root());
+
+    std::vector<JSOutPoint> sproutNotes {jsoutpt};
+    std::vector<boost::optional<SproutWitness>> sproutWitnesses;
+    std::vector<boost::optional<SaplingWitness>> saplingWitnesses;
+    auto anchors = GetWitnessesAndAnchors(wallet, sproutNotes, saplingNotes, sproutWitnesses, saplingWitnesses);
+    ASSERT_TRUE((bool) sproutWitnesses[0]);
+    ASSERT_TRUE((bool) saplingWitnesses[0]);
+    EXPECT_TRUE(*sproutWitnesses[0] == *sproutExpected);
+    EXPECT_TRUE(*saplingWitnesses[0] == *saplingExpected);
+    EXPECT_EQ(sproutTree.root(), anchors.first);
+    EXPECT_EQ(saplingTree.root(), anchors.second);
+}
+
 TEST(WalletTests, CachedWitnessesDecrementFirst) {
     TestWallet wallet;
     SproutMerkleTree sproutTree;
@@ -1443,6 +1588,85 @@ TEST(WalletTests, CachedWitnessesCleanIndex) {
     }
 }
 
+TEST(WalletTests, CachedWitnessesFrozenAcrossReorg) {
+    LOCK(cs_main);
+    TestWallet wallet;
+    SproutMerkleTree sproutTree;
+    SaplingMerkleTree saplingTree;
+
+    auto sk = libzcash::SproutSpendingKey::random();
+    wallet.AddSproutSpendingKey(sk);
+
+    // A chain in which our note is received at height 0 and spent at height
+    // 1, long enough for the spend to end up deeper than any reorg
+    size_t numBlocks = WITNESS_CACHE_SIZE + 2;
+    int tipHeight = numBlocks - 1;
+    std::vector<CBlock> blocks(numBlocks);
+    std::vector<CBlockIndex> indices(numBlocks);
+    for (size_t i = 0; i < numBlocks; i++) {
+        indices[i].nHeight = i;
+        indices[i].pprev = i > 0 ? &indices[i - 1] : NULL;
+    }
+
+    auto outpts = CreateValidBlock(wallet, sk, indices[0], blocks[0], sproutTree, saplingTree);
+    auto hash = outpts.first.hash;
+    auto note = GetSproutNote(sk, wallet.mapWallet[hash], 0, 1);
+
+    auto wtx2 = GetValidSproutSpend(sk, note, 5);
+    blocks[1].vtx.push_back(wtx2);
+    blocks[1].hashMerkleRoot = blocks[1].BuildMerkleTree();
+    indices[1].hashMerkleRoot = blocks[1].hashMerkleRoot;
+    mapBlockIndex.insert(std::make_pair(blocks[1].GetHash(), &indices[1]));
+    wtx2.SetMerkleBranch(blocks[1]);
+    wallet.AddToWallet(wtx2, true, NULL);
+
+    auto connect = [&](int height) {
+        chainActive.SetTip(&indices[height]);
+        wallet.IncrementNoteWitnesses(&indices[height], &blocks[height], sproutTree, saplingTree);
+    };
+    // The chain tip moves back before the wallet sees the block disconnected
+    auto disconnect = [&](int height) {
+        chainActive.SetTip(&indices[height - 1]);
+        wallet.DecrementNoteWitnesses(&indices[height]);
+    };
+    auto witnessHeight = [&]() {
+        return wallet.mapWallet[hash].mapSproutNoteData[outpts.first].witnessHeight;
+    };
+
+    for (int i = 1; i < tipHeight; i++) {
+        connect(i);
+    }
+    EXPECT_EQ(tipHeight - 1, witnessHeight());
+
+    // Connecting the tip puts the spend too deep to reorg, so the note's
+    // witnesses are no longer updated and its transaction isn't rewritten
+    wallet.setNoteDataDirty.clear();
+    connect(tipHeight);
+    EXPECT_EQ(tipHeight - 1, witnessHeight());
+    EXPECT_EQ(0, wallet.setNoteDataDirty.count(hash));
+
+    // Disconnecting the tip makes the spend shallow again, but the note stays
+    // frozen at the height it was last witnessed
+    disconnect(tipHeight);
+    EXPECT_EQ(tipHeight - 1, witnessHeight());
+    connect(tipHeight);
+    EXPECT_EQ(tipHeight - 1, witnessHeight());
+
+    // A reorg reaching the block the note was last witnessed at decrements it
+    disconnect(tipHeight);
+    disconnect(tipHeight - 1);
+    EXPECT_EQ(tipHeight - 2, witnessHeight());
+    connect(tipHeight - 1);
+    EXPECT_EQ(tipHeight - 1, witnessHeight());
+    connect(tipHeight);
+    EXPECT_EQ(tipHeight - 1, witnessHeight());
+    EXPECT_LE(wallet.mapWallet[hash].mapSproutNoteData[outpts.first].witnesses.size(), WITNESS_CACHE_SIZE);
+
+    // Tear down
+    chainActive.SetTip(NULL);
+    mapBlockIndex.erase(blocks[1].GetHash());
+}
+
 TEST(WalletTests, ClearNoteWitnessCache) {
     TestWallet wallet;
 
@@ -1519,6 +1743,7 @@ TEST(WalletTests, WriteWitnessCache) {
     noteData[jsoutpt] = nd;
     wtx.SetSproutNoteData(noteData);
     wallet.AddToWallet(wtx, true, NULL);
+    wallet.setNoteDataDirty.insert(wtx.GetHash());
 
     // TxnBegin fails
     EXPECT_CALL(walletdb, TxnBegin())
@@ -1584,6 +1809,12 @@ TEST(WalletTests, WriteWitnessCache) {
 
     // Everything succeeds
     wallet.SetBestChain(walletdb, loc);
+    EXPECT_TRUE(wallet.setNoteDataDirty.empty());
+
+    // Nothing has changed since, so the transaction is not written again
+    EXPECT_CALL(walletdb, WriteTx(wtx.GetHash(), wtx))
+        .Times(0);
+    wallet.SetBestChain(walletdb, loc);
 }
 
 TEST(WalletTests, SetBestChainIgnoresTxsWithoutShieldedData) {
@@ -1646,6 +1877,12 @@ TEST(WalletTests, SetBestChainIgnoresTxsWithoutShieldedData) {
     CWalletTx wtxSaplingTransparent {nullptr, mtxSaplingTransparent};
     wallet.AddToWallet(wtxSaplingTransparent, true, nullptr);
 
+    // Even if they are all marked dirty, only the transactions with note
+    // data are written
+    for (const CWalletTx& wtx : {wtxTransparent, wtxSprout, wtxSproutTransparent, wtxSapling, wtxSaplingTransparent}) {
+        wallet.setNoteDataDirty.insert(wtx.GetHash());
+    }
+
     EXPECT_CALL(walletdb, TxnBegin())
         .WillOnce(Return(true));
     EXPECT_CALL(walletdb, WriteTx(wtxTransparent.GetHash(), wtxTransparent))
@@ -2065,3 +2302,79 @@ TEST(WalletTests, SaplingNoteLocking) {
     EXPECT_FALSE(wallet.IsLockedNote(sop1));
     EXPECT_FALSE(wallet.IsLockedNote(sop2));
 }
+
+TEST(WalletTests, AvailableCoinsSkipsDeeplySpentTransactions) {
+    TestWallet wallet;
+    LOCK2(cs_main, wallet.cs_wallet);
+
+    CKey key;
+    key.MakeNewKey(true);
+    wallet.AddKey(key);
+    CScript scriptMine = GetScriptForDestination(key.GetPubKey().GetID());
+    CKey otherKey;
+    otherKey.MakeNewKey(true);
+    CScript scriptOther = GetScriptForDestination(otherKey.GetPubKey().GetID());
+
+    CMutableTransaction mtx;
+    mtx.vout.push_back(CTxOut(5 * COIN, scriptMine));
+    mtx.vout.push_back(CTxOut(COIN, scriptOther));
+    CWalletTx wtx(&wallet, mtx);
+    wallet.AddToWallet(wtx, true, NULL);
+
+    std::vector<COutput> vCoins;
+    wallet.AvailableCoins(vCoins, false);
+    ASSERT_EQ(1, vCoins.size());
+    EXPECT_EQ(wtx.GetHash(), vCoins[0].tx->GetHash());
+    EXPECT_EQ(0, vCoins[0].i);
+
+    CMutableTransaction mtx2;
+    mtx2.vin.push_back(CTxIn(wtx.GetHash(), 0));
+    mtx2.vout.push_back(CTxOut(4 * COIN, scriptOther));
+    CWalletTx wtx2(&wallet, mtx2);
+
+    // Fake-mine the transactions in the first two blocks of a chain, which
+    // puts the spend deeper than any reorg can reach
+    CBlock block;
+    block.vtx.push_back(wtx);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    CBlock block2;
+    block2.vtx.push_back(wtx2);
+    block2.hashMerkleRoot = block2.BuildMerkleTree();
+    block2.hashPrevBlock = block.GetHash();
+
+    std::vector<CBlockIndex> vIndex(MAX_REORG_LENGTH + 3);
+    vIndex[0] = CBlockIndex(block);
+    vIndex[1] = CBlockIndex(block2);
+    for (size_t i = 0; i < vIndex.size(); i++) {
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = i > 0 ? &vIndex[i - 1] : NULL;
+    }
+    mapBlockIndex.insert(std::make_pair(block.GetHash(), &vIndex[0]));
+    mapBlockIndex.insert(std::make_pair(block2.GetHash(), &vIndex[1]));
+    chainActive.SetTip(&vIndex.back());
+
+    wtx.SetMerkleBranch(block);
+    wallet.AddToWallet(wtx, true, NULL);
+    wtx2.SetMerkleBranch(block2);
+    wallet.AddToWallet(wtx2, true, NULL);
+    EXPECT_EQ((int)MAX_REORG_LENGTH + 2, wallet.GetSpendDepth(wtx.GetHash(), 0));
+
+    wallet.AvailableCoins(vCoins, false);
+    EXPECT_EQ(0, vCoins.size());
+
+    // Neither transaction has outputs we can spend any more, so importing a
+    // script they pay is only noticed once MarkDirty() adds them back
+    wallet.AddWatchOnly(scriptOther);
+    wallet.AvailableCoins(vCoins, false);
+    EXPECT_EQ(0, vCoins.size());
+    wallet.MarkDirty();
+    wallet.AvailableCoins(vCoins, false);
+    ASSERT_EQ(2, vCoins.size());
+    EXPECT_FALSE(vCoins[0].fSpendable);
+    EXPECT_FALSE(vCoins[1].fSpendable);
+
+    // Tear down
+    chainActive.SetTip(NULL);
+    mapBlockIndex.erase(block.GetHash());
+    mapBlockIndex.erase(block2.GetHash());
+}
@@ -2782,7 +2782,20 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
             sample_times.push_back(benchmark_try_decrypt_sprout_notes(nKeys));
         } else if (benchmarktype == "trydecryptsaplingnotes") {
             int nKeys = params[2].get_int();
-            sample_times.push_back(benchmark_try_decrypt_sapling_notes(nKeys));
+            // Optionally, the number of transactions in a block to decrypt
+            // as one batch, and the number of threads to decrypt it on
+            int nTxs = 1;
+            int nThreads = 1;
+            if (params.size() >= 4) {
+                nTxs = params[3].get_int();
+            }
+            if (params.size() >= 5) {
+                nThreads = params[4].get_int();
+            }
+            if (nTxs <= 0 || nThreads <= 0) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid number of transactions or threads");
+            }
+            sample_times.push_back(benchmark_try_decrypt_sapling_notes(nKeys, nTxs, nThreads));
         } else if (benchmarktype == "incnotewitnesses") {
             int nTxs = params[2].get_int();
             sample_times.push_back(benchmark_increment_sprout_note_witnesses(nTxs));
@@ -2815,6 +2828,36 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
             sample_times.push_back(benchmark_verify_sapling_spend());
         } else if (benchmarktype == "verifysaplingoutput") {
             sample_times.push_back(benchmark_verify_sapling_output());
+        } else if (benchmarktype == "sha256") {
+            // Number of bytes to hash
+            int nBytes = 1000000;
+            if (params.size() >= 3) {
+                nBytes = params[2].get_int();
+            }
+            if (nBytes < 0) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid number of bytes");
+            }
+            sample_times.push_back(benchmark_sha256(nBytes));
+        } else if (benchmarktype == "sha256d64") {
+            // Number of 64-byte inputs to double-hash in one batch
+            int nBlocks = 100000;
+            if (params.size() >= 3) {
+                nBlocks = params[2].get_int();
+            }
+            if (nBlocks < 0) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid number of inputs");
+            }
+            sample_times.push_back(benchmark_sha256d64(nBlocks));
+        } else if (benchmarktype == "merkleroot") {
+            // Number of transactions in the block
+            int nTxs = 5000;
+            if (params.size() >= 3) {
+                nTxs = params[2].get_int();
+            }
+            if (nTxs < 0) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid number of transactions");
+            }
+            sample_times.push_back(benchmark_merkle_root(nTxs));
         } else {
             throw JSONRPCError(RPC_TYPE_ERROR, "Invalid benchmarktype");
         }
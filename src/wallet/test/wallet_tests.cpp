@@ -307,4 +307,53 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(coin_selection_changeless)
+{
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+
+    LOCK(wallet.cs_wallet);
+
+    for (int i = 0; i < RUN_TESTS; i++)
+    {
+        empty_wallet();
+        for (int j = 1; j <= 9; j++)
+            add_coin(j * CENT);
+
+        // 15 cents can be made from many subsets of 1..9 cents; we should
+        // get one of the two that need only two inputs (6+9 or 7+8)
+        BOOST_CHECK( wallet.SelectCoinsMinConf(15 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, 15 * CENT);
+        BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
+
+        // a subset whose excess would only be dust change is as good as exact,
+        // and is preferred over the next bigger coin
+        empty_wallet();
+        add_coin(3 * CENT + 10);
+        add_coin(5 * CENT);
+        add_coin(20 * CENT);
+        BOOST_CHECK( wallet.SelectCoinsMinConf(8 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, 8 * CENT + 10);
+        BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
+
+        // but not once the excess would be a change output
+        empty_wallet();
+        add_coin(3 * CENT + 1000);
+        add_coin(5 * CENT);
+        add_coin(20 * CENT);
+        BOOST_CHECK( wallet.SelectCoinsMinConf(8 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, 20 * CENT);
+        BOOST_CHECK_EQUAL(setCoinsRet.size(), 1U);
+    }
+
+    // many small coins of equal value are searched without trying every subset
+    empty_wallet();
+    for (int j = 0; j < 10000; j++)
+        add_coin(CENT / 100);
+    BOOST_CHECK( wallet.SelectCoinsMinConf(50 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 50 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 5000U);
+    empty_wallet();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
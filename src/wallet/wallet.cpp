@@ -935,6 +935,26 @@ bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
     return false;
 }
 
+/**
+ * Returns the depth of the non-conflicted transaction spending an outpoint,
+ * or 0 if it is unspent.
+ */
+int CWallet::GetSpendDepth(const uint256& hash, unsigned int n) const
+{
+    const COutPoint outpoint(hash, n);
+    pair<TxSpends::const_iterator, TxSpends::const_iterator> range;
+    range = mapTxSpends.equal_range(outpoint);
+
+    for (TxSpends::const_iterator it = range.first; it != range.second; ++it)
+    {
+        const uint256& wtxid = it->second;
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(wtxid);
+        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain() >= 0)
+            return mit->second.GetDepthInMainChain(); // Spent
+    }
+    return 0;
+}
+
 /**
  * Note is spent if any non-conflicted transaction
  * spends it:
@@ -967,6 +987,38 @@ bool CWallet::IsSaplingSpent(const uint256& nullifier) const {
     return false;
 }
 
+/**
+ * Depth in the main chain of the transaction spending a note, or 0 if the
+ * note is unspent or only spent by unconfirmed transactions.
+ */
+int CWallet::GetSproutSpendDepth(const uint256& nullifier) const {
+    pair<TxNullifiers::const_iterator, TxNullifiers::const_iterator> range;
+    range = mapTxSproutNullifiers.equal_range(nullifier);
+
+    for (TxNullifiers::const_iterator it = range.first; it != range.second; ++it) {
+        const uint256& wtxid = it->second;
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(wtxid);
+        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain() >= 0) {
+            return mit->second.GetDepthInMainChain(); // Spent
+        }
+    }
+    return 0;
+}
+
+int CWallet::GetSaplingSpendDepth(const uint256& nullifier) const {
+    pair<TxNullifiers::const_iterator, TxNullifiers::const_iterator> range;
+    range = mapTxSaplingNullifiers.equal_range(nullifier);
+
+    for (TxNullifiers::const_iterator it = range.first; it != range.second; ++it) {
+        const uint256& wtxid = it->second;
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(wtxid);
+        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain() >= 0) {
+            return mit->second.GetDepthInMainChain(); // Spent
+        }
+    }
+    return 0;
+}
+
 void CWallet::AddToTransparentSpends(const COutPoint& outpoint, const uint256& wtxid)
 {
     mapTxSpends.insert(make_pair(outpoint, wtxid));
@@ -1018,6 +1070,9 @@ void CWallet::ClearNoteWitnessCache()
 {
     LOCK(cs_wallet);
     for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
+        if (!(wtxItem.second.mapSproutNoteData.empty() && wtxItem.second.mapSaplingNoteData.empty())) {
+            setNoteDataDirty.insert(wtxItem.first);
+        }
         for (mapSproutNoteData_t::value_type& item : wtxItem.second.mapSproutNoteData) {
             item.second.witnesses.clear();
             item.second.witnessHeight = -1;
@@ -1030,11 +1085,42 @@ void CWallet::ClearNoteWitnessCache()
     nWitnessCacheSize = 0;
 }
 
+static bool IsSpentBeyondReorg(const CWallet& wallet, const SproutNoteData& nd)
+{
+    return nd.nullifier && wallet.GetSproutSpendDepth(*nd.nullifier) > (int)WITNESS_CACHE_SIZE;
+}
+
+static bool IsSpentBeyondReorg(const CWallet& wallet, const SaplingNoteData& nd)
+{
+    return nd.nullifier && wallet.GetSaplingSpendDepth(*nd.nullifier) > (int)WITNESS_CACHE_SIZE;
+}
+
+/**
+ * A note spent more than WITNESS_CACHE_SIZE blocks ago can no longer be
+ * unspent by a reorg, so its witnesses are never needed again. We stop
+ * updating them, which keeps the transaction out of the set that has to be
+ * rewritten on every block.
+ *
+ * The spend depth moves back during a reorg, so once a note is frozen it is
+ * recognised by its witnessHeight falling behind the block being connected.
+ * DecrementNoteWitnesses leaves such notes alone until the reorg reaches the
+ * block they were last witnessed at.
+ */
+template<typename NoteData>
+static bool IsFrozen(const CWallet& wallet, const NoteData& nd, int indexHeight)
+{
+    return (nd.witnessHeight != -1 && nd.witnessHeight < indexHeight - 1) ||
+        IsSpentBeyondReorg(wallet, nd);
+}
+
 template<typename NoteDataMap>
-void CopyPreviousWitnesses(NoteDataMap& noteDataMap, int indexHeight, int64_t nWitnessCacheSize)
+void CopyPreviousWitnesses(const CWallet& wallet, NoteDataMap& noteDataMap, int indexHeight, int64_t nWitnessCacheSize)
 {
     for (auto& item : noteDataMap) {
         auto* nd = &(item.second);
+        if (IsFrozen(wallet, *nd, indexHeight)) {
+            continue;
+        }
         // Only increment witnesses that are behind the current height
         if (nd->witnessHeight < indexHeight) {
             // Check the validity of the cache
@@ -1057,16 +1143,16 @@ void CopyPreviousWitnesses(NoteDataMap& noteDataMap, int indexHeight, int64_t nW
     }
 }
 
-template<typename NoteDataMap>
-void AppendNoteCommitment(NoteDataMap& noteDataMap, int indexHeight, int64_t nWitnessCacheSize, const uint256& note_commitment)
+template<typename NoteDataMap, typename Updater>
+void UpdateNoteWitnesses(const CWallet& wallet, NoteDataMap& noteDataMap, int indexHeight, int64_t nWitnessCacheSize, const Updater& updater)
 {
     for (auto& item : noteDataMap) {
         auto* nd = &(item.second);
-        if (nd->witnessHeight < indexHeight && nd->witnesses.size() > 0) {
+        if (nd->witnessHeight < indexHeight && nd->witnesses.size() > 0 && !IsFrozen(wallet, *nd, indexHeight)) {
             // Check the validity of the cache
             // See comment in CopyPreviousWitnesses about validity.
             assert(nWitnessCacheSize >= nd->witnesses.size());
-            nd->witnesses.front().append(note_commitment);
+            updater.update(nd->witnesses.front());
         }
     }
 }
@@ -1103,17 +1189,20 @@ void WitnessNoteIfMine(std::map<OutPoint, NoteData>& noteDataMap, int indexHeigh
 
 
 template<typename NoteDataMap>
-void UpdateWitnessHeights(NoteDataMap& noteDataMap, int indexHeight, int64_t nWitnessCacheSize)
+bool UpdateWitnessHeights(const CWallet& wallet, NoteDataMap& noteDataMap, int indexHeight, int64_t nWitnessCacheSize)
 {
+    bool fUpdated = false;
     for (auto& item : noteDataMap) {
         auto* nd = &(item.second);
-        if (nd->witnessHeight < indexHeight) {
+        if (nd->witnessHeight < indexHeight && !IsFrozen(wallet, *nd, indexHeight)) {
             nd->witnessHeight = indexHeight;
+            fUpdated = true;
             // Check the validity of the cache
             // See comment in CopyPreviousWitnesses about validity.
             assert(nWitnessCacheSize >= nd->witnesses.size());
         }
     }
+    return fUpdated;
 }
 
 void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
@@ -1123,8 +1212,8 @@ void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
 {
     LOCK(cs_wallet);
     for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
-       ::CopyPreviousWitnesses(wtxItem.second.mapSproutNoteData, pindex->nHeight, nWitnessCacheSize);
-       ::CopyPreviousWitnesses(wtxItem.second.mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize);
+       ::CopyPreviousWitnesses(*this, wtxItem.second.mapSproutNoteData, pindex->nHeight, nWitnessCacheSize);
+       ::CopyPreviousWitnesses(*this, wtxItem.second.mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize);
     }
 
     if (nWitnessCacheSize < WITNESS_CACHE_SIZE) {
@@ -1138,6 +1227,12 @@ void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
         pblock = &block;
     }
 
+    // Append the block's note commitments to the trees once, witnessing our
+    // new notes along the way, and then bring every witness up to date from
+    // the subtrees they completed.
+    SproutWitnessUpdater sproutUpdater(sproutTree);
+    SaplingWitnessUpdater saplingUpdater(saplingTree);
+
     for (const CTransaction& tx : pblock->vtx) {
         auto hash = tx.GetHash();
         bool txIsOurs = mapWallet.count(hash);
@@ -1145,43 +1240,41 @@ void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
         for (size_t i = 0; i < tx.vjoinsplit.size(); i++) {
             const JSDescription& jsdesc = tx.vjoinsplit[i];
             for (uint8_t j = 0; j < jsdesc.commitments.size(); j++) {
-                const uint256& note_commitment = jsdesc.commitments[j];
-                sproutTree.append(note_commitment);
-
-                // Increment existing witnesses
-                for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
-                    ::AppendNoteCommitment(wtxItem.second.mapSproutNoteData, pindex->nHeight, nWitnessCacheSize, note_commitment);
-                }
+                sproutUpdater.append(jsdesc.commitments[j]);
 
                 // If this is our note, witness it
                 if (txIsOurs) {
                     JSOutPoint jsoutpt {hash, i, j};
-                    ::WitnessNoteIfMine(mapWallet[hash].mapSproutNoteData, pindex->nHeight, nWitnessCacheSize, jsoutpt, sproutTree.witness());
+                    ::WitnessNoteIfMine(mapWallet[hash].mapSproutNoteData, pindex->nHeight, nWitnessCacheSize, jsoutpt, sproutUpdater.tree().witness());
                 }
             }
         }
         // Sapling
         for (uint32_t i = 0; i < tx.vShieldedOutput.size(); i++) {
-            const uint256& note_commitment = tx.vShieldedOutput[i].cm;
-            saplingTree.append(note_commitment);
-
-            // Increment existing witnesses
-            for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
-                ::AppendNoteCommitment(wtxItem.second.mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize, note_commitment);
-            }
+            saplingUpdater.append(tx.vShieldedOutput[i].cm);
 
             // If this is our note, witness it
             if (txIsOurs) {
                 SaplingOutPoint outPoint {hash, i};
-                ::WitnessNoteIfMine(mapWallet[hash].mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize, outPoint, saplingTree.witness());
+                ::WitnessNoteIfMine(mapWallet[hash].mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize, outPoint, saplingUpdater.tree().witness());
             }
         }
     }
 
-    // Update witness heights
+    sproutTree = sproutUpdater.tree();
+    saplingTree = saplingUpdater.tree();
+
+    // Increment existing witnesses and update witness heights. Every note
+    // whose witnesses changed also had its height moved forward, so that
+    // tells us which transactions SetBestChain() has to write out.
     for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
-        ::UpdateWitnessHeights(wtxItem.second.mapSproutNoteData, pindex->nHeight, nWitnessCacheSize);
-        ::UpdateWitnessHeights(wtxItem.second.mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize);
+        ::UpdateNoteWitnesses(*this, wtxItem.second.mapSproutNoteData, pindex->nHeight, nWitnessCacheSize, sproutUpdater);
+        ::UpdateNoteWitnesses(*this, wtxItem.second.mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize, saplingUpdater);
+        bool fUpdated = ::UpdateWitnessHeights(*this, wtxItem.second.mapSproutNoteData, pindex->nHeight, nWitnessCacheSize);
+        fUpdated |= ::UpdateWitnessHeights(*this, wtxItem.second.mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize);
+        if (fUpdated) {
+            setNoteDataDirty.insert(wtxItem.first);
+        }
     }
 
     // For performance reasons, we write out the witness cache in
@@ -1190,12 +1283,24 @@ void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
 }
 
 template<typename NoteDataMap>
-void DecrementNoteWitnesses(NoteDataMap& noteDataMap, int indexHeight, int64_t nWitnessCacheSize)
+bool DecrementNoteWitnesses(const CWallet& wallet, NoteDataMap& noteDataMap, int indexHeight, int64_t nWitnessCacheSize)
 {
+    bool fUpdated = false;
     for (auto& item : noteDataMap) {
         auto* nd = &(item.second);
+        // A frozen note was last witnessed below the block being removed, so
+        // its witnesses stay as they are; only trim them to the size the
+        // cache is shrinking to.
+        if (nd->witnessHeight != -1 && nd->witnessHeight < indexHeight) {
+            while ((int64_t)nd->witnesses.size() > nWitnessCacheSize - 1) {
+                nd->witnesses.pop_back();
+                fUpdated = true;
+            }
+            continue;
+        }
         // Only decrement witnesses that are not above the current height
         if (nd->witnessHeight <= indexHeight) {
+            fUpdated = true;
             // Check the validity of the cache
             // See comment below (this would be invalid if there were a
             // prior decrement).
@@ -1227,14 +1332,18 @@ void DecrementNoteWitnesses(NoteDataMap& noteDataMap, int indexHeight, int64_t n
             assert((nWitnessCacheSize - 1) >= nd->witnesses.size());
         }
     }
+    return fUpdated;
 }
 
 void CWallet::DecrementNoteWitnesses(const CBlockIndex* pindex)
 {
     LOCK(cs_wallet);
     for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
-        ::DecrementNoteWitnesses(wtxItem.second.mapSproutNoteData, pindex->nHeight, nWitnessCacheSize);
-        ::DecrementNoteWitnesses(wtxItem.second.mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize);
+        bool fUpdated = ::DecrementNoteWitnesses(*this, wtxItem.second.mapSproutNoteData, pindex->nHeight, nWitnessCacheSize);
+        fUpdated |= ::DecrementNoteWitnesses(*this, wtxItem.second.mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize);
+        if (fUpdated) {
+            setNoteDataDirty.insert(wtxItem.first);
+        }
     }
     nWitnessCacheSize -= 1;
     // TODO: If nWitnessCache is zero, we need to regenerate the caches (#1302)
@@ -1377,8 +1486,11 @@ void CWallet::MarkDirty()
 {
     {
         LOCK(cs_wallet);
-        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet) {
             item.second.MarkDirty();
+            if (!item.second.vout.empty())
+                setCoinTxs.insert(item.first);
+        }
     }
 }
 
@@ -1408,6 +1520,7 @@ bool CWallet::UpdateNullifierNoteMap()
                             dec,
                             hSig,
                             item.first.n);
+                        setNoteDataDirty.insert(wtxItem.first);
                     }
                 }
             }
@@ -1443,6 +1556,20 @@ void CWallet::UpdateNullifierNoteMapWithTx(const CWalletTx& wtx)
     }
 }
 
+/**
+ * Add the notes in this tx to mapSproutNotesByAddress and mapSaplingNotesByIvk.
+ */
+void CWallet::UpdateNoteIndexWithTx(const CWalletTx& wtx)
+{
+    LOCK(cs_wallet);
+    for (const mapSproutNoteData_t::value_type& item : wtx.mapSproutNoteData) {
+        mapSproutNotesByAddress[item.second.address].insert(item.first);
+    }
+    for (const mapSaplingNoteData_t::value_type& item : wtx.mapSaplingNoteData) {
+        mapSaplingNotesByIvk[item.second.ivk].insert(item.first);
+    }
+}
+
 /**
  * Update mapSaplingNullifiersToNotes, computing the nullifier from a cached witness if necessary.
  */
@@ -1457,6 +1584,7 @@ void CWallet::UpdateSaplingNullifierNoteMapWithTx(CWalletTx& wtx) {
             // If there are no witnesses, erase the nullifier and associated mapping.
             if (item.second.nullifier) {
                 mapSaplingNullifiersToNotes.erase(item.second.nullifier.get());
+                setNoteDataDirty.insert(wtx.GetHash());
             }
             item.second.nullifier = boost::none;
         }
@@ -1481,6 +1609,9 @@ void CWallet::UpdateSaplingNullifierNoteMapWithTx(CWalletTx& wtx) {
             }
             uint256 nullifier = optNullifier.get();
             mapSaplingNullifiersToNotes[nullifier] = op;
+            if (item.second.nullifier != nullifier) {
+                setNoteDataDirty.insert(wtx.GetHash());
+            }
             item.second.nullifier = nullifier;
         }
     }
@@ -1511,7 +1642,10 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
         mapWallet[hash] = wtxIn;
         mapWallet[hash].BindWallet(this);
         UpdateNullifierNoteMapWithTx(mapWallet[hash]);
+        UpdateNoteIndexWithTx(mapWallet[hash]);
         AddToSpends(hash);
+        if (!wtxIn.vout.empty())
+            setCoinTxs.insert(hash);
     }
     else
     {
@@ -1600,13 +1734,23 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
             }
         }
 
+        UpdateNoteIndexWithTx(wtx);
+        if (!wtx.vout.empty())
+            setCoinTxs.insert(hash);
+
         //// debug print
         LogPrintf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
 
         // Write to disk
-        if (fInsertedNew || fUpdated)
+        if (fInsertedNew || fUpdated) {
             if (!wtx.WriteToDisk(pwalletdb))
                 return false;
+            // Also rewrite the note data with the next best block, so that
+            // it stays consistent with the witness cache on disk.
+            if (!(wtx.mapSproutNoteData.empty() && wtx.mapSaplingNoteData.empty())) {
+                setNoteDataDirty.insert(hash);
+            }
+        }
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
@@ -1670,16 +1814,35 @@ bool CWallet::UpdatedNoteData(const CWalletTx& wtxIn, CWalletTx& wtx)
  * If fUpdate is true, existing transactions will be updated.
  */
 bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate)
+{
+    AssertLockHeld(cs_wallet);
+    if (!fUpdate && mapWallet.count(tx.GetHash()) != 0) return false;
+    return AddToWalletIfInvolvingMe(tx, pblock, fUpdate, FindMySproutNotes(tx), FindMySaplingNotes(tx));
+}
+
+/**
+ * As above, but with the results of FindMySproutNotes and FindMySaplingNotes
+ * for this transaction already computed, e.g. by a rescan thread.
+ */
+bool CWallet::AddToWalletIfInvolvingMe(
+    const CTransaction& tx,
+    const CBlock* pblock,
+    bool fUpdate,
+    const mapSproutNoteData_t& sproutNoteData,
+    const std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>& saplingNoteDataAndAddressesToAdd)
 {
     {
         AssertLockHeld(cs_wallet);
         bool fExisted = mapWallet.count(tx.GetHash()) != 0;
         if (fExisted && !fUpdate) return false;
-        auto sproutNoteData = FindMySproutNotes(tx);
-        auto saplingNoteDataAndAddressesToAdd = FindMySaplingNotes(tx);
         auto saplingNoteData = saplingNoteDataAndAddressesToAdd.first;
         auto addressesToAdd = saplingNoteDataAndAddressesToAdd.second;
         for (const auto &addressToAdd : addressesToAdd) {
+            // The note data may have been computed before an earlier
+            // transaction added this address.
+            if (HaveSaplingIncomingViewingKey(addressToAdd.first)) {
+                continue;
+            }
             if (!AddSaplingIncomingViewingKey(addressToAdd.second, addressToAdd.first)) {
                 return false;
             }
@@ -1713,7 +1876,10 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
 void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
 {
     LOCK2(cs_main, cs_wallet);
-    if (!AddToWalletIfInvolvingMe(tx, pblock, true))
+    bool fInvolvesMe = pblock ?
+        AddToWalletIfInvolvingMe(tx, pblock, true, FindMySproutNotes(tx), FindMySaplingNotesCached(tx, *pblock)) :
+        AddToWalletIfInvolvingMe(tx, pblock, true);
+    if (!fInvolvesMe)
         return; // Not one of ours
 
     MarkAffectedTransactionsDirty(tx);
@@ -1753,8 +1919,23 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        auto mi = mapWallet.find(hash);
+        if (mi != mapWallet.end()) {
+            for (const mapSproutNoteData_t::value_type& item : mi->second.mapSproutNoteData) {
+                mapSproutNoteEntries.erase(item.first);
+            }
+            for (const mapSaplingNoteData_t::value_type& item : mi->second.mapSaplingNoteData) {
+                mapSaplingNoteEntries.erase(item.first);
+            }
+            // The outputs this transaction spent may be spendable again
+            for (const CTxIn& txin : mi->second.vin) {
+                if (mapWallet.count(txin.prevout.hash))
+                    setCoinTxs.insert(txin.prevout.hash);
+            }
+            setCoinTxs.erase(hash);
+            mapWallet.erase(mi);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return;
 }
@@ -1805,13 +1986,23 @@ boost::optional<uint256> CWallet::GetSproutNoteNullifier(const JSDescription &js
 mapSproutNoteData_t CWallet::FindMySproutNotes(const CTransaction &tx) const
 {
     LOCK(cs_SpendingKeyStore);
+    return FindMySproutNotes(tx, mapNoteDecryptors);
+}
+
+/**
+ * As above, but trial-decrypts with the given decryptors rather than the
+ * wallet's own, so that callers holding a copy of mapNoteDecryptors can
+ * search several transactions concurrently.
+ */
+mapSproutNoteData_t CWallet::FindMySproutNotes(const CTransaction &tx, const NoteDecryptorMap& decryptors) const
+{
     uint256 hash = tx.GetHash();
 
     mapSproutNoteData_t noteData;
     for (size_t i = 0; i < tx.vjoinsplit.size(); i++) {
         auto hSig = tx.vjoinsplit[i].h_sig(*pzcashParams, tx.joinSplitPubKey);
         for (uint8_t j = 0; j < tx.vjoinsplit[i].ciphertexts.size(); j++) {
-            for (const NoteDecryptorMap::value_type& item : mapNoteDecryptors) {
+            for (const NoteDecryptorMap::value_type& item : decryptors) {
                 try {
                     auto address = item.first;
                     JSOutPoint jsoutpt {hash, i, j};
@@ -1852,36 +2043,116 @@ mapSproutNoteData_t CWallet::FindMySproutNotes(const CTransaction &tx) const
  */
 std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> CWallet::FindMySaplingNotes(const CTransaction &tx) const
 {
-    LOCK(cs_SpendingKeyStore);
-    uint256 hash = tx.GetHash();
+    std::vector<SaplingIncomingViewingKey> ivks;
+    GetSaplingIncomingViewingKeys(ivks);
+    return FindMySaplingNotes(tx, ivks);
+}
+
+/**
+ * As above, but trial-decrypts with the given incoming viewing keys rather
+ * than the wallet's own, so that callers holding a copy of them can search
+ * several transactions concurrently.
+ */
+std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> CWallet::FindMySaplingNotes(
+    const CTransaction &tx,
+    const std::vector<SaplingIncomingViewingKey>& ivks) const
+{
+    return FindMySaplingNotes(std::vector<const CTransaction*> {&tx}, ivks, 1)[0];
+}
+
+/**
+ * Finds the Sapling notes in every transaction of the given block, trial-
+ * decrypting all of the block's outputs in one batch on up to nThreads
+ * threads. Returns the results of FindMySaplingNotes for each transaction,
+ * in block order.
+ */
+std::vector<std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>> CWallet::FindMySaplingNotesInBlock(
+    const CBlock& block,
+    const std::vector<SaplingIncomingViewingKey>& ivks,
+    size_t nThreads) const
+{
+    std::vector<const CTransaction*> vtx;
+    vtx.reserve(block.vtx.size());
+    for (const CTransaction& tx : block.vtx) {
+        vtx.push_back(&tx);
+    }
+    return FindMySaplingNotes(vtx, ivks, nThreads);
+}
 
-    mapSaplingNoteData_t noteData;
-    SaplingIncomingViewingKeyMap viewingKeysToAdd;
+std::vector<std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>> CWallet::FindMySaplingNotes(
+    const std::vector<const CTransaction*>& vtx,
+    const std::vector<SaplingIncomingViewingKey>& ivks,
+    size_t nThreads) const
+{
+    std::vector<std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>> ret(vtx.size());
 
     // Protocol Spec: 4.19 Block Chain Scanning (Sapling)
-    for (uint32_t i = 0; i < tx.vShieldedOutput.size(); ++i) {
-        const OutputDescription output = tx.vShieldedOutput[i];
-        for (auto it = mapSaplingFullViewingKeys.begin(); it != mapSaplingFullViewingKeys.end(); ++it) {
-            SaplingIncomingViewingKey ivk = it->first;
-            auto result = SaplingNotePlaintext::decrypt(output.encCiphertext, ivk, output.ephemeralKey, output.cm);
-            if (!result) {
-                continue;
-            }
-            auto address = ivk.address(result.get().d);
-            if (address && mapSaplingIncomingViewingKeys.count(address.get()) == 0) {
-                viewingKeysToAdd[address.get()] = ivk;
+    std::vector<SaplingEncDecryptionInput> outputs;
+    std::vector<uint256> cmus;
+    std::vector<std::pair<size_t, uint32_t>> outputTxIndices;
+    for (size_t t = 0; t < vtx.size(); t++) {
+        for (uint32_t i = 0; i < vtx[t]->vShieldedOutput.size(); i++) {
+            const OutputDescription& output = vtx[t]->vShieldedOutput[i];
+            outputs.push_back(SaplingEncDecryptionInput {&output.encCiphertext, output.ephemeralKey});
+            cmus.push_back(output.cm);
+            outputTxIndices.push_back(std::make_pair(t, i));
+        }
+    }
+    if (outputs.empty() || ivks.empty()) {
+        return ret;
+    }
+
+    std::vector<uint256> ivkValues(ivks.begin(), ivks.end());
+    for (const auto& match : SaplingNotePlaintext::decrypt_batch(outputs, cmus, ivkValues, nThreads)) {
+        size_t t = outputTxIndices[match.first].first;
+        uint32_t i = outputTxIndices[match.first].second;
+        const SaplingIncomingViewingKey& ivk = ivks[match.second.first];
+        auto address = ivk.address(match.second.second.d);
+        if (address && !HaveSaplingIncomingViewingKey(address.get())) {
+            ret[t].second[address.get()] = ivk;
+        }
+        // We don't cache the nullifier here as computing it requires knowledge of the note position
+        // in the commitment tree, which can only be determined when the transaction has been mined.
+        SaplingOutPoint op {vtx[t]->GetHash(), i};
+        SaplingNoteData nd;
+        nd.ivk = ivk;
+        ret[t].first.insert(std::make_pair(op, nd));
+    }
+
+    return ret;
+}
+
+/**
+ * Returns the results of FindMySaplingNotes for a transaction in the given
+ * block, trial-decrypting the whole block in one batch the first time one of
+ * its transactions is looked up.
+ */
+std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> CWallet::FindMySaplingNotesCached(
+    const CTransaction& tx,
+    const CBlock& block)
+{
+    AssertLockHeld(cs_wallet);
+    std::vector<SaplingIncomingViewingKey> ivks;
+    GetSaplingIncomingViewingKeys(ivks);
+
+    uint256 hashBlock = block.GetHash();
+    if (hashBlock != hashSaplingNotesBlock || ivks.size() != nSaplingNotesBlockKeys) {
+        auto vNoteData = FindMySaplingNotesInBlock(block, ivks, std::max(nScriptCheckThreads, 1));
+        mapSaplingNotesBlock.clear();
+        for (size_t i = 0; i < block.vtx.size(); i++) {
+            if (!vNoteData[i].first.empty()) {
+                mapSaplingNotesBlock[block.vtx[i].GetHash()] = vNoteData[i];
             }
-            // We don't cache the nullifier here as computing it requires knowledge of the note position
-            // in the commitment tree, which can only be determined when the transaction has been mined.
-            SaplingOutPoint op {hash, i};
-            SaplingNoteData nd;
-            nd.ivk = ivk;
-            noteData.insert(std::make_pair(op, nd));
-            break;
         }
+        hashSaplingNotesBlock = hashBlock;
+        nSaplingNotesBlockKeys = ivks.size();
     }
 
-    return std::make_pair(noteData, viewingKeysToAdd);
+    auto it = mapSaplingNotesBlock.find(tx.GetHash());
+    if (it == mapSaplingNotesBlock.end()) {
+        return std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>();
+    }
+    return it->second;
 }
 
 bool CWallet::IsSproutNullifierFromMe(const uint256& nullifier) const
@@ -2192,7 +2463,7 @@ bool CWallet::LoadCryptedHDSeed(const uint256& seedFp, const std::vector<unsigne
     return CCryptoKeyStore::SetCryptedHDSeed(seedFp, seed);
 }
 
-void CWalletTx::SetSproutNoteData(mapSproutNoteData_t &noteData)
+void CWalletTx::SetSproutNoteData(const mapSproutNoteData_t &noteData)
 {
     mapSproutNoteData.clear();
     for (const std::pair<JSOutPoint, SproutNoteData> nd : noteData) {
@@ -2208,7 +2479,7 @@ void CWalletTx::SetSproutNoteData(mapSproutNoteData_t &noteData)
     }
 }
 
-void CWalletTx::SetSaplingNoteData(mapSaplingNoteData_t &noteData)
+void CWalletTx::SetSaplingNoteData(const mapSaplingNoteData_t &noteData)
 {
     mapSaplingNoteData.clear();
     for (const std::pair<SaplingOutPoint, SaplingNoteData> nd : noteData) {
@@ -2479,10 +2750,146 @@ void CWallet::WitnessNoteCommitment(std::vector<uint256> commitments,
     }
 }
 
+/**
+ * Reads the blocks of a wallet rescan from disk and trial-decrypts their
+ * shielded outputs ahead of the thread that adds the results to the wallet.
+ *
+ * Worker threads claim blocks in chain order, each reading one block and
+ * searching all of its transactions for notes, so the outputs of several
+ * blocks are trial-decrypted concurrently. Results are handed back in chain
+ * order by Next(), and at most nWindow blocks are held in memory at a time.
+ * With no worker threads, Next() does the work itself.
+ *
+ * The caller must hold cs_main and cs_wallet for the lifetime of the
+ * pipeline: that keeps the chain, the block files and the wallet's keys
+ * unchanged while the workers read them.
+ */
+class CWalletRescanPipeline
+{
+public:
+    struct Block {
+        CBlock block;
+        std::vector<mapSproutNoteData_t> vSproutNoteData;
+        std::vector<std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>> vSaplingNoteData;
+    };
+
+private:
+    const CWallet& wallet;
+    const std::vector<CBlockIndex*>& vBlocks;
+    const Consensus::Params& consensusParams;
+
+    //! Copies of the wallet's keys, so the workers need not take cs_SpendingKeyStore
+    NoteDecryptorMap decryptors;
+    std::vector<libzcash::SaplingIncomingViewingKey> ivks;
+
+    boost::mutex mutex;
+    boost::condition_variable condReady;
+    boost::condition_variable condSpace;
+    std::map<size_t, std::shared_ptr<Block>> mapReady;
+    size_t nNextClaim;
+    size_t nNextConsume;
+    size_t nWindow;
+    bool fStop;
+    boost::thread_group threadGroup;
+
+    void Process(size_t i, Block& item)
+    {
+        // A block we cannot read is scanned as empty, as before.
+        if (!ReadBlockFromDisk(item.block, vBlocks[i], consensusParams)) {
+            LogPrintf("ScanForWalletTransactions(): Failed to read block %s at height %d\n",
+                vBlocks[i]->GetBlockHash().ToString(), vBlocks[i]->nHeight);
+        }
+        item.vSproutNoteData.reserve(item.block.vtx.size());
+        for (const CTransaction& tx : item.block.vtx) {
+            item.vSproutNoteData.push_back(wallet.FindMySproutNotes(tx, decryptors));
+        }
+        // Each worker decrypts its own block, so one thread per block suffices.
+        item.vSaplingNoteData = wallet.FindMySaplingNotesInBlock(item.block, ivks, 1);
+    }
+
+    void Thread()
+    {
+        while (true) {
+            size_t i;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && nNextClaim < vBlocks.size() && nNextClaim >= nNextConsume + nWindow) {
+                    condSpace.wait(lock);
+                }
+                if (fStop || nNextClaim >= vBlocks.size()) {
+                    return;
+                }
+                i = nNextClaim++;
+            }
+            std::shared_ptr<Block> item = std::make_shared<Block>();
+            Process(i, *item);
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                mapReady[i] = item;
+            }
+            condReady.notify_all();
+        }
+    }
+
+public:
+    CWalletRescanPipeline(
+        const CWallet& walletIn,
+        const NoteDecryptorMap& decryptorsIn,
+        const std::vector<libzcash::SaplingIncomingViewingKey>& ivksIn,
+        const std::vector<CBlockIndex*>& vBlocksIn,
+        const Consensus::Params& consensusParamsIn,
+        int nThreads) :
+        wallet(walletIn), vBlocks(vBlocksIn), consensusParams(consensusParamsIn),
+        decryptors(decryptorsIn), ivks(ivksIn),
+        nNextClaim(0), nNextConsume(0), nWindow(nThreads * RESCAN_PREFETCH_BLOCKS_PER_THREAD), fStop(false)
+    {
+        for (int i = 0; i < nThreads; i++) {
+            threadGroup.create_thread(boost::bind(&CWalletRescanPipeline::Thread, this));
+        }
+    }
+
+    ~CWalletRescanPipeline()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+        }
+        condSpace.notify_all();
+        threadGroup.join_all();
+    }
+
+    //! Returns the next block in chain order, waiting for a worker if necessary.
+    std::shared_ptr<Block> Next()
+    {
+        assert(nNextConsume < vBlocks.size());
+        if (threadGroup.size() == 0) {
+            std::shared_ptr<Block> item = std::make_shared<Block>();
+            Process(nNextConsume++, *item);
+            return item;
+        }
+        std::shared_ptr<Block> item;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (mapReady.count(nNextConsume) == 0) {
+                condReady.wait(lock);
+            }
+            item = mapReady[nNextConsume];
+            mapReady.erase(nNextConsume);
+            nNextConsume++;
+        }
+        condSpace.notify_all();
+        return item;
+    }
+};
+
 /**
  * Scan the block chain (starting in pindexStart) for transactions
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
+ *
+ * Blocks are read and trial-decrypted by up to -rescanthreads threads
+ * (see CWalletRescanPipeline); adding transactions to the wallet and
+ * updating the note witness caches happens here, one block at a time.
  */
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
@@ -2502,44 +2909,92 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
         while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)))
             pindex = chainActive.Next(pindex);
 
+        std::vector<CBlockIndex*> vBlocks;
+        for (CBlockIndex* pindexScan = pindex; pindexScan; pindexScan = chainActive.Next(pindexScan)) {
+            vBlocks.push_back(pindexScan);
+        }
+
+        // -rescanthreads=0 means autodetect; <0 leaves that many cores free
+        int nThreads = GetArg("-rescanthreads", DEFAULT_RESCAN_THREADS);
+        if (nThreads <= 0)
+            nThreads += GetNumCores();
+        if (nThreads <= 1 || vBlocks.size() <= 1)
+            nThreads = 0;
+        else if (nThreads > MAX_RESCAN_THREADS)
+            nThreads = MAX_RESCAN_THREADS;
+
+        NoteDecryptorMap decryptors;
+        std::vector<libzcash::SaplingIncomingViewingKey> ivks;
+        {
+            LOCK(cs_SpendingKeyStore);
+            decryptors = mapNoteDecryptors;
+        }
+        GetSaplingIncomingViewingKeys(ivks);
+        LogPrintf("Rescanning %u blocks from height %d using %d threads (%u Sprout and %u Sapling keys)\n",
+            vBlocks.size(), pindex ? pindex->nHeight : -1, std::max(nThreads, 1), decryptors.size(), ivks.size());
+
+        int64_t nStartTime = GetTimeMillis();
+        uint64_t nBlocksScanned = 0;
+        uint64_t nTxScanned = 0;
+        uint64_t nBlocksAtLastLog = 0;
+        uint64_t nTxAtLastLog = 0;
+
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
         double dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
         double dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
-        while (pindex)
         {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
-
-            CBlock block;
-            ReadBlockFromDisk(block, pindex, Params().GetConsensus());
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            CSequentialBlockReads sequential(mappedBlockFiles);
+            CWalletRescanPipeline pipeline(*this, decryptors, ivks, vBlocks, chainParams.GetConsensus(), nThreads);
+            for (CBlockIndex* pindexScan : vBlocks)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate)) {
-                    myTxHashes.push_back(tx.GetHash());
-                    ret++;
-                }
-            }
+                pindex = pindexScan;
+                if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+                    ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
 
-            SproutMerkleTree sproutTree;
-            SaplingMerkleTree saplingTree;
-            // This should never fail: we should always be able to get the tree
-            // state on the path to the tip of our chain
-            assert(pcoinsTip->GetSproutAnchorAt(pindex->hashSproutAnchor, sproutTree));
-            if (pindex->pprev) {
-                if (NetworkUpgradeActive(pindex->pprev->nHeight, Params().GetConsensus(), Consensus::UPGRADE_SAPLING)) {
-                    assert(pcoinsTip->GetSaplingAnchorAt(pindex->pprev->hashFinalSaplingRoot, saplingTree));
+                std::shared_ptr<CWalletRescanPipeline::Block> item = pipeline.Next();
+                const CBlock& block = item->block;
+                for (size_t i = 0; i < block.vtx.size(); i++)
+                {
+                    const CTransaction& tx = block.vtx[i];
+                    if (AddToWalletIfInvolvingMe(tx, &block, fUpdate, item->vSproutNoteData[i], item->vSaplingNoteData[i])) {
+                        myTxHashes.push_back(tx.GetHash());
+                        ret++;
+                    }
                 }
-            }
-            // Increment note witness caches
-            ChainTipAdded(pindex, &block, sproutTree, saplingTree);
 
-            pindex = chainActive.Next(pindex);
-            if (GetTime() >= nNow + 60) {
-                nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex));
+                SproutMerkleTree sproutTree;
+                SaplingMerkleTree saplingTree;
+                // This should never fail: we should always be able to get the tree
+                // state on the path to the tip of our chain
+                assert(pcoinsTip->GetSproutAnchorAt(pindex->hashSproutAnchor, sproutTree));
+                if (pindex->pprev) {
+                    if (NetworkUpgradeActive(pindex->pprev->nHeight, Params().GetConsensus(), Consensus::UPGRADE_SAPLING)) {
+                        assert(pcoinsTip->GetSaplingAnchorAt(pindex->pprev->hashFinalSaplingRoot, saplingTree));
+                    }
+                }
+                // Increment note witness caches
+                ChainTipAdded(pindex, &block, sproutTree, saplingTree);
+
+                nBlocksScanned++;
+                nTxScanned += block.vtx.size();
+                if (GetTime() >= nNow + 60) {
+                    int64_t nElapsed = GetTime() - nNow;
+                    nNow = GetTime();
+                    LogPrintf("Still rescanning. At block %d. Progress=%f (%.2f blocks/s, %.2f tx/s)\n",
+                        pindex->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex),
+                        (double)(nBlocksScanned - nBlocksAtLastLog) / nElapsed,
+                        (double)(nTxScanned - nTxAtLastLog) / nElapsed);
+                    nBlocksAtLastLog = nBlocksScanned;
+                    nTxAtLastLog = nTxScanned;
+                }
             }
         }
 
+        int64_t nElapsedMillis = std::max<int64_t>(GetTimeMillis() - nStartTime, 1);
+        LogPrintf("Rescanned %u blocks (%u transactions) in %.2fs (%.2f blocks/s, %.2f tx/s), found %d wallet transactions\n",
+            nBlocksScanned, nTxScanned, nElapsedMillis * 0.001,
+            nBlocksScanned * 1000.0 / nElapsedMillis, nTxScanned * 1000.0 / nElapsedMillis, ret);
+
         // After rescanning, persist Sapling note data that might have changed, e.g. nullifiers.
         // Do not flush the wallet here for performance reasons.
         CWalletDB walletdb(strWalletFile, "r+", false);
@@ -2950,6 +3405,20 @@ CAmount CWallet::GetImmatureWatchOnlyBalance() const
     return nTotal;
 }
 
+/**
+ * Returns false if each output of wtx is either not ours, or spent by a
+ * transaction deeper than MAX_REORG_LENGTH which can no longer be disconnected.
+ */
+static bool HasUnspentOutputs(const CWallet& wallet, const CWalletTx& wtx)
+{
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        if (wallet.IsMine(wtx.vout[i]) != ISMINE_NO &&
+            wallet.GetSpendDepth(wtx.GetHash(), i) <= (int)MAX_REORG_LENGTH)
+            return true;
+    }
+    return false;
+}
+
 /**
  * populate vCoins with vector of available COutputs.
  */
@@ -2959,10 +3428,24 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (std::set<uint256>::iterator it = setCoinTxs.begin(); it != setCoinTxs.end(); )
         {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+            const uint256& wtxid = *it;
+            map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(wtxid);
+            if (mi == mapWallet.end()) {
+                setCoinTxs.erase(it++);
+                continue;
+            }
+            const CWalletTx* pcoin = &mi->second;
+
+            // Only a transaction deeper than MAX_REORG_LENGTH can have been
+            // spent by one that can no longer be disconnected
+            int nDepth = pcoin->GetDepthInMainChain();
+            if (nDepth > (int)MAX_REORG_LENGTH && !HasUnspentOutputs(*this, *pcoin)) {
+                setCoinTxs.erase(it++);
+                continue;
+            }
+            ++it;
 
             if (!CheckFinalTx(*pcoin))
                 continue;
@@ -2976,22 +3459,21 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
             if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
                 continue;
 
-            int nDepth = pcoin->GetDepthInMainChain();
             if (nDepth < 0)
                 continue;
 
             for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
                 isminetype mine = IsMine(pcoin->vout[i]);
                 if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && (pcoin->vout[i].nValue > 0 || fIncludeZeroValue) &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected((*it).first, i)))
+                    !IsLockedCoin(wtxid, i) && (pcoin->vout[i].nValue > 0 || fIncludeZeroValue) &&
+                    (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected(wtxid, i)))
                         vCoins.push_back(COutput(pcoin, i, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
             }
         }
     }
 }
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
+static void ApproximateBestSubset(const vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
                                   vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
@@ -3037,6 +3519,96 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,uns
     }
 }
 
+/**
+ * Search vValue, sorted by decreasing value, for a subset totalling between
+ * nTargetValue and nTargetValue + nCostOfChange, which needs no change output.
+ * Of the subsets found, the one with the fewest inputs, and then the least
+ * excess, is returned in vfBest. The search is depth-first, including each
+ * coin before excluding it, and gives up after nTotalTries steps.
+ */
+static bool SelectCoinsBnB(const vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >& vValue, const CAmount& nTargetValue, const CAmount& nCostOfChange,
+                           vector<char>& vfBest, CAmount& nBest, size_t nTotalTries = 100000)
+{
+    CAmount nAvailable = 0;
+    for (unsigned int i = 0; i < vValue.size(); i++)
+        nAvailable += vValue[i].first;
+    if (nAvailable < nTargetValue)
+        return false;
+
+    // Whether each of the first vfSelection.size() coins is included
+    vector<char> vfSelection;
+    CAmount nValue = 0;
+    size_t nInputs = 0;
+    size_t nBestInputs = 0;
+    bool fFound = false;
+
+    for (size_t nTries = 0; nTries < nTotalTries; nTries++)
+    {
+        bool fBacktrack = false;
+        if (nValue + nAvailable < nTargetValue ||               // the remaining coins can't reach the target
+            nValue > nTargetValue + nCostOfChange ||             // the selection would need change
+            (fFound && nValue < nTargetValue && nInputs >= nBestInputs)) // it can't beat the best with more inputs
+        {
+            fBacktrack = true;
+        }
+        else if (nValue >= nTargetValue)
+        {
+            if (!fFound || nInputs < nBestInputs || (nInputs == nBestInputs && nValue < nBest))
+            {
+                vfBest = vfSelection;
+                vfBest.resize(vValue.size(), false);
+                nBest = nValue;
+                nBestInputs = nInputs;
+                fFound = true;
+            }
+            fBacktrack = true;
+        }
+
+        if (fBacktrack)
+        {
+            // Walk back to the last included coin, and exclude it instead
+            while (!vfSelection.empty() && !vfSelection.back())
+            {
+                vfSelection.pop_back();
+                nAvailable += vValue[vfSelection.size()].first;
+            }
+            if (vfSelection.empty())
+                break; // the whole tree has been searched
+            vfSelection.back() = false;
+            nValue -= vValue[vfSelection.size() - 1].first;
+            nInputs--;
+        }
+        else
+        {
+            const CAmount n = vValue[vfSelection.size()].first;
+            nAvailable -= n;
+            // Including a coin of the same value as one just excluded would
+            // repeat a branch that has already been searched
+            if (!vfSelection.empty() && !vfSelection.back() && n == vValue[vfSelection.size() - 1].first)
+            {
+                vfSelection.push_back(false);
+            }
+            else
+            {
+                vfSelection.push_back(true);
+                nValue += n;
+                nInputs++;
+            }
+        }
+    }
+
+    return fFound;
+}
+
+/**
+ * Change below the dust threshold is added to the fee by CreateTransaction,
+ * so a selection within this much of the target needs no change output.
+ */
+static CAmount GetCostOfChange()
+{
+    return CTxOut(0, GetScriptForDestination(CKeyID())).GetDustThreshold(::minRelayTxFee);
+}
+
 bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
 {
@@ -3108,13 +3680,19 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
     vector<char> vfBest;
     CAmount nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    // A subset that needs no change can't be improved on, and is usually
+    // found long before the stochastic approximation would finish
+    bool fChangeless = SelectCoinsBnB(vValue, nTargetValue, GetCostOfChange(), vfBest, nBest);
+    if (!fChangeless)
+    {
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+        if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
+            ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    }
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
-    if (coinLowestLarger.second.first &&
+    if (!fChangeless && coinLowestLarger.second.first &&
         ((nBest != nTargetValue && nBest < nTargetValue + CENT) || coinLowestLarger.first <= nBest))
     {
         setCoinsRet.insert(coinLowestLarger.second);
@@ -3142,8 +3720,12 @@ bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*
 {
     // Output parameter fOnlyCoinbaseCoinsRet is set to true when the only available coins are coinbase utxos.
     vector<COutput> vCoinsNoCoinbase, vCoinsWithCoinbase;
-    AvailableCoins(vCoinsNoCoinbase, true, coinControl, false, false);
     AvailableCoins(vCoinsWithCoinbase, true, coinControl, false, true);
+    for (const COutput& out : vCoinsWithCoinbase) {
+        if (!out.tx->IsCoinBase()) {
+            vCoinsNoCoinbase.push_back(out);
+        }
+    }
     fOnlyCoinbaseCoinsRet = vCoinsNoCoinbase.size() == 0 && vCoinsWithCoinbase.size() > 0;
 
     // If coinbase utxos can only be sent to zaddrs, exclude any coinbase utxos from coin selection.
@@ -4503,6 +5085,9 @@ void CWallet::GetFilteredNotes(
  * Find notes in the wallet filtered by payment addresses, min depth, max depth, 
  * if the note is spent, if a spending key is required, and if the notes are locked.
  * These notes are decrypted and added to the output parameter vector, outEntries.
+ *
+ * Only the notes received by the filtered addresses are visited, and each note
+ * is decrypted at most once over the lifetime of the wallet.
  */
 void CWallet::GetFilteredNotes(
     std::vector<SproutNoteEntry>& sproutEntries,
@@ -4516,42 +5101,89 @@ void CWallet::GetFilteredNotes(
 {
     LOCK2(cs_main, cs_wallet);
 
-    for (auto & p : mapWallet) {
-        CWalletTx wtx = p.second;
-
-        // Filter the transactions before checking for notes
-        if (!CheckFinalTx(wtx) ||
-            wtx.GetBlocksToMaturity() > 0 ||
-            wtx.GetDepthInMainChain() < minDepth ||
-            wtx.GetDepthInMainChain() > maxDepth) {
-            continue;
+    // Collect the candidate notes in outpoint order, which is the order in
+    // which a walk over mapWallet would have found them.
+    std::set<JSOutPoint> sproutNotes;
+    std::set<SaplingOutPoint> saplingNotes;
+    if (filterAddresses.empty()) {
+        for (const auto& item : mapSproutNotesByAddress) {
+            sproutNotes.insert(item.second.begin(), item.second.end());
         }
-
-        for (auto & pair : wtx.mapSproutNoteData) {
-            JSOutPoint jsop = pair.first;
-            SproutNoteData nd = pair.second;
-            SproutPaymentAddress pa = nd.address;
-
-            // skip notes which belong to a different payment address in the wallet
-            if (!(filterAddresses.empty() || filterAddresses.count(pa))) {
-                continue;
+        for (const auto& item : mapSaplingNotesByIvk) {
+            saplingNotes.insert(item.second.begin(), item.second.end());
+        }
+    } else {
+        for (const PaymentAddress& addr : filterAddresses) {
+            if (auto sproutAddr = boost::get<SproutPaymentAddress>(&addr)) {
+                auto it = mapSproutNotesByAddress.find(*sproutAddr);
+                if (it != mapSproutNotesByAddress.end()) {
+                    sproutNotes.insert(it->second.begin(), it->second.end());
+                }
+            } else if (auto saplingAddr = boost::get<SaplingPaymentAddress>(&addr)) {
+                libzcash::SaplingIncomingViewingKey ivk;
+                if (GetSaplingIncomingViewingKey(*saplingAddr, ivk)) {
+                    auto it = mapSaplingNotesByIvk.find(ivk);
+                    if (it != mapSaplingNotesByIvk.end()) {
+                        saplingNotes.insert(it->second.begin(), it->second.end());
+                    }
+                }
             }
+        }
+    }
 
-            // skip note which has been spent
-            if (ignoreSpent && nd.nullifier && IsSproutSpent(*nd.nullifier)) {
-                continue;
+    // Filter the transactions before checking for notes, once per transaction
+    std::map<uint256, std::pair<const CWalletTx*, int>> mapTxs;
+    auto getTx = [&](const uint256& hash) -> const CWalletTx* {
+        auto it = mapTxs.find(hash);
+        if (it == mapTxs.end()) {
+            const CWalletTx* pwtx = nullptr;
+            int nDepth = 0;
+            auto mi = mapWallet.find(hash);
+            if (mi != mapWallet.end()) {
+                pwtx = &mi->second;
+                nDepth = pwtx->GetDepthInMainChain();
+                if (!CheckFinalTx(*pwtx) ||
+                    pwtx->GetBlocksToMaturity() > 0 ||
+                    nDepth < minDepth ||
+                    nDepth > maxDepth) {
+                    pwtx = nullptr;
+                }
             }
+            it = mapTxs.insert(std::make_pair(hash, std::make_pair(pwtx, nDepth))).first;
+        }
+        return it->second.first;
+    };
 
-            // skip notes which cannot be spent
-            if (requireSpendingKey && !HaveSproutSpendingKey(pa)) {
-                continue;
-            }
+    for (const JSOutPoint& jsop : sproutNotes) {
+        const CWalletTx* pwtx = getTx(jsop.hash);
+        if (!pwtx) {
+            continue;
+        }
+        const CWalletTx& wtx = *pwtx;
+        auto ndit = wtx.mapSproutNoteData.find(jsop);
+        if (ndit == wtx.mapSproutNoteData.end()) {
+            continue;
+        }
+        const SproutNoteData& nd = ndit->second;
+        SproutPaymentAddress pa = nd.address;
 
-            // skip locked notes
-            if (ignoreLocked && IsLockedNote(jsop)) {
-                continue;
-            }
+        // skip note which has been spent
+        if (ignoreSpent && nd.nullifier && IsSproutSpent(*nd.nullifier)) {
+            continue;
+        }
+
+        // skip notes which cannot be spent
+        if (requireSpendingKey && !HaveSproutSpendingKey(pa)) {
+            continue;
+        }
 
+        // skip locked notes
+        if (ignoreLocked && IsLockedNote(jsop)) {
+            continue;
+        }
+
+        auto cached = mapSproutNoteEntries.find(jsop);
+        if (cached == mapSproutNoteEntries.end()) {
             int i = jsop.js; // Index into CTransaction.vjoinsplit
             int j = jsop.n; // Index into JSDescription.ciphertexts
 
@@ -4572,8 +5204,8 @@ void CWallet::GetFilteredNotes(
                         hSig,
                         (unsigned char) j);
 
-                sproutEntries.push_back(SproutNoteEntry {
-                    jsop, pa, plaintext.note(pa), plaintext.memo(), wtx.GetDepthInMainChain() });
+                cached = mapSproutNoteEntries.insert(std::make_pair(jsop, SproutNoteEntry {
+                    jsop, pa, plaintext.note(pa), plaintext.memo(), 0 })).first;
 
             } catch (const note_decryption_failed &err) {
                 // Couldn't decrypt with this spending key
@@ -4584,10 +5216,24 @@ void CWallet::GetFilteredNotes(
             }
         }
 
-        for (auto & pair : wtx.mapSaplingNoteData) {
-            SaplingOutPoint op = pair.first;
-            SaplingNoteData nd = pair.second;
+        sproutEntries.push_back(cached->second);
+        sproutEntries.back().confirmations = mapTxs[jsop.hash].second;
+    }
+
+    for (const SaplingOutPoint& op : saplingNotes) {
+        const CWalletTx* pwtx = getTx(op.hash);
+        if (!pwtx) {
+            continue;
+        }
+        const CWalletTx& wtx = *pwtx;
+        auto ndit = wtx.mapSaplingNoteData.find(op);
+        if (ndit == wtx.mapSaplingNoteData.end()) {
+            continue;
+        }
+        const SaplingNoteData& nd = ndit->second;
 
+        auto cached = mapSaplingNoteEntries.find(op);
+        if (cached == mapSaplingNoteEntries.end()) {
             auto maybe_pt = SaplingNotePlaintext::decrypt(
                 wtx.vShieldedOutput[op.n].encCiphertext,
                 nd.ivk,
@@ -4600,35 +5246,39 @@ void CWallet::GetFilteredNotes(
             assert(static_cast<bool>(maybe_pa));
             auto pa = maybe_pa.get();
 
-            // skip notes which belong to a different payment address in the wallet
-            if (!(filterAddresses.empty() || filterAddresses.count(pa))) {
-                continue;
-            }
+            auto note = notePt.note(nd.ivk).get();
+            cached = mapSaplingNoteEntries.insert(std::make_pair(op, SaplingNoteEntry {
+                op, pa, note, notePt.memo(), 0 })).first;
+        }
+        const SaplingPaymentAddress& pa = cached->second.address;
 
-            if (ignoreSpent && nd.nullifier && IsSaplingSpent(*nd.nullifier)) {
-                continue;
-            }
+        // skip notes which belong to a different payment address in the wallet
+        if (!(filterAddresses.empty() || filterAddresses.count(pa))) {
+            continue;
+        }
 
-            // skip notes which cannot be spent
-            if (requireSpendingKey) {
-                libzcash::SaplingIncomingViewingKey ivk;
-                libzcash::SaplingFullViewingKey fvk;
-                if (!(GetSaplingIncomingViewingKey(pa, ivk) &&
-                    GetSaplingFullViewingKey(ivk, fvk) &&
-                    HaveSaplingSpendingKey(fvk))) {
-                    continue;
-                }
-            }
+        if (ignoreSpent && nd.nullifier && IsSaplingSpent(*nd.nullifier)) {
+            continue;
+        }
 
-            // skip locked notes
-            if (ignoreLocked && IsLockedNote(op)) {
+        // skip notes which cannot be spent
+        if (requireSpendingKey) {
+            libzcash::SaplingIncomingViewingKey ivk;
+            libzcash::SaplingFullViewingKey fvk;
+            if (!(GetSaplingIncomingViewingKey(pa, ivk) &&
+                GetSaplingFullViewingKey(ivk, fvk) &&
+                HaveSaplingSpendingKey(fvk))) {
                 continue;
             }
+        }
 
-            auto note = notePt.note(nd.ivk).get();
-            saplingEntries.push_back(SaplingNoteEntry {
-                op, pa, note, notePt.memo(), wtx.GetDepthInMainChain() });
+        // skip locked notes
+        if (ignoreLocked && IsLockedNote(op)) {
+            continue;
         }
+
+        saplingEntries.push_back(cached->second);
+        saplingEntries.back().confirmations = mapTxs[op.hash].second;
     }
 }
 
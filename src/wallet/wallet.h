@@ -68,6 +68,13 @@ static const unsigned int WITNESS_CACHE_SIZE = MAX_REORG_LENGTH + 1;
 //! Size of HD seed in bytes
 static const size_t HD_WALLET_SEED_LENGTH = 32;
 
+//! -rescanthreads default (0 = one thread per core)
+static const int DEFAULT_RESCAN_THREADS = 0;
+//! Maximum number of threads that read and trial-decrypt blocks during a rescan
+static const int MAX_RESCAN_THREADS = 16;
+//! Number of blocks each rescan thread may read ahead of the wallet update
+static const unsigned int RESCAN_PREFETCH_BLOCKS_PER_THREAD = 8;
+
 class CBlockIndex;
 class CCoinControl;
 class COutput;
@@ -552,8 +559,8 @@ public:
         MarkDirty();
     }
 
-    void SetSproutNoteData(mapSproutNoteData_t &noteData);
-    void SetSaplingNoteData(mapSaplingNoteData_t &noteData);
+    void SetSproutNoteData(const mapSproutNoteData_t &noteData);
+    void SetSaplingNoteData(const mapSaplingNoteData_t &noteData);
 
     //! filter decides which addresses will count towards the debit
     CAmount GetDebit(const isminefilter& filter) const;
@@ -765,6 +772,52 @@ private:
     void AddToSaplingSpends(const uint256& nullifier, const uint256& wtxid);
     void AddToSpends(const uint256& wtxid);
 
+    /**
+     * Sapling notes found in the transactions of the block most recently
+     * passed to SyncTransaction, so that the block's outputs are trial-
+     * decrypted in one batch rather than a transaction at a time. Only valid
+     * while the wallet has nSaplingNotesBlockKeys incoming viewing keys.
+     */
+    uint256 hashSaplingNotesBlock;
+    size_t nSaplingNotesBlockKeys = 0;
+    std::map<uint256, std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>> mapSaplingNotesBlock;
+
+    /**
+     * The notes in mapWallet indexed by the Sprout address or Sapling
+     * incoming viewing key that received them, so that GetFilteredNotes
+     * only visits the notes it can return. Entries may outlive the note
+     * data they were created from, and are checked against mapWallet on use.
+     */
+    std::map<libzcash::SproutPaymentAddress, std::set<JSOutPoint>> mapSproutNotesByAddress;
+    std::map<libzcash::SaplingIncomingViewingKey, std::set<SaplingOutPoint>> mapSaplingNotesByIvk;
+    /**
+     * Notes already decrypted by GetFilteredNotes. A note's plaintext never
+     * changes, so entries stay valid until the transaction is erased; the
+     * confirmations field is filled in on each lookup.
+     */
+    std::map<JSOutPoint, SproutNoteEntry> mapSproutNoteEntries;
+    std::map<SaplingOutPoint, SaplingNoteEntry> mapSaplingNoteEntries;
+
+    void UpdateNoteIndexWithTx(const CWalletTx& wtx);
+
+    /**
+     * The transactions in mapWallet that may have transparent outputs we can
+     * spend, so that AvailableCoins doesn't visit the whole wallet history.
+     * AvailableCoins drops a transaction once each of its outputs is either
+     * not ours or spent by a transaction too deep to be reorged away.
+     * MarkDirty adds every transaction back, as imported keys can make
+     * outputs ours.
+     */
+    mutable std::set<uint256> setCoinTxs;
+
+    std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> FindMySaplingNotesCached(
+        const CTransaction& tx,
+        const CBlock& block);
+    std::vector<std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>> FindMySaplingNotes(
+        const std::vector<const CTransaction*>& vtx,
+        const std::vector<libzcash::SaplingIncomingViewingKey>& ivks,
+        size_t nThreads) const;
+
 public:
     /*
      * Size of the incremental witness cache for the notes in our wallet.
@@ -772,6 +825,11 @@ public:
      * incremental witness cache in any transaction in mapWallet.
      */
     int64_t nWitnessCacheSize;
+    /*
+     * Transactions whose note data (including their cached witnesses) has
+     * changed since it was last written out by SetBestChain().
+     */
+    std::set<uint256> setNoteDataDirty;
     bool fSaplingMigrationEnabled = false;
 
     void ClearNoteWitnessCache();
@@ -791,20 +849,28 @@ protected:
 
     template <typename WalletDB>
     void SetBestChainINTERNAL(WalletDB& walletdb, const CBlockLocator& loc) {
+        LOCK(cs_wallet);
         if (!walletdb.TxnBegin()) {
             // This needs to be done atomically, so don't do it at all
             LogPrintf("SetBestChain(): Couldn't start atomic write\n");
             return;
         }
         try {
-            for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
-                auto wtx = wtxItem.second;
+            // Only transactions whose note data has changed since the last
+            // successful write need to be rewritten; the rest are already
+            // consistent with the best block on disk.
+            for (const uint256& hash : setNoteDataDirty) {
+                auto mi = mapWallet.find(hash);
+                if (mi == mapWallet.end()) {
+                    continue;
+                }
+                const CWalletTx& wtx = mi->second;
                 // We skip transactions for which mapSproutNoteData and mapSaplingNoteData
                 // are empty. This covers transactions that have no Sprout or Sapling data
                 // (i.e. are purely transparent), as well as shielding and unshielding
                 // transactions in which we only have transparent addresses involved.
                 if (!(wtx.mapSproutNoteData.empty() && wtx.mapSaplingNoteData.empty())) {
-                    if (!walletdb.WriteTx(wtxItem.first, wtx)) {
+                    if (!walletdb.WriteTx(hash, wtx)) {
                         LogPrintf("SetBestChain(): Failed to write CWalletTx, aborting atomic write\n");
                         walletdb.TxnAbort();
                         return;
@@ -833,6 +899,7 @@ protected:
             LogPrintf("SetBestChain(): Couldn't commit atomic write\n");
             return;
         }
+        setNoteDataDirty.clear();
     }
 
 private:
@@ -979,8 +1046,11 @@ public:
     bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
 
     bool IsSpent(const uint256& hash, unsigned int n) const;
+    int GetSpendDepth(const uint256& hash, unsigned int n) const;
     bool IsSproutSpent(const uint256& nullifier) const;
     bool IsSaplingSpent(const uint256& nullifier) const;
+    int GetSproutSpendDepth(const uint256& nullifier) const;
+    int GetSaplingSpendDepth(const uint256& nullifier) const;
 
     bool IsLockedCoin(uint256 hash, unsigned int n) const;
     void LockCoin(COutPoint& output);
@@ -1120,6 +1190,12 @@ public:
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
+    bool AddToWalletIfInvolvingMe(
+        const CTransaction& tx,
+        const CBlock* pblock,
+        bool fUpdate,
+        const mapSproutNoteData_t& sproutNoteData,
+        const std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>& saplingNoteDataAndAddressesToAdd);
     void EraseFromWallet(const uint256 &hash);
     void WitnessNoteCommitment(
          std::vector<uint256> commitments,
@@ -1164,7 +1240,15 @@ public:
         const uint256& hSig,
         uint8_t n) const;
     mapSproutNoteData_t FindMySproutNotes(const CTransaction& tx) const;
+    mapSproutNoteData_t FindMySproutNotes(const CTransaction& tx, const NoteDecryptorMap& decryptors) const;
     std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> FindMySaplingNotes(const CTransaction& tx) const;
+    std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> FindMySaplingNotes(
+        const CTransaction& tx,
+        const std::vector<libzcash::SaplingIncomingViewingKey>& ivks) const;
+    std::vector<std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>> FindMySaplingNotesInBlock(
+        const CBlock& block,
+        const std::vector<libzcash::SaplingIncomingViewingKey>& ivks,
+        size_t nThreads) const;
     bool IsSproutNullifierFromMe(const uint256& nullifier) const;
     bool IsSaplingNullifierFromMe(const uint256& nullifier) const;
 
@@ -333,7 +333,7 @@ void IncrementalWitness<Depth, Hash>::append(Hash obj) {
             cursor = boost::none;
         }
     } else {
-        cursor_depth = tree.next_depth(filled.size());
+        cursor_depth = tree->next_depth(filled.size());
 
         if (cursor_depth >= Depth) {
             throw std::runtime_error("tree is full");
@@ -348,6 +348,112 @@ void IncrementalWitness<Depth, Hash>::append(Hash obj) {
     }
 }
 
+template<size_t Depth, typename Hash>
+IncrementalWitnessUpdater<Depth, Hash>::IncrementalWitnessUpdater(const IncrementalMerkleTree<Depth, Hash>& tree) :
+    current(tree), nSize(tree.size()), frontier(Depth)
+{
+    // The tree only combines its two rightmost leaves when another leaf is
+    // appended, so its parents are the frontier as of its last odd size.
+    for (size_t i = 0; i < tree.parents.size(); i++) {
+        frontier[i + 1] = tree.parents[i];
+    }
+
+    if (tree.left && tree.right) {
+        Hash combined = Hash::combine(*tree.left, *tree.right, 0);
+        size_t d = 1;
+        while (d < Depth && frontier[d]) {
+            combined = Hash::combine(*frontier[d], combined, d);
+            frontier[d] = boost::none;
+            d++;
+        }
+        if (d < Depth) {
+            frontier[d] = combined;
+        }
+    } else if (tree.left) {
+        frontier[0] = tree.left;
+    }
+}
+
+template<size_t Depth, typename Hash>
+void IncrementalWitnessUpdater<Depth, Hash>::append(Hash obj) {
+    current.append(obj);
+
+    uint64_t index = nSize++;
+    size_t d = 0;
+    completed[std::make_pair(d, index)] = obj;
+
+    // Complete every subtree this leaf is the rightmost leaf of
+    while (index & 1) {
+        obj = Hash::combine(*frontier[d], obj, d);
+        frontier[d] = boost::none;
+        d++;
+        index >>= 1;
+        completed[std::make_pair(d, index)] = obj;
+    }
+
+    if (d < Depth) {
+        frontier[d] = obj;
+    }
+}
+
+template<size_t Depth, typename Hash>
+void IncrementalWitnessUpdater<Depth, Hash>::update(IncrementalWitness<Depth, Hash>& witness) const {
+    uint64_t position = witness.position();
+    if (position >= nSize) {
+        throw std::runtime_error("witness is ahead of the tree");
+    }
+
+    bool fFilled = false;
+    size_t lastDepth = 0;
+
+    while (true) {
+        size_t d = witness.tree->next_depth(witness.filled.size());
+
+        // The uncle subtree at depth d covers the leaves [start, end).
+        uint64_t index = (position >> d) + 1;
+        uint64_t start = index << d;
+        uint64_t end = start + ((uint64_t) 1 << d);
+
+        if (d < Depth && end <= nSize) {
+            auto it = completed.find(std::make_pair(d, index));
+            if (it == completed.end()) {
+                throw std::runtime_error("witness is behind the tree");
+            }
+            witness.filled.push_back(it->second);
+            fFilled = true;
+            lastDepth = d;
+            continue;
+        }
+
+        if (d < Depth && start < nSize) {
+            // The leaves [start, nSize) are the rightmost leaves of the
+            // tree, so the cursor's frontier is the tree's frontier below
+            // depth d. Its parents, like the tree's, only record pairs of
+            // leaves that have been combined.
+            uint64_t nCursorSize = nSize - start;
+            uint64_t nCombinedPairs = (nCursorSize - 1) / 2;
+            size_t nParents = 0;
+            while (nCombinedPairs >> nParents) {
+                nParents++;
+            }
+
+            IncrementalMerkleTree<Depth, Hash> cursor;
+            cursor.left = current.left;
+            cursor.right = current.right;
+            cursor.parents.assign(current.parents.begin(), current.parents.begin() + nParents);
+            witness.cursor = cursor;
+            witness.cursor_depth = d;
+        } else {
+            witness.cursor = boost::none;
+            // As append() would leave it
+            if (fFilled) {
+                witness.cursor_depth = lastDepth;
+            }
+        }
+        break;
+    }
+}
+
 template class IncrementalMerkleTree<INCREMENTAL_MERKLE_TREE_DEPTH, SHA256Compress>;
 template class IncrementalMerkleTree<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, SHA256Compress>;
 
@@ -360,4 +466,10 @@ template class IncrementalMerkleTree<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, Pede
 template class IncrementalWitness<SAPLING_INCREMENTAL_MERKLE_TREE_DEPTH, PedersenHash>;
 template class IncrementalWitness<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, PedersenHash>;
 
+template class IncrementalWitnessUpdater<INCREMENTAL_MERKLE_TREE_DEPTH, SHA256Compress>;
+template class IncrementalWitnessUpdater<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, SHA256Compress>;
+
+template class IncrementalWitnessUpdater<SAPLING_INCREMENTAL_MERKLE_TREE_DEPTH, PedersenHash>;
+template class IncrementalWitnessUpdater<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, PedersenHash>;
+
 } // end namespace `libzcash`
@@ -3,6 +3,8 @@
 
 #include <array>
 #include <deque>
+#include <map>
+#include <memory>
 #include <boost/optional.hpp>
 #include <boost/static_assert.hpp>
 
@@ -82,10 +84,14 @@ bool operator==(const EmptyMerkleRoots<Depth, Hash>& a,
 template<size_t Depth, typename Hash>
 class IncrementalWitness;
 
+template<size_t Depth, typename Hash>
+class IncrementalWitnessUpdater;
+
 template<size_t Depth, typename Hash>
 class IncrementalMerkleTree {
 
 friend class IncrementalWitness<Depth, Hash>;
+friend class IncrementalWitnessUpdater<Depth, Hash>;
 
 public:
     BOOST_STATIC_ASSERT(Depth >= 1);
@@ -155,40 +161,48 @@ bool operator==(const IncrementalMerkleTree<Depth, Hash>& a,
 template <size_t Depth, typename Hash>
 class IncrementalWitness {
 friend class IncrementalMerkleTree<Depth, Hash>;
+friend class IncrementalWitnessUpdater<Depth, Hash>;
 
 public:
     // Required for Unserialize()
-    IncrementalWitness() {}
+    IncrementalWitness() : tree(std::make_shared<const IncrementalMerkleTree<Depth, Hash>>()) {}
 
     MerklePath path() const {
-        return tree.path(partial_path());
+        return tree->path(partial_path());
     }
 
     // Return the element being witnessed (should be a note
     // commitment!)
     Hash element() const {
-        return tree.last();
+        return tree->last();
     }
 
     uint64_t position() const {
-        return tree.size() - 1;
+        return tree->size() - 1;
     }
 
     Hash root() const {
-        return tree.root(Depth, partial_path());
+        return tree->root(Depth, partial_path());
     }
 
     void append(Hash obj);
 
-    ADD_SERIALIZE_METHODS;
+    template <typename Stream>
+    void Serialize(Stream& s) const {
+        ::Serialize(s, *tree);
+        ::Serialize(s, filled);
+        ::Serialize(s, cursor);
+    }
 
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action) {
-        READWRITE(tree);
-        READWRITE(filled);
-        READWRITE(cursor);
+    template <typename Stream>
+    void Unserialize(Stream& s) {
+        IncrementalMerkleTree<Depth, Hash> unserializedTree;
+        ::Unserialize(s, unserializedTree);
+        tree = std::make_shared<const IncrementalMerkleTree<Depth, Hash>>(unserializedTree);
+        ::Unserialize(s, filled);
+        ::Unserialize(s, cursor);
 
-        cursor_depth = tree.next_depth(filled.size());
+        cursor_depth = tree->next_depth(filled.size());
     }
 
     template <size_t D, typename H>
@@ -196,23 +210,67 @@ public:
                            const IncrementalWitness<D, H>& b);
 
 private:
-    IncrementalMerkleTree<Depth, Hash> tree;
+    // The tree as of the witnessed element. It never changes once the
+    // witness is created, so copies of a witness (such as the wallet's
+    // cache of a note's witnesses at previous heights) share it.
+    std::shared_ptr<const IncrementalMerkleTree<Depth, Hash>> tree;
     std::vector<Hash> filled;
     boost::optional<IncrementalMerkleTree<Depth, Hash>> cursor;
     size_t cursor_depth = 0;
     std::deque<Hash> partial_path() const;
-    IncrementalWitness(IncrementalMerkleTree<Depth, Hash> tree) : tree(tree) {}
+    IncrementalWitness(IncrementalMerkleTree<Depth, Hash> tree) :
+        tree(std::make_shared<const IncrementalMerkleTree<Depth, Hash>>(tree)) {}
 };
 
 template<size_t Depth, typename Hash>
 bool operator==(const IncrementalWitness<Depth, Hash>& a,
                 const IncrementalWitness<Depth, Hash>& b) {
-    return (a.tree == b.tree &&
+    return (*a.tree == *b.tree &&
             a.filled == b.filled &&
             a.cursor == b.cursor &&
             a.cursor_depth == b.cursor_depth);
 }
 
+// Brings witnesses into a tree up to date with elements appended to the
+// tree, without appending each element to each witness.
+//
+// The elements are appended once, to a copy of the tree, and the root of
+// every subtree they complete is recorded. A witness can then take the
+// roots of its newly completed uncle subtrees from that record, and its
+// partially filled uncle subtree from the frontier of the tree, so the
+// cost of updating it does not depend on the number of elements appended.
+template<size_t Depth, typename Hash>
+class IncrementalWitnessUpdater {
+public:
+    // The witnesses to be updated must be up to date with `tree`.
+    IncrementalWitnessUpdater(const IncrementalMerkleTree<Depth, Hash>& tree);
+
+    void append(Hash obj);
+
+    // The tree with every element appended so far.
+    const IncrementalMerkleTree<Depth, Hash>& tree() const {
+        return current;
+    }
+
+    // Updates a witness that was up to date with the tree the updater
+    // started from, or was taken from tree() since, as if every element
+    // appended since then had been appended to it. Throws if the witness
+    // is behind the starting tree.
+    void update(IncrementalWitness<Depth, Hash>& witness) const;
+
+private:
+    IncrementalMerkleTree<Depth, Hash> current;
+    uint64_t nSize;
+
+    // Complete subtrees on the frontier of the tree that are left
+    // children, by depth.
+    std::vector<boost::optional<Hash>> frontier;
+
+    // Roots of the subtrees completed since the updater was created, by
+    // depth and index at that depth.
+    std::map<std::pair<size_t, uint64_t>, Hash> completed;
+};
+
 class SHA256Compress : public uint256 {
 public:
     SHA256Compress() : uint256() {}
@@ -254,10 +312,16 @@ typedef libzcash::IncrementalMerkleTree<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, l
 typedef libzcash::IncrementalWitness<INCREMENTAL_MERKLE_TREE_DEPTH, libzcash::SHA256Compress> SproutWitness;
 typedef libzcash::IncrementalWitness<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, libzcash::SHA256Compress> SproutTestingWitness;
 
+typedef libzcash::IncrementalWitnessUpdater<INCREMENTAL_MERKLE_TREE_DEPTH, libzcash::SHA256Compress> SproutWitnessUpdater;
+typedef libzcash::IncrementalWitnessUpdater<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, libzcash::SHA256Compress> SproutTestingWitnessUpdater;
+
 typedef libzcash::IncrementalMerkleTree<SAPLING_INCREMENTAL_MERKLE_TREE_DEPTH, libzcash::PedersenHash> SaplingMerkleTree;
 typedef libzcash::IncrementalMerkleTree<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, libzcash::PedersenHash> SaplingTestingMerkleTree;
 
 typedef libzcash::IncrementalWitness<SAPLING_INCREMENTAL_MERKLE_TREE_DEPTH, libzcash::PedersenHash> SaplingWitness;
 typedef libzcash::IncrementalWitness<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, libzcash::PedersenHash> SaplingTestingWitness;
 
+typedef libzcash::IncrementalWitnessUpdater<SAPLING_INCREMENTAL_MERKLE_TREE_DEPTH, libzcash::PedersenHash> SaplingWitnessUpdater;
+typedef libzcash::IncrementalWitnessUpdater<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, libzcash::PedersenHash> SaplingTestingWitnessUpdater;
+
 #endif /* ZC_INCREMENTALMERKLETREE_H_ */
@@ -184,21 +184,17 @@ boost::optional<SaplingOutgoingPlaintext> SaplingOutgoingPlaintext::decrypt(
     return ret;
 }
 
-boost::optional<SaplingNotePlaintext> SaplingNotePlaintext::decrypt(
-    const SaplingEncCiphertext &ciphertext,
+// Deserializes a plaintext decrypted with ivk, and checks it against the
+// note commitment of the output it came from.
+static boost::optional<SaplingNotePlaintext> ParseSaplingEncPlaintext(
+    const SaplingEncPlaintext &pt,
     const uint256 &ivk,
-    const uint256 &epk,
     const uint256 &cmu
 )
 {
-    auto pt = AttemptSaplingEncDecryption(ciphertext, ivk, epk);
-    if (!pt) {
-        return boost::none;
-    }
-
     // Deserialize from the plaintext
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss << pt.get();
+    ss << pt;
 
     SaplingNotePlaintext ret;
     ss >> ret;
@@ -229,6 +225,45 @@ boost::optional<SaplingNotePlaintext> SaplingNotePlaintext::decrypt(
     return ret;
 }
 
+boost::optional<SaplingNotePlaintext> SaplingNotePlaintext::decrypt(
+    const SaplingEncCiphertext &ciphertext,
+    const uint256 &ivk,
+    const uint256 &epk,
+    const uint256 &cmu
+)
+{
+    auto pt = AttemptSaplingEncDecryption(ciphertext, ivk, epk);
+    if (!pt) {
+        return boost::none;
+    }
+
+    return ParseSaplingEncPlaintext(pt.get(), ivk, cmu);
+}
+
+std::map<size_t, std::pair<size_t, SaplingNotePlaintext>> SaplingNotePlaintext::decrypt_batch(
+    const std::vector<SaplingEncDecryptionInput> &outputs,
+    const std::vector<uint256> &cmus,
+    const std::vector<uint256> &ivks,
+    size_t nThreads
+)
+{
+    assert(cmus.size() == outputs.size());
+
+    // Only the thread trial-decrypting an output writes to its slot.
+    std::vector<boost::optional<SaplingNotePlaintext>> notes(outputs.size());
+    auto matches = AttemptSaplingEncDecryptionBatch(outputs, ivks, nThreads,
+        [&](const SaplingEncDecryptionMatch &match) {
+            notes[match.output] = ParseSaplingEncPlaintext(match.plaintext, ivks[match.ivk], cmus[match.output]);
+            return (bool) notes[match.output];
+        });
+
+    std::map<size_t, std::pair<size_t, SaplingNotePlaintext>> ret;
+    for (const auto &match : matches) {
+        ret.insert(std::make_pair(match.output, std::make_pair(match.ivk, notes[match.output].get())));
+    }
+    return ret;
+}
+
 boost::optional<SaplingNotePlaintext> SaplingNotePlaintext::decrypt(
     const SaplingEncCiphertext &ciphertext,
     const uint256 &epk,
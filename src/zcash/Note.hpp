@@ -7,6 +7,7 @@
 #include "NoteEncryption.hpp"
 
 #include <array>
+#include <map>
 #include <boost/optional.hpp>
 
 namespace libzcash {
@@ -142,6 +143,18 @@ public:
         const uint256 &cmu
     );
 
+    // Trial-decrypts a batch of outputs with a set of incoming viewing keys
+    // on up to nThreads threads (see AttemptSaplingEncDecryptionBatch),
+    // checking each note against its output's commitment in cmus. Maps the
+    // index of each output that decrypted to the index of the key that
+    // decrypted it and the note plaintext.
+    static std::map<size_t, std::pair<size_t, SaplingNotePlaintext>> decrypt_batch(
+        const std::vector<SaplingEncDecryptionInput> &outputs,
+        const std::vector<uint256> &cmus,
+        const std::vector<uint256> &ivks,
+        size_t nThreads
+    );
+
     boost::optional<SaplingNote> note(const SaplingIncomingViewingKey& ivk) const;
 
     virtual ~SaplingNotePlaintext() {}
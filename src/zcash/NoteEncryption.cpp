@@ -1,5 +1,8 @@
 #include "NoteEncryption.hpp"
 #include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 #include "sodium.h"
 #include <boost/static_assert.hpp>
 #include "prf.h"
@@ -7,6 +10,9 @@
 
 #define NOTEENCRYPTION_CIPHER_KEYSIZE 32
 
+// Minimum number of trial decryptions per thread in AttemptSaplingEncDecryptionBatch
+#define SAPLING_BATCH_MIN_DECRYPTIONS_PER_THREAD 16
+
 void clamp_curve25519(unsigned char key[crypto_scalarmult_SCALARBYTES])
 {
     key[0] &= 248;
@@ -187,6 +193,79 @@ boost::optional<SaplingEncPlaintext> AttemptSaplingEncDecryption(
     return plaintext;
 }
 
+std::vector<SaplingEncDecryptionMatch> AttemptSaplingEncDecryptionBatch(
+    const std::vector<SaplingEncDecryptionInput> &outputs,
+    const std::vector<uint256> &ivks,
+    size_t nThreads,
+    const std::function<bool(const SaplingEncDecryptionMatch&)> &accept
+)
+{
+    if (outputs.empty() || ivks.empty()) {
+        return {};
+    }
+
+    // Each output is trial-decrypted by exactly one thread, which writes its
+    // result into its own slot, so the only shared state is the counter.
+    std::vector<boost::optional<SaplingEncDecryptionMatch>> results(outputs.size());
+    std::atomic<size_t> nextOutput(0);
+
+    auto worker = [&]() {
+        // The nonce is zero because we never reuse keys
+        const unsigned char cipher_nonce[crypto_aead_chacha20poly1305_IETF_NPUBBYTES] = {};
+        uint256 dhsecret;
+        unsigned char K[NOTEENCRYPTION_CIPHER_KEYSIZE];
+        SaplingEncDecryptionMatch match;
+
+        size_t i;
+        while ((i = nextOutput++) < outputs.size()) {
+            const SaplingEncDecryptionInput &output = outputs[i];
+            match.output = i;
+            for (match.ivk = 0; match.ivk < ivks.size(); match.ivk++) {
+                if (!librustzcash_sapling_ka_agree(output.epk.begin(), ivks[match.ivk].begin(), dhsecret.begin())) {
+                    continue;
+                }
+
+                KDF_Sapling(K, dhsecret, output.epk);
+
+                if (crypto_aead_chacha20poly1305_ietf_decrypt(
+                    match.plaintext.begin(), NULL,
+                    NULL,
+                    output.ciphertext->begin(), ZC_SAPLING_ENCCIPHERTEXT_SIZE,
+                    NULL,
+                    0,
+                    cipher_nonce, K) != 0)
+                {
+                    continue;
+                }
+
+                if (!accept || accept(match)) {
+                    results[i] = match;
+                    break;
+                }
+            }
+        }
+    };
+
+    // Starting a thread only pays off if it has several trial decryptions to do.
+    nThreads = std::min(nThreads, outputs.size() * ivks.size() / SAPLING_BATCH_MIN_DECRYPTIONS_PER_THREAD);
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < nThreads; t++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    std::vector<SaplingEncDecryptionMatch> matches;
+    for (const auto &result : results) {
+        if (result) {
+            matches.push_back(*result);
+        }
+    }
+    return matches;
+}
+
 boost::optional<SaplingEncPlaintext> AttemptSaplingEncDecryption (
     const SaplingEncCiphertext &ciphertext,
     const uint256 &epk,
@@ -13,6 +13,8 @@ https://github.com/zcash/zips/blob/master/protocol/protocol.pdf
 #include "zcash/Address.hpp"
 
 #include <array>
+#include <functional>
+#include <vector>
 
 namespace libzcash {
 
@@ -82,6 +84,35 @@ boost::optional<SaplingEncPlaintext> AttemptSaplingEncDecryption (
     const uint256 &pk_d
 );
 
+// A Sapling output to be trial-decrypted by AttemptSaplingEncDecryptionBatch.
+// The ciphertext is not copied, and must outlive the call.
+struct SaplingEncDecryptionInput {
+    const SaplingEncCiphertext *ciphertext;
+    uint256 epk;
+};
+
+// A successful trial decryption: the indices of the output and of the
+// incoming viewing key that decrypted it, and the plaintext.
+struct SaplingEncDecryptionMatch {
+    size_t output;
+    size_t ivk;
+    SaplingEncPlaintext plaintext;
+};
+
+// Attempts to decrypt each of the outputs with each of the incoming viewing
+// keys, in order, stopping for each output at the first key that decrypts it
+// and whose plaintext `accept` (if given) returns true for. The outputs are
+// shared between up to nThreads threads (0 or 1 meaning the calling thread
+// only), so `accept` must be safe to call concurrently. Returns the matches
+// ordered by output. This will not check that the contents of the
+// ciphertexts are correct unless `accept` does.
+std::vector<SaplingEncDecryptionMatch> AttemptSaplingEncDecryptionBatch(
+    const std::vector<SaplingEncDecryptionInput> &outputs,
+    const std::vector<uint256> &ivks,
+    size_t nThreads,
+    const std::function<bool(const SaplingEncDecryptionMatch&)> &accept = nullptr
+);
+
 // Attempts to decrypt a Sapling note. This will not check that the contents
 // of the ciphertext are correct.
 boost::optional<SaplingOutPlaintext> AttemptSaplingOutDecryption(
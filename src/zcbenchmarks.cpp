@@ -11,6 +11,7 @@
 #include "primitives/transaction.h"
 #include "base58.h"
 #include "crypto/equihash.h"
+#include "crypto/sha256.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "consensus/upgrades.h"
@@ -18,6 +19,7 @@
 #include "main.h"
 #include "miner.h"
 #include "pow.h"
+#include "random.h"
 #include "rpc/server.h"
 #include "script/sign.h"
 #include "sodium.h"
@@ -305,7 +307,9 @@ double benchmark_try_decrypt_sprout_notes(size_t nKeys)
     return timer_stop(tv_start);
 }
 
-double benchmark_try_decrypt_sapling_notes(size_t nKeys)
+// With nTxs > 1 or nThreads > 1, this measures the batched trial decryption
+// of a block made of nTxs copies of the transaction, on nThreads threads.
+double benchmark_try_decrypt_sapling_notes(size_t nKeys, size_t nTxs, size_t nThreads)
 {
     // Set params
     auto consensusParams = Params().GetConsensus();
@@ -323,10 +327,25 @@ double benchmark_try_decrypt_sapling_notes(size_t nKeys)
     auto sk = masterKey.Derive(nKeys);
     auto tx = GetValidSaplingReceive(consensusParams, wallet, sk, 10);
 
+    if (nTxs <= 1 && nThreads <= 1) {
+        struct timeval tv_start;
+        timer_start(tv_start);
+        auto noteDataMapAndAddressesToAdd = wallet.FindMySaplingNotes(tx);
+        assert(noteDataMapAndAddressesToAdd.first.empty());
+        return timer_stop(tv_start);
+    }
+
+    CBlock block;
+    block.vtx.assign(nTxs, tx);
+    std::vector<libzcash::SaplingIncomingViewingKey> ivks;
+    wallet.GetSaplingIncomingViewingKeys(ivks);
+
     struct timeval tv_start;
     timer_start(tv_start);
-    auto noteDataMapAndAddressesToAdd = wallet.FindMySaplingNotes(tx);
-    assert(noteDataMapAndAddressesToAdd.first.empty());
+    auto noteData = wallet.FindMySaplingNotesInBlock(block, ivks, nThreads);
+    for (const auto& txNoteData : noteData) {
+        assert(txNoteData.first.empty());
+    }
     return timer_stop(tv_start);
 }
 
@@ -452,22 +471,20 @@ double benchmark_increment_sapling_note_witnesses(size_t nTxs)
 
 // Fake the input of a given block
 // This class is based on the class CCoinsViewDB, but with limited functionality.
-// The construtor and the functions `GetCoins` and `HaveCoins` come directly from
-// CCoinsViewDB, but the rest are either mocks and/or don't really do anything.
-
-// The following constant is a duplicate of the one found in txdb.cpp
-static const char DB_COINS = 'c';
-
-class FakeCoinsViewDB : public CCoinsView {
-
-    CDBWrapper db;
+// The functions `GetCoin` and `HaveCoin` come directly from CCoinsViewDB, but
+// the rest are either mocks and/or don't really do anything.
+class FakeCoinsViewDB : public CCoinsViewDB {
 
     uint256 hash;
     SproutMerkleTree sproutTree;
     SaplingMerkleTree saplingTree;
 
 public:
-    FakeCoinsViewDB(std::string dbName, uint256& hash) : db(GetDataDir() / dbName, 100, false, false), hash(hash) {}
+    FakeCoinsViewDB(std::string dbName, uint256& hash) : CCoinsViewDB(dbName, 100), hash(hash) {
+        // Archives created before coins were stored per output hold one
+        // record per transaction; convert them as the chainstate would be.
+        if (!Upgrade()) throw new std::runtime_error("Failed to upgrade the benchmark input database");
+    }
 
     bool GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const {
         if (rt == sproutTree.root()) {
@@ -489,14 +506,6 @@ public:
         return false;
     }
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
-        return db.Read(std::make_pair(DB_COINS, txid), coins);
-    }
-
-    bool HaveCoins(const uint256 &txid) const {
-        return db.Exists(std::make_pair(DB_COINS, txid));
-    }
-
     uint256 GetBestBlock() const {
         return hash;
     }
@@ -762,3 +771,44 @@ double benchmark_verify_sapling_output()
     }
     return timer_stop(tv_start);
 }
+
+double benchmark_sha256(size_t nBytes)
+{
+    std::vector<unsigned char> data(nBytes);
+    GetRandBytes(data.data(), std::min(nBytes, (size_t)32));
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+
+    struct timeval tv_start;
+    timer_start(tv_start);
+    CSHA256().Write(data.data(), data.size()).Finalize(hash);
+    return timer_stop(tv_start);
+}
+
+double benchmark_sha256d64(size_t nBlocks)
+{
+    std::vector<unsigned char> in(64 * nBlocks);
+    std::vector<unsigned char> out(32 * nBlocks);
+    GetRandBytes(in.data(), std::min(in.size(), (size_t)32));
+
+    struct timeval tv_start;
+    timer_start(tv_start);
+    SHA256D64(out.data(), in.data(), nBlocks);
+    return timer_stop(tv_start);
+}
+
+double benchmark_merkle_root(size_t nTxs)
+{
+    CBlock block;
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vout.resize(1);
+    for (size_t i = 0; i < nTxs; i++) {
+        mtx.vin[0].prevout.hash = GetRandHash();
+        block.vtx.push_back(mtx);
+    }
+
+    struct timeval tv_start;
+    timer_start(tv_start);
+    block.BuildMerkleTree();
+    return timer_stop(tv_start);
+}
@@ -14,7 +14,7 @@ extern double benchmark_verify_joinsplit(const JSDescription &joinsplit);
 extern double benchmark_verify_equihash();
 extern double benchmark_large_tx(size_t nInputs);
 extern double benchmark_try_decrypt_sprout_notes(size_t nAddrs);
-extern double benchmark_try_decrypt_sapling_notes(size_t nAddrs);
+extern double benchmark_try_decrypt_sapling_notes(size_t nAddrs, size_t nTxs = 1, size_t nThreads = 1);
 extern double benchmark_increment_sprout_note_witnesses(size_t nTxs);
 extern double benchmark_increment_sapling_note_witnesses(size_t nTxs);
 extern double benchmark_connectblock_slow();
@@ -25,5 +25,8 @@ extern double benchmark_create_sapling_spend();
 extern double benchmark_create_sapling_output();
 extern double benchmark_verify_sapling_spend();
 extern double benchmark_verify_sapling_output();
+extern double benchmark_sha256(size_t nBytes);
+extern double benchmark_sha256d64(size_t nBlocks);
+extern double benchmark_merkle_root(size_t nTxs);
 
 #endif